@@ -0,0 +1,167 @@
+/* Load generator for the REPL server (rescheme -s path).
+
+   Usage: loadgen path [clients] [sessions] [requests]
+
+   Each of the clients, on a thread of its own, opens the given number of
+   sessions, one after another, and sends each of them the given number of
+   requests, waiting for the prompt after each one. It prints how long
+   sessions took to start (until the first prompt) and requests took to
+   answer, and how many of each were done a second.
+*/
+#define _DEFAULT_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *path;
+static int nsessions = 100;
+static int nrequests = 100;
+
+struct client {
+	pthread_t thread;
+	double *starts;        // seconds, one per session
+	double *latencies;     // seconds, one per request
+};
+
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Read until the server prompts again. */
+static void await_prompt(int fd)
+{
+	char buf[4096];
+	size_t len = 0;
+	for (;;) {
+		ssize_t n = read(fd, buf + len, sizeof(buf) - len);
+		if (n <= 0) {
+			fprintf(stderr, "loadgen: session ended early\n");
+			exit(1);
+		}
+		len += n;
+		if (len >= 2 && buf[len - 2] == '>' && buf[len - 1] == ' ') {
+			return;
+		}
+		if (len == sizeof(buf)) {
+			buf[0] = buf[len - 1];
+			len = 1;
+		}
+	}
+}
+
+
+static void *run_client(void *arg)
+{
+	struct client *c = arg;
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	for (int i = 0; i < nsessions; i++) {
+		double start = now();
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0 ||
+		    connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+			perror("loadgen: connect");
+			exit(1);
+		}
+		await_prompt(fd);
+		c->starts[i] = now() - start;
+
+		for (int j = 0; j < nrequests; j++) {
+			char req[64];
+			int len = snprintf(req, sizeof(req), "(+ %d %d)\n", i, j);
+			start = now();
+			if (write(fd, req, len) != len) {
+				perror("loadgen: write");
+				exit(1);
+			}
+			await_prompt(fd);
+			c->latencies[i * nrequests + j] = now() - start;
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+
+static int compare(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+
+static void report(const char *what, double *times, size_t n, double elapsed)
+{
+	if (n == 0) {
+		return;
+	}
+	qsort(times, n, sizeof(double), compare);
+	printf("%-9s %8zu  %10.0f/s   p50 %8.1f us   p99 %8.1f us\n", what, n,
+	       n / elapsed, times[n / 2] * 1e6, times[n * 99 / 100] * 1e6);
+}
+
+
+int main(int argc, char **argv)
+{
+	if (argc < 2 || argc > 5) {
+		fprintf(stderr, "usage: loadgen path [clients] [sessions] "
+		        "[requests]\n");
+		return 2;
+	}
+	path = argv[1];
+	int nclients = argc > 2 ? atoi(argv[2]) : 4;
+	if (argc > 3) {
+		nsessions = atoi(argv[3]);
+	}
+	if (argc > 4) {
+		nrequests = atoi(argv[4]);
+	}
+	if (nclients < 1 || nsessions < 1 || nrequests < 0) {
+		fprintf(stderr, "loadgen: bad counts\n");
+		return 2;
+	}
+
+	size_t ns = (size_t) nclients * nsessions;
+	size_t nr = ns * nrequests;
+	struct client *clients = calloc(nclients, sizeof(struct client));
+	double *starts = malloc(ns * sizeof(double));
+	double *latencies = malloc((nr > 0 ? nr : 1) * sizeof(double));
+	if (clients == NULL || starts == NULL || latencies == NULL) {
+		perror("loadgen");
+		return 1;
+	}
+
+	double start = now();
+	for (int i = 0; i < nclients; i++) {
+		clients[i].starts = starts + (size_t) i * nsessions;
+		clients[i].latencies = latencies + (size_t) i * nsessions * nrequests;
+		if (pthread_create(&clients[i].thread, NULL, run_client,
+		                   &clients[i]) != 0) {
+			fprintf(stderr, "loadgen: could not start client\n");
+			return 1;
+		}
+	}
+	for (int i = 0; i < nclients; i++) {
+		pthread_join(clients[i].thread, NULL);
+	}
+	double elapsed = now() - start;
+
+	printf("%d clients, %d sessions each, %d requests a session, "
+	       "%.2f s\n", nclients, nsessions, nrequests, elapsed);
+	report("sessions", starts, ns, elapsed);
+	report("requests", latencies, nr, elapsed);
+	return 0;
+}
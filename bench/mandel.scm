@@ -0,0 +1,27 @@
+;;; mandel -- count the points of a grid that are in the Mandelbrot set, all
+;;; flonum arithmetic.
+
+(define (mandel? cr ci)
+  (let loop ((zr 0.0) (zi 0.0) (i 0))
+    (cond ((= i 100) #t)
+          ((> (+ (* zr zr) (* zi zi)) 4.0) #f)
+          (else (loop (+ (- (* zr zr) (* zi zi)) cr)
+                      (+ (* 2.0 zr zi) ci)
+                      (+ i 1))))))
+
+(define (count-row y n)
+  (let loop ((x 0) (count 0))
+    (if (= x n)
+        count
+        (loop (+ x 1)
+              (if (mandel? (- (* 3.0 (/ x n)) 2.0) (- (* 2.0 (/ y n)) 1.0))
+                  (+ count 1)
+                  count)))))
+
+(define (mandel n)
+  (let loop ((y 0) (count 0))
+    (if (= y n)
+        count
+        (loop (+ y 1) (+ count (count-row y n))))))
+
+(mandel 120)
@@ -0,0 +1,28 @@
+;;; nqueens -- count the solutions to the 8 queens problem, with lists.
+
+(define (nqueens n)
+  (define (one-to n)
+    (let loop ((i n) (l '()))
+      (if (= i 0) l (loop (- i 1) (cons i l)))))
+  (define (try x y z)
+    (if (null? x)
+        (if (null? y) 1 0)
+        (+ (if (ok? (car x) 1 z)
+               (try (append (cdr x) y) '() (cons (car x) z))
+               0)
+           (try (cdr x) (cons (car x) y) z))))
+  (define (ok? row dist placed)
+    (if (null? placed)
+        #t
+        (and (not (= (car placed) (+ row dist)))
+             (not (= (car placed) (- row dist)))
+             (ok? row (+ dist 1) (cdr placed)))))
+  (try (one-to n) '() '()))
+
+(define (run n)
+  (let loop ((i 0) (result 0))
+    (if (= i n)
+        result
+        (loop (+ i 1) (nqueens 8)))))
+
+(run 50)
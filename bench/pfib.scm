@@ -0,0 +1,16 @@
+;;; pfib -- fib, with the two recursive calls made in parallel with futures
+;;; until the work gets too small to be worth it. Compare with fib.
+
+(define (fib n)
+  (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2)))))
+
+(define (pfib n)
+  (if (< n 20)
+      (fib n)
+      (let ((f (future (lambda () (pfib (- n 1))))))
+        (let ((b (pfib (- n 2))))
+          (+ (touch f) b)))))
+
+(pfib 30)
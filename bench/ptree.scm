@@ -0,0 +1,30 @@
+;;; ptree -- builds a complete binary tree, and adds up its leaves, with
+;;; futures for the subtrees near the root, so that the threads allocate and
+;;; collect in parallel too.
+
+(define (make-tree depth n)
+  (if (= depth 0)
+      n
+      (cons (make-tree (- depth 1) (* 2 n))
+            (make-tree (- depth 1) (+ (* 2 n) 1)))))
+
+(define (tree-sum t)
+  (if (pair? t)
+      (+ (tree-sum (car t)) (tree-sum (cdr t)))
+      t))
+
+(define (pmake-tree depth n)
+  (if (< depth 12)
+      (make-tree depth n)
+      (let ((f (future (lambda () (pmake-tree (- depth 1) (* 2 n))))))
+        (let ((right (pmake-tree (- depth 1) (+ (* 2 n) 1))))
+          (cons (touch f) right)))))
+
+(define (ptree-sum t depth)
+  (if (< depth 12)
+      (tree-sum t)
+      (let ((f (future (lambda () (ptree-sum (car t) (- depth 1))))))
+        (let ((right (ptree-sum (cdr t) (- depth 1))))
+          (+ (touch f) right)))))
+
+(ptree-sum (pmake-tree 20 1) 20)
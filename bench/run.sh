@@ -0,0 +1,15 @@
+#!/bin/sh
+# Run each benchmark, and print how long it took.
+# Usage: bench/run.sh [path to rescheme]
+
+rescheme=${1:-./rescheme}
+dir=$(dirname "$0")
+
+for b in fib tak nqueens deriv mandel tasks pfib ptree; do
+	start=$(date +%s%N)
+	result=$("$rescheme" < "$dir/$b.scm" 2>/dev/null | tail -n 2 | head -n 1 |
+	         sed 's/^\(> \)*//')
+	end=$(date +%s%N)
+	printf '%-10s %6d ms   %s\n' "$b" $(( (end - start) / 1000000 )) \
+		"$result"
+done
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Start a REPL server, put some load on it with loadgen, and stop it.
+# Usage: bench/server.sh [path to rescheme] [loadgen arguments after the path]
+
+rescheme=${1:-./rescheme}
+[ $# -gt 0 ] && shift
+dir=$(dirname "$0")
+sock=${TMPDIR:-/tmp}/rescheme-bench.$$
+
+"$rescheme" -s "$sock" >/dev/null 2>&1 &
+server=$!
+while [ ! -S "$sock" ]; do
+	kill -0 $server 2>/dev/null || exit 1
+	sleep 0.1
+done
+
+"$dir/loadgen" "$sock" "$@"
+
+kill -INT $server
+wait $server
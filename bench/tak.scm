@@ -0,0 +1,16 @@
+;;; tak -- the Takeuchi function, a classic Gabriel benchmark of calls.
+
+(define (tak x y z)
+  (if (not (< y x))
+      z
+      (tak (tak (- x 1) y z)
+           (tak (- y 1) z x)
+           (tak (- z 1) x y))))
+
+(define (run n)
+  (let loop ((i 0) (result 0))
+    (if (= i n)
+        result
+        (loop (+ i 1) (tak 18 12 6)))))
+
+(run 50)
@@ -0,0 +1,25 @@
+;;; tasks -- a ring of lightweight tasks passing a counter along channels,
+;;; mostly task switches.
+
+(define (make-ring n)
+  (let ((first (make-channel)))
+    (let loop ((i 0) (in first))
+      (if (= i n)
+          (cons first in)
+          (let ((out (make-channel)))
+            (spawn (lambda ()
+                     (let pass ()
+                       (channel-put! out (+ (channel-get in) 1))
+                       (pass))))
+            (loop (+ i 1) out))))))
+
+(define (run-ring n laps)
+  (let ((ring (make-ring n)))
+    (let lap ((k 0) (count 0))
+      (if (= k laps)
+          count
+          (begin
+            (channel-put! (car ring) count)
+            (lap (+ k 1) (channel-get (cdr ring))))))))
+
+(run-ring 1000 2000)
@@ -0,0 +1,1232 @@
+#include "rescheme.h"
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+/* Bignums are stored in sign-magnitude form. The magnitude is an array of
+   32-bit digits, least significant first, and the sign is kept in the size
+   field: a negative size means a negative number. A bignum is always
+   normalized, so the most significant digit is never zero, and its value never
+   fits in a fixnum.
+
+   Functions with names starting with "mag_" work on bare magnitudes, and don't
+   know anything about objects or signs.
+*/
+
+typedef uint32_t digit;
+typedef uint64_t ddigit;
+
+#define DIGIT_BITS 32
+
+/* Operands shorter than this (in digits) are multiplied with the schoolbook
+   algorithm. Karatsuba's algorithm is only a win for larger numbers.
+*/
+#define KARATSUBA_THRESHOLD 32
+
+/* Divisors shorter than this are divided with the schoolbook algorithm, and
+   longer ones with Burnikel and Ziegler's recursive one, which does most of
+   its work in Karatsuba multiplications.
+*/
+#define DIVIDE_THRESHOLD 80
+
+/* Radix conversion splits numbers in half, by powers of the base, until they
+   are shorter than this, and converts the pieces a digit at a time.
+*/
+#define CONVERT_THRESHOLD 40
+
+/* The powers base^(2^k), as magnitudes, computed as they're needed. */
+struct mag_powers {
+	digit base;
+	int count;
+	digit *digits[64];
+	size_t len[64];
+};
+
+
+static digit *mag_alloc(size_t len);
+static size_t mag_normalize(const digit *a, size_t len);
+static int mag_cmp(const digit *a, size_t an, const digit *b, size_t bn);
+static digit mag_add(digit *r, const digit *a, size_t an,
+                     const digit *b, size_t bn);
+static void mag_sub(digit *r, const digit *a, size_t an,
+                    const digit *b, size_t bn);
+static void mag_mul(digit *r, const digit *a, size_t an,
+                    const digit *b, size_t bn);
+static void mag_mul_school(digit *r, const digit *a, size_t an,
+                           const digit *b, size_t bn);
+static void mag_mul_karatsuba(digit *r, const digit *a, const digit *b,
+                              size_t n);
+static digit mag_divmod_small(digit *a, size_t len, digit d);
+static digit mag_shift_left(digit *r, const digit *a, size_t n, int s);
+static void mag_divmod(digit *q, digit *r, const digit *a, size_t an,
+                       const digit *b, size_t bn);
+static void mag_divmod_school(digit *q, digit *r, const digit *a, size_t an,
+                              const digit *b, size_t bn);
+static void mag_div2n1n(digit *q, digit *r, const digit *a, const digit *b,
+                        size_t n);
+static void mag_div3n2n(digit *q, digit *r, const digit *a12, const digit *a3,
+                        const digit *b, size_t half);
+static void mag_powers_init(struct mag_powers *p, digit base);
+static const digit *mag_power(struct mag_powers *p, int k, size_t *len);
+static void mag_powers_free(struct mag_powers *p);
+
+/* An integer that has been unpacked into a magnitude and a sign. Fixnums are
+   unpacked into the small array, so that they don't need to be allocated.
+*/
+struct rs_bignum_view {
+	const digit *digits;
+	size_t len;
+	int neg;
+	digit small[2];
+};
+
+static void rs_bignum_view(rs_object obj, struct rs_bignum_view *v);
+static rs_object rs_bignum_make(digit *digits, size_t len, int neg);
+static rs_object rs_bignum_addsub(rs_object a, rs_object b, int negate_b);
+static rs_object rs_bignum_div(rs_object a, rs_object b, int want_rem);
+static void rs_bignum_put(char **p, const digit *n, size_t len, int k,
+                          size_t width, struct mag_powers *powers, int base,
+                          int per_chunk);
+static digit *rs_bignum_acc_chunks(const uint32_t *chunks, size_t n,
+                                   struct mag_powers *powers, size_t *len);
+static void rs_bignum_acc_collapse(struct rs_bignum_acc *acc);
+
+
+
+/**** Integer arithmetic. ****/
+
+rs_object rs_bignum_add(rs_object a, rs_object b)
+{
+	return rs_bignum_addsub(a, b, 0);
+}
+
+
+rs_object rs_bignum_sub(rs_object a, rs_object b)
+{
+	return rs_bignum_addsub(a, b, 1);
+}
+
+
+rs_object rs_bignum_mul(rs_object a, rs_object b)
+{
+	struct rs_bignum_view va, vb;
+	rs_bignum_view(a, &va);
+	rs_bignum_view(b, &vb);
+
+	if (va.len == 0 || vb.len == 0) {
+		return rs_fixnum_to_obj(0);
+	}
+
+	digit *r = mag_alloc(va.len + vb.len);
+	mag_mul(r, va.digits, va.len, vb.digits, vb.len);
+	return rs_bignum_make(r, va.len + vb.len, va.neg != vb.neg);
+}
+
+
+rs_object rs_bignum_neg(rs_object a)
+{
+	return rs_bignum_addsub(rs_fixnum_to_obj(0), a, 1);
+}
+
+
+rs_object rs_bignum_quotient(rs_object a, rs_object b)
+{
+	return rs_bignum_div(a, b, 0);
+}
+
+
+rs_object rs_bignum_remainder(rs_object a, rs_object b)
+{
+	return rs_bignum_div(a, b, 1);
+}
+
+
+int rs_bignum_cmp(rs_object a, rs_object b)
+{
+	struct rs_bignum_view va, vb;
+	rs_bignum_view(a, &va);
+	rs_bignum_view(b, &vb);
+
+	if (va.neg != vb.neg) {
+		return va.neg ? -1 : 1;
+	}
+	int c = mag_cmp(va.digits, va.len, vb.digits, vb.len);
+	return va.neg ? -c : c;
+}
+
+
+/* Only one of the quotient and the remainder is made into an object, so
+   there's never a new object to keep safe from the collector.
+*/
+static rs_object rs_bignum_div(rs_object a, rs_object b, int want_rem)
+{
+	struct rs_bignum_view va, vb;
+	rs_bignum_view(a, &va);
+	rs_bignum_view(b, &vb);
+	assert(vb.len > 0);
+
+	if (va.len < vb.len) {
+		return want_rem ? a : rs_fixnum_to_obj(0);
+	}
+	digit *q = mag_alloc(va.len - vb.len + 1);
+	digit *r = mag_alloc(vb.len);
+	mag_divmod(q, r, va.digits, va.len, vb.digits, vb.len);
+	if (want_rem) {
+		free(q);
+		return rs_bignum_make(r, vb.len, va.neg);
+	}
+	free(r);
+	return rs_bignum_make(q, va.len - vb.len + 1, va.neg != vb.neg);
+}
+
+
+static rs_object rs_bignum_addsub(rs_object a, rs_object b, int negate_b)
+{
+	struct rs_bignum_view va, vb;
+	rs_bignum_view(a, &va);
+	rs_bignum_view(b, &vb);
+	if (negate_b && vb.len > 0) {
+		vb.neg = !vb.neg;
+	}
+
+	/* Make sure that x has the larger magnitude. */
+	struct rs_bignum_view *x = &va, *y = &vb;
+	if (mag_cmp(va.digits, va.len, vb.digits, vb.len) < 0) {
+		x = &vb;
+		y = &va;
+	}
+
+	digit *r = mag_alloc(x->len + 1);
+	if (x->neg == y->neg) {
+		r[x->len] = mag_add(r, x->digits, x->len, y->digits, y->len);
+	} else {
+		mag_sub(r, x->digits, x->len, y->digits, y->len);
+	}
+	return rs_bignum_make(r, x->len + 1, x->neg);
+}
+
+
+
+/**** Conversion. ****/
+
+char *rs_bignum_to_cstr(rs_object obj, int base)
+{
+	assert(base >= 2 && base <= 16);
+
+	static const char chars[] = "0123456789abcdef";
+
+	struct rs_bignum_view v;
+	rs_bignum_view(obj, &v);
+
+	/* Every digit of the magnitude needs at most 32 characters, plus a sign
+	   and a NUL. */
+	size_t cap = v.len * DIGIT_BITS + 3;
+	char *str = malloc(cap);
+	if (str == NULL) {
+		rs_fatal("could not allocate string:");
+	}
+	char *p = str + cap - 1;
+	*p = '\0';
+
+	if (v.len == 0) {
+		*--p = '0';
+	} else if ((base & (base - 1)) == 0) {
+		/* For power-of-two bases, each character is just a group of bits. */
+		int bits = base == 2 ? 1 : base == 4 ? 2 : base == 8 ? 3 : 4;
+		size_t total = v.len * DIGIT_BITS;
+		for (size_t i = 0; i < total; i += bits) {
+			unsigned int ch = 0;
+			for (int j = bits - 1; j >= 0; j--) {
+				size_t bit = i + j;
+				ch <<= 1;
+				if (bit < total) {
+					ch |= (v.digits[bit / DIGIT_BITS] >> (bit % DIGIT_BITS)) & 1;
+				}
+			}
+			*--p = chars[ch];
+		}
+		while (p[0] == '0' && p[1] != '\0') {
+			p++;
+		}
+	} else {
+		/* Otherwise, work in chunks of characters, with the largest power of
+		   the base that fits in a digit, and split the number in half by
+		   powers of that until the pieces are short (see rs_bignum_put()). */
+		digit chunk = base;
+		int per_chunk = 1;
+		while ((ddigit)chunk * base <= UINT32_MAX) {
+			chunk *= base;
+			per_chunk++;
+		}
+
+		/* The first split is by the smallest power at least half as long
+		   as the number, so that the quotient is no longer than the
+		   remainder. */
+		struct mag_powers powers;
+		mag_powers_init(&powers, chunk);
+		int k = -1;
+		if (v.len >= CONVERT_THRESHOLD) {
+			size_t plen;
+			do {
+				mag_power(&powers, ++k, &plen);
+			} while (2 * plen < v.len);
+		}
+		rs_bignum_put(&p, v.digits, v.len, k, 0, &powers, base, per_chunk);
+		mag_powers_free(&powers);
+	}
+
+	if (v.neg) {
+		*--p = '-';
+	}
+	memmove(str, p, strlen(p) + 1);
+	return str;
+}
+
+
+/* Write the characters of the magnitude n, backwards, ending at *p, and move
+   *p back past them. n is split by base^(per_chunk * 2^k), the kth power of
+   the chunk base, into a quotient and a remainder that are each written the
+   same way, with k one less, the remainder padded with zeros to its full
+   length. Unless width is 0, n is padded out to width characters too. Pieces
+   short enough are written a chunk at a time.
+*/
+static void rs_bignum_put(char **p, const digit *n, size_t len, int k,
+                          size_t width, struct mag_powers *powers, int base,
+                          int per_chunk)
+{
+	static const char chars[] = "0123456789abcdef";
+
+	len = mag_normalize(n, len);
+	if (k < 0 || len < CONVERT_THRESHOLD) {
+		digit *tmp = mag_alloc(len);
+		memcpy(tmp, n, len * sizeof(digit));
+		size_t written = 0;
+		while (len > 0) {
+			digit rem = mag_divmod_small(tmp, len, powers->base);
+			len = mag_normalize(tmp, len);
+			for (int i = 0; i < per_chunk; i++) {
+				if (width == 0 && len == 0 && rem == 0) break;
+				*--*p = chars[rem % base];
+				rem /= base;
+				written++;
+			}
+		}
+		for (; written < width; written++) {
+			*--*p = '0';
+		}
+		free(tmp);
+		return;
+	}
+
+	size_t plen;
+	const digit *pk = mag_power(powers, k, &plen);
+	if (len < plen) {
+		/* Less than the power, so the quotient would be zero. */
+		rs_bignum_put(p, n, len, k - 1, width, powers, base, per_chunk);
+		return;
+	}
+	size_t low = (size_t)per_chunk << k;
+	digit *q = mag_alloc(len - plen + 1);
+	digit *r = mag_alloc(plen);
+	mag_divmod(q, r, n, len, pk, plen);
+	rs_bignum_put(p, r, plen, k - 1, low, powers, base, per_chunk);
+	rs_bignum_put(p, q, len - plen + 1, k - 1, width > low ? width - low : 0,
+	              powers, base, per_chunk);
+	free(q);
+	free(r);
+}
+
+
+double rs_bignum_to_double(rs_object obj)
+{
+	struct rs_bignum_view v;
+	rs_bignum_view(obj, &v);
+
+	double d = 0;
+	for (size_t i = v.len; i-- > 0; ) {
+		d = d * 4294967296.0 + v.digits[i];
+	}
+	return v.neg ? -d : d;
+}
+
+
+rs_object rs_bignum_from_double(double val)
+{
+	assert(isfinite(val) && floor(val) == val);
+
+	/* The magnitude is a 53-bit integer, shifted left by whatever is left of
+	   the exponent. */
+	int exp;
+	double m = frexp(fabs(val), &exp);
+	int shift = exp > 53 ? exp - 53 : 0;
+	ddigit u = (ddigit)ldexp(m, exp - shift);
+
+	size_t word = shift / DIGIT_BITS;
+	int bits = shift % DIGIT_BITS;
+	digit *d = mag_alloc(word + 3);
+	ddigit t = (ddigit)(digit)u << bits;
+	d[word] = (digit)t;
+	t = ((u >> DIGIT_BITS) << bits) | (t >> DIGIT_BITS);
+	d[word + 1] = (digit)t;
+	d[word + 2] = (digit)(t >> DIGIT_BITS);
+	return rs_bignum_make(d, word + 3, val < 0);
+}
+
+
+/* Pushing a chunk only saves it. Runs of chunks with the same multiplier are
+   turned into a magnitude all at once, by rs_bignum_acc_collapse(), when the
+   multiplier changes or the accumulator is finished, so that a long literal
+   takes a few big multiplications instead of a pass over the whole value for
+   every chunk.
+*/
+void rs_bignum_acc_init(struct rs_bignum_acc *acc, rs_fixnum val)
+{
+	assert(acc != NULL);
+	assert(val >= 0);
+
+	acc->digits = mag_alloc(2);
+	acc->digits[0] = (digit)val;
+	acc->digits[1] = (digit)((ddigit)val >> DIGIT_BITS);
+	acc->len = 2;
+	acc->chunks = NULL;
+	acc->nchunks = acc->capchunks = 0;
+	acc->mul = 0;
+}
+
+
+void rs_bignum_acc_push(struct rs_bignum_acc *acc, uint32_t mul, uint32_t add)
+{
+	assert(acc != NULL);
+	assert(acc->digits != NULL);
+
+	if (acc->nchunks > 0 && mul != acc->mul) {
+		rs_bignum_acc_collapse(acc);
+	}
+	acc->mul = mul;
+	if (acc->nchunks == acc->capchunks) {
+		acc->capchunks = acc->capchunks > 0 ? 2 * acc->capchunks : 16;
+		uint32_t *c = realloc(acc->chunks, acc->capchunks * sizeof(uint32_t));
+		if (c == NULL) {
+			rs_fatal("could not grow bignum:");
+		}
+		acc->chunks = c;
+	}
+	acc->chunks[acc->nchunks++] = add;
+}
+
+
+rs_object rs_bignum_acc_finish(struct rs_bignum_acc *acc, int neg)
+{
+	assert(acc != NULL);
+	assert(acc->digits != NULL);
+
+	rs_bignum_acc_collapse(acc);
+	free(acc->chunks);
+	rs_object obj = rs_bignum_make(acc->digits, acc->len, neg);
+	acc->digits = NULL;
+	acc->chunks = NULL;
+	acc->len = acc->nchunks = acc->capchunks = 0;
+	return obj;
+}
+
+
+/* Set the accumulated value to value * mul^nchunks + the chunks' value. */
+static void rs_bignum_acc_collapse(struct rs_bignum_acc *acc)
+{
+	if (acc->nchunks == 0) {
+		return;
+	}
+
+	struct mag_powers powers;
+	mag_powers_init(&powers, acc->mul);
+	size_t vlen;
+	digit *v = rs_bignum_acc_chunks(acc->chunks, acc->nchunks, &powers, &vlen);
+
+	/* mul^nchunks is the product of the powers for its bits. */
+	digit *m = mag_alloc(1);
+	size_t mlen = 1;
+	m[0] = 1;
+	for (int k = 0; (acc->nchunks >> k) != 0; k++) {
+		if ((acc->nchunks >> k) & 1) {
+			size_t plen;
+			const digit *pk = mag_power(&powers, k, &plen);
+			digit *t = mag_alloc(mlen + plen);
+			mag_mul(t, m, mlen, pk, plen);
+			free(m);
+			m = t;
+			mlen = mag_normalize(t, mlen + plen);
+		}
+	}
+
+	size_t rlen = (acc->len + mlen > vlen ? acc->len + mlen : vlen) + 1;
+	digit *r = mag_alloc(rlen);
+	mag_mul(r, acc->digits, acc->len, m, mlen);
+	r[rlen - 1] = mag_add(r, r, rlen - 1, v, vlen);
+
+	free(acc->digits);
+	acc->digits = r;
+	acc->len = mag_normalize(r, rlen);
+	acc->nchunks = 0;
+	free(v);
+	free(m);
+	mag_powers_free(&powers);
+}
+
+
+/* Return the value of n chunks, most significant first, as digits in base
+   powers->base, and set *len to its length. A long run is split so that the
+   less significant part is 2^k chunks, and the parts are combined with one
+   multiplication, by the kth power.
+*/
+static digit *rs_bignum_acc_chunks(const uint32_t *chunks, size_t n,
+                                   struct mag_powers *powers, size_t *len)
+{
+	if (n <= CONVERT_THRESHOLD) {
+		digit *r = mag_alloc(n + 1);
+		size_t rlen = 0;
+		for (size_t i = 0; i < n; i++) {
+			ddigit carry = chunks[i];
+			for (size_t j = 0; j < rlen; j++) {
+				carry += (ddigit)r[j] * powers->base;
+				r[j] = (digit)carry;
+				carry >>= DIGIT_BITS;
+			}
+			if (carry != 0) {
+				r[rlen++] = (digit)carry;
+			}
+		}
+		*len = rlen;
+		return r;
+	}
+
+	int k = 0;
+	while (((size_t)2 << k) < n) {
+		k++;
+	}
+	size_t low = (size_t)1 << k;
+	size_t hlen, llen, plen;
+	digit *hi = rs_bignum_acc_chunks(chunks, n - low, powers, &hlen);
+	digit *lo = rs_bignum_acc_chunks(chunks + n - low, low, powers, &llen);
+	const digit *pk = mag_power(powers, k, &plen);
+
+	size_t rlen = hlen + plen + 1;
+	digit *r = mag_alloc(rlen);
+	mag_mul(r, hi, hlen, pk, plen);
+	r[rlen - 1] = mag_add(r, r, rlen - 1, lo, llen);
+	free(hi);
+	free(lo);
+	*len = mag_normalize(r, rlen);
+	return r;
+}
+
+
+size_t rs_bignum_digits(rs_bignum *big, const uint32_t **digits, int *neg)
+{
+	assert(rs_bignum_p((rs_object)big));
+	assert(digits != NULL);
+	assert(neg != NULL);
+
+	*digits = big->val.big.digits;
+	*neg = big->val.big.size < 0;
+	return *neg ? -big->val.big.size : big->val.big.size;
+}
+
+
+rs_object rs_bignum_from_digits(const uint32_t *digits, size_t len, int neg)
+{
+	assert(digits != NULL || len == 0);
+
+	digit *d = mag_alloc(len > 0 ? len : 1);
+	if (len > 0) {
+		memcpy(d, digits, len * sizeof(digit));
+	}
+	return rs_bignum_make(d, len, neg);
+}
+
+
+void rs_bignum_release(rs_bignum *big)
+{
+	assert(rs_bignum_p((rs_object)big));
+	assert(big->val.big.digits != NULL);
+
+	free(big->val.big.digits);
+}
+
+
+/* Unpack an integer into a magnitude and a sign. */
+static void rs_bignum_view(rs_object obj, struct rs_bignum_view *v)
+{
+	if (rs_fixnum_p(obj)) {
+		rs_fixnum f = rs_obj_to_fixnum(obj);
+		/* Fixnums are symmetric around zero, so this can't overflow. */
+		ddigit m = f < 0 ? (ddigit)-f : (ddigit)f;
+		v->small[0] = (digit)m;
+		v->small[1] = (digit)(m >> DIGIT_BITS);
+		v->digits = v->small;
+		v->len = mag_normalize(v->small, 2);
+		v->neg = f < 0;
+	} else {
+		rs_bignum *big = rs_obj_to_bignum(obj);
+		v->digits = big->val.big.digits;
+		v->len = big->val.big.size < 0 ? -big->val.big.size :
+		                                  big->val.big.size;
+		v->neg = big->val.big.size < 0;
+	}
+}
+
+
+/* Turn a magnitude into an integer object. The digits array is owned by the
+   new object afterwards (or freed, if the result is a fixnum).
+*/
+static rs_object rs_bignum_make(digit *digits, size_t len, int neg)
+{
+	assert(digits != NULL);
+
+	len = mag_normalize(digits, len);
+	if (len <= 2) {
+		ddigit m = len == 0 ? 0 : digits[0];
+		if (len == 2) {
+			m |= (ddigit)digits[1] << DIGIT_BITS;
+		}
+		if (m <= (ddigit)rs_fixnum_max) {
+			free(digits);
+			return rs_fixnum_to_obj(neg ? -(rs_fixnum)m : (rs_fixnum)m);
+		}
+	}
+
+	rs_bignum *big = rs_gc_alloc_hobject();
+	big->type = RS_BIGNUM;
+	big->val.big.digits = digits;
+	big->val.big.size = neg ? -(long)len : (long)len;
+	return rs_bignum_to_obj(big);
+}
+
+
+
+/**** Magnitudes. ****/
+
+/* Allocate a zeroed magnitude. */
+static digit *mag_alloc(size_t len)
+{
+	digit *d = calloc(len > 0 ? len : 1, sizeof(digit));
+	if (d == NULL) {
+		rs_fatal("could not allocate bignum:");
+	}
+	return d;
+}
+
+
+/* Return the length of a, not counting leading zeros. */
+static size_t mag_normalize(const digit *a, size_t len)
+{
+	while (len > 0 && a[len - 1] == 0) {
+		len--;
+	}
+	return len;
+}
+
+
+static int mag_cmp(const digit *a, size_t an, const digit *b, size_t bn)
+{
+	an = mag_normalize(a, an);
+	bn = mag_normalize(b, bn);
+	if (an != bn) {
+		return an < bn ? -1 : 1;
+	}
+	while (an-- > 0) {
+		if (a[an] != b[an]) {
+			return a[an] < b[an] ? -1 : 1;
+		}
+	}
+	return 0;
+}
+
+
+/* r = a + b, where an >= bn. r must have room for an digits, and may be the
+   same as a. Returns the carry out of the top digit.
+*/
+static digit mag_add(digit *r, const digit *a, size_t an,
+                     const digit *b, size_t bn)
+{
+	assert(an >= bn);
+
+	ddigit carry = 0;
+	size_t i;
+	for (i = 0; i < bn; i++) {
+		carry += (ddigit)a[i] + b[i];
+		r[i] = (digit)carry;
+		carry >>= DIGIT_BITS;
+	}
+	for (; i < an; i++) {
+		carry += a[i];
+		r[i] = (digit)carry;
+		carry >>= DIGIT_BITS;
+	}
+	return (digit)carry;
+}
+
+
+/* r = a - b, where a >= b. r must have room for an digits, and may be the same
+   as a.
+*/
+static void mag_sub(digit *r, const digit *a, size_t an,
+                    const digit *b, size_t bn)
+{
+	assert(an >= bn);
+
+	digit borrow = 0;
+	size_t i;
+	for (i = 0; i < bn; i++) {
+		ddigit s = (ddigit)b[i] + borrow;
+		borrow = a[i] < s;
+		r[i] = (digit)(a[i] - s);
+	}
+	for (; i < an; i++) {
+		digit ai = a[i];
+		r[i] = ai - borrow;
+		borrow = ai < borrow;
+	}
+	assert(borrow == 0);
+}
+
+
+/* r = a * b. r must have room for an + bn digits, and must not overlap either
+   argument.
+*/
+static void mag_mul(digit *r, const digit *a, size_t an,
+                    const digit *b, size_t bn)
+{
+	if (an < bn) {
+		const digit *t = a; a = b; b = t;
+		size_t tn = an; an = bn; bn = tn;
+	}
+	memset(r, 0, (an + bn) * sizeof(digit));
+	if (bn < KARATSUBA_THRESHOLD) {
+		mag_mul_school(r, a, an, b, bn);
+		return;
+	}
+
+	/* Karatsuba wants equal-sized operands, so multiply b by each bn-digit
+	   slice of a, and add up the results. */
+	digit *tmp = mag_alloc(2 * bn);
+	size_t off;
+	for (off = 0; off + bn <= an; off += bn) {
+		mag_mul_karatsuba(tmp, a + off, b, bn);
+		digit c = mag_add(r + off, r + off, an + bn - off, tmp, 2 * bn);
+		assert(c == 0);
+		(void) c;
+	}
+	if (off < an) {
+		size_t rest = an - off;
+		mag_mul(tmp, a + off, rest, b, bn);
+		digit c = mag_add(r + off, r + off, an + bn - off, tmp, rest + bn);
+		assert(c == 0);
+		(void) c;
+	}
+	free(tmp);
+}
+
+
+/* r += a * b. */
+static void mag_mul_school(digit *r, const digit *a, size_t an,
+                           const digit *b, size_t bn)
+{
+	for (size_t j = 0; j < bn; j++) {
+		ddigit carry = 0;
+		ddigit bj = b[j];
+		if (bj == 0) continue;
+		for (size_t i = 0; i < an; i++) {
+			carry += (ddigit)a[i] * bj + r[i + j];
+			r[i + j] = (digit)carry;
+			carry >>= DIGIT_BITS;
+		}
+		r[an + j] = (digit)carry;
+	}
+}
+
+
+/* r = a * b, where both a and b have n digits. r must have room for 2n digits,
+   and must not overlap either argument.
+
+   With a = a1*B^k + a0 and b = b1*B^k + b0, the product is
+   z2*B^2k + z1*B^k + z0, where z0 = a0*b0, z2 = a1*b1, and
+   z1 = (a0 + a1)(b0 + b1) - z0 - z2. That's three half-sized multiplications
+   instead of four.
+*/
+static void mag_mul_karatsuba(digit *r, const digit *a, const digit *b,
+                              size_t n)
+{
+	if (n < KARATSUBA_THRESHOLD) {
+		memset(r, 0, 2 * n * sizeof(digit));
+		mag_mul_school(r, a, n, b, n);
+		return;
+	}
+
+	size_t lo = n / 2;
+	size_t hi = n - lo;
+
+	/* z0 goes in the bottom of r, and z2 in the top. */
+	mag_mul_karatsuba(r, a, b, lo);
+	mag_mul_karatsuba(r + 2 * lo, a + lo, b + lo, hi);
+
+	digit *sa = mag_alloc(hi + 1);
+	digit *sb = mag_alloc(hi + 1);
+	digit *z1 = mag_alloc(2 * (hi + 1));
+	sa[hi] = mag_add(sa, a + lo, hi, a, lo);
+	sb[hi] = mag_add(sb, b + lo, hi, b, lo);
+	mag_mul_karatsuba(z1, sa, sb, hi + 1);
+
+	size_t z1n = 2 * (hi + 1);
+	mag_sub(z1, z1, z1n, r, 2 * lo);
+	mag_sub(z1, z1, z1n, r + 2 * lo, 2 * hi);
+	z1n = mag_normalize(z1, z1n);
+
+	digit c = mag_add(r + lo, r + lo, 2 * n - lo, z1, z1n);
+	assert(c == 0);
+	(void) c;
+
+	free(sa);
+	free(sb);
+	free(z1);
+}
+
+
+/* a = a / d, and return a % d. */
+static digit mag_divmod_small(digit *a, size_t len, digit d)
+{
+	assert(d != 0);
+
+	ddigit rem = 0;
+	while (len-- > 0) {
+		rem = (rem << DIGIT_BITS) | a[len];
+		a[len] = (digit)(rem / d);
+		rem %= d;
+	}
+	return (digit)rem;
+}
+
+
+/* r = a << s, for s less than DIGIT_BITS, and return the bits shifted out of
+   the top digit.
+*/
+static digit mag_shift_left(digit *r, const digit *a, size_t n, int s)
+{
+	digit out = 0;
+	for (size_t i = 0; i < n; i++) {
+		digit d = a[i];
+		r[i] = (digit)(d << s) | out;
+		out = s > 0 ? d >> (DIGIT_BITS - s) : 0;
+	}
+	return out;
+}
+
+
+/* q = a / b and r = a % b, where an >= bn, and b's top digit isn't zero. q
+   must have room for an - bn + 1 digits, and r for bn.
+
+   Both are shifted so that b's top bit is set, as the algorithms need. Short
+   divisors go to the schoolbook algorithm. Otherwise, a is divided a block of
+   bn digits at a time, from the top, with the remainder so far above the
+   block, which is the division mag_div2n1n() does. Halving a number of 2 * bn
+   digits, as radix conversion does, takes just one.
+*/
+static void mag_divmod(digit *q, digit *r, const digit *a, size_t an,
+                       const digit *b, size_t bn)
+{
+	assert(an >= bn && bn > 0 && b[bn - 1] != 0);
+
+	if (bn == 1) {
+		memcpy(q, a, an * sizeof(digit));
+		r[0] = mag_divmod_small(q, an, b[0]);
+		return;
+	}
+
+	int s = 0;
+	while (((digit)(b[bn - 1] << s) >> (DIGIT_BITS - 1)) == 0) {
+		s++;
+	}
+	size_t nblocks = (an + bn) / bn;
+	digit *bs = mag_alloc(bn);
+	digit *as = mag_alloc(nblocks * bn);
+	digit *qs = mag_alloc(nblocks * bn);
+	digit *rs = mag_alloc(bn);
+	mag_shift_left(bs, b, bn, s);
+	as[an] = mag_shift_left(as, a, an, s);
+
+	if (bn < DIVIDE_THRESHOLD) {
+		mag_divmod_school(qs, rs, as, an + 1, bs, bn);
+	} else {
+		/* The digits above the last whole block start off the remainder, as
+		   does that block, if it's less than b. */
+		size_t m = mag_normalize(as, an + 1);
+		nblocks = m / bn;
+		memcpy(rs, as + nblocks * bn, (m % bn) * sizeof(digit));
+		if (m % bn == 0 && nblocks > 0 &&
+		    mag_cmp(as + (nblocks - 1) * bn, bn, bs, bn) < 0) {
+			nblocks--;
+			memcpy(rs, as + nblocks * bn, bn * sizeof(digit));
+		}
+		digit *t = mag_alloc(2 * bn);
+		for (size_t i = nblocks; i-- > 0; ) {
+			memcpy(t, as + i * bn, bn * sizeof(digit));
+			memcpy(t + bn, rs, bn * sizeof(digit));
+			mag_div2n1n(qs + i * bn, rs, t, bs, bn);
+		}
+		free(t);
+	}
+	memcpy(q, qs, (an - bn + 1) * sizeof(digit));
+
+	for (size_t i = 0; i < bn; i++) {
+		digit above = i + 1 < bn && s > 0 ? rs[i + 1] << (DIGIT_BITS - s) : 0;
+		r[i] = (rs[i] >> s) | above;
+	}
+	free(bs);
+	free(as);
+	free(qs);
+	free(rs);
+}
+
+
+/* Knuth's algorithm D: q = a / b and r = a % b, where an >= bn, and b's top
+   bit is set. q must have room for an - bn + 1 digits, and r for bn.
+*/
+static void mag_divmod_school(digit *q, digit *r, const digit *a, size_t an,
+                              const digit *b, size_t bn)
+{
+	assert(an >= bn && bn > 0 && (b[bn - 1] >> (DIGIT_BITS - 1)) != 0);
+
+	digit *u = mag_alloc(an + 1);
+	memcpy(u, a, an * sizeof(digit));
+	if (bn == 1) {
+		r[0] = mag_divmod_small(u, an, b[0]);
+		memcpy(q, u, an * sizeof(digit));
+		free(u);
+		return;
+	}
+
+	ddigit top = b[bn - 1], next = b[bn - 2];
+	for (size_t j = an - bn + 1; j-- > 0; ) {
+		/* Estimate the quotient digit from the top digits. The estimate is
+		   at most one too big after this. */
+		ddigit num = ((ddigit)u[j + bn] << DIGIT_BITS) | u[j + bn - 1];
+		ddigit qhat = num / top, rhat = num % top;
+		while (qhat > UINT32_MAX ||
+		       qhat * next > ((rhat << DIGIT_BITS) | u[j + bn - 2])) {
+			qhat--;
+			rhat += top;
+			if (rhat > UINT32_MAX) {
+				break;
+			}
+		}
+
+		/* u -= qhat * b, adding b back if that went negative. */
+		ddigit carry = 0;
+		digit borrow = 0;
+		for (size_t i = 0; i < bn; i++) {
+			ddigit prod = qhat * b[i] + carry;
+			carry = prod >> DIGIT_BITS;
+			ddigit diff = (ddigit)u[i + j] - (digit)prod - borrow;
+			u[i + j] = (digit)diff;
+			borrow = (diff >> DIGIT_BITS) != 0;
+		}
+		ddigit diff = (ddigit)u[j + bn] - carry - borrow;
+		u[j + bn] = (digit)diff;
+		if ((diff >> DIGIT_BITS) != 0) {
+			qhat--;
+			u[j + bn] += mag_add(u + j, u + j, bn, b, bn);
+		}
+		q[j] = (digit)qhat;
+	}
+	memcpy(r, u, bn * sizeof(digit));
+	free(u);
+}
+
+
+/* Burnikel and Ziegler's recursive division: q = a / b and r = a % b, where
+   a has 2n digits, b has n and its top bit set, and a < b * B^n, so that q
+   fits in n digits. a is divided as three halves and then three again, by
+   mag_div3n2n(), each of which divides by b's top half recursively, and then
+   corrects the estimate with a multiplication by its bottom half.
+*/
+static void mag_div2n1n(digit *q, digit *r, const digit *a, const digit *b,
+                        size_t n)
+{
+	if (n < DIVIDE_THRESHOLD) {
+		digit *qs = mag_alloc(n + 1);
+		mag_divmod_school(qs, r, a, 2 * n, b, n);
+		assert(qs[n] == 0);
+		memcpy(q, qs, n * sizeof(digit));
+		free(qs);
+		return;
+	}
+
+	if (n % 2 != 0) {
+		/* Multiply both by the base, to make n even. */
+		digit *as = mag_alloc(2 * n + 2);
+		digit *bs = mag_alloc(n + 1);
+		digit *qs = mag_alloc(n + 1);
+		digit *rs = mag_alloc(n + 1);
+		memcpy(as + 1, a, 2 * n * sizeof(digit));
+		memcpy(bs + 1, b, n * sizeof(digit));
+		mag_div2n1n(qs, rs, as, bs, n + 1);
+		memcpy(q, qs, n * sizeof(digit));
+		memcpy(r, rs + 1, n * sizeof(digit));
+		free(as);
+		free(bs);
+		free(qs);
+		free(rs);
+		return;
+	}
+
+	size_t half = n / 2;
+	digit *r1 = mag_alloc(n);
+	mag_div3n2n(q + half, r1, a + n, a + half, b, half);
+	mag_div3n2n(q, r, r1, a, b, half);
+	free(r1);
+}
+
+
+/* q = (a12 * B^half + a3) / b and r the remainder, where a12 has 2 * half
+   digits and is less than b, a3 has half, and b has 2 * half, with its top
+   bit set. q has half digits and r 2 * half.
+*/
+static void mag_div3n2n(digit *q, digit *r, const digit *a12, const digit *a3,
+                        const digit *b, size_t half)
+{
+	size_t n = 2 * half;
+	const digit *b1 = b + half;
+	digit *t = mag_alloc(n + 1);
+
+	/* Estimate q from a12 / b1, leaving the remainder in t's top half. If
+	   a12's top half is b1, the estimate would be too big, so it starts at
+	   the largest half-length number instead. */
+	if (mag_cmp(a12 + half, half, b1, half) == 0) {
+		memset(q, 0xff, half * sizeof(digit));
+		t[n] = mag_add(t + half, a12, half, b1, half);
+	} else {
+		mag_div2n1n(q, t + half, a12, b1, half);
+	}
+	memcpy(t, a3, half * sizeof(digit));
+
+	/* Then take off q times b's bottom half. If that goes negative, the
+	   estimate was too big (by at most two), so add b back until it isn't. */
+	digit *d = mag_alloc(n);
+	mag_mul(d, q, half, b, half);
+	if (mag_cmp(t, n + 1, d, n) >= 0) {
+		mag_sub(t, t, n + 1, d, n);
+	} else {
+		mag_sub(d, d, n, t, n);
+		for (;;) {
+			for (size_t i = 0; i < half && q[i]-- == 0; i++) {
+				continue;
+			}
+			if (mag_cmp(b, n, d, n) >= 0) {
+				mag_sub(t, b, n, d, n);
+				t[n] = 0;
+				break;
+			}
+			mag_sub(d, d, n, b, n);
+		}
+	}
+	assert(t[n] == 0);
+	memcpy(r, t, n * sizeof(digit));
+	free(t);
+	free(d);
+}
+
+
+static void mag_powers_init(struct mag_powers *p, digit base)
+{
+	p->base = base;
+	p->count = 0;
+}
+
+
+/* Return base^(2^k), and set *len to its length. Each power is the square of
+   the one before.
+*/
+static const digit *mag_power(struct mag_powers *p, int k, size_t *len)
+{
+	assert(k >= 0 && k < 64);
+
+	while (p->count <= k) {
+		int i = p->count;
+		if (i == 0) {
+			p->digits[0] = mag_alloc(1);
+			p->digits[0][0] = p->base;
+			p->len[0] = 1;
+		} else {
+			size_t n = p->len[i - 1];
+			p->digits[i] = mag_alloc(2 * n);
+			mag_mul(p->digits[i], p->digits[i - 1], n, p->digits[i - 1], n);
+			p->len[i] = mag_normalize(p->digits[i], 2 * n);
+		}
+		p->count++;
+	}
+	*len = p->len[k];
+	return p->digits[k];
+}
+
+
+static void mag_powers_free(struct mag_powers *p)
+{
+	for (int i = 0; i < p->count; i++) {
+		free(p->digits[i]);
+	}
+	p->count = 0;
+}
+
+
+
+/**** Testing. ****/
+
+void rs_bignum_test(void)
+{
+	/* Build a few large numbers out of pseudo-random digits, and check
+	   Karatsuba multiplication against the schoolbook algorithm. */
+	size_t sizes[] = { 1, 5, 31, 32, 33, 64, 100, 257 };
+	size_t nsizes = sizeof(sizes) / sizeof(sizes[0]);
+	unsigned long seed = 12345;
+
+	for (size_t i = 0; i < nsizes; i++) {
+		for (size_t j = 0; j < nsizes; j++) {
+			size_t an = sizes[i], bn = sizes[j];
+			digit *a = mag_alloc(an), *b = mag_alloc(bn);
+			for (size_t k = 0; k < an; k++) {
+				seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+				a[k] = (digit)(seed >> 16);
+			}
+			for (size_t k = 0; k < bn; k++) {
+				seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+				b[k] = (digit)(seed >> 16);
+			}
+			digit *r1 = mag_alloc(an + bn), *r2 = mag_alloc(an + bn);
+			mag_mul(r1, a, an, b, bn);
+			mag_mul_school(r2, a, an, b, bn);
+			if (memcmp(r1, r2, (an + bn) * sizeof(digit)) != 0) {
+				rs_fatal("multiplication mismatch (%zu x %zu digits)", an, bn);
+			}
+			free(a); free(b); free(r1); free(r2);
+		}
+	}
+
+	/* Check division against multiplication, on both sides of the
+	   thresholds, with random digits and with runs of ones, which make the
+	   quotient estimates wrong most often. */
+	size_t dsizes[] = { 1, 2, 3, 40, 79, 80, 81, 161, 330 };
+	size_t ndsizes = sizeof(dsizes) / sizeof(dsizes[0]);
+	for (size_t i = 0; i < ndsizes; i++) {
+		for (int shape = 0; shape < 3; shape++) {
+			size_t bn = dsizes[i], an = bn + dsizes[(i + shape) % ndsizes];
+			digit *a = mag_alloc(an), *b = mag_alloc(bn);
+			for (size_t k = 0; k < an; k++) {
+				seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+				a[k] = shape == 1 ? UINT32_MAX : (digit)(seed >> 16);
+			}
+			for (size_t k = 0; k < bn; k++) {
+				seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+				b[k] = shape == 1 && k > 0 ? UINT32_MAX : (digit)(seed >> 16);
+			}
+			if (shape == 2) {
+				b[bn - 1] = 1;
+			}
+			b[bn - 1] |= 1;
+			digit *q = mag_alloc(an - bn + 1), *r = mag_alloc(bn);
+			digit *check = mag_alloc(an + 1);
+			mag_divmod(q, r, a, an, b, bn);
+			mag_mul(check, q, an - bn + 1, b, bn);
+			check[an] = mag_add(check, check, an, r, bn);
+			if (mag_cmp(check, an + 1, a, an) != 0 ||
+			    mag_cmp(r, bn, b, bn) >= 0) {
+				rs_fatal("division mismatch (%zu / %zu digits)", an, bn);
+			}
+			free(a); free(b); free(q); free(r); free(check);
+		}
+	}
+
+	/* Check that conversion to and from long strings of digits round-trips,
+	   in bases that split it by powers and in ones that don't. Runs of
+	   zeros make some of the pieces need padding. */
+	static const int bases[] = { 10, 7, 16 };
+	for (int i = 0; i < 3; i++) {
+		int base = bases[i];
+		size_t n = 30000;
+		char *digits = malloc(n + 1);
+		if (digits == NULL) {
+			rs_fatal("could not allocate digits:");
+		}
+		struct rs_bignum_acc acc;
+		rs_bignum_acc_init(&acc, 0);
+		uint32_t chunk = 0, mul = 1;
+		for (size_t k = 0; k < n; k++) {
+			seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+			int d = k == 0 ? 1 + (int)(seed >> 33) % (base - 1) :
+			        (k / 97) % 4 == 1 ? 0 : (int)(seed >> 33) % base;
+			digits[k] = "0123456789abcdef"[d];
+			if (mul > UINT32_MAX / (uint32_t)base) {
+				rs_bignum_acc_push(&acc, mul, chunk);
+				chunk = 0;
+				mul = 1;
+			}
+			chunk = chunk * base + d;
+			mul *= base;
+		}
+		digits[n] = '\0';
+		rs_bignum_acc_push(&acc, mul, chunk);
+		rs_object obj = rs_bignum_acc_finish(&acc, 1);
+		char *s = rs_bignum_to_cstr(obj, base);
+		if (s[0] != '-' || strcmp(s + 1, digits) != 0) {
+			rs_fatal("conversion mismatch in base %d", base);
+		}
+		free(s);
+		free(digits);
+	}
+
+	/* Check that decimal conversion and the boundaries of the fixnum range
+	   work. */
+	struct rs_bignum_acc acc;
+	rs_bignum_acc_init(&acc, rs_fixnum_max);
+	rs_bignum_acc_push(&acc, 1, 1);
+	rs_object big = rs_bignum_acc_finish(&acc, 0);
+	assert(rs_bignum_p(big));
+	assert(rs_bignum_sub(big, rs_fixnum_to_obj(1)) ==
+	       rs_fixnum_to_obj(rs_fixnum_max));
+	assert(rs_bignum_cmp(big, rs_fixnum_to_obj(rs_fixnum_max)) > 0);
+	assert(rs_bignum_cmp(rs_bignum_neg(big),
+	                     rs_fixnum_to_obj(rs_fixnum_min)) < 0);
+
+	rs_bignum_acc_init(&acc, 0);
+	for (int i = 0; i < 4; i++) {
+		rs_bignum_acc_push(&acc, 1000000000, 123456789);
+	}
+	big = rs_bignum_acc_finish(&acc, 1);
+	char *s = rs_bignum_to_cstr(big, 10);
+	assert(strcmp(s, "-123456789123456789123456789123456789") == 0);
+	free(s);
+
+	/* Check truncating division, with the signs of the results. */
+	rs_object billion = rs_fixnum_to_obj(-1000000000);
+	s = rs_bignum_to_cstr(rs_bignum_quotient(big, billion), 10);
+	assert(strcmp(s, "123456789123456789123456789") == 0);
+	free(s);
+	assert(rs_bignum_remainder(big, billion) == rs_fixnum_to_obj(-123456789));
+	assert(rs_bignum_quotient(billion, big) == rs_fixnum_to_obj(0));
+	assert(rs_bignum_remainder(billion, big) == billion);
+	assert(rs_bignum_remainder(rs_bignum_mul(big, big), big) ==
+	       rs_fixnum_to_obj(0));
+	s = rs_bignum_to_cstr(rs_bignum_mul(big, big), 16);
+	assert(strcmp(s, "2355771a115ed1cffcd3e4df977be4dc4f56bfd817b421d4edcc3"
+	                 "f897b9") == 0);
+	free(s);
+
+	/* Check conversions to and from doubles. */
+	assert(rs_bignum_from_double(-12345.0) == rs_fixnum_to_obj(-12345));
+	big = rs_bignum_from_double(ldexp(-3.0, 100));
+	s = rs_bignum_to_cstr(big, 16);
+	assert(strcmp(s, "-30000000000000000000000000") == 0);
+	free(s);
+	assert(rs_bignum_to_double(big) == ldexp(-3.0, 100));
+
+	TRACE("passed");
+}
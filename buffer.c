@@ -3,15 +3,25 @@
 #include <assert.h>
 #include <string.h>
 
-#define _RS_BUF_GROWBY 128
+/* Buffers start out using the small array inside the structure itself, so
+   short strings never touch malloc. When that fills up, the contents move to
+   the heap, and the capacity doubles every time it runs out after that, so
+   pushing n characters costs O(n) in total.
+
+   NOTE: Since a fresh buffer points into itself, a struct rs_buf must not be
+   copied.
+*/
+
+
+static struct rs_buf *rs_buf_grow(struct rs_buf *buf, size_t need);
 
 
 void rs_buf_init(struct rs_buf *buf)
 {
 	assert(buf != NULL);
 
-	buf->buf = NULL;
-	buf->cap = 0;
+	buf->buf = buf->small;
+	buf->cap = _RS_BUF_SMALL;
 	buf->off = 0;
 }
 
@@ -20,9 +30,16 @@ void rs_buf_reset(struct rs_buf *buf)
 {
 	assert(buf != NULL);
 
-	free(buf->buf);
-	buf->buf = NULL;
-	buf->cap = 0;
+	if (buf->buf != buf->small) {
+		free(buf->buf);
+	}
+	rs_buf_init(buf);
+}
+
+
+void rs_buf_clear(struct rs_buf *buf)
+{
+	assert(buf != NULL);
 	buf->off = 0;
 }
 
@@ -30,30 +47,31 @@ void rs_buf_reset(struct rs_buf *buf)
 struct rs_buf *rs_buf_push(struct rs_buf *buf, char c)
 {
 	assert(buf != NULL);
-	assert((buf->buf == NULL && buf->cap == 0 && buf->off == 0) ||
-	       (buf->buf != NULL && buf->cap > 0 && buf->off < buf->cap));
+	assert(buf->buf != NULL && buf->off < buf->cap);
 
-	if (buf->buf == NULL) {
-		buf->buf = calloc(_RS_BUF_GROWBY, 1);
-		if (buf->buf == NULL) {
-			return NULL;
-		}
-		buf->cap = _RS_BUF_GROWBY;
+	if (buf->off + 1 >= buf->cap && rs_buf_grow(buf, 1) == NULL) {
+		return NULL;
 	}
+	buf->buf[buf->off++] = c;
 
-	if (buf->off >= buf->cap - 1) {
-		char *newbuf = realloc(buf->buf, buf->cap + _RS_BUF_GROWBY);
-		if (newbuf == NULL) {
-			return NULL;
-		}
-		buf->buf = newbuf;
-		buf->cap += _RS_BUF_GROWBY;
+	assert(buf->off < buf->cap);
+	return buf;
+}
+
+
+struct rs_buf *rs_buf_append(struct rs_buf *buf, const char *data, size_t len)
+{
+	assert(buf != NULL);
+	assert(buf->buf != NULL && buf->off < buf->cap);
+	assert(data != NULL || len == 0);
+
+	if (buf->off + len >= buf->cap && rs_buf_grow(buf, len) == NULL) {
+		return NULL;
 	}
-	buf->buf[buf->off++] = c;
+	memcpy(buf->buf + buf->off, data, len);
+	buf->off += len;
 
-	assert(buf->buf != NULL);
-	assert(buf->cap > 0);
-	assert(buf->off > 0 && buf->off < buf->cap);
+	assert(buf->off < buf->cap);
 	return buf;
 }
 
@@ -61,17 +79,53 @@ struct rs_buf *rs_buf_push(struct rs_buf *buf, char c)
 const char *rs_buf_cstr(struct rs_buf *buf)
 {
 	assert(buf != NULL);
-	assert((buf->buf == NULL && buf->cap == 0 && buf->off == 0) ||
-	       (buf->buf != NULL && buf->cap > 0 && buf->off < buf->cap));
+	assert(buf->buf != NULL && buf->off < buf->cap);
 
-	if (buf->buf == NULL) {
-		return "";
-	}
 	buf->buf[buf->off] = '\0';
 	return (const char *) buf->buf;
 }
 
 
+size_t rs_buf_len(struct rs_buf *buf)
+{
+	assert(buf != NULL);
+	return buf->off;
+}
+
+
+size_t rs_buf_cap(struct rs_buf *buf)
+{
+	assert(buf != NULL);
+	return buf->cap;
+}
+
+
+/* Make room for need more characters, plus the NUL. */
+static struct rs_buf *rs_buf_grow(struct rs_buf *buf, size_t need)
+{
+	size_t cap = buf->cap;
+	while (buf->off + need >= cap) {
+		cap *= 2;
+	}
+
+	char *newbuf;
+	if (buf->buf == buf->small) {
+		newbuf = malloc(cap);
+		if (newbuf != NULL) {
+			memcpy(newbuf, buf->small, buf->off);
+		}
+	} else {
+		newbuf = realloc(buf->buf, cap);
+	}
+	if (newbuf == NULL) {
+		return NULL;
+	}
+	buf->buf = newbuf;
+	buf->cap = cap;
+	return buf;
+}
+
+
 void rs_buf_test(void)
 {
 	struct rs_buf buf;
@@ -88,13 +142,31 @@ void rs_buf_test(void)
 			rs_fatal("could not push to buffer:");
 		}
 	}
-	const char *bufstr = rs_buf_cstr(&buf);
 
-	// Make sure the returned string is nul-terminated.
-	assert(bufstr[strlen(str)+1] == '\0');
+	// Make sure the returned string is nul-terminated, and matches the
+	// original string.
+	assert(rs_buf_cstr(&buf)[strlen(str)] == '\0');
+	assert(strcmp(rs_buf_cstr(&buf), str) == 0);
 
-	// Make sure the returned string matches the original string.
-	assert(strcmp(bufstr, str) == 0);
+	// Append enough copies to move the buffer out of the small array, and
+	// make sure nothing was lost along the way.
+	for (int i = 0; i < 100; i++) {
+		if (rs_buf_append(&buf, str, strlen(str)) == NULL) {
+			rs_fatal("could not append to buffer:");
+		}
+	}
+	assert(rs_buf_len(&buf) == 101 * strlen(str));
+	for (int i = 0; i < 101; i++) {
+		assert(strncmp(rs_buf_cstr(&buf) + i * strlen(str), str,
+		               strlen(str)) == 0);
+	}
+
+	// Clearing keeps the memory around.
+	size_t cap = rs_buf_cap(&buf);
+	rs_buf_clear(&buf);
+	assert(strcmp(rs_buf_cstr(&buf), "") == 0);
+	assert(rs_buf_cap(&buf) == cap);
+	(void) cap;
 
 	rs_buf_reset(&buf);
 	TRACE("passed");
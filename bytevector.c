@@ -0,0 +1,269 @@
+#include "rescheme.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+/* A bytevector's bytes are either malloc'd, or they're part of a file that's
+   been mapped into memory (see source.c). A mapped bytevector is a slice, like
+   a string read from a mapped file: it points straight into the mapping, which
+   stays mapped for as long as the bytevector is alive, so a file of any size
+   can be read without copying it. Mappings are read-only, and so are the
+   bytevectors that point into them.
+
+   Multi-byte values are read and written with memcpy(), which compiles to a
+   single unaligned load or store, and byte-swapped if their endianness isn't
+   the machine's.
+*/
+
+static uint64_t rs_bytevector_swap(uint64_t val, int size);
+
+
+rs_object rs_bytevector_create(size_t len, int fill)
+{
+	/* Empty bytevectors get a byte anyway, so the data is never NULL. */
+	unsigned char *data = malloc(len > 0 ? len : 1);
+	if (data == NULL) {
+		rs_fatal("could not create bytevector:");
+	}
+	memset(data, fill, len);
+
+	rs_bytevector *bv = rs_gc_alloc_hobject();
+	bv->type = RS_BYTEVECTOR;
+	bv->val.bytes.data = data;
+	bv->val.bytes.len = len;
+	return rs_bytevector_to_obj(bv);
+}
+
+
+rs_object rs_bytevector_map(const char *path, size_t start, size_t end)
+{
+	assert(path != NULL);
+
+	struct rs_source *src = rs_source_map(path);
+	if (src == NULL) {
+		return rs_false;
+	}
+	size_t len = rs_source_len(src);
+	if (end == SIZE_MAX) {
+		end = len;
+	}
+	if (start > end || end > len) {
+		rs_source_release(src);
+		rs_fatal("could not map %s: region is outside the file", path);
+	}
+
+	/* The source has to stay owned until the bytevector points into it, in
+	   case allocating the bytevector starts a collection. */
+	rs_bytevector *bv = rs_gc_alloc_hobject();
+	bv->type = RS_BYTEVECTOR;
+	bv->flags |= _HOBJECT_FLAG_SLICE;
+	bv->val.bytes.data = (unsigned char *)rs_source_data(src) + start;
+	bv->val.bytes.len = end - start;
+	rs_source_release(src);
+	return rs_bytevector_to_obj(bv);
+}
+
+
+rs_object rs_bytevector_from_list(rs_object list)
+{
+	size_t len = 0;
+	rs_object l;
+	for (l = list; rs_pair_p(l); l = rs_pair_cdr(rs_obj_to_pair(l))) {
+		rs_object b = rs_pair_car(rs_obj_to_pair(l));
+		if (!rs_fixnum_p(b) || rs_obj_to_fixnum(b) < 0 ||
+		    rs_obj_to_fixnum(b) > 255) {
+			rs_fatal("not a byte");
+		}
+		len++;
+	}
+	if (!rs_null_p(l)) {
+		rs_fatal("not a proper list");
+	}
+
+	rs_gc_push(list);
+	rs_object obj = rs_bytevector_create(len, 0);
+	rs_gc_pop();
+	unsigned char *data = rs_bytevector_data(rs_obj_to_bytevector(obj));
+	for (l = list; rs_pair_p(l); l = rs_pair_cdr(rs_obj_to_pair(l))) {
+		rs_object b = rs_pair_car(rs_obj_to_pair(l));
+		*data++ = (unsigned char)rs_obj_to_fixnum(b);
+	}
+	return obj;
+}
+
+
+rs_object rs_bytevector_copy(rs_object bv, size_t start, size_t end)
+{
+	assert(start <= end &&
+	       end <= rs_bytevector_length(rs_obj_to_bytevector(bv)));
+
+	rs_gc_push(bv);
+	rs_object copy = rs_bytevector_create(end - start, 0);
+	rs_gc_pop();
+	memcpy(rs_bytevector_data(rs_obj_to_bytevector(copy)),
+	       rs_bytevector_data(rs_obj_to_bytevector(bv)) + start, end - start);
+	return copy;
+}
+
+
+void rs_bytevector_move(rs_bytevector *dst, size_t at, rs_bytevector *src,
+                        size_t start, size_t end)
+{
+	assert(rs_bytevector_mutable_p(dst));
+	assert(start <= end && end <= rs_bytevector_length(src));
+	assert(at <= rs_bytevector_length(dst) &&
+	       end - start <= rs_bytevector_length(dst) - at);
+
+	/* The source and destination may be the same bytevector. */
+	memmove(rs_bytevector_data(dst) + at, rs_bytevector_data(src) + start,
+	        end - start);
+}
+
+
+uint64_t rs_bytevector_ref_uint(rs_bytevector *bv, size_t i, int size,
+                                int big)
+{
+	assert(size == 1 || size == 2 || size == 4 || size == 8);
+	assert(i <= rs_bytevector_length(bv) &&
+	       (size_t)size <= rs_bytevector_length(bv) - i);
+
+	const unsigned char *p = rs_bytevector_data(bv) + i;
+	uint64_t val;
+	switch (size) {
+	case 1:
+		return *p;
+	case 2: {
+		uint16_t v;
+		memcpy(&v, p, sizeof(v));
+		val = v;
+		break;
+	}
+	case 4: {
+		uint32_t v;
+		memcpy(&v, p, sizeof(v));
+		val = v;
+		break;
+	}
+	default:
+		memcpy(&val, p, sizeof(val));
+		break;
+	}
+	return big == rs_bytevector_native_big() ? val
+	                                         : rs_bytevector_swap(val, size);
+}
+
+
+void rs_bytevector_set_uint(rs_bytevector *bv, size_t i, int size, int big,
+                            uint64_t val)
+{
+	assert(rs_bytevector_mutable_p(bv));
+	assert(size == 1 || size == 2 || size == 4 || size == 8);
+	assert(i <= rs_bytevector_length(bv) &&
+	       (size_t)size <= rs_bytevector_length(bv) - i);
+
+	unsigned char *p = rs_bytevector_data(bv) + i;
+	if (big != rs_bytevector_native_big()) {
+		val = rs_bytevector_swap(val, size);
+	}
+	switch (size) {
+	case 1:
+		*p = (unsigned char)val;
+		break;
+	case 2: {
+		uint16_t v = (uint16_t)val;
+		memcpy(p, &v, sizeof(v));
+		break;
+	}
+	case 4: {
+		uint32_t v = (uint32_t)val;
+		memcpy(p, &v, sizeof(v));
+		break;
+	}
+	default:
+		memcpy(p, &val, sizeof(val));
+		break;
+	}
+}
+
+
+/* Reverse the low size bytes of val. */
+static uint64_t rs_bytevector_swap(uint64_t val, int size)
+{
+#ifdef __GNUC__
+	switch (size) {
+	case 1:
+		return val;
+	case 2:
+		return __builtin_bswap16((uint16_t)val);
+	case 4:
+		return __builtin_bswap32((uint32_t)val);
+	default:
+		return __builtin_bswap64(val);
+	}
+#else
+	uint64_t r = 0;
+	for (int k = 0; k < size; k++) {
+		r = (r << 8) | ((val >> (8 * k)) & 0xff);
+	}
+	return r;
+#endif
+}
+
+
+int rs_bytevector_native_big(void)
+{
+	const union { uint16_t u; unsigned char c[2]; } probe = { 1 };
+	return probe.c[0] == 0;
+}
+
+
+
+/**** Testing. ****/
+
+void rs_bytevector_test(void)
+{
+	rs_eval_expect("(let ((bv (make-bytevector 4 7)))"
+	               "  (bytevector-u8-set! bv 0 255)"
+	               "  (bytevector-u8-set! bv 3 0)"
+	               "  (list (bytevector-u8-ref bv 0) (bytevector-u8-ref bv 1)"
+	               "        (bytevector-s8-ref bv 0) bv))",
+	               "(255 7 -1 #u8(255 7 7 0))");
+	rs_eval_expect("(let ((bv (make-bytevector 8 0)))"
+	               "  (bytevector-u16-set! bv 1 #x1234 'big)"
+	               "  (bytevector-s32-set! bv 4 -2 'little)"
+	               "  (list bv (bytevector-u16-ref bv 1 'little)"
+	               "        (bytevector-s32-ref bv 4 'little)"
+	               "        (bytevector-u32-ref bv 4 'big)))",
+	               "(#u8(0 #x12 #x34 0 #xfe #xff #xff #xff) #x3412 -2"
+	               " #xfeffffff)");
+	rs_eval_expect("(let ((bv (make-bytevector 8 #xff)))"
+	               "  (list (bytevector-u64-ref bv 0) (bytevector-s64-ref bv 0)))",
+	               "(18446744073709551615 -1)");
+	rs_eval_expect("(let ((bv (make-bytevector 8 0)))"
+	               "  (bytevector-ieee-double-set! bv 0 -1.5 'big)"
+	               "  (list (bytevector-u8-ref bv 0)"
+	               "        (bytevector-ieee-double-ref bv 0 'big)))",
+	               "(#xbf -1.5)");
+	rs_eval_expect("(let ((bv (bytevector 1 2 3 4 5)))"
+	               "  (bytevector-copy! bv 1 bv 0 3)"
+	               "  (list bv (bytevector-copy bv 3)))",
+	               "(#u8(1 1 2 3 5) #u8(3 5))");
+
+	rs_eval_expect_error("(bytevector-u8-set! (make-bytevector 3 0) 3 1)");
+	rs_eval_expect_error("(bytevector-u8-set! (make-bytevector 3 0) -1 1)");
+	rs_eval_expect_error("(bytevector-u8-set! (make-bytevector 0) 0 1)");
+	rs_eval_expect_error("(bytevector-u8-ref (bytevector 1 2) 2)");
+	rs_eval_expect_error("(bytevector-u8-set! (make-bytevector 3 0) 0 256)");
+	rs_eval_expect_error("(bytevector-u8-set! (make-bytevector 3 0) 0 -1)");
+	rs_eval_expect_error("(bytevector-s8-set! (make-bytevector 3 0) 0 128)");
+	rs_eval_expect_error("(bytevector-u16-ref (make-bytevector 3 0) 2)");
+	rs_eval_expect_error("(bytevector-u64-set! (make-bytevector 8 0) 0"
+	                     "  18446744073709551616)");
+	rs_eval_expect_error("(bytevector-u16-ref (make-bytevector 2 0) 0 'middle)");
+	rs_eval_expect_error("(bytevector 1 256)");
+	rs_eval_expect_error("(bytevector-copy! (make-bytevector 2 0) 1"
+	                     "  (bytevector 1 2) 0 2)");
+
+	TRACE("passed");
+}
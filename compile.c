@@ -0,0 +1,1351 @@
+#include "rescheme.h"
+
+#include <assert.h>
+#include <string.h>
+
+/* The compiler turns an expression into code for the VM (see vm.c) in a
+   single pass, keeping a scope for each lambda expression it is inside.
+
+   Variables bound by lambda, let and friends live in numbered slots in their
+   procedure's frame, and are looked up by slot number. Variables from an
+   enclosing lambda are copied into the closure when it is made, and looked up
+   by their index in it. Everything else is a global variable.
+
+   Copying only works for variables that never change, so a variable that is
+   the target of a set! anywhere in the body of the lambda that binds it is
+   kept in a box instead, and closures copy the box. A quick scan of each
+   lambda's body before compiling it finds those variables.
+
+   letrec (and internal defines) of procedures that are never assigned don't
+   need boxes either: the closures are made with empty slots for each other,
+   and patched with FIX instructions once they all exist.
+
+   The compiler also keeps track of how deep the value stack gets, so that the
+   VM only needs to check for overflow once per call.
+
+   Compiling recurses on subexpressions, so an expression nested more than
+   MAX_NESTING deep is an error, rather than a crash once the C stack runs
+   out. Quoted data isn't compiled, or scanned, so it can be nested as deeply
+   as memory allows.
+*/
+#define MAX_NESTING 10000
+
+/* What is done with an expression's value: it's either left on the stack,
+   thrown away, or returned from the procedure.
+*/
+enum rs_compile_ctx {
+	CTX_VALUE, CTX_EFFECT, CTX_TAIL
+};
+
+struct rs_compile_var {
+	const char *name;
+	int slot;
+	int boxed;
+};
+
+struct rs_compile_free {
+	const char *name;
+	int boxed;
+};
+
+struct rs_compile_fix {
+	long closure;
+	long index;
+	long slot;
+};
+
+struct rs_compile_scope {
+	struct rs_compile_scope *outer;
+	struct rs_code *code;
+	struct rs_compile_var *vars;       // innermost binding last
+	int nvars, capvars;
+	struct rs_compile_free *free;
+	int nfree, capfree;
+	const char **mutated;
+	int nmutated, capmutated;
+	struct rs_compile_fix *fixes;
+	int nfixes, capfixes;
+	int nslots;
+	int depth;
+	int nesting;                       // counting the outer scopes' too
+};
+
+enum rs_compile_ref_kind {
+	REF_LOCAL, REF_FREE, REF_GLOBAL
+};
+
+struct rs_compile_ref {
+	enum rs_compile_ref_kind kind;
+	long index;                        // a global's shared symbol
+	int boxed;
+};
+
+/* A letrec binding, or an internal definition. Procedures are compiled from
+   their parameters and body, so that (define (f x) ...) doesn't have to be
+   rewritten into a lambda expression first.
+*/
+struct rs_compile_binding {
+	const char *name;
+	int lambda;
+	rs_object params;
+	rs_object body;
+	rs_object init;
+};
+
+#define KEYWORDS(X) \
+	X(QUOTE, "quote") X(IF, "if") X(DEFINE, "define") X(SET, "set!") \
+	X(LAMBDA, "lambda") X(BEGIN, "begin") X(LET, "let") X(LETSTAR, "let*") \
+	X(LETREC, "letrec") X(LETRECSTAR, "letrec*") X(COND, "cond") \
+	X(ELSE, "else") X(ARROW, "=>") X(AND, "and") X(OR, "or") \
+	X(WHEN, "when") X(UNLESS, "unless")
+
+#define _KW_ENUM(kw, name) KW_##kw,
+enum rs_compile_keyword { KEYWORDS(_KW_ENUM) KW_COUNT, KW_NONE };
+#undef _KW_ENUM
+
+#define _KW_NAME(kw, name) name,
+static const char *const keyword_names[] = { KEYWORDS(_KW_NAME) };
+#undef _KW_NAME
+
+/* The interned names of the keywords, so they can be compared by address, are
+   kept in the interpreter (see struct rs_vm), since each one has its own
+   symbol table.
+*/
+
+/* Primitives that have instructions of their own, when called with nargs
+   arguments.
+*/
+static const struct {
+	const char *name;
+	enum rs_opcode op;
+	int nargs;
+} open_coded[] = {
+	{ "car", OP_CAR, 1 }, { "cdr", OP_CDR, 1 }, { "cons", OP_CONS, 2 },
+	{ "null?", OP_NULL_P, 1 }, { "pair?", OP_PAIR_P, 1 },
+	{ "not", OP_NOT, 1 }, { "eq?", OP_EQ_P, 2 },
+	{ "+", OP_ADD, 2 }, { "-", OP_SUB, 2 }, { "*", OP_MUL, 2 },
+	{ "=", OP_NUM_EQ, 2 }, { "<", OP_LT, 2 }, { ">", OP_GT, 2 },
+	{ "<=", OP_LE, 2 }, { ">=", OP_GE, 2 }
+};
+
+#define CAR(x) rs_pair_car(rs_obj_to_pair(x))
+#define CDR(x) rs_pair_cdr(rs_obj_to_pair(x))
+#define CADR(x) CAR(CDR(x))
+#define CDDR(x) CDR(CDR(x))
+
+
+static void rs_compile_expr(struct rs_compile_scope *s, rs_object x,
+                            enum rs_compile_ctx ctx);
+static void rs_compile_form(struct rs_compile_scope *s, enum
+                            rs_compile_keyword kw, rs_object x,
+                            enum rs_compile_ctx ctx);
+static void rs_compile_seq(struct rs_compile_scope *s, rs_object body,
+                           enum rs_compile_ctx ctx);
+static void rs_compile_body(struct rs_compile_scope *s, rs_object body,
+                            enum rs_compile_ctx ctx);
+static void rs_compile_named(struct rs_compile_scope *s, rs_object x,
+                             const char *name);
+static void rs_compile_lambda(struct rs_compile_scope *s, rs_object params,
+                              rs_object body, const char *name, int fix_lo,
+                              int fix_hi, int fix_slot);
+static void rs_compile_if(struct rs_compile_scope *s, rs_object x,
+                          enum rs_compile_ctx ctx);
+static void rs_compile_cond(struct rs_compile_scope *s, rs_object x,
+                            enum rs_compile_ctx ctx);
+static void rs_compile_and_or(struct rs_compile_scope *s, rs_object x,
+                              int and, enum rs_compile_ctx ctx);
+static void rs_compile_let(struct rs_compile_scope *s, rs_object x,
+                           enum rs_compile_ctx ctx);
+static void rs_compile_named_let(struct rs_compile_scope *s, rs_object x,
+                                 enum rs_compile_ctx ctx);
+static void rs_compile_let_star(struct rs_compile_scope *s, rs_object x,
+                                enum rs_compile_ctx ctx);
+static void rs_compile_letrec(struct rs_compile_scope *s, rs_object x,
+                              enum rs_compile_ctx ctx);
+static void rs_compile_bindings(struct rs_compile_scope *s,
+                                struct rs_compile_binding *b, int n);
+static void rs_compile_define_binding(rs_object x,
+                                      struct rs_compile_binding *b);
+static void rs_compile_call(struct rs_compile_scope *s, rs_object x,
+                            enum rs_compile_ctx ctx);
+static int rs_compile_prim_call(struct rs_compile_scope *s, rs_object x,
+                                long n, enum rs_compile_ctx ctx);
+static void rs_compile_ref(struct rs_compile_scope *s, const char *name,
+                           struct rs_compile_ref *ref);
+static int rs_compile_find(struct rs_compile_scope *s, const char *name,
+                           struct rs_compile_ref *ref);
+static int rs_compile_bound_p(struct rs_compile_scope *s, const char *name);
+static int rs_compile_bind(struct rs_compile_scope *s, const char *name,
+                           int boxed);
+static int rs_compile_temp(struct rs_compile_scope *s);
+static int rs_compile_mutated_p(struct rs_compile_scope *s, const char *name);
+static void rs_compile_scan(struct rs_compile_scope *s, rs_object x);
+static enum rs_compile_keyword rs_compile_keyword(struct rs_compile_scope *s,
+                                                  rs_object x);
+static const char *rs_compile_name(rs_object x, const char *form);
+static long rs_compile_length(rs_object x, long min, long max,
+                              const char *form);
+static long rs_compile_emit(struct rs_compile_scope *s, long word);
+static void rs_compile_op(struct rs_compile_scope *s, enum rs_opcode op,
+                          int delta);
+static void rs_compile_const(struct rs_compile_scope *s, rs_object obj);
+static void rs_compile_keep(struct rs_compile_scope *s, rs_object obj);
+static long rs_compile_jump(struct rs_compile_scope *s, enum rs_opcode op,
+                            int delta);
+static void rs_compile_patch(struct rs_compile_scope *s, long at);
+static void rs_compile_done(struct rs_compile_scope *s,
+                            enum rs_compile_ctx ctx);
+static void rs_compile_unspecified(struct rs_compile_scope *s,
+                                   enum rs_compile_ctx ctx);
+static void rs_compile_scope_init(struct rs_compile_scope *s,
+                                  struct rs_compile_scope *outer,
+                                  rs_object code);
+static void rs_compile_scope_finish(struct rs_compile_scope *s,
+                                    const char *name);
+static void *rs_compile_grow(void *p, int *cap, size_t size);
+
+
+rs_object rs_compile(rs_object expr)
+{
+	struct rs_vm *vm = rs_vm_current();
+	if (vm->keywords == NULL) {
+		vm->keywords = malloc(KW_COUNT * sizeof(const char *));
+		if (vm->keywords == NULL) {
+			rs_fatal("could not allocate keywords:");
+		}
+		for (int i = 0; i < KW_COUNT; i++) {
+			vm->keywords[i] = rs_symtab_insert(keyword_names[i]);
+		}
+	}
+
+	rs_gc_push(expr);
+	rs_object code = rs_code_create();
+	rs_gc_push(code);
+
+	struct rs_compile_scope top;
+	rs_compile_scope_init(&top, NULL, code);
+	rs_compile_scan(&top, expr);
+	rs_compile_expr(&top, expr, CTX_TAIL);
+	rs_compile_scope_finish(&top, NULL);
+
+	rs_gc_pop();
+	rs_gc_pop();
+	return code;
+}
+
+
+static void rs_compile_expr(struct rs_compile_scope *s, rs_object x,
+                            enum rs_compile_ctx ctx)
+{
+	if (++s->nesting > MAX_NESTING) {
+		rs_fatal("expression nested too deeply");
+	}
+	if (rs_symbol_p(x)) {
+		struct rs_compile_ref ref;
+		rs_compile_ref(s, rs_symbol_cstr(rs_obj_to_symbol(x)), &ref);
+		switch (ref.kind) {
+		case REF_LOCAL:
+			rs_compile_op(s, ref.boxed ? OP_LOCAL_BOXED : OP_LOCAL, 1);
+			break;
+		case REF_FREE:
+			rs_compile_op(s, ref.boxed ? OP_FREE_BOXED : OP_FREE, 1);
+			break;
+		case REF_GLOBAL:
+			rs_compile_op(s, OP_GLOBAL, 1);
+			break;
+		}
+		rs_compile_emit(s, ref.index);
+		rs_compile_done(s, ctx);
+	} else if (rs_pair_p(x)) {
+		enum rs_compile_keyword kw = rs_compile_keyword(s, CAR(x));
+		if (kw == KW_NONE) {
+			rs_compile_call(s, x, ctx);
+		} else {
+			rs_compile_form(s, kw, x, ctx);
+		}
+	} else {
+		rs_compile_const(s, x);
+		rs_compile_done(s, ctx);
+	}
+	s->nesting--;
+}
+
+
+static void rs_compile_form(struct rs_compile_scope *s,
+                            enum rs_compile_keyword kw, rs_object x,
+                            enum rs_compile_ctx ctx)
+{
+	struct rs_compile_ref ref;
+	const char *name;
+
+	switch (kw) {
+	case KW_QUOTE:
+		rs_compile_length(x, 2, 2, "quote");
+		rs_compile_const(s, CADR(x));
+		rs_compile_done(s, ctx);
+		break;
+
+	case KW_IF:
+		rs_compile_if(s, x, ctx);
+		break;
+
+	case KW_DEFINE:
+		/* Internal definitions are handled by rs_compile_body(), so this is
+		   a global one. */
+		if (s->outer != NULL || s->nvars > 0) {
+			rs_fatal("misplaced definition");
+		}
+		{
+			struct rs_compile_binding b;
+			rs_compile_define_binding(x, &b);
+			if (b.lambda) {
+				rs_compile_lambda(s, b.params, b.body, b.name, 0, 0, -1);
+			} else {
+				rs_compile_named(s, b.init, b.name);
+			}
+			rs_compile_ref(s, b.name, &ref);
+			assert(ref.kind == REF_GLOBAL);
+			rs_compile_op(s, OP_DEFINE_GLOBAL, -1);
+			rs_compile_emit(s, ref.index);
+		}
+		rs_compile_unspecified(s, ctx);
+		break;
+
+	case KW_SET:
+		rs_compile_length(x, 3, 3, "set!");
+		name = rs_compile_name(CADR(x), "set!");
+		rs_compile_named(s, CAR(CDDR(x)), name);
+		rs_compile_ref(s, name, &ref);
+		switch (ref.kind) {
+		case REF_LOCAL:
+			assert(ref.boxed);
+			rs_compile_op(s, OP_SET_LOCAL_BOXED, -1);
+			break;
+		case REF_FREE:
+			assert(ref.boxed);
+			rs_compile_op(s, OP_SET_FREE_BOXED, -1);
+			break;
+		case REF_GLOBAL:
+			rs_compile_op(s, OP_SET_GLOBAL, -1);
+			break;
+		}
+		rs_compile_emit(s, ref.index);
+		rs_compile_unspecified(s, ctx);
+		break;
+
+	case KW_LAMBDA:
+		rs_compile_length(x, 3, -1, "lambda");
+		rs_compile_lambda(s, CADR(x), CDDR(x), NULL, 0, 0, -1);
+		rs_compile_done(s, ctx);
+		break;
+
+	case KW_BEGIN:
+		rs_compile_length(x, 1, -1, "begin");
+		rs_compile_seq(s, CDR(x), ctx);
+		break;
+
+	case KW_LET:
+		rs_compile_length(x, 3, -1, "let");
+		if (rs_symbol_p(CADR(x))) {
+			rs_compile_named_let(s, x, ctx);
+		} else {
+			rs_compile_let(s, x, ctx);
+		}
+		break;
+
+	case KW_LETSTAR:
+		rs_compile_let_star(s, x, ctx);
+		break;
+
+	case KW_LETREC:
+	case KW_LETRECSTAR:
+		rs_compile_letrec(s, x, ctx);
+		break;
+
+	case KW_COND:
+		rs_compile_cond(s, x, ctx);
+		break;
+
+	case KW_AND:
+	case KW_OR:
+		rs_compile_and_or(s, x, kw == KW_AND, ctx);
+		break;
+
+	case KW_WHEN:
+	case KW_UNLESS: {
+		rs_compile_length(x, 3, -1, keyword_names[kw]);
+		rs_compile_expr(s, CADR(x), CTX_VALUE);
+		if (kw == KW_UNLESS) {
+			/* (unless t body ...) is (if t #f (begin body ...)), more or
+			   less. */
+			long skip = rs_compile_jump(s, OP_JUMP_FALSE, -1);
+			int depth = s->depth;
+			rs_compile_unspecified(s, ctx);
+			long end = ctx == CTX_TAIL ? -1 : rs_compile_jump(s, OP_JUMP, 0);
+			rs_compile_patch(s, skip);
+			s->depth = depth;
+			rs_compile_seq(s, CDDR(x), ctx);
+			if (end >= 0) {
+				rs_compile_patch(s, end);
+			}
+		} else {
+			long skip = rs_compile_jump(s, OP_JUMP_FALSE, -1);
+			int depth = s->depth;
+			rs_compile_seq(s, CDDR(x), ctx);
+			long end = ctx == CTX_TAIL ? -1 : rs_compile_jump(s, OP_JUMP, 0);
+			rs_compile_patch(s, skip);
+			s->depth = depth;
+			rs_compile_unspecified(s, ctx);
+			if (end >= 0) {
+				rs_compile_patch(s, end);
+			}
+		}
+		break;
+	}
+
+	case KW_ELSE:
+	case KW_ARROW:
+	default:
+		rs_fatal("bad syntax: %s", keyword_names[kw]);
+	}
+}
+
+
+static void rs_compile_seq(struct rs_compile_scope *s, rs_object body,
+                           enum rs_compile_ctx ctx)
+{
+	if (rs_null_p(body)) {
+		rs_compile_unspecified(s, ctx);
+		return;
+	}
+	while (!rs_null_p(CDR(body))) {
+		rs_compile_expr(s, CAR(body), CTX_EFFECT);
+		body = CDR(body);
+	}
+	rs_compile_expr(s, CAR(body), ctx);
+}
+
+
+/* Compile a lambda or let body, which can start with definitions. They're
+   treated like a letrec* around the rest of the body.
+*/
+static void rs_compile_body(struct rs_compile_scope *s, rs_object body,
+                            enum rs_compile_ctx ctx)
+{
+	int n = 0;
+	rs_object rest = body;
+	while (rs_pair_p(rest) && rs_pair_p(CAR(rest)) &&
+	       rs_compile_keyword(s, CAR(CAR(rest))) == KW_DEFINE) {
+		n++;
+		rest = CDR(rest);
+	}
+	if (n == 0) {
+		rs_compile_seq(s, body, ctx);
+		return;
+	}
+
+	struct rs_compile_binding *b = malloc(n * sizeof(*b));
+	if (b == NULL) {
+		rs_fatal("could not allocate bindings:");
+	}
+	for (int i = 0; i < n; i++) {
+		rs_compile_define_binding(CAR(body), &b[i]);
+		body = CDR(body);
+	}
+	rs_compile_bindings(s, b, n);
+	free(b);
+	rs_compile_seq(s, rest, ctx);
+}
+
+
+/* Compile x, and if it's a lambda expression, give the procedure a name. */
+static void rs_compile_named(struct rs_compile_scope *s, rs_object x,
+                             const char *name)
+{
+	if (rs_pair_p(x) && rs_compile_keyword(s, CAR(x)) == KW_LAMBDA) {
+		rs_compile_length(x, 3, -1, "lambda");
+		rs_compile_lambda(s, CADR(x), CDDR(x), name, 0, 0, -1);
+	} else {
+		rs_compile_expr(s, x, CTX_VALUE);
+	}
+}
+
+
+/* Compile a procedure, and the code to make a closure of it. If the closure is
+   part of a letrec whose variables are in slots fix_lo to fix_hi - 1, and will
+   be stored in fix_slot, references to those variables are left for FIX
+   instructions to fill in.
+*/
+static void rs_compile_lambda(struct rs_compile_scope *s, rs_object params,
+                              rs_object body, const char *name, int fix_lo,
+                              int fix_hi, int fix_slot)
+{
+	rs_object code = rs_code_create();
+	rs_gc_push(code);
+
+	struct rs_compile_scope inner;
+	rs_compile_scope_init(&inner, s, code);
+	rs_compile_scan(&inner, body);
+
+	int nargs = 0;
+	while (rs_pair_p(params)) {
+		const char *p = rs_compile_name(CAR(params), "lambda");
+		rs_compile_bind(&inner, p, rs_compile_mutated_p(&inner, p));
+		nargs++;
+		params = CDR(params);
+	}
+	inner.code->nargs = nargs;
+	if (!rs_null_p(params)) {
+		const char *p = rs_compile_name(params, "lambda");
+		rs_compile_bind(&inner, p, rs_compile_mutated_p(&inner, p));
+		inner.code->rest = 1;
+	}
+	for (int i = 0; i < inner.nvars; i++) {
+		if (inner.vars[i].boxed) {
+			rs_compile_op(&inner, OP_BOX_LOCAL, 0);
+			rs_compile_emit(&inner, inner.vars[i].slot);
+		}
+	}
+
+	rs_compile_body(&inner, body, CTX_TAIL);
+
+	/* Capture the closure's free variables. */
+	for (int i = 0; i < inner.nfree; i++) {
+		struct rs_compile_ref ref;
+		rs_compile_ref(s, inner.free[i].name, &ref);
+		assert(ref.kind != REF_GLOBAL);
+		if (ref.kind == REF_LOCAL && ref.index >= fix_lo &&
+		    ref.index < fix_hi) {
+			if (s->nfixes == s->capfixes) {
+				s->fixes = rs_compile_grow(s->fixes, &s->capfixes,
+				                           sizeof(*s->fixes));
+			}
+			s->fixes[s->nfixes].closure = fix_slot;
+			s->fixes[s->nfixes].index = i;
+			s->fixes[s->nfixes].slot = ref.index;
+			s->nfixes++;
+		}
+		rs_compile_op(s, ref.kind == REF_LOCAL ? OP_LOCAL : OP_FREE, 1);
+		rs_compile_emit(s, ref.index);
+	}
+	rs_compile_scope_finish(&inner, name);
+
+	rs_compile_op(s, OP_CLOSURE, 1 - inner.code->nfree);
+	rs_compile_keep(s, code);
+	rs_compile_emit(s, code);
+	rs_compile_emit(s, inner.code->nfree);
+	rs_gc_pop();
+}
+
+
+static void rs_compile_if(struct rs_compile_scope *s, rs_object x,
+                          enum rs_compile_ctx ctx)
+{
+	long len = rs_compile_length(x, 3, 4, "if");
+
+	rs_compile_expr(s, CADR(x), CTX_VALUE);
+	long alt = rs_compile_jump(s, OP_JUMP_FALSE, -1);
+	int depth = s->depth;
+
+	rs_compile_expr(s, CAR(CDDR(x)), ctx);
+	if (len == 3 && ctx == CTX_EFFECT) {
+		rs_compile_patch(s, alt);
+		return;
+	}
+	long end = ctx == CTX_TAIL ? -1 : rs_compile_jump(s, OP_JUMP, 0);
+
+	rs_compile_patch(s, alt);
+	s->depth = depth;
+	if (len == 4) {
+		rs_compile_expr(s, CADR(CDDR(x)), ctx);
+	} else {
+		rs_compile_unspecified(s, ctx);
+	}
+	if (end >= 0) {
+		rs_compile_patch(s, end);
+	}
+}
+
+
+static void rs_compile_cond(struct rs_compile_scope *s, rs_object x,
+                            enum rs_compile_ctx ctx)
+{
+	rs_compile_length(x, 1, -1, "cond");
+
+	long *ends = NULL;
+	int nends = 0, capends = 0;
+	int depth = s->depth;
+	int has_else = 0;
+
+	for (rs_object c = CDR(x); !rs_null_p(c); c = CDR(c)) {
+		rs_object clause = CAR(c);
+		long len = rs_compile_length(clause, 1, -1, "cond");
+		s->depth = depth;
+
+		if (rs_compile_keyword(s, CAR(clause)) == KW_ELSE) {
+			rs_compile_seq(s, CDR(clause), ctx);
+			has_else = 1;
+			break;
+		}
+
+		long next;
+		rs_compile_expr(s, CAR(clause), CTX_VALUE);
+		if (len == 1) {
+			/* (test) gives the value of test. */
+			rs_compile_op(s, OP_DUP, 1);
+			next = rs_compile_jump(s, OP_JUMP_FALSE, -1);
+			rs_compile_done(s, ctx);
+		} else if (rs_compile_keyword(s, CADR(clause)) == KW_ARROW) {
+			/* (test => f) calls f on the value of test, which is kept in a
+			   spare slot while f is evaluated. */
+			rs_compile_length(clause, 3, 3, "cond");
+			int slot = rs_compile_temp(s);
+			rs_compile_op(s, OP_SET_LOCAL, -1);
+			rs_compile_emit(s, slot);
+			rs_compile_op(s, OP_LOCAL, 1);
+			rs_compile_emit(s, slot);
+			next = rs_compile_jump(s, OP_JUMP_FALSE, -1);
+			rs_compile_expr(s, CAR(CDDR(clause)), CTX_VALUE);
+			rs_compile_op(s, OP_LOCAL, 1);
+			rs_compile_emit(s, slot);
+			s->nslots--;
+			if (ctx == CTX_TAIL) {
+				rs_compile_op(s, OP_TAIL_CALL, -1);
+				rs_compile_emit(s, 1);
+			} else {
+				rs_compile_op(s, OP_CALL, -1);
+				rs_compile_emit(s, 1);
+				rs_compile_done(s, ctx);
+			}
+		} else {
+			next = rs_compile_jump(s, OP_JUMP_FALSE, -1);
+			rs_compile_seq(s, CDR(clause), ctx);
+		}
+
+		if (ctx != CTX_TAIL) {
+			if (nends == capends) {
+				ends = rs_compile_grow(ends, &capends, sizeof(long));
+			}
+			ends[nends++] = rs_compile_jump(s, OP_JUMP, 0);
+		}
+		rs_compile_patch(s, next);
+		if (len == 1) {
+			s->depth = depth + 1;
+			rs_compile_op(s, OP_POP, -1);
+		}
+	}
+
+	if (!has_else) {
+		s->depth = depth;
+		rs_compile_unspecified(s, ctx);
+	}
+	for (int i = 0; i < nends; i++) {
+		rs_compile_patch(s, ends[i]);
+	}
+	free(ends);
+}
+
+
+static void rs_compile_and_or(struct rs_compile_scope *s, rs_object x,
+                              int and, enum rs_compile_ctx ctx)
+{
+	rs_compile_length(x, 1, -1, and ? "and" : "or");
+
+	rs_object args = CDR(x);
+	if (rs_null_p(args)) {
+		rs_compile_const(s, and ? rs_true : rs_false);
+		rs_compile_done(s, ctx);
+		return;
+	}
+
+	/* Every test but the last jumps to the end if it decides the answer. For
+	   and, the answer is then #f; for or, it's the value of the test, which
+	   is duplicated so that it survives the jump. */
+	long *exits = NULL;
+	int nexits = 0, capexits = 0;
+	int depth = s->depth;
+	for (; !rs_null_p(CDR(args)); args = CDR(args)) {
+		rs_compile_expr(s, CAR(args), CTX_VALUE);
+		if (nexits == capexits) {
+			exits = rs_compile_grow(exits, &capexits, sizeof(long));
+		}
+		if (and) {
+			exits[nexits++] = rs_compile_jump(s, OP_JUMP_FALSE, -1);
+		} else {
+			rs_compile_op(s, OP_DUP, 1);
+			long next = rs_compile_jump(s, OP_JUMP_FALSE, -1);
+			exits[nexits++] = rs_compile_jump(s, OP_JUMP, 0);
+			rs_compile_patch(s, next);
+			rs_compile_op(s, OP_POP, -1);
+		}
+	}
+	rs_compile_expr(s, CAR(args), ctx);
+	long end = ctx == CTX_TAIL ? -1 : rs_compile_jump(s, OP_JUMP, 0);
+
+	for (int i = 0; i < nexits; i++) {
+		rs_compile_patch(s, exits[i]);
+	}
+	s->depth = depth;
+	if (and) {
+		rs_compile_const(s, rs_false);
+	} else {
+		s->depth++;
+	}
+	rs_compile_done(s, ctx);
+	if (end >= 0) {
+		rs_compile_patch(s, end);
+	}
+	free(exits);
+}
+
+
+static void rs_compile_let(struct rs_compile_scope *s, rs_object x,
+                           enum rs_compile_ctx ctx)
+{
+	rs_compile_length(CADR(x), 0, -1, "let");
+	int saved_vars = s->nvars, saved_slots = s->nslots;
+
+	/* Evaluate all of the inits, then bind the variables. */
+	int n = 0;
+	for (rs_object b = CADR(x); !rs_null_p(b); b = CDR(b)) {
+		rs_compile_length(CAR(b), 2, 2, "let");
+		rs_compile_named(s, CADR(CAR(b)),
+		                 rs_compile_name(CAR(CAR(b)), "let"));
+		n++;
+	}
+	int first = s->nvars;
+	for (rs_object b = CADR(x); !rs_null_p(b); b = CDR(b)) {
+		const char *name = rs_compile_name(CAR(CAR(b)), "let");
+		rs_compile_bind(s, name, rs_compile_mutated_p(s, name));
+	}
+	for (int i = n - 1; i >= 0; i--) {
+		rs_compile_op(s, OP_SET_LOCAL, -1);
+		rs_compile_emit(s, s->vars[first + i].slot);
+	}
+	for (int i = 0; i < n; i++) {
+		if (s->vars[first + i].boxed) {
+			rs_compile_op(s, OP_BOX_LOCAL, 0);
+			rs_compile_emit(s, s->vars[first + i].slot);
+		}
+	}
+
+	rs_compile_body(s, CDDR(x), ctx);
+	s->nvars = saved_vars;
+	s->nslots = saved_slots;
+}
+
+
+/* (let name ((var init) ...) body ...) calls a procedure bound to name,
+   inside its own body, with the inits.
+*/
+static void rs_compile_named_let(struct rs_compile_scope *s, rs_object x,
+                                 enum rs_compile_ctx ctx)
+{
+	rs_compile_length(x, 4, -1, "let");
+	rs_compile_length(CAR(CDDR(x)), 0, -1, "let");
+	int saved_vars = s->nvars, saved_slots = s->nslots;
+
+	/* Make the procedure's parameter list, backwards, and then turn it
+	   around. */
+	rs_object params = rs_null;
+	long n = 0;
+	rs_gc_push(params);
+	for (rs_object b = CAR(CDDR(x)); !rs_null_p(b); b = CDR(b)) {
+		rs_compile_length(CAR(b), 2, 2, "let");
+		rs_compile_name(CAR(CAR(b)), "let");
+		params = rs_pair_create(CAR(CAR(b)), params);
+		rs_gc_pop();
+		rs_gc_push(params);
+		n++;
+	}
+	rs_object prev = rs_null;
+	while (!rs_null_p(params)) {
+		rs_object next = CDR(params);
+		rs_pair_set_cdr(rs_obj_to_pair(params), prev);
+		prev = params;
+		params = next;
+	}
+	params = prev;
+	rs_gc_pop();
+	rs_gc_push(params);
+
+	struct rs_compile_binding b;
+	b.name = rs_symbol_cstr(rs_obj_to_symbol(CADR(x)));
+	b.lambda = 1;
+	b.params = params;
+	b.body = CDR(CDDR(x));
+	rs_compile_bindings(s, &b, 1);
+	rs_gc_pop();
+
+	struct rs_compile_ref ref;
+	rs_compile_ref(s, b.name, &ref);
+	rs_compile_op(s, ref.boxed ? OP_LOCAL_BOXED : OP_LOCAL, 1);
+	rs_compile_emit(s, ref.index);
+	s->nvars = saved_vars;
+	s->nslots = saved_slots;
+
+	for (rs_object i = CAR(CDDR(x)); !rs_null_p(i); i = CDR(i)) {
+		rs_compile_expr(s, CADR(CAR(i)), CTX_VALUE);
+	}
+	if (ctx == CTX_TAIL) {
+		rs_compile_op(s, OP_TAIL_CALL, -n);
+		rs_compile_emit(s, n);
+	} else {
+		rs_compile_op(s, OP_CALL, -n);
+		rs_compile_emit(s, n);
+		rs_compile_done(s, ctx);
+	}
+}
+
+
+static void rs_compile_let_star(struct rs_compile_scope *s, rs_object x,
+                                enum rs_compile_ctx ctx)
+{
+	rs_compile_length(x, 3, -1, "let*");
+	rs_compile_length(CADR(x), 0, -1, "let*");
+	int saved_vars = s->nvars, saved_slots = s->nslots;
+
+	for (rs_object b = CADR(x); !rs_null_p(b); b = CDR(b)) {
+		rs_compile_length(CAR(b), 2, 2, "let*");
+		const char *name = rs_compile_name(CAR(CAR(b)), "let*");
+		rs_compile_named(s, CADR(CAR(b)), name);
+		int boxed = rs_compile_mutated_p(s, name);
+		int slot = rs_compile_bind(s, name, boxed);
+		rs_compile_op(s, OP_SET_LOCAL, -1);
+		rs_compile_emit(s, slot);
+		if (boxed) {
+			rs_compile_op(s, OP_BOX_LOCAL, 0);
+			rs_compile_emit(s, slot);
+		}
+	}
+
+	rs_compile_body(s, CDDR(x), ctx);
+	s->nvars = saved_vars;
+	s->nslots = saved_slots;
+}
+
+
+static void rs_compile_letrec(struct rs_compile_scope *s, rs_object x,
+                              enum rs_compile_ctx ctx)
+{
+	rs_compile_length(x, 3, -1, "letrec");
+	int saved_vars = s->nvars, saved_slots = s->nslots;
+
+	long n = rs_compile_length(CADR(x), 0, -1, "letrec");
+	struct rs_compile_binding *b = malloc((n > 0 ? n : 1) * sizeof(*b));
+	if (b == NULL) {
+		rs_fatal("could not allocate bindings:");
+	}
+	rs_object l = CADR(x);
+	for (long i = 0; i < n; i++, l = CDR(l)) {
+		rs_object init;
+		rs_compile_length(CAR(l), 2, 2, "letrec");
+		b[i].name = rs_compile_name(CAR(CAR(l)), "letrec");
+		init = CADR(CAR(l));
+		b[i].lambda = rs_pair_p(init) &&
+			rs_compile_keyword(s, CAR(init)) == KW_LAMBDA;
+		if (b[i].lambda) {
+			rs_compile_length(init, 3, -1, "lambda");
+			b[i].params = CADR(init);
+			b[i].body = CDDR(init);
+		} else {
+			b[i].init = init;
+		}
+	}
+	rs_compile_bindings(s, b, (int)n);
+	free(b);
+
+	rs_compile_body(s, CDDR(x), ctx);
+	s->nvars = saved_vars;
+	s->nslots = saved_slots;
+}
+
+
+/* Bind and initialize a group of letrec* bindings. */
+static void rs_compile_bindings(struct rs_compile_scope *s,
+                                struct rs_compile_binding *b, int n)
+{
+	if (n == 0) {
+		return;
+	}
+
+	int fix = 1;
+	for (int i = 0; i < n; i++) {
+		if (!b[i].lambda || rs_compile_mutated_p(s, b[i].name)) {
+			fix = 0;
+		}
+	}
+
+	int first = s->nvars;
+	for (int i = 0; i < n; i++) {
+		rs_compile_bind(s, b[i].name, !fix);
+	}
+	int lo = s->vars[first].slot;
+	int hi = lo + n;
+
+	if (fix) {
+		int nfixes = s->nfixes;
+		for (int i = 0; i < n; i++) {
+			int slot = s->vars[first + i].slot;
+			rs_compile_lambda(s, b[i].params, b[i].body, b[i].name, lo, hi,
+			                  slot);
+			rs_compile_op(s, OP_SET_LOCAL, -1);
+			rs_compile_emit(s, slot);
+		}
+		for (int i = nfixes; i < s->nfixes; i++) {
+			rs_compile_op(s, OP_FIX, 0);
+			rs_compile_emit(s, s->fixes[i].closure);
+			rs_compile_emit(s, s->fixes[i].index);
+			rs_compile_emit(s, s->fixes[i].slot);
+		}
+		s->nfixes = nfixes;
+		return;
+	}
+
+	for (int i = 0; i < n; i++) {
+		int slot = s->vars[first + i].slot;
+		rs_compile_const(s, rs_unspecified);
+		rs_compile_op(s, OP_SET_LOCAL, -1);
+		rs_compile_emit(s, slot);
+		rs_compile_op(s, OP_BOX_LOCAL, 0);
+		rs_compile_emit(s, slot);
+	}
+	for (int i = 0; i < n; i++) {
+		if (b[i].lambda) {
+			rs_compile_lambda(s, b[i].params, b[i].body, b[i].name, 0, 0, -1);
+		} else {
+			rs_compile_named(s, b[i].init, b[i].name);
+		}
+		rs_compile_op(s, OP_SET_LOCAL_BOXED, -1);
+		rs_compile_emit(s, s->vars[first + i].slot);
+	}
+}
+
+
+/* Take apart (define name init) or (define (name . params) body ...). */
+static void rs_compile_define_binding(rs_object x,
+                                      struct rs_compile_binding *b)
+{
+	rs_compile_length(x, 2, -1, "define");
+	rs_object target = CADR(x);
+	if (rs_pair_p(target)) {
+		rs_compile_length(x, 3, -1, "define");
+		b->name = rs_compile_name(CAR(target), "define");
+		b->lambda = 1;
+		b->params = CDR(target);
+		b->body = CDDR(x);
+	} else {
+		rs_compile_length(x, 3, 3, "define");
+		b->name = rs_compile_name(target, "define");
+		b->lambda = 0;
+		b->init = CAR(CDDR(x));
+	}
+}
+
+
+static void rs_compile_call(struct rs_compile_scope *s, rs_object x,
+                            enum rs_compile_ctx ctx)
+{
+	long n = rs_compile_length(x, 1, -1, "procedure call") - 1;
+
+	if (rs_compile_prim_call(s, x, n, ctx)) {
+		return;
+	}
+	for (rs_object a = x; !rs_null_p(a); a = CDR(a)) {
+		rs_compile_expr(s, CAR(a), CTX_VALUE);
+	}
+	if (ctx == CTX_TAIL) {
+		rs_compile_op(s, OP_TAIL_CALL, -n);
+		rs_compile_emit(s, n);
+	} else {
+		rs_compile_op(s, OP_CALL, -n);
+		rs_compile_emit(s, n);
+		rs_compile_done(s, ctx);
+	}
+}
+
+
+/* If x calls a global variable that currently holds a primitive, and has the
+   right number of arguments for it, compile it into a PRIM_CALL, which calls
+   the primitive directly without pushing it, or, for some simple primitives,
+   an instruction that does the primitive's work itself. Returns false if x
+   isn't that kind of call.
+
+   Calls to primitives never grow the stack, so in tail position a PRIM_CALL
+   is followed by a return. (If the variable is later changed to a closure,
+   the call still works, but it isn't a tail call.) For the same reason, calls
+   to apply are left as ordinary calls, which the VM makes in place.
+*/
+static int rs_compile_prim_call(struct rs_compile_scope *s, rs_object x,
+                                long n, enum rs_compile_ctx ctx)
+{
+	rs_object head = CAR(x);
+	if (!rs_symbol_p(head)) {
+		return 0;
+	}
+	const char *name = rs_symbol_cstr(rs_obj_to_symbol(head));
+	if (rs_compile_bound_p(s, name)) {
+		return 0;
+	}
+	rs_object sym = rs_hashcons_symbol(name);
+	rs_object prim = rs_global_ref(sym);
+	if (!rs_primitive_p(prim)) {
+		return 0;
+	}
+	const struct rs_primitive_def *def = rs_obj_to_primitive(prim)->val.prim;
+	if (n < def->min_args || (def->max_args >= 0 && n > def->max_args) ||
+	    def->fn == rs_primitive_apply || rs_primitive_suspends_p(def)) {
+		return 0;
+	}
+
+	rs_compile_keep(s, sym);
+	for (rs_object a = CDR(x); !rs_null_p(a); a = CDR(a)) {
+		rs_compile_expr(s, CAR(a), CTX_VALUE);
+	}
+	/* Leave room for the procedure, in case the call has to be made the
+	   ordinary way. */
+	if (s->depth + 1 > s->code->maxdepth) {
+		s->code->maxdepth = s->depth + 1;
+	}
+
+	size_t nopen = sizeof(open_coded) / sizeof(open_coded[0]);
+	size_t i = 0;
+	while (i < nopen && (open_coded[i].nargs != n ||
+	                     strcmp(open_coded[i].name, def->name) != 0)) {
+		i++;
+	}
+	if (i < nopen) {
+		rs_compile_op(s, open_coded[i].op, 1 - n);
+	} else {
+		rs_compile_op(s, OP_PRIM_CALL, 1 - n);
+	}
+	rs_compile_keep(s, prim);
+	rs_compile_emit(s, sym);
+	rs_compile_emit(s, prim);
+	if (i == nopen) {
+		rs_compile_emit(s, n);
+	}
+	rs_compile_done(s, ctx);
+	return 1;
+}
+
+
+/* Find where the variable called name lives. */
+static void rs_compile_ref(struct rs_compile_scope *s, const char *name,
+                           struct rs_compile_ref *ref)
+{
+	if (!rs_compile_find(s, name, ref)) {
+		ref->kind = REF_GLOBAL;
+		ref->index = rs_hashcons_symbol(name);
+		ref->boxed = 0;
+		rs_compile_keep(s, ref->index);
+	}
+}
+
+
+/* Look up a lexical variable, adding it to the free variables of each scope
+   between here and where it's bound.
+*/
+static int rs_compile_find(struct rs_compile_scope *s, const char *name,
+                           struct rs_compile_ref *ref)
+{
+	for (int i = s->nvars - 1; i >= 0; i--) {
+		if (s->vars[i].name == name) {
+			ref->kind = REF_LOCAL;
+			ref->index = s->vars[i].slot;
+			ref->boxed = s->vars[i].boxed;
+			return 1;
+		}
+	}
+	for (int i = 0; i < s->nfree; i++) {
+		if (s->free[i].name == name) {
+			ref->kind = REF_FREE;
+			ref->index = i;
+			ref->boxed = s->free[i].boxed;
+			return 1;
+		}
+	}
+	if (s->outer == NULL || !rs_compile_find(s->outer, name, ref)) {
+		return 0;
+	}
+
+	if (s->nfree == s->capfree) {
+		s->free = rs_compile_grow(s->free, &s->capfree, sizeof(*s->free));
+	}
+	s->free[s->nfree].name = name;
+	s->free[s->nfree].boxed = ref->boxed;
+	ref->kind = REF_FREE;
+	ref->index = s->nfree++;
+	return 1;
+}
+
+
+static int rs_compile_bound_p(struct rs_compile_scope *s, const char *name)
+{
+	for (; s != NULL; s = s->outer) {
+		for (int i = 0; i < s->nvars; i++) {
+			if (s->vars[i].name == name) {
+				return 1;
+			}
+		}
+		for (int i = 0; i < s->nfree; i++) {
+			if (s->free[i].name == name) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+
+/* Bind name to the next free slot, and return the slot. */
+static int rs_compile_bind(struct rs_compile_scope *s, const char *name,
+                           int boxed)
+{
+	if (s->nvars == s->capvars) {
+		s->vars = rs_compile_grow(s->vars, &s->capvars, sizeof(*s->vars));
+	}
+	int slot = rs_compile_temp(s);
+	s->vars[s->nvars].name = name;
+	s->vars[s->nvars].slot = slot;
+	s->vars[s->nvars].boxed = boxed;
+	s->nvars++;
+	return slot;
+}
+
+
+/* Take a slot without binding a variable to it. */
+static int rs_compile_temp(struct rs_compile_scope *s)
+{
+	int slot = s->nslots++;
+	if (s->nslots > s->code->nlocals) {
+		s->code->nlocals = s->nslots;
+	}
+	return slot;
+}
+
+
+static int rs_compile_mutated_p(struct rs_compile_scope *s, const char *name)
+{
+	for (int i = 0; i < s->nmutated; i++) {
+		if (s->mutated[i] == name) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/* Find the variables that are assigned to in x. This doesn't know about
+   scoping, so it can find too many, which is harmless. Quoted data is
+   skipped, since it can be nested deeper than the C stack could follow.
+*/
+static void rs_compile_scan(struct rs_compile_scope *s, rs_object x)
+{
+	const char *set = rs_vm_current()->keywords[KW_SET];
+	while (rs_pair_p(x)) {
+		rs_object head = CAR(x);
+		if (rs_compile_keyword(s, head) == KW_QUOTE) {
+			return;
+		}
+		if (rs_symbol_p(head) &&
+		    rs_symbol_cstr(rs_obj_to_symbol(head)) == set &&
+		    rs_pair_p(CDR(x)) && rs_symbol_p(CADR(x))) {
+			const char *name = rs_symbol_cstr(rs_obj_to_symbol(CADR(x)));
+			if (!rs_compile_mutated_p(s, name)) {
+				if (s->nmutated == s->capmutated) {
+					s->mutated = rs_compile_grow(s->mutated, &s->capmutated,
+					                             sizeof(*s->mutated));
+				}
+				s->mutated[s->nmutated++] = name;
+			}
+		} else if (rs_pair_p(head)) {
+			if (++s->nesting > MAX_NESTING) {
+				rs_fatal("expression nested too deeply");
+			}
+			rs_compile_scan(s, head);
+			s->nesting--;
+		}
+		x = CDR(x);
+	}
+}
+
+
+/* Return the special form keyword x refers to, if it does. */
+static enum rs_compile_keyword rs_compile_keyword(struct rs_compile_scope *s,
+                                                  rs_object x)
+{
+	if (!rs_symbol_p(x)) {
+		return KW_NONE;
+	}
+	const char *name = rs_symbol_cstr(rs_obj_to_symbol(x));
+	const char **keywords = rs_vm_current()->keywords;
+	for (int i = 0; i < KW_COUNT; i++) {
+		if (keywords[i] == name) {
+			return rs_compile_bound_p(s, name) ? KW_NONE : i;
+		}
+	}
+	return KW_NONE;
+}
+
+
+static const char *rs_compile_name(rs_object x, const char *form)
+{
+	if (!rs_symbol_p(x)) {
+		rs_fatal("bad syntax in %s: expected a variable", form);
+	}
+	return rs_symbol_cstr(rs_obj_to_symbol(x));
+}
+
+
+/* Check that x is a proper list with between min and max elements (or any
+   number over min, if max is negative), and return its length.
+*/
+static long rs_compile_length(rs_object x, long min, long max,
+                              const char *form)
+{
+	long n = 0;
+	for (; rs_pair_p(x); x = CDR(x)) {
+		n++;
+	}
+	if (!rs_null_p(x) || n < min || (max >= 0 && n > max)) {
+		rs_fatal("bad syntax in %s", form);
+	}
+	return n;
+}
+
+
+static long rs_compile_emit(struct rs_compile_scope *s, long word)
+{
+	struct rs_code *c = s->code;
+	if (c->ninsns == c->capinsns) {
+		c->capinsns = c->capinsns == 0 ? 32 : c->capinsns * 2;
+		union rs_insn *i = realloc(c->insns,
+		                           c->capinsns * sizeof(union rs_insn));
+		if (i == NULL) {
+			rs_fatal("could not grow code:");
+		}
+		c->insns = i;
+	}
+	c->insns[c->ninsns].n = word;
+	return c->ninsns++;
+}
+
+
+/* Emit an instruction that changes the depth of the value stack by delta. */
+static void rs_compile_op(struct rs_compile_scope *s, enum rs_opcode op,
+                          int delta)
+{
+	rs_compile_emit(s, op);
+	s->depth += delta;
+	if (s->depth > s->code->maxdepth) {
+		s->code->maxdepth = s->depth;
+	}
+}
+
+
+static void rs_compile_const(struct rs_compile_scope *s, rs_object obj)
+{
+	rs_compile_keep(s, obj);
+	rs_compile_op(s, OP_CONST, 1);
+	rs_compile_emit(s, obj);
+}
+
+
+/* Keep an object that the code refers to alive for as long as the code. */
+static void rs_compile_keep(struct rs_compile_scope *s, rs_object obj)
+{
+	struct rs_code *c = s->code;
+	if (rs_heap_p(obj)) {
+		if (c->nconsts == c->capconsts) {
+			c->capconsts = c->capconsts == 0 ? 8 : c->capconsts * 2;
+			rs_object *k = realloc(c->consts,
+			                       c->capconsts * sizeof(rs_object));
+			if (k == NULL) {
+				rs_fatal("could not grow code:");
+			}
+			c->consts = k;
+		}
+		c->consts[c->nconsts++] = obj;
+	}
+}
+
+
+/* Emit a jump, and return where its offset goes. */
+static long rs_compile_jump(struct rs_compile_scope *s, enum rs_opcode op,
+                            int delta)
+{
+	rs_compile_op(s, op, delta);
+	return rs_compile_emit(s, 0);
+}
+
+
+/* Make the jump whose offset is at at go to the next instruction. */
+static void rs_compile_patch(struct rs_compile_scope *s, long at)
+{
+	s->code->insns[at].n = (long)s->code->ninsns - at;
+}
+
+
+/* Deal with a value that has just been pushed. */
+static void rs_compile_done(struct rs_compile_scope *s,
+                            enum rs_compile_ctx ctx)
+{
+	if (ctx == CTX_EFFECT) {
+		rs_compile_op(s, OP_POP, -1);
+	} else if (ctx == CTX_TAIL) {
+		rs_compile_op(s, OP_RETURN, -1);
+	}
+}
+
+
+static void rs_compile_unspecified(struct rs_compile_scope *s,
+                                   enum rs_compile_ctx ctx)
+{
+	if (ctx != CTX_EFFECT) {
+		rs_compile_const(s, rs_unspecified);
+		rs_compile_done(s, ctx);
+	}
+}
+
+
+static void rs_compile_scope_init(struct rs_compile_scope *s,
+                                  struct rs_compile_scope *outer,
+                                  rs_object code)
+{
+	memset(s, 0, sizeof(*s));
+	s->outer = outer;
+	s->nesting = outer != NULL ? outer->nesting : 0;
+	s->code = rs_obj_to_code(code)->val.code;
+}
+
+
+static void rs_compile_scope_finish(struct rs_compile_scope *s,
+                                    const char *name)
+{
+	struct rs_code *c = s->code;
+	c->nfree = s->nfree;
+	if (name != NULL) {
+		c->name = strdup(name);
+		if (c->name == NULL) {
+			rs_fatal("could not copy procedure name:");
+		}
+	}
+	rs_vm_thread(c);
+
+	free(s->vars);
+	free(s->free);
+	free(s->mutated);
+	free(s->fixes);
+}
+
+
+static void *rs_compile_grow(void *p, int *cap, size_t size)
+{
+	*cap = *cap == 0 ? 8 : *cap * 2;
+	p = realloc(p, *cap * size);
+	if (p == NULL) {
+		rs_fatal("could not grow compiler tables:");
+	}
+	return p;
+}
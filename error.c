@@ -1,10 +1,15 @@
+/* For fork() and friends. */
+#define _DEFAULT_SOURCE
 #include "rescheme.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #define BUFSIZE 1024
 
@@ -40,3 +45,31 @@ void eprintf(int status, char const * const func, char const * const fmt, ...)
 
 	errno = olderr;
 }
+
+
+int rs_fails_p(void (*fn)(void *), void *arg)
+{
+	assert(fn != NULL);
+
+	(void) fflush(NULL);
+	pid_t pid = fork();
+	if (pid < 0) {
+		rs_fatal("could not fork:");
+	} else if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		if (null >= 0) {
+			dup2(null, STDOUT_FILENO);
+			dup2(null, STDERR_FILENO);
+		}
+		fn(arg);
+		exit(EXIT_SUCCESS);
+	}
+
+	int status;
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			rs_fatal("could not wait for child:");
+		}
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE;
+}
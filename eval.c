@@ -1,7 +1,161 @@
 #include "rescheme.h"
 
+#include <assert.h>
+#include <string.h>
+
+/* Expressions are evaluated by compiling them (see compile.c), and running the
+   result on the VM (see vm.c).
+*/
+
+/* Library procedures that are easier to write in Scheme than in C. */
+static const char prelude[] =
+	"(define (map f l . ls)"
+	"  (define (map1 f l)"
+	"    (if (pair? l) (cons (f (car l)) (map1 f (cdr l))) '()))"
+	"  (define (any-null? ls)"
+	"    (and (pair? ls) (or (null? (car ls)) (any-null? (cdr ls)))))"
+	"  (if (null? ls)"
+	"      (map1 f l)"
+	"      (let loop ((ls (cons l ls)))"
+	"        (if (any-null? ls)"
+	"            '()"
+	"            (cons (apply f (map1 car ls)) (loop (map1 cdr ls)))))))"
+	"(define (for-each f l)"
+	"  (when (pair? l) (f (car l)) (for-each f (cdr l))))"
+	"(define (vector-map f v . vs)"
+	"  (cond ((null? vs)"
+	"         (let* ((n (vector-length v)) (r (make-vector n)))"
+	"           (let loop ((i 0))"
+	"             (if (= i n)"
+	"                 r"
+	"                 (begin (vector-set! r i (f (vector-ref v i)))"
+	"                        (loop (+ i 1)))))))"
+	"        ((and (null? (cdr vs)) (or (eq? f +) (eq? f -))"
+	"              (= (vector-length v) (vector-length (car vs))))"
+	"         ((if (eq? f +) vector-add vector-subtract) v (car vs)))"
+	"        (else"
+	"         (list->vector"
+	"          (apply map f (vector->list v) (map vector->list vs))))))"
+	"(define (vector-for-each f v)"
+	"  (let loop ((i 0))"
+	"    (when (< i (vector-length v))"
+	"      (f (vector-ref v i))"
+	"      (loop (+ i 1)))))"
+	"(define hash-table-ref"
+	"  (let ((ref hash-table-ref) (missing (list 'missing)))"
+	"    (lambda (table key . thunk)"
+	"      (if (null? thunk)"
+	"          (ref table key)"
+	"          (let ((val (hash-table-ref/default table key missing)))"
+	"            (if (eq? val missing) ((car thunk)) val))))))"
+	"(define (hash-table-update! table key f . thunk)"
+	"  (hash-table-set! table key (f (apply hash-table-ref table key thunk))))"
+	"(define (hash-table-update!/default table key f default)"
+	"  (hash-table-set! table key"
+	"                   (f (hash-table-ref/default table key default))))"
+	"(define (hash-table-walk table f)"
+	"  (for-each (lambda (p) (f (car p) (cdr p))) (hash-table->alist table)))"
+	"(define (hash-table-fold table f acc)"
+	"  (let loop ((ps (hash-table->alist table)) (acc acc))"
+	"    (if (null? ps)"
+	"        acc"
+	"        (loop (cdr ps) (f (car (car ps)) (cdr (car ps)) acc)))))"
+	"(define (alist->hash-table alist . args)"
+	"  (let ((table (apply make-hash-table args)))"
+	"    (for-each (lambda (p)"
+	"                (if (not (hash-table-exists? table (car p)))"
+	"                    (hash-table-set! table (car p) (cdr p))))"
+	"              alist)"
+	"    table))"
+	"(define (list-tail l k) (if (= k 0) l (list-tail (cdr l) (- k 1))))"
+	"(define (list-ref l k) (car (list-tail l k)))"
+	"(define (memq x l)"
+	"  (cond ((null? l) #f) ((eq? x (car l)) l) (else (memq x (cdr l)))))"
+	"(define (member x l)"
+	"  (cond ((null? l) #f) ((equal? x (car l)) l) (else (member x (cdr l)))))"
+	"(define (assq x l)"
+	"  (cond ((null? l) #f) ((eq? x (car (car l))) (car l))"
+	"        (else (assq x (cdr l)))))"
+	"(define (assoc x l)"
+	"  (cond ((null? l) #f) ((equal? x (car (car l))) (car l))"
+	"        (else (assoc x (cdr l)))))"
+	"(define (zero? n) (= n 0))"
+	"(define (list? l)"
+	"  (or (null? l) (and (pair? l) (list? (cdr l)))))";
+
+
+void rs_eval_init(void)
+{
+	rs_vm_init();
+	rs_primitive_init();
+
+	struct rs_port *in = rs_port_open_mem(prelude, strlen(prelude));
+	rs_object expr;
+	while (!rs_eof_p(expr = rs_read(in))) {
+		rs_eval(expr);
+	}
+	rs_port_close(in);
+}
+
+
+void rs_eval_shutdown(void)
+{
+	rs_vm_shutdown();
+}
+
+
 rs_object rs_eval(rs_object expr)
 {
-	/* For now, just return expr. */
-	return expr;
+	return rs_vm_execute(rs_compile(expr));
+}
+
+
+rs_object rs_eval_string(const char *src)
+{
+	struct rs_port *in = rs_port_open_mem(src, strlen(src));
+	rs_object expr, val = rs_unspecified;
+	rs_gc_push(val);
+	while (!rs_eof_p(expr = rs_read(in))) {
+		val = rs_eval(expr);
+		rs_gc_pop();
+		rs_gc_push(val);
+	}
+	rs_gc_pop();
+	rs_port_close(in);
+	return val;
+}
+
+
+
+/**** Testing. ****/
+
+void rs_eval_expect(const char *src, const char *expected)
+{
+	rs_object val = rs_eval_string(src);
+	rs_gc_push(val);
+	struct rs_port *in = rs_port_open_mem(expected, strlen(expected));
+	rs_object want = rs_read(in);
+	rs_port_close(in);
+	rs_gc_pop();
+	if (!rs_equal_p(val, want)) {
+		struct rs_outport *out = rs_outport_open_string();
+		rs_write(out, val);
+		size_t len;
+		const char *got = rs_outport_data(out, &len);
+		rs_fatal("%s gave %.*s, not %s", src, (int)len, got, expected);
+	}
+}
+
+
+static void rs_eval_string_void(void *src)
+{
+	(void) rs_eval_string(src);
+}
+
+
+void rs_eval_expect_error(const char *src)
+{
+	if (!rs_fails_p(rs_eval_string_void, (void *)src)) {
+		rs_fatal("%s gave no error", src);
+	}
 }
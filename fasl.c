@@ -0,0 +1,918 @@
+#include "rescheme.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <string.h>
+
+/* Fasl ("fast load") is a binary format for objects, for passing data between
+   processes without going through the writer and the reader. A stream is any
+   number of records, one per object, and each record stands alone:
+
+     header:   the bytes 0x7f 'r' 's' 'f', and a version byte
+     symbols:  a count, then each symbol's name (length, then characters)
+     object:   a tagged encoding of the object itself
+
+   Numbers (counts, lengths, and so on) are unsigned LEB128 varints. Within the
+   object, symbols are written as an index into the record's symbol section,
+   so each name is only interned once per record, no matter how often it is
+   used. Fixnums are zigzag-encoded varints, and bignums are a varint holding
+   their digit count and sign, followed by their digits (least significant
+   first, 4 bytes each, little-endian). Flonums are the 8 bytes of their
+   double, little-endian.
+
+   A list is written as the number of elements, then the elements, then the
+   final cdr (which is () for proper lists). A pair that can be reached more
+   than once is written the first time with FASL_DEF in front, which gives it
+   the next back-reference number; after that, it's just FASL_REF and the
+   number. That makes cycles and shared structure come back exactly as they
+   were written. A shared pair always starts a new list, so the encoding of a
+   list stops at a shared cdr.
+
+   A vector is written as its length, then its elements, and can be referred
+   back to in the same way as a pair. A bytevector is written like a string,
+   but it's always read into a new, mutable bytevector, even from a mapped
+   file.
+
+   Neither writing nor reading recurses, since data can be nested far deeper
+   than the C stack could follow. Each keeps a stack of the lists and vectors
+   it's part way through instead, and carries on with the one on top.
+*/
+
+#define _FASL_VERSION 1
+static const char fasl_magic[4] = { 0x7f, 'r', 's', 'f' };
+
+enum rs_fasl_tag { FASL_NULL, FASL_TRUE, FASL_FALSE, FASL_EOF, FASL_FIXNUM,
+                   FASL_BIGNUM, FASL_CHARACTER, FASL_STRING, FASL_SYMBOL,
+                   FASL_LIST, FASL_DEF, FASL_REF, FASL_FLONUM, FASL_VECTOR,
+                   FASL_BYTEVECTOR };
+
+/* A list or vector that's part way through being written or read. For a
+   list, n counts the cars left and then the final cdr, and obj is the pair
+   whose car is next (or, at the end, the final cdr itself). When reading,
+   head is the first pair, kept on the GC stack, and obj is the last one made.
+   For a vector, obj is the vector, and i and n its next index and length.
+*/
+struct rs_fasl_frame {
+	rs_object head;
+	rs_object obj;
+	size_t i;
+	size_t n;
+	int vector;
+};
+
+struct rs_fasl_writer {
+	struct rs_outport *out;
+	struct rs_objtab syms;     // symbol name -> index
+	struct rs_objtab shared;   // pair or vector -> -1, or back-reference + 1
+	long next_ref;
+	const char **names;
+	size_t nnames;
+	size_t capnames;
+	struct rs_fasl_frame *frames;
+	size_t nframes;
+	size_t capframes;
+};
+
+struct rs_fasl_reader {
+	struct rs_port *in;
+	rs_object *syms;
+	size_t nsyms;
+	rs_object *refs;
+	size_t nrefs;
+	size_t caprefs;
+	struct rs_fasl_frame *frames;
+	size_t nframes;
+	size_t capframes;
+};
+
+
+static void rs_fasl_scan(struct rs_fasl_writer *w, rs_object obj);
+static void rs_fasl_add_symbol(struct rs_fasl_writer *w, rs_object sym);
+static void rs_fasl_put_obj(struct rs_fasl_writer *w, rs_object obj);
+static void rs_fasl_put_one(struct rs_fasl_writer *w, rs_object obj);
+static int rs_fasl_put_ref(struct rs_fasl_writer *w, rs_object obj);
+static void rs_fasl_put_uint(struct rs_outport *out, unsigned long v);
+
+static rs_object rs_fasl_get_obj(struct rs_fasl_reader *r);
+static int rs_fasl_get_one(struct rs_fasl_reader *r, rs_object *obj);
+static void rs_fasl_get_list(struct rs_fasl_reader *r, int def);
+static int rs_fasl_get_vector(struct rs_fasl_reader *r, int def,
+                              rs_object *obj);
+static void rs_fasl_add_ref(struct rs_fasl_reader *r, rs_object obj);
+static struct rs_fasl_frame *rs_fasl_push_frame(struct rs_fasl_frame **frames,
+                                                size_t *n, size_t *cap);
+static unsigned long rs_fasl_get_uint(struct rs_port *in);
+static int rs_fasl_get_byte(struct rs_port *in);
+static void rs_fasl_get_bytes(struct rs_port *in, struct rs_buf *buf,
+                              size_t len);
+
+
+int rs_write_fasl(struct rs_outport *out, rs_object obj)
+{
+	assert(out != NULL);
+
+	struct rs_fasl_writer w;
+	w.out = out;
+	rs_objtab_init(&w.syms);
+	rs_objtab_init(&w.shared);
+	w.next_ref = 0;
+	w.names = NULL;
+	w.nnames = w.capnames = 0;
+	w.frames = NULL;
+	w.nframes = w.capframes = 0;
+
+	rs_fasl_scan(&w, obj);
+
+	long start = rs_outport_offset(out);
+	rs_outport_write(out, fasl_magic, sizeof(fasl_magic));
+	rs_outport_putc(out, _FASL_VERSION);
+	rs_fasl_put_uint(out, w.nnames);
+	for (size_t i = 0; i < w.nnames; i++) {
+		size_t len = strlen(w.names[i]);
+		rs_fasl_put_uint(out, len);
+		rs_outport_write(out, w.names[i], len);
+	}
+	rs_fasl_put_obj(&w, obj);
+
+	rs_objtab_reset(&w.syms);
+	rs_objtab_reset(&w.shared);
+	free(w.names);
+	free(w.frames);
+	return (int)(rs_outport_offset(out) - start);
+}
+
+
+rs_object rs_read_fasl(struct rs_port *in)
+{
+	assert(in != NULL);
+
+	int c = rs_port_getc(in);
+	if (c == EOF) {
+		return rs_eof;
+	}
+	rs_port_ungetc(in, c);
+	for (size_t i = 0; i < sizeof(fasl_magic); i++) {
+		if (rs_fasl_get_byte(in) != (unsigned char)fasl_magic[i]) {
+			rs_fatal("not a fasl record");
+		}
+	}
+	int version = rs_fasl_get_byte(in);
+	if (version != _FASL_VERSION) {
+		rs_fatal("unsupported fasl version %d", version);
+	}
+
+	struct rs_fasl_reader r;
+	r.in = in;
+	r.refs = NULL;
+	r.nrefs = r.caprefs = 0;
+	r.frames = NULL;
+	r.nframes = r.capframes = 0;
+
+	/* The symbols are kept alive by a list of them, while the object is being
+	   built. */
+	r.nsyms = rs_fasl_get_uint(in);
+	r.syms = malloc((r.nsyms > 0 ? r.nsyms : 1) * sizeof(rs_object));
+	if (r.syms == NULL) {
+		rs_fatal("could not allocate fasl symbol table:");
+	}
+	rs_object symlist = rs_null;
+	rs_gc_push(symlist);
+	struct rs_buf *buf = rs_port_scratch(in);
+	for (size_t i = 0; i < r.nsyms; i++) {
+		rs_fasl_get_bytes(in, buf, rs_fasl_get_uint(in));
+		r.syms[i] = rs_symbol_create(rs_buf_cstr(buf));
+		rs_gc_pop();
+		symlist = rs_pair_create(r.syms[i], symlist);
+		rs_gc_push(symlist);
+		rs_buf_clear(buf);
+	}
+
+	rs_object obj = rs_fasl_get_obj(&r);
+
+	rs_gc_pop();
+	free(r.syms);
+	free(r.refs);
+	free(r.frames);
+	return obj;
+}
+
+
+/* Find the record's symbols, and the pairs and vectors that need
+   back-references.
+*/
+static void rs_fasl_scan(struct rs_fasl_writer *w, rs_object obj)
+{
+	struct rs_objtab seen;
+	rs_objtab_init(&seen);
+
+	size_t n = 0, cap = 64;
+	rs_object *todo = malloc(cap * sizeof(rs_object));
+	if (todo == NULL) {
+		rs_fatal("could not allocate fasl work list:");
+	}
+	todo[n++] = obj;
+	while (n > 0) {
+		obj = todo[--n];
+		while (rs_pair_p(obj) || rs_vector_p(obj)) {
+			if (rs_objtab_get(&seen, obj, NULL)) {
+				rs_objtab_put(&w->shared, obj, -1);
+				break;
+			}
+			rs_objtab_put(&seen, obj, 0);
+
+			rs_object car, *elts = &car;
+			size_t nelts = 1;
+			if (rs_pair_p(obj)) {
+				car = rs_pair_car(rs_obj_to_pair(obj));
+			} else {
+				elts = rs_vector_data(rs_obj_to_vector(obj));
+				nelts = rs_vector_length(rs_obj_to_vector(obj));
+			}
+			for (size_t i = 0; i < nelts; i++) {
+				if (rs_symbol_p(elts[i])) {
+					rs_fasl_add_symbol(w, elts[i]);
+				}
+				if (!rs_pair_p(elts[i]) && !rs_vector_p(elts[i])) {
+					continue;
+				}
+				if (n == cap) {
+					cap *= 2;
+					rs_object *t = realloc(todo, cap * sizeof(rs_object));
+					if (t == NULL) {
+						rs_fatal("could not grow fasl work list:");
+					}
+					todo = t;
+				}
+				todo[n++] = elts[i];
+			}
+			if (!rs_pair_p(obj)) {
+				break;
+			}
+			obj = rs_pair_cdr(rs_obj_to_pair(obj));
+		}
+		if (rs_symbol_p(obj)) {
+			rs_fasl_add_symbol(w, obj);
+		}
+	}
+
+	free(todo);
+	rs_objtab_reset(&seen);
+}
+
+
+static void rs_fasl_add_symbol(struct rs_fasl_writer *w, rs_object sym)
+{
+	/* Symbol objects aren't unique, but their interned names are, so the
+	   table is keyed on those. */
+	const char *name = rs_symbol_cstr(rs_obj_to_symbol(sym));
+	if (rs_objtab_get(&w->syms, (rs_object)name, NULL)) {
+		return;
+	}
+	if (w->nnames == w->capnames) {
+		w->capnames = w->capnames == 0 ? 16 : w->capnames * 2;
+		const char **p = realloc(w->names, w->capnames * sizeof(char *));
+		if (p == NULL) {
+			rs_fatal("could not grow fasl symbol table:");
+		}
+		w->names = p;
+	}
+	rs_objtab_put(&w->syms, (rs_object)name, w->nnames);
+	w->names[w->nnames++] = name;
+}
+
+
+static void rs_fasl_put_obj(struct rs_fasl_writer *w, rs_object obj)
+{
+	rs_fasl_put_one(w, obj);
+	while (w->nframes > 0) {
+		struct rs_fasl_frame *f = &w->frames[w->nframes - 1];
+		if (f->vector) {
+			obj = rs_vector_ref(rs_obj_to_vector(f->obj), f->i++);
+			if (f->i == f->n) {
+				w->nframes--;
+			}
+		} else if (f->n == 1) {
+			obj = f->obj;
+			w->nframes--;
+		} else {
+			obj = rs_pair_car(rs_obj_to_pair(f->obj));
+			f->obj = rs_pair_cdr(rs_obj_to_pair(f->obj));
+			f->n--;
+		}
+		rs_fasl_put_one(w, obj);
+	}
+}
+
+
+/* Write obj, or, for a list or a vector, just what comes before its
+   elements, leaving a frame for them.
+*/
+static void rs_fasl_put_one(struct rs_fasl_writer *w, rs_object obj)
+{
+	struct rs_outport *out = w->out;
+	long ref;
+
+	if (rs_fixnum_p(obj)) {
+		long v = rs_obj_to_fixnum(obj);
+		rs_outport_putc(out, FASL_FIXNUM);
+		rs_fasl_put_uint(out, v < 0 ? ((unsigned long)-(v + 1) << 1) | 1
+		                            : (unsigned long)v << 1);
+	} else if (rs_character_p(obj)) {
+		rs_outport_putc(out, FASL_CHARACTER);
+		rs_outport_putc(out, (char)rs_obj_to_character(obj));
+	} else if (rs_boolean_p(obj)) {
+		rs_outport_putc(out, obj == rs_true ? FASL_TRUE : FASL_FALSE);
+	} else if (rs_null_p(obj)) {
+		rs_outport_putc(out, FASL_NULL);
+	} else if (rs_eof_p(obj)) {
+		rs_outport_putc(out, FASL_EOF);
+	} else if (rs_symbol_p(obj)) {
+		const char *name = rs_symbol_cstr(rs_obj_to_symbol(obj));
+		rs_objtab_get(&w->syms, (rs_object)name, &ref);
+		rs_outport_putc(out, FASL_SYMBOL);
+		rs_fasl_put_uint(out, ref);
+	} else if (rs_string_p(obj)) {
+		rs_string *str = rs_obj_to_string(obj);
+		rs_outport_putc(out, FASL_STRING);
+		rs_fasl_put_uint(out, rs_string_length(str));
+		rs_outport_write(out, rs_string_data(str), rs_string_length(str));
+	} else if (rs_bytevector_p(obj)) {
+		rs_bytevector *bv = rs_obj_to_bytevector(obj);
+		rs_outport_putc(out, FASL_BYTEVECTOR);
+		rs_fasl_put_uint(out, rs_bytevector_length(bv));
+		rs_outport_write(out, (const char *)rs_bytevector_data(bv),
+		                 rs_bytevector_length(bv));
+	} else if (rs_bignum_p(obj)) {
+		const uint32_t *digits;
+		int neg;
+		size_t len = rs_bignum_digits(rs_obj_to_bignum(obj), &digits, &neg);
+		rs_outport_putc(out, FASL_BIGNUM);
+		rs_fasl_put_uint(out, (len << 1) | (neg ? 1 : 0));
+		for (size_t i = 0; i < len; i++) {
+			rs_outport_putc(out, digits[i] & 0xff);
+			rs_outport_putc(out, (digits[i] >> 8) & 0xff);
+			rs_outport_putc(out, (digits[i] >> 16) & 0xff);
+			rs_outport_putc(out, (digits[i] >> 24) & 0xff);
+		}
+	} else if (rs_flonum_p(obj)) {
+		double val = rs_flonum_value(obj);
+		uint64_t bits;
+		memcpy(&bits, &val, sizeof(bits));
+		rs_outport_putc(out, FASL_FLONUM);
+		for (int i = 0; i < 8; i++) {
+			rs_outport_putc(out, (bits >> (8 * i)) & 0xff);
+		}
+	} else if (rs_pair_p(obj)) {
+		if (rs_fasl_put_ref(w, obj)) {
+			return;
+		}
+
+		size_t n = 0;
+		rs_object rest = obj;
+		do {
+			n++;
+			rest = rs_pair_cdr(rs_obj_to_pair(rest));
+		} while (rs_pair_p(rest) && !rs_objtab_get(&w->shared, rest, NULL));
+		rs_outport_putc(out, FASL_LIST);
+		rs_fasl_put_uint(out, n);
+
+		struct rs_fasl_frame *f = rs_fasl_push_frame(&w->frames, &w->nframes,
+		                                             &w->capframes);
+		f->obj = obj;
+		f->n = n + 1;
+		f->vector = 0;
+	} else if (rs_vector_p(obj)) {
+		if (rs_fasl_put_ref(w, obj)) {
+			return;
+		}
+
+		rs_vector *vec = rs_obj_to_vector(obj);
+		rs_outport_putc(out, FASL_VECTOR);
+		rs_fasl_put_uint(out, rs_vector_length(vec));
+		if (rs_vector_length(vec) > 0) {
+			struct rs_fasl_frame *f = rs_fasl_push_frame(&w->frames,
+			                                             &w->nframes,
+			                                             &w->capframes);
+			f->obj = obj;
+			f->i = 0;
+			f->n = rs_vector_length(vec);
+			f->vector = 1;
+		}
+	} else {
+		rs_fatal("illegal object type");
+	}
+}
+
+
+/* If obj can be reached more than once, write FASL_DEF in front of it the
+   first time, or write a back-reference to it and return true after that.
+*/
+static int rs_fasl_put_ref(struct rs_fasl_writer *w, rs_object obj)
+{
+	long ref;
+	if (!rs_objtab_get(&w->shared, obj, &ref)) {
+		return 0;
+	}
+	if (ref > 0) {
+		rs_outport_putc(w->out, FASL_REF);
+		rs_fasl_put_uint(w->out, ref - 1);
+		return 1;
+	}
+	rs_objtab_put(&w->shared, obj, ++w->next_ref);
+	rs_outport_putc(w->out, FASL_DEF);
+	return 0;
+}
+
+
+static void rs_fasl_put_uint(struct rs_outport *out, unsigned long v)
+{
+	while (v >= 0x80) {
+		rs_outport_putc(out, (v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	rs_outport_putc(out, v);
+}
+
+
+/* Read an object. Each finished one goes into the list or vector on top of
+   the stack, until one finishes with the stack empty.
+*/
+static rs_object rs_fasl_get_obj(struct rs_fasl_reader *r)
+{
+	rs_object obj;
+	for (;;) {
+		if (!rs_fasl_get_one(r, &obj)) {
+			continue;
+		}
+		for (;;) {
+			if (r->nframes == 0) {
+				return obj;
+			}
+			struct rs_fasl_frame *f = &r->frames[r->nframes - 1];
+			if (f->vector) {
+				rs_vector_set(rs_obj_to_vector(f->obj), f->i++, obj);
+				if (f->i < f->n) {
+					break;
+				}
+			} else if (f->n > 1) {
+				/* The pairs are made before their cars are read, so that the
+				   cars can refer back to them. */
+				rs_pair_set_car(rs_obj_to_pair(f->obj), obj);
+				if (--f->n > 1) {
+					rs_object next = rs_pair_create(rs_null, rs_null);
+					rs_pair_set_cdr(rs_obj_to_pair(f->obj), next);
+					f->obj = next;
+				}
+				break;
+			} else {
+				rs_pair_set_cdr(rs_obj_to_pair(f->obj), obj);
+			}
+			/* It's finished, so it goes into the one below. */
+			obj = f->head;
+			r->nframes--;
+			rs_gc_pop();
+		}
+	}
+}
+
+
+/* Read an object into obj, and return true. Or, for a list or a vector with
+   elements, just start it, leaving a frame for the elements, and return
+   false.
+*/
+static int rs_fasl_get_one(struct rs_fasl_reader *r, rs_object *obj)
+{
+	struct rs_port *in = r->in;
+	int tag = rs_fasl_get_byte(in);
+	int def = tag == FASL_DEF;
+	if (def) {
+		tag = rs_fasl_get_byte(in);
+	}
+	if (def && tag != FASL_LIST && tag != FASL_VECTOR) {
+		rs_fatal("bad fasl record: only lists and vectors can be referred "
+		         "back to");
+	}
+
+	switch (tag) {
+	case FASL_NULL:
+		*obj = rs_null;
+		return 1;
+	case FASL_TRUE:
+		*obj = rs_true;
+		return 1;
+	case FASL_FALSE:
+		*obj = rs_false;
+		return 1;
+	case FASL_EOF:
+		*obj = rs_eof;
+		return 1;
+	case FASL_FIXNUM: {
+		unsigned long v = rs_fasl_get_uint(in);
+		long f = (v & 1) ? -(long)(v >> 1) - 1 : (long)(v >> 1);
+		if (f < rs_fixnum_min || f > rs_fixnum_max) {
+			rs_fatal("bad fasl record: fixnum out of range");
+		}
+		*obj = rs_fixnum_to_obj(f);
+		return 1;
+	}
+	case FASL_BIGNUM: {
+		unsigned long v = rs_fasl_get_uint(in);
+		size_t len = v >> 1;
+		struct rs_buf *buf = rs_port_scratch(in);
+		rs_fasl_get_bytes(in, buf, len * 4);
+		const unsigned char *b = (const unsigned char *)rs_buf_cstr(buf);
+		uint32_t *digits = malloc((len > 0 ? len : 1) * sizeof(uint32_t));
+		if (digits == NULL) {
+			rs_fatal("could not allocate bignum:");
+		}
+		for (size_t i = 0; i < len; i++, b += 4) {
+			digits[i] = (uint32_t)b[0] | (uint32_t)b[1] << 8 |
+			            (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24;
+		}
+		*obj = rs_bignum_from_digits(digits, len, v & 1);
+		free(digits);
+		return 1;
+	}
+	case FASL_FLONUM: {
+		uint64_t bits = 0;
+		for (int i = 0; i < 8; i++) {
+			bits |= (uint64_t)rs_fasl_get_byte(in) << (8 * i);
+		}
+		double val;
+		memcpy(&val, &bits, sizeof(val));
+		*obj = rs_flonum_create(val);
+		return 1;
+	}
+	case FASL_CHARACTER:
+		*obj = rs_character_to_obj(rs_fasl_get_byte(in));
+		return 1;
+	case FASL_STRING: {
+		size_t len = rs_fasl_get_uint(in);
+		const char *data;
+		if (rs_port_avail(in, &data) >= len) {
+			/* The whole string is in the port's buffer, so it can be made
+			   from there directly (or even point into it). */
+			*obj = rs_port_source(in) != NULL
+			       ? rs_string_create_slice(data, len)
+			       : rs_string_create_n(data, len);
+			rs_port_skip(in, len);
+			return 1;
+		}
+		struct rs_buf *buf = rs_port_scratch(in);
+		rs_fasl_get_bytes(in, buf, len);
+		*obj = rs_string_create_n(rs_buf_cstr(buf), len);
+		return 1;
+	}
+	case FASL_BYTEVECTOR: {
+		size_t len = rs_fasl_get_uint(in);
+		*obj = rs_bytevector_create(len, 0);
+		unsigned char *bytes = rs_bytevector_data(rs_obj_to_bytevector(*obj));
+		const char *data;
+		if (rs_port_avail(in, &data) >= len) {
+			memcpy(bytes, data, len);
+			rs_port_skip(in, len);
+		} else {
+			struct rs_buf *buf = rs_port_scratch(in);
+			rs_fasl_get_bytes(in, buf, len);
+			memcpy(bytes, rs_buf_cstr(buf), len);
+		}
+		return 1;
+	}
+	case FASL_SYMBOL: {
+		unsigned long i = rs_fasl_get_uint(in);
+		if (i >= r->nsyms) {
+			rs_fatal("bad fasl record: no symbol %lu", i);
+		}
+		*obj = r->syms[i];
+		return 1;
+	}
+	case FASL_LIST:
+		rs_fasl_get_list(r, def);
+		return 0;
+	case FASL_VECTOR:
+		return rs_fasl_get_vector(r, def, obj);
+	case FASL_REF: {
+		unsigned long i = rs_fasl_get_uint(in);
+		if (i >= r->nrefs) {
+			rs_fatal("bad fasl record: no back-reference %lu", i);
+		}
+		*obj = r->refs[i];
+		return 1;
+	}
+	default:
+		rs_fatal("bad fasl record: unknown tag %d", tag);
+	}
+	return 0;
+}
+
+
+static void rs_fasl_get_list(struct rs_fasl_reader *r, int def)
+{
+	unsigned long n = rs_fasl_get_uint(r->in);
+	if (n == 0) {
+		rs_fatal("bad fasl record: empty list");
+	}
+
+	rs_object head = rs_pair_create(rs_null, rs_null);
+	rs_gc_push(head);
+	if (def) {
+		rs_fasl_add_ref(r, head);
+	}
+	struct rs_fasl_frame *f = rs_fasl_push_frame(&r->frames, &r->nframes,
+	                                             &r->capframes);
+	f->head = f->obj = head;
+	f->n = n + 1;
+	f->vector = 0;
+}
+
+
+/* Like a list, the vector is made before its elements are read. An empty one
+   is finished straight away.
+*/
+static int rs_fasl_get_vector(struct rs_fasl_reader *r, int def,
+                              rs_object *obj)
+{
+	unsigned long n = rs_fasl_get_uint(r->in);
+
+	*obj = rs_vector_create(n, rs_unspecified);
+	if (def) {
+		rs_fasl_add_ref(r, *obj);
+	}
+	if (n == 0) {
+		return 1;
+	}
+	rs_gc_push(*obj);
+	struct rs_fasl_frame *f = rs_fasl_push_frame(&r->frames, &r->nframes,
+	                                             &r->capframes);
+	f->head = f->obj = *obj;
+	f->i = 0;
+	f->n = n;
+	f->vector = 1;
+	return 0;
+}
+
+
+static void rs_fasl_add_ref(struct rs_fasl_reader *r, rs_object obj)
+{
+	if (r->nrefs == r->caprefs) {
+		r->caprefs = r->caprefs == 0 ? 16 : r->caprefs * 2;
+		rs_object *p = realloc(r->refs, r->caprefs * sizeof(rs_object));
+		if (p == NULL) {
+			rs_fatal("could not grow fasl back-reference table:");
+		}
+		r->refs = p;
+	}
+	r->refs[r->nrefs++] = obj;
+}
+
+
+static struct rs_fasl_frame *rs_fasl_push_frame(struct rs_fasl_frame **frames,
+                                                size_t *n, size_t *cap)
+{
+	if (*n == *cap) {
+		*cap = *cap == 0 ? 16 : *cap * 2;
+		struct rs_fasl_frame *p = realloc(*frames,
+		                                  *cap * sizeof(struct rs_fasl_frame));
+		if (p == NULL) {
+			rs_fatal("could not grow fasl frame stack:");
+		}
+		*frames = p;
+	}
+	return &(*frames)[(*n)++];
+}
+
+
+static unsigned long rs_fasl_get_uint(struct rs_port *in)
+{
+	unsigned long v = 0;
+	int shift = 0;
+	int b;
+	do {
+		b = rs_fasl_get_byte(in);
+		if (shift >= (int)(sizeof(unsigned long) * CHAR_BIT)) {
+			rs_fatal("bad fasl record: number too large");
+		}
+		v |= (unsigned long)(b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
+	return v;
+}
+
+
+static int rs_fasl_get_byte(struct rs_port *in)
+{
+	int c = rs_port_getc(in);
+	if (c == EOF) {
+		rs_fatal("unexpected EOF in a fasl record");
+	}
+	return c;
+}
+
+
+/* Read len bytes into a buffer. */
+static void rs_fasl_get_bytes(struct rs_port *in, struct rs_buf *buf,
+                              size_t len)
+{
+	while (len > 0) {
+		const char *data;
+		size_t n = rs_port_avail(in, &data);
+		if (n == 0) {
+			rs_port_ungetc(in, rs_fasl_get_byte(in));
+			continue;
+		}
+		if (n > len) {
+			n = len;
+		}
+		if (rs_buf_append(buf, data, n) == NULL) {
+			rs_fatal("could not write to buffer:");
+		}
+		rs_port_skip(in, n);
+		len -= n;
+	}
+}
+
+
+
+/**** Testing. ****/
+
+struct rs_fasl_test_input {
+	const char *data;
+	size_t len;
+};
+
+
+static rs_object rs_fasl_test_read(const char *src)
+{
+	struct rs_port *in = rs_port_open_mem(src, strlen(src));
+	rs_object obj = rs_read(in);
+	rs_port_close(in);
+	return obj;
+}
+
+
+static void rs_fasl_test_load(void *arg)
+{
+	struct rs_fasl_test_input *input = arg;
+	struct rs_port *in = rs_port_open_mem(input->data, input->len);
+	(void) rs_read_fasl(in);
+	rs_port_close(in);
+}
+
+
+/* Write and read back a list or vector nested n deep. */
+static void rs_fasl_test_deep(long n, int vector)
+{
+	rs_object obj = rs_null;
+	rs_gc_push(obj);
+	for (long i = 0; i < n; i++) {
+		obj = vector ? rs_vector_create(1, obj) : rs_pair_create(obj, rs_null);
+		rs_gc_pop();
+		rs_gc_push(obj);
+	}
+
+	struct rs_outport *out = rs_outport_open_string();
+	rs_write_fasl(out, obj);
+	size_t len;
+	const char *data = rs_outport_data(out, &len);
+	struct rs_port *in = rs_port_open_mem(data, len);
+	rs_object copy = rs_read_fasl(in);
+	rs_gc_push(copy);
+	if (copy == obj || !rs_equal_p(copy, obj)) {
+		rs_fatal("a %s nested %ld deep did not round-trip",
+		         vector ? "vector" : "list", n);
+	}
+	rs_gc_pop();
+	rs_port_close(in);
+	rs_outport_close(out);
+	rs_gc_pop();
+}
+
+
+/* Check that reading a record from len bytes of data fails, as it should. */
+static void rs_fasl_test_bad(const char *data, size_t len, const char *what)
+{
+	struct rs_fasl_test_input input = { data, len };
+	if (!rs_fails_p(rs_fasl_test_load, &input)) {
+		rs_fatal("read %s without an error", what);
+	}
+}
+
+
+void rs_fasl_test(void)
+{
+	/* Some acyclic records, which should come back equal. */
+	char ints[128], bigs[160];
+	snprintf(ints, sizeof(ints), "(%ld %ld -1 0 1)", rs_fixnum_min,
+	         rs_fixnum_max);
+	snprintf(bigs, sizeof(bigs), "(123456789012345678901234567890 "
+	         "-98765432109876543210987654321 %ld)", rs_fixnum_max + 1);
+	const char *plain[] = {
+		ints,
+		bigs,
+		"#(\"str\" #u8(1 2 255) 1.5 sym #\\a () #t (sym . 3))",
+	};
+	size_t nplain = sizeof(plain) / sizeof(plain[0]);
+
+	struct rs_outport *out = rs_outport_open_string();
+	long start[4];
+	for (size_t i = 0; i < nplain; i++) {
+		start[i] = rs_outport_offset(out);
+		rs_write_fasl(out, rs_fasl_test_read(plain[i]));
+	}
+	start[nplain] = rs_outport_offset(out);
+
+	/* A vector shared by a list, then a cycle through cdrs, through a car,
+	   and through a vector. */
+	rs_object obj = rs_fasl_test_read("(#(1) x)");
+	rs_pair_set_car(rs_obj_to_pair(rs_pair_cdr(rs_obj_to_pair(obj))),
+	                rs_pair_car(rs_obj_to_pair(obj)));
+	rs_write_fasl(out, obj);
+	obj = rs_fasl_test_read("(1 2)");
+	rs_pair_set_cdr(rs_obj_to_pair(rs_pair_cdr(rs_obj_to_pair(obj))), obj);
+	rs_write_fasl(out, obj);
+	obj = rs_fasl_test_read("(1)");
+	rs_pair_set_car(rs_obj_to_pair(obj), obj);
+	rs_write_fasl(out, obj);
+	obj = rs_fasl_test_read("#(1 2)");
+	rs_vector_set(rs_obj_to_vector(obj), 1, obj);
+	rs_write_fasl(out, obj);
+
+	/* Read them all back from the one stream. */
+	size_t len;
+	const char *data = rs_outport_data(out, &len);
+	struct rs_port *in = rs_port_open_mem(data, len);
+	for (size_t i = 0; i < nplain; i++) {
+		obj = rs_read_fasl(in);
+		rs_gc_push(obj);
+		if (!rs_equal_p(obj, rs_fasl_test_read(plain[i]))) {
+			rs_fatal("%s did not round-trip", plain[i]);
+		}
+		rs_gc_pop();
+	}
+
+	obj = rs_read_fasl(in);
+	rs_pair *p = rs_obj_to_pair(obj);
+	rs_object second = rs_pair_car(rs_obj_to_pair(rs_pair_cdr(p)));
+	if (!rs_vector_p(rs_pair_car(p)) || rs_pair_car(p) != second) {
+		rs_fatal("shared vector did not round-trip");
+	}
+	obj = rs_read_fasl(in);
+	p = rs_obj_to_pair(obj);
+	if (rs_pair_car(p) != rs_fixnum_to_obj(1) ||
+	    rs_pair_cdr(rs_obj_to_pair(rs_pair_cdr(p))) != obj) {
+		rs_fatal("cyclic list did not round-trip");
+	}
+	obj = rs_read_fasl(in);
+	if (rs_pair_car(rs_obj_to_pair(obj)) != obj) {
+		rs_fatal("cyclic car did not round-trip");
+	}
+	obj = rs_read_fasl(in);
+	if (rs_vector_ref(rs_obj_to_vector(obj), 1) != obj) {
+		rs_fatal("cyclic vector did not round-trip");
+	}
+	if (!rs_eof_p(rs_read_fasl(in))) {
+		rs_fatal("extra fasl record");
+	}
+	rs_port_close(in);
+
+	rs_fasl_test_deep(1000000, 0);
+	rs_fasl_test_deep(1000000, 1);
+
+	/* Records cut short anywhere are errors, not garbage. */
+	const char *rec = data + start[2];
+	size_t reclen = (size_t)(start[3] - start[2]);
+	size_t cuts[] = { 1, 4, 5, 6, reclen / 2, reclen - 1 };
+	for (size_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]); i++) {
+		rs_fasl_test_bad(rec, cuts[i], "a truncated record");
+	}
+
+	/* So are corrupt ones. Each has a header, and no symbols. */
+	struct {
+		char data[9];
+		size_t len;
+		const char *what;
+	} bad[] = {
+		{ { 0x7f, 'r', 's', 'g', 1, 0, FASL_NULL }, 7, "a bad magic number" },
+		{ { 0x7f, 'r', 's', 'f', 99, 0, FASL_NULL }, 7, "a bad version" },
+		{ { 0x7f, 'r', 's', 'f', 1, 0, 0x7e }, 7, "an unknown tag" },
+		{ { 0x7f, 'r', 's', 'f', 1, 0, FASL_REF, 0 }, 8,
+		  "a missing back-reference" },
+		{ { 0x7f, 'r', 's', 'f', 1, 0, FASL_SYMBOL, 3 }, 8,
+		  "a missing symbol" },
+		{ { 0x7f, 'r', 's', 'f', 1, 0, FASL_LIST, 0 }, 8, "an empty list" },
+		{ { 0x7f, 'r', 's', 'f', 1, 0, FASL_DEF, FASL_FIXNUM, 0 }, 9,
+		  "a back-reference to a fixnum" },
+	};
+	for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+		rs_fasl_test_bad(bad[i].data, bad[i].len, bad[i].what);
+	}
+	const char good[] = { 0x7f, 'r', 's', 'f', 1, 0, FASL_NULL };
+	in = rs_port_open_mem(good, sizeof(good));
+	if (!rs_null_p(rs_read_fasl(in))) {
+		rs_fatal("could not read an empty list record");
+	}
+	rs_port_close(in);
+
+	rs_outport_close(out);
+	TRACE("passed");
+}
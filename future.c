@@ -0,0 +1,416 @@
+/* For sysconf(). */
+#define _DEFAULT_SOURCE
+#include "rescheme.h"
+
+#include <assert.h>
+#include <unistd.h>
+
+/* Each worker has a deque of futures. The futures a worker makes go on the
+   bottom of its own, and it takes its next one from the bottom too, so that
+   it works depth-first, the way the calls would have run without futures. A
+   worker that runs out steals from the top of the others', where the oldest
+   futures are, which in divide-and-conquer code are the biggest pieces of
+   work. Futures made by threads that aren't workers go in a shared deque,
+   which every worker steals from.
+
+   A future can still be in a deque when it's touched, so a thread has to
+   claim a future, by moving it from queued to running, before it runs it.
+   One that's already been claimed is just dropped when it comes off a deque.
+
+   Threads with nothing to do wait on the pool's condition variable, while
+   blocked (see rs_gc_block()), until there are futures queued again, or, for
+   a thread that's touching one, until a future has finished. pending counts
+   what's in the deques, and sleeping counts the waiting threads, so that
+   whoever queues or finishes a future only has to take the pool's lock when
+   someone is waiting. No lock is held while allocating, or calling Scheme
+   code, so the GC never waits on one.
+*/
+
+struct rs_deque {
+	pthread_mutex_t lock;
+	struct rs_pool *pool;
+	rs_object *items;      // a ring, with the top at head
+	size_t head;
+	size_t count;
+	size_t cap;
+};
+
+struct rs_pool {
+	struct rs_vm *vm;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int nworkers;
+	pthread_t *threads;
+	struct rs_deque *deques;    // the workers', then the shared one
+	long pending;
+	int sleeping;
+	int stopping;
+};
+
+
+static struct rs_pool *rs_future_pool(void);
+static void *rs_future_worker(void *arg);
+static struct rs_deque *rs_future_deque(struct rs_pool *pool);
+static rs_future *rs_future_take(struct rs_pool *pool, struct rs_deque *own);
+static void rs_future_run(struct rs_pool *pool, rs_future *f);
+static void rs_future_wait(struct rs_pool *pool, rs_future *f);
+static void rs_future_push(struct rs_deque *d, rs_object fut);
+static rs_future *rs_future_pop(struct rs_deque *d, int bottom);
+static void rs_future_mark(void);
+
+
+void rs_future_set_workers(int n)
+{
+	rs_vm_current()->nworkers = n;
+}
+
+
+rs_object rs_future_create(rs_object thunk)
+{
+	assert(rs_closure_p(thunk));
+
+	struct rs_pool *pool = rs_future_pool();
+	rs_future *f = rs_gc_alloc_hobject();
+	f->type = RS_FUTURE;
+	f->val.future.value = thunk;
+	f->val.future.state = RS_FUTURE_QUEUED;
+
+	rs_future_push(rs_future_deque(pool), rs_future_to_obj(f));
+	return rs_future_to_obj(f);
+}
+
+
+rs_object rs_future_touch(rs_object fut)
+{
+	rs_future *f = rs_obj_to_future(fut);
+	if (_VM_LOAD(&f->val.future.state) == RS_FUTURE_DONE) {
+		return f->val.future.value;
+	}
+
+	struct rs_pool *pool = _VM_LOAD(&rs_vm_current()->pool);
+	if (_VM_CAS(&f->val.future.state, RS_FUTURE_QUEUED, RS_FUTURE_RUNNING)) {
+		rs_future_run(pool, f);
+		return f->val.future.value;
+	}
+
+	/* Another thread is running it, so help with the rest until it's done. */
+	struct rs_deque *own = rs_future_deque(pool);
+	rs_gc_push(fut);
+	while (_VM_LOAD(&f->val.future.state) != RS_FUTURE_DONE) {
+		rs_future *g = rs_future_take(pool, own);
+		if (g != NULL) {
+			rs_future_run(pool, g);
+		} else {
+			rs_future_wait(pool, f);
+		}
+	}
+	rs_gc_pop();
+	return f->val.future.value;
+}
+
+
+void rs_future_shutdown(void)
+{
+	struct rs_vm *vm = rs_vm_current();
+	struct rs_pool *pool = vm->pool;
+	if (pool == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	_VM_STORE(&pool->stopping, 1);
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	/* The workers may need to collect before they get to leave. */
+	rs_gc_block();
+	for (int i = 0; i < pool->nworkers; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	rs_gc_unblock();
+
+	for (int i = 0; i <= pool->nworkers; i++) {
+		pthread_mutex_destroy(&pool->deques[i].lock);
+		free(pool->deques[i].items);
+	}
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->deques);
+	free(pool->threads);
+	free(pool);
+	vm->pool = NULL;
+}
+
+
+/* Get the interpreter's pool, starting it if it hasn't been. */
+static struct rs_pool *rs_future_pool(void)
+{
+	struct rs_vm *vm = rs_vm_current();
+	struct rs_pool *pool = _VM_LOAD(&vm->pool);
+	if (pool != NULL) {
+		return pool;
+	}
+
+	/* The workers wait for the lock to enter the interpreter, so none of
+	   them runs until the pool is ready. */
+	pthread_mutex_lock(&vm->lock);
+	if (vm->pool != NULL) {
+		pthread_mutex_unlock(&vm->lock);
+		return vm->pool;
+	}
+
+	int n = vm->nworkers;
+	if (n <= 0) {
+		n = (int) sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	}
+	if (n < 1) {
+		n = 1;
+	}
+	pool = calloc(1, sizeof(struct rs_pool));
+	if (pool == NULL ||
+	    (pool->threads = malloc(n * sizeof(pthread_t))) == NULL ||
+	    (pool->deques = calloc(n + 1, sizeof(struct rs_deque))) == NULL) {
+		rs_fatal("could not allocate worker pool:");
+	}
+	pool->vm = vm;
+	pool->nworkers = n;
+	if (pthread_mutex_init(&pool->lock, NULL) != 0 ||
+	    pthread_cond_init(&pool->wake, NULL) != 0) {
+		rs_fatal("could not create worker pool lock");
+	}
+	for (int i = 0; i <= n; i++) {
+		if (pthread_mutex_init(&pool->deques[i].lock, NULL) != 0) {
+			rs_fatal("could not create worker pool lock");
+		}
+		pool->deques[i].pool = pool;
+	}
+	for (int i = 0; i < n; i++) {
+		if (pthread_create(&pool->threads[i], NULL, rs_future_worker,
+		                   &pool->deques[i]) != 0) {
+			rs_fatal("could not start worker thread");
+		}
+	}
+	rs_gc_add_root_hook(rs_future_mark);
+	_VM_STORE(&vm->pool, pool);
+	pthread_mutex_unlock(&vm->lock);
+	return pool;
+}
+
+
+static void *rs_future_worker(void *arg)
+{
+	struct rs_deque *own = arg;
+	struct rs_pool *pool = own->pool;
+	rs_vm_enter(pool->vm);
+	rs_mutator_current()->deque = own;
+
+	while (!_VM_LOAD(&pool->stopping)) {
+		rs_future *f = rs_future_take(pool, own);
+		if (f != NULL) {
+			rs_future_run(pool, f);
+		} else {
+			rs_future_wait(pool, NULL);
+		}
+	}
+
+	rs_vm_leave();
+	return NULL;
+}
+
+
+/* Get the calling thread's deque: its own, if it's a worker, or else the
+   shared one.
+*/
+static struct rs_deque *rs_future_deque(struct rs_pool *pool)
+{
+	struct rs_deque *d = rs_mutator_current()->deque;
+	return d != NULL ? d : &pool->deques[pool->nworkers];
+}
+
+
+/* Claim the next future the calling thread should run: the newest one in its
+   own deque, or else the oldest one in someone else's. Return NULL if there
+   aren't any.
+*/
+static rs_future *rs_future_take(struct rs_pool *pool, struct rs_deque *own)
+{
+	rs_future *f = rs_future_pop(own, 1);
+	int n = pool->nworkers + 1;
+	int start = (int) (own - pool->deques);
+	for (int i = 1; f == NULL && i < n; i++) {
+		f = rs_future_pop(&pool->deques[(start + i) % n], 0);
+	}
+	return f;
+}
+
+
+/* Run a future the calling thread has claimed, and wake up anyone waiting,
+   in case it's waiting for this one.
+*/
+static void rs_future_run(struct rs_pool *pool, rs_future *f)
+{
+	rs_gc_push(rs_future_to_obj(f));
+	rs_object val = rs_vm_apply(f->val.future.value, NULL, 0);
+	f->val.future.value = val;
+	_VM_STORE(&f->val.future.state, RS_FUTURE_DONE);
+	rs_gc_pop();
+
+	_VM_FENCE();
+	if (_VM_LOAD(&pool->sleeping) > 0) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_broadcast(&pool->wake);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+
+/* Wait until there are futures queued, or f (if it isn't NULL) is done, or
+   the pool is stopping.
+*/
+static void rs_future_wait(struct rs_pool *pool, rs_future *f)
+{
+	rs_gc_block();
+	pthread_mutex_lock(&pool->lock);
+	_VM_ADD(&pool->sleeping, 1);
+	_VM_FENCE();
+	while (_VM_LOAD(&pool->pending) <= 0 && !pool->stopping &&
+	       (f == NULL ||
+	        _VM_LOAD(&f->val.future.state) != RS_FUTURE_DONE)) {
+		pthread_cond_wait(&pool->wake, &pool->lock);
+	}
+	_VM_ADD(&pool->sleeping, -1);
+	pthread_mutex_unlock(&pool->lock);
+	rs_gc_unblock();
+}
+
+
+/** Deques **/
+
+static void rs_future_push(struct rs_deque *d, rs_object fut)
+{
+	struct rs_pool *pool = d->pool;
+	pthread_mutex_lock(&d->lock);
+	if (d->count == d->cap) {
+		size_t cap = d->cap == 0 ? 64 : d->cap * 2;
+		rs_object *items = malloc(cap * sizeof(rs_object));
+		if (items == NULL) {
+			rs_fatal("could not grow future queue:");
+		}
+		for (size_t i = 0; i < d->count; i++) {
+			items[i] = d->items[(d->head + i) % d->cap];
+		}
+		free(d->items);
+		d->items = items;
+		d->head = 0;
+		d->cap = cap;
+	}
+	d->items[(d->head + d->count) % d->cap] = fut;
+	_VM_STORE(&d->count, d->count + 1);
+	_VM_ADD(&pool->pending, 1);
+	pthread_mutex_unlock(&d->lock);
+
+	_VM_FENCE();
+	if (_VM_LOAD(&pool->sleeping) > 0) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_signal(&pool->wake);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+
+/* Take futures from the bottom of a deque, or the top, until one can be
+   claimed, and return it, or NULL if the deque runs out first.
+*/
+static rs_future *rs_future_pop(struct rs_deque *d, int bottom)
+{
+	if (_VM_LOAD(&d->count) == 0) {
+		return NULL;
+	}
+
+	rs_future *f = NULL;
+	pthread_mutex_lock(&d->lock);
+	while (f == NULL && d->count > 0) {
+		rs_object fut;
+		if (bottom) {
+			fut = d->items[(d->head + d->count - 1) % d->cap];
+		} else {
+			fut = d->items[d->head];
+			d->head = (d->head + 1) % d->cap;
+		}
+		_VM_STORE(&d->count, d->count - 1);
+		_VM_ADD(&d->pool->pending, -1);
+		f = rs_obj_to_future(fut);
+		if (!_VM_CAS(&f->val.future.state, RS_FUTURE_QUEUED,
+		             RS_FUTURE_RUNNING)) {
+			f = NULL;
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+	return f;
+}
+
+
+/* Mark the futures in the deques, including ones that have been claimed
+   already, which don't need it, but are harmless.
+*/
+static void rs_future_mark(void)
+{
+	struct rs_pool *pool = rs_vm_current()->pool;
+	if (pool == NULL) {
+		return;
+	}
+	for (int i = 0; i <= pool->nworkers; i++) {
+		struct rs_deque *d = &pool->deques[i];
+		for (size_t j = 0; j < d->count; j++) {
+			rs_gc_mark_range(&d->items[(d->head + j) % d->cap], 1);
+		}
+	}
+}
+
+
+
+/**** Testing. ****/
+
+void rs_future_test(void)
+{
+	/* An error ends the program even on a worker, and even if nothing touches
+	   the future. These run first, in child processes, since they can only
+	   fork safely while this thread is the only one.
+	*/
+	rs_eval_expect_error("(touch (future (lambda () (car 1))))");
+	rs_eval_expect_error("(touch (future (lambda ()"
+	                     "  (touch (future (lambda ()"
+	                     "    (vector-ref (vector) 0)))))))");
+	rs_eval_expect_error("(future (lambda () (car 1))) (sleep 10)");
+	rs_eval_expect_error("(future car)");
+
+	rs_future_set_workers(2);
+	rs_eval_expect("(touch (future (lambda () (+ 1 2))))", "3");
+	rs_eval_expect("(touch 5)", "5");
+	rs_eval_expect("(let ((f (future (lambda () (list 1 2)))))"
+	               "  (and (eq? (touch f) (touch f)) (touch f)))", "(1 2)");
+	rs_eval_expect("(let ()"
+	               "  (define (pfib n)"
+	               "    (if (< n 2)"
+	               "        n"
+	               "        (let* ((a (future (lambda () (pfib (- n 1)))))"
+	               "               (b (pfib (- n 2))))"
+	               "          (+ (touch a) b))))"
+	               "  (pfib 20))", "6765");
+
+	/* Enough allocation on the workers for them to collect as they go. */
+	rs_eval_expect("(let loop ((i 0) (fs '()))"
+	               "  (if (< i 100)"
+	               "      (loop (+ i 1)"
+	               "            (cons (future (lambda ()"
+	               "                    (let build ((j 0) (l '()))"
+	               "                      (if (< j 10000)"
+	               "                          (build (+ j 1) (cons i l))"
+	               "                          (apply + l)))))"
+	               "                  fs))"
+	               "      (apply + (map touch fs))))", "49500000");
+
+	rs_future_shutdown();
+	rs_future_set_workers(0);
+	TRACE("passed");
+}
@@ -1,19 +1,67 @@
 #include "rescheme.h"
-
-
+#include <string.h>
+
+
+/* The heap is a list of chunks of objects. It starts out with one chunk, and
+   whenever a collection leaves it more than three-quarters full, a new chunk
+   is added that's as big as the rest of the heap put together. Objects never
+   move, so the chunks are never merged or compacted.
+
+   Free objects are kept in spans, runs of them that are next to each other in
+   a chunk, linked together through the val.span field of each one's first
+   object. Each thread in the interpreter takes an allocation buffer of up to
+   TLAB_SIZE objects from the front of the list, and allocates from it by
+   bumping a pointer, without taking any locks, so the lock is only needed
+   once every TLAB_SIZE allocations.
+
+   A vector's elements, and a hash table's entries, are outside the heap, but
+   they're marked along with it, so they count towards the heap's size when
+   deciding whether to grow it. Otherwise a big vector in a small heap would be
+   marked over and over again, for a few objects each time.
+
+   Each interpreter has a heap of its own (see struct rs_vm), and collects it
+   by itself, without stopping any other. A collection does stop every other
+   thread in the same interpreter, though: it sets their stop flags, and waits
+   until they've all reached a safepoint, which they do whenever they need a
+   new buffer, and at each procedure call (see rs_vm_run() and jit.c), where
+   all their objects are on their stacks. Then it marks from every thread's
+   roots and stacks, and throws away their buffers, whose unused objects are
+   swept into spans along with everything else.
+*/
 #define HEAP_SIZE 1024
-
-
-static struct rs_hobject *heap = NULL;
-static int next_obj = 0;
-
-
-static struct rs_stack *root = NULL;
-
-
-static int rs_gc_next_obj(void);
+#define TLAB_SIZE 256
+
+struct rs_gc_chunk {
+	struct rs_gc_chunk *next;
+	size_t size;
+	struct rs_hobject objs[];
+};
+
+/* Each thread's root stack is an array, so that pushing and popping (which
+   happens for nearly every allocation) doesn't need to allocate.
+
+   Other modules that hold objects (the VM's stack, for example) mark them from
+   a hook.
+
+   Marking doesn't recurse, since data can be nested far deeper than the C
+   stack could follow. Each object's fields, other than the one it goes on to
+   mark next, are pushed onto a mark stack as runs of objects still to be
+   marked, and the stack is worked down until it's empty.
+*/
+struct rs_gc_range {
+	const rs_object *objs;
+	size_t n;
+};
+
+
+static struct rs_hobject *rs_gc_refill(struct rs_mutator *self);
+static void rs_gc_collect(struct rs_vm *vm, struct rs_mutator *self);
+static void rs_gc_park(struct rs_vm *vm);
+static void rs_gc_grow(size_t size);
 static void rs_gc_mark(void);
 static void rs_gc_mark_obj(rs_object obj);
+static void rs_gc_mark_push(const rs_object *objs, size_t n);
+static void rs_gc_mark_table(struct rs_hashtable *t);
 static void rs_gc_sweep(void);
 
 
@@ -25,114 +73,514 @@ static void rs_gc_sweep(void);
 #define GC_FLAG_MARK_SET(flags) ((flags) |= 2)
 #define GC_FLAG_MARK_CLEAR(flags) ((flags) &= ~2)
 
+#define GC_FLAG_WATCH_P(flags) ((flags) & 4)
+#define GC_FLAG_WATCH_SET(flags) ((flags) |= 4)
+#define GC_FLAG_WATCH_CLEAR(flags) ((flags) &= ~4)
+
 
 void rs_gc_init(void)
 {
 	TRACE("heap size = %ld objects", HEAP_SIZE);
-	heap = calloc(HEAP_SIZE, sizeof(struct rs_hobject));
-	if (heap == NULL) {
-		rs_fatal("cannot allocate heap:");
-	}
+	rs_gc_grow(HEAP_SIZE);
 }
 
 
 void rs_gc_shutdown(void)
 {
-	assert(heap != NULL);
-	for (int i = 0; i < HEAP_SIZE; i++) {
-		if (GC_FLAG_ALLOC_P(heap[i].flags)) {
-			rs_hobject_release(&(heap[i]));
+	struct rs_vm *vm = rs_vm_current();
+	assert(vm->heap != NULL);
+	while (vm->heap != NULL) {
+		struct rs_gc_chunk *chunk = vm->heap;
+		for (size_t i = 0; i < chunk->size; i++) {
+			if (GC_FLAG_ALLOC_P(chunk->objs[i].flags)) {
+				rs_hobject_release(&(chunk->objs[i]));
+			}
 		}
+		vm->heap = chunk->next;
+		free(chunk);
 	}
-	free(heap);
+	vm->heap_size = 0;
+	vm->free_spans = NULL;
+	vm->free_count = 0;
+	vm->extra_words = 0;
+
+	for (struct rs_mutator *m = vm->mutators; m != NULL; m = m->next) {
+		free(m->roots);
+		m->roots = NULL;
+		m->nroots = m->caproots = 0;
+		m->tlab_next = m->tlab_end = NULL;
+	}
+	vm->nhooks = 0;
+	free(vm->marking);
+	vm->marking = NULL;
+	vm->nmarking = vm->capmarking = 0;
+
+	rs_hashcons_shutdown();
+	rs_source_shutdown();
 }
 
 
 struct rs_hobject *rs_gc_alloc_hobject(void)
 {
-	assert(heap != NULL);
+	struct rs_mutator *self = rs_mutator_current();
+	assert(self->vm->heap != NULL);
 
-	int i;
-	if ((i = rs_gc_next_obj()) < 0) {
-		TRACE("garbage day");
-		rs_gc_mark();
-		rs_gc_sweep();
-		if ((i = rs_gc_next_obj()) < 0) {
-			rs_fatal("could not allocate an object");
-		}
+	struct rs_hobject *obj = self->tlab_next;
+	if (obj == self->tlab_end) {
+		obj = rs_gc_refill(self);
 	}
+	self->tlab_next = obj + 1;
 
-	GC_FLAG_ALLOC_SET(heap[i].flags);
-	GC_FLAG_MARK_CLEAR(heap[i].flags);
-	return &(heap[i]);
+	obj->flags = 0;
+	GC_FLAG_ALLOC_SET(obj->flags);
+	return obj;
 }
 
 
 void rs_gc_push(rs_object obj)
 {
-	root = rs_stack_push(root, (void*) obj);
+	struct rs_mutator *self = rs_mutator_current();
+	if (self->nroots == self->caproots) {
+		self->caproots = self->caproots == 0 ? 64 : self->caproots * 2;
+		rs_object *r = realloc(self->roots,
+		                       self->caproots * sizeof(rs_object));
+		if (r == NULL) {
+			rs_fatal("could not grow root stack:");
+		}
+		self->roots = r;
+	}
+	self->roots[self->nroots++] = obj;
 }
 
 
 void rs_gc_pop(void)
 {
-	assert(root != NULL);
-	(void) rs_stack_pop(&root);
+	struct rs_mutator *self = rs_mutator_current();
+	assert(self->nroots > 0);
+	self->nroots--;
+}
+
+
+void rs_gc_block(void)
+{
+	struct rs_vm *vm = rs_vm_current();
+	pthread_mutex_lock(&vm->lock);
+	vm->nrunning--;
+	pthread_cond_broadcast(&vm->stopped);
+	pthread_mutex_unlock(&vm->lock);
+}
+
+
+void rs_gc_unblock(void)
+{
+	struct rs_vm *vm = rs_vm_current();
+	pthread_mutex_lock(&vm->lock);
+	while (vm->stopping) {
+		pthread_cond_wait(&vm->stopped, &vm->lock);
+	}
+	vm->nrunning++;
+	pthread_mutex_unlock(&vm->lock);
+}
+
+
+void rs_gc_safepoint(void)
+{
+	struct rs_vm *vm = rs_vm_current();
+	pthread_mutex_lock(&vm->lock);
+	rs_gc_park(vm);
+	pthread_mutex_unlock(&vm->lock);
+}
+
+
+void rs_gc_attach(struct rs_mutator *m)
+{
+	struct rs_vm *vm = m->vm;
+	pthread_mutex_lock(&vm->lock);
+	while (vm->stopping) {
+		pthread_cond_wait(&vm->stopped, &vm->lock);
+	}
+	m->next = vm->mutators;
+	vm->mutators = m;
+	vm->nrunning++;
+	pthread_mutex_unlock(&vm->lock);
+}
+
+
+void rs_gc_detach(void)
+{
+	struct rs_mutator *self = rs_mutator_current();
+	struct rs_vm *vm = self->vm;
+	pthread_mutex_lock(&vm->lock);
+	rs_gc_park(vm);
+	struct rs_mutator **p = &vm->mutators;
+	while (*p != self) {
+		assert(*p != NULL);
+		p = &(*p)->next;
+	}
+	*p = self->next;
+	vm->nrunning--;
+	pthread_cond_broadcast(&vm->stopped);
+	pthread_mutex_unlock(&vm->lock);
+
+	free(self->roots);
+	self->roots = NULL;
+	self->nroots = self->caproots = 0;
+}
+
+
+void rs_gc_add_root_hook(void (*hook)(void))
+{
+	struct rs_vm *vm = rs_vm_current();
+	assert(hook != NULL);
+	for (int i = 0; i < vm->nhooks; i++) {
+		if (vm->root_hooks[i] == hook) {
+			return;
+		}
+	}
+	if (vm->nhooks == _GC_MAX_HOOKS) {
+		rs_fatal("too many GC root hooks");
+	}
+	vm->root_hooks[vm->nhooks++] = hook;
+}
+
+
+void rs_gc_mark_range(const rs_object *objs, size_t n)
+{
+	assert(objs != NULL || n == 0);
+	struct rs_vm *vm = rs_vm_current();
+	rs_gc_mark_push(objs, n);
+	while (vm->nmarking > 0) {
+		struct rs_gc_range *top = &vm->marking[vm->nmarking - 1];
+		rs_object obj = *top->objs++;
+		if (--top->n == 0) {
+			vm->nmarking--;
+		}
+		rs_gc_mark_obj(obj);
+	}
 }
 
 
-static int rs_gc_next_obj(void)
+void rs_gc_watch(struct rs_hobject *obj)
 {
-	assert(next_obj >= 0 && next_obj < HEAP_SIZE);
+	assert(obj != NULL);
+	assert(GC_FLAG_ALLOC_P(obj->flags));
+	GC_FLAG_WATCH_SET(obj->flags);
+}
 
-	int i = next_obj;
+
+/* Give self a new buffer, from the first free span, and return its first
+   object. If there are no free spans, collect; if another thread is already
+   collecting, wait for it to finish.
+*/
+static struct rs_hobject *rs_gc_refill(struct rs_mutator *self)
+{
+	struct rs_vm *vm = self->vm;
+	pthread_mutex_lock(&vm->lock);
 	for (;;) {
-		if (!GC_FLAG_ALLOC_P(heap[i].flags)) {
-			next_obj = (i + 1) % HEAP_SIZE;
-			return i;
+		if (vm->stopping) {
+			rs_gc_park(vm);
+		} else if (vm->free_spans == NULL) {
+			rs_gc_collect(vm, self);
+		} else {
+			break;
 		}
-		i = (i + 1) % HEAP_SIZE;
-		if (i == next_obj) {
-			return -1;
+	}
+
+	struct rs_hobject *span = vm->free_spans;
+	struct rs_hobject *end = span->val.span.end;
+	if (end - span > TLAB_SIZE) {
+		struct rs_hobject *rest = span + TLAB_SIZE;
+		rest->val.span.next = span->val.span.next;
+		rest->val.span.end = end;
+		vm->free_spans = rest;
+		end = rest;
+	} else {
+		vm->free_spans = span->val.span.next;
+	}
+	vm->free_count -= end - span;
+	pthread_mutex_unlock(&vm->lock);
+
+	self->tlab_next = span;
+	self->tlab_end = end;
+	return span;
+}
+
+
+/* Stop every other thread, and collect. The lock is held on entry and exit,
+   but not during the collection itself, which only this thread is running.
+*/
+static void rs_gc_collect(struct rs_vm *vm, struct rs_mutator *self)
+{
+	vm->stopping = 1;
+	for (struct rs_mutator *m = vm->mutators; m != NULL; m = m->next) {
+		if (m != self) {
+			_VM_STORE(&m->stop, 1);
 		}
 	}
+	while (vm->nrunning > 1) {
+		pthread_cond_wait(&vm->stopped, &vm->lock);
+	}
+	pthread_mutex_unlock(&vm->lock);
+
+	TRACE("garbage day");
+	for (struct rs_mutator *m = vm->mutators; m != NULL; m = m->next) {
+		m->tlab_next = m->tlab_end = NULL;
+	}
+	rs_gc_mark();
+	rs_gc_sweep();
+	if (vm->free_count < (vm->heap_size + vm->extra_words) / 4) {
+		TRACE("heap size = %zu objects", 2 * vm->heap_size);
+		rs_gc_grow(vm->heap_size);
+	}
+
+	pthread_mutex_lock(&vm->lock);
+	for (struct rs_mutator *m = vm->mutators; m != NULL; m = m->next) {
+		_VM_STORE(&m->stop, 0);
+	}
+	vm->stopping = 0;
+	pthread_cond_broadcast(&vm->stopped);
+}
+
+
+/* Stop running until the collection under way, if any, is done. The lock is
+   held throughout, except while waiting.
+*/
+static void rs_gc_park(struct rs_vm *vm)
+{
+	vm->nrunning--;
+	pthread_cond_broadcast(&vm->stopped);
+	while (vm->stopping) {
+		pthread_cond_wait(&vm->stopped, &vm->lock);
+	}
+	vm->nrunning++;
+}
+
+
+/* Add a chunk of size objects to the heap, as a single free span. */
+static void rs_gc_grow(size_t size)
+{
+	struct rs_gc_chunk *chunk = calloc(1, sizeof(struct rs_gc_chunk) +
+	                                   size * sizeof(struct rs_hobject));
+	if (chunk == NULL) {
+		rs_fatal("cannot allocate heap:");
+	}
+	struct rs_vm *vm = rs_vm_current();
+	chunk->size = size;
+	chunk->next = vm->heap;
+	vm->heap = chunk;
+	vm->heap_size += size;
+
+	chunk->objs[0].val.span.next = vm->free_spans;
+	chunk->objs[0].val.span.end = chunk->objs + size;
+	vm->free_spans = chunk->objs;
+	vm->free_count += size;
 }
 
 
 static void rs_gc_mark(void)
 {
-	struct rs_stack *s = root;
-	while (s != NULL) {
-		rs_gc_mark_obj((rs_object)rs_stack_top(s));
-		s = s->next;
+	struct rs_vm *vm = rs_vm_current();
+	vm->extra_words = 0;
+	for (struct rs_mutator *m = vm->mutators; m != NULL; m = m->next) {
+		rs_gc_mark_range(m->roots, m->nroots);
+	}
+	for (int i = 0; i < vm->nhooks; i++) {
+		vm->root_hooks[i]();
 	}
-	return;
 }
 
 
+/* Mark obj, and what it leads to through its last field, leaving the rest of
+   its fields on the mark stack.
+*/
 static void rs_gc_mark_obj(rs_object obj)
 {
-	if (rs_heap_p(obj)) {
-		GC_FLAG_MARK_SET(((struct rs_hobject *)obj)->flags);
-		if (rs_pair_p(obj)) {
-			rs_pair *p = rs_obj_to_pair(obj);
-			rs_gc_mark_obj(rs_pair_car(p));
-			rs_gc_mark_obj(rs_pair_cdr(p));
+	while (rs_heap_p(obj)) {
+		struct rs_hobject *h = (struct rs_hobject *)obj;
+		if (GC_FLAG_MARK_P(h->flags)) {
+			return;
+		}
+		GC_FLAG_MARK_SET(h->flags);
+
+		switch (h->type) {
+		case RS_SYMBOL:
+			obj = h->val.sym.value;
+			break;
+		case RS_STRING:
+			if (h->flags & _HOBJECT_FLAG_SLICE) {
+				rs_source_pin(rs_string_data(h));
+			}
+			return;
+		case RS_PAIR:
+			rs_gc_mark_push(&h->val.pair.car, 1);
+			obj = h->val.pair.cdr;
+			break;
+		case RS_CLOSURE: {
+			struct rs_code *code = rs_obj_to_code(h->val.closure.code)->val.code;
+			rs_gc_mark_push(h->val.closure.free, code->nfree);
+			obj = h->val.closure.code;
+			break;
+		}
+		case RS_CODE:
+			rs_gc_mark_push(h->val.code->consts, h->val.code->nconsts);
+			return;
+		case RS_BOX:
+			obj = h->val.box;
+			break;
+		case RS_VECTOR:
+			rs_gc_mark_push(h->val.vec.elts, h->val.vec.len);
+			rs_vm_current()->extra_words += h->val.vec.len;
+			return;
+		case RS_HASHTABLE:
+			rs_gc_mark_table(h->val.table);
+			return;
+		case RS_BYTEVECTOR:
+			if (h->flags & _HOBJECT_FLAG_SLICE) {
+				rs_source_pin(h->val.bytes.data);
+			}
+			return;
+		case RS_CHANNEL:
+			obj = h->val.chan->head;
+			break;
+		case RS_FUTURE:
+			obj = h->val.future.value;
+			break;
+		default:
+			return;
 		}
 	}
 }
 
 
-void rs_gc_sweep(void)
+static void rs_gc_mark_push(const rs_object *objs, size_t n)
 {
-	assert(heap != NULL);
+	struct rs_vm *vm = rs_vm_current();
+	if (n == 0) {
+		return;
+	}
+	if (vm->nmarking == vm->capmarking) {
+		vm->capmarking = vm->capmarking == 0 ? 256 : vm->capmarking * 2;
+		struct rs_gc_range *r = realloc(vm->marking, vm->capmarking *
+		                                sizeof(struct rs_gc_range));
+		if (r == NULL) {
+			rs_fatal("could not grow mark stack:");
+		}
+		vm->marking = r;
+	}
+	vm->marking[vm->nmarking].objs = objs;
+	vm->marking[vm->nmarking].n = n;
+	vm->nmarking++;
+}
 
-	for (int i = 0; i < HEAP_SIZE; i++) {
-		if (GC_FLAG_MARK_P(heap[i].flags)) {
-			GC_FLAG_MARK_CLEAR(heap[i].flags);
-		} else {
-			GC_FLAG_ALLOC_CLEAR(heap[i].flags);
-			rs_hobject_release(&(heap[i]));
+
+/* Mark the keys and values in both of a hash table's arrays (see
+   hashtable.c). Empty slots have a key of 0, which isn't an object. Each
+   key and value is marked only as far as its last field, so this doesn't
+   recurse either.
+*/
+static void rs_gc_mark_table(struct rs_hashtable *t)
+{
+	for (size_t i = 0; i < t->cap; i++) {
+		if (t->entries[i].key != 0) {
+			rs_gc_mark_obj(t->entries[i].key);
+			rs_gc_mark_obj(t->entries[i].val);
+		}
+	}
+	for (size_t i = t->moved; i < t->old_cap; i++) {
+		if (t->old[i].key != 0) {
+			rs_gc_mark_obj(t->old[i].key);
+			rs_gc_mark_obj(t->old[i].val);
 		}
 	}
+	rs_vm_current()->extra_words += 2 * (t->cap + t->old_cap);
+}
+
+
+/* Free every unmarked object, and gather all the free ones, old and new,
+   into spans, in the order they're in the heap.
+*/
+void rs_gc_sweep(void)
+{
+	struct rs_vm *vm = rs_vm_current();
+	assert(vm->heap != NULL);
+
+	struct rs_hobject **tail = &vm->free_spans;
+	vm->free_spans = NULL;
+	vm->free_count = 0;
+	for (struct rs_gc_chunk *chunk = vm->heap; chunk != NULL;
+	     chunk = chunk->next) {
+		struct rs_hobject *span = NULL;
+		for (size_t i = 0; i < chunk->size; i++) {
+			struct rs_hobject *obj = &(chunk->objs[i]);
+			if (GC_FLAG_MARK_P(obj->flags)) {
+				GC_FLAG_MARK_CLEAR(obj->flags);
+				span = NULL;
+				continue;
+			}
+			if (GC_FLAG_ALLOC_P(obj->flags)) {
+				if (GC_FLAG_WATCH_P(obj->flags)) {
+					rs_srcloc_forget(obj);
+					rs_hashcons_forget(obj);
+				}
+				rs_hobject_release(obj);
+				obj->flags = 0;
+			}
+			if (span == NULL) {
+				span = obj;
+				span->val.span.next = NULL;
+				*tail = span;
+				tail = &span->val.span.next;
+			}
+			span->val.span.end = obj + 1;
+			vm->free_count++;
+		}
+	}
+
+	rs_source_sweep();
+}
+
+
+
+/**** Testing. ****/
+
+void rs_gc_test(void)
+{
+	/* Each structure is kept while the next is built, so collections happen
+	   with it in the heap. */
+	rs_eval_expect("(let ()"
+	               "  (define (nest f n)"
+	               "    (let loop ((n n) (x '()))"
+	               "      (if (= n 0) x (loop (- n 1) (f x)))))"
+	               "  (let* ((a (nest list 1000000)) (b (nest list 1000000))"
+	               "         (c (nest vector 1000000)) (d (nest vector 1000000)))"
+	               "    (list (equal? a b) (equal? c d)"
+	               "          (equal? a (nest list 999999)) (equal? a c))))",
+	               "(#t #t #f #f)");
+	rs_eval_expect("(let loop ((n 1000000) (f (lambda () 0)))"
+	               "  (if (= n 0)"
+	               "      (begin (make-vector 1000000 0) (procedure? f))"
+	               "      (loop (- n 1) (lambda () (f)))))",
+	               "#t");
+
+	/* The reader keeps what it has read on the GC stack. */
+	size_t n = 1000000;
+	char *src = malloc(2 * n);
+	if (src == NULL) {
+		rs_fatal("could not allocate test input:");
+	}
+	memset(src, '(', n);
+	memset(src + n, ')', n);
+	struct rs_port *in = rs_port_open_mem(src, 2 * n);
+	rs_object obj = rs_read(in);
+	rs_port_close(in);
+	free(src);
+	rs_gc_push(obj);
+	rs_object want = rs_eval_string("(let loop ((n 999999) (x '()))"
+	                                "  (if (= n 0) x (loop (- n 1) (list x))))");
+	if (!rs_equal_p(obj, want)) {
+		rs_fatal("deeply nested list was read wrong");
+	}
+	rs_gc_pop();
+
+	TRACE("passed");
 }
@@ -0,0 +1,434 @@
+#include "rescheme.h"
+
+#include <assert.h>
+#include <string.h>
+
+/* The hash-consing table holds every shared object, keyed on its structure:
+   strings and symbols on their characters, and pairs on the identity of their
+   car and cdr. Since a pair is only shared once its car and cdr have been,
+   comparing those by identity is the same as comparing them structurally, and
+   structurally identical trees all end up as the same object. Numbers on the
+   heap, vectors and bytevectors are never shared, so a pair holding one isn't
+   either, and nor is anything that holds that pair.
+
+   The table doesn't keep anything alive. Shared objects are watched by the
+   GC, which removes them from the table when they're collected.
+
+   The table uses open addressing with linear probing, and each entry caches
+   its object's hash, so growing the table and removing entries never need to
+   look at the objects. Each interpreter has a table of its own, which is only
+   touched with the interpreter's lock held, except by the GC, which runs with
+   every other thread stopped. Nothing is allocated with the lock held, in
+   case that starts a collection, so a new string or symbol is made after
+   looking for it, and then looked for again, in case another thread has put
+   one in in the meantime.
+*/
+
+struct rs_hashcons_entry {
+	rs_object obj;
+	unsigned long hash;
+};
+
+#define _HASHCONS_MIN_CAP 256
+
+
+static unsigned long rs_hashcons_hash_bytes(const char *s, size_t len,
+                                            unsigned long seed);
+static unsigned long rs_hashcons_hash_pair(rs_object car, rs_object cdr);
+static unsigned long rs_hashcons_hash_obj(struct rs_hobject *obj);
+static rs_object rs_hashcons_find_string(const char *data, size_t len,
+                                         unsigned long hash);
+static rs_object rs_hashcons_find_symbol(const char *name, unsigned long hash);
+static void rs_hashcons_insert(rs_object obj, unsigned long hash);
+static void rs_hashcons_grow(void);
+static int rs_hashcons_shareable_p(rs_object obj);
+
+/* Different seeds keep strings and symbols with the same characters apart. */
+#define _SEED_STRING 5381
+#define _SEED_SYMBOL 7919
+
+
+rs_object rs_hashcons_string(const char *data, size_t len, int slice)
+{
+	assert(data != NULL);
+
+	struct rs_vm *vm = rs_vm_current();
+	unsigned long hash = rs_hashcons_hash_bytes(data, len, _SEED_STRING);
+	pthread_mutex_lock(&vm->lock);
+	rs_object obj = rs_hashcons_find_string(data, len, hash);
+	pthread_mutex_unlock(&vm->lock);
+	if (obj != 0) {
+		return obj;
+	}
+
+	rs_object made = slice ? rs_string_create_slice(data, len)
+	                       : rs_string_create_n(data, len);
+	pthread_mutex_lock(&vm->lock);
+	obj = rs_hashcons_find_string(data, len, hash);
+	if (obj == 0) {
+		obj = made;
+		rs_hashcons_insert(obj, hash);
+	}
+	pthread_mutex_unlock(&vm->lock);
+	return obj;
+}
+
+
+rs_object rs_hashcons_symbol(const char *name)
+{
+	assert(name != NULL);
+
+	struct rs_vm *vm = rs_vm_current();
+	unsigned long hash = rs_hashcons_hash_bytes(name, strlen(name),
+	                                            _SEED_SYMBOL);
+	pthread_mutex_lock(&vm->lock);
+	rs_object obj = rs_hashcons_find_symbol(name, hash);
+	pthread_mutex_unlock(&vm->lock);
+	if (obj != 0) {
+		return obj;
+	}
+
+	rs_object made = rs_symbol_create(name);
+	pthread_mutex_lock(&vm->lock);
+	obj = rs_hashcons_find_symbol(name, hash);
+	if (obj == 0) {
+		obj = made;
+		rs_hashcons_insert(obj, hash);
+	}
+	pthread_mutex_unlock(&vm->lock);
+	return obj;
+}
+
+
+rs_object rs_hashcons_list(rs_object list)
+{
+	if (!rs_pair_p(list)) {
+		return list;
+	}
+
+	/* Gather up the pairs, so that they can be visited back to front. */
+	size_t n = 0, ncap = 16;
+	rs_pair **pairs = malloc(ncap * sizeof(rs_pair *));
+	if (pairs == NULL) {
+		rs_fatal("could not allocate list spine:");
+	}
+	rs_object rest = list;
+	while (rs_pair_p(rest) && !rs_hobject_shared_p(rs_obj_to_pair(rest))) {
+		if (n == ncap) {
+			ncap *= 2;
+			rs_pair **p = realloc(pairs, ncap * sizeof(rs_pair *));
+			if (p == NULL) {
+				rs_fatal("could not allocate list spine:");
+			}
+			pairs = p;
+		}
+		pairs[n++] = rs_obj_to_pair(rest);
+		rest = rs_pair_cdr(pairs[n - 1]);
+	}
+
+	/* Each pair is either replaced by an existing, identical one, or it
+	   becomes the shared copy itself. Either way, nothing is allocated, so
+	   the lock can be held throughout. */
+	struct rs_vm *vm = rs_vm_current();
+	pthread_mutex_lock(&vm->lock);
+	while (n-- > 0) {
+		rs_pair *pair = pairs[n];
+		rs_object car = rs_pair_car(pair);
+		if (!rs_hashcons_shareable_p(car) || !rs_hashcons_shareable_p(rest)) {
+			rs_pair_set_cdr(pair, rest);
+			rest = rs_pair_to_obj(pair);
+			continue;
+		}
+		unsigned long hash = rs_hashcons_hash_pair(car, rest);
+		rs_object found = 0;
+		struct rs_hashcons_entry *table = vm->hashcons;
+		size_t cap = vm->hashcons_cap;
+		if (vm->hashcons_count > 0) {
+			size_t i = hash & (cap - 1);
+			for (; table[i].obj != 0; i = (i + 1) & (cap - 1)) {
+				if (table[i].hash == hash && rs_pair_p(table[i].obj)) {
+					rs_pair *p = rs_obj_to_pair(table[i].obj);
+					if (rs_pair_car(p) == car && rs_pair_cdr(p) == rest) {
+						found = table[i].obj;
+						break;
+					}
+				}
+			}
+		}
+		if (found != 0) {
+			rest = found;
+		} else {
+			rs_pair_set_cdr(pair, rest);
+			rest = rs_pair_to_obj(pair);
+			rs_hashcons_insert(rest, hash);
+		}
+	}
+	pthread_mutex_unlock(&vm->lock);
+
+	free(pairs);
+	return rest;
+}
+
+
+void rs_hashcons_forget(struct rs_hobject *obj)
+{
+	assert(obj != NULL);
+
+	struct rs_vm *vm = rs_vm_current();
+	struct rs_hashcons_entry *table = vm->hashcons;
+	if (!rs_hobject_shared_p(obj) || vm->hashcons_count == 0) {
+		return;
+	}
+
+	size_t mask = vm->hashcons_cap - 1;
+	size_t i = rs_hashcons_hash_obj(obj) & mask;
+	while (table[i].obj != (rs_object)obj) {
+		assert(table[i].obj != 0);
+		i = (i + 1) & mask;
+	}
+
+	/* Shift later entries back into the hole (see objtab.c). */
+	size_t j = i;
+	for (;;) {
+		table[i].obj = 0;
+		size_t home;
+		do {
+			j = (j + 1) & mask;
+			if (table[j].obj == 0) {
+				vm->hashcons_count--;
+				return;
+			}
+			home = table[j].hash & mask;
+		} while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+		table[i] = table[j];
+		i = j;
+	}
+}
+
+
+void rs_hashcons_shutdown(void)
+{
+	struct rs_vm *vm = rs_vm_current();
+	free(vm->hashcons);
+	vm->hashcons = NULL;
+	vm->hashcons_cap = vm->hashcons_count = 0;
+}
+
+
+static unsigned long rs_hashcons_hash_bytes(const char *s, size_t len,
+                                            unsigned long seed)
+{
+	// DJB2 hash, as in symtab.c, followed by a final mix.
+	unsigned long h = seed;
+	for (size_t i = 0; i < len; i++) {
+		h = ((h << 5) + h) + (unsigned char)s[i];
+	}
+	return h ^ (h >> 16);
+}
+
+
+static unsigned long rs_hashcons_hash_pair(rs_object car, rs_object cdr)
+{
+	uint64_t h = (uint64_t)(unsigned long)car * UINT64_C(0x9e3779b97f4a7c15);
+	h ^= (uint64_t)(unsigned long)cdr + (h << 6) + (h >> 2);
+	h *= UINT64_C(0xff51afd7ed558ccd);
+	return (unsigned long)(h ^ (h >> 32));
+}
+
+
+static unsigned long rs_hashcons_hash_obj(struct rs_hobject *obj)
+{
+	rs_object o = (rs_object)obj;
+	if (rs_string_p(o)) {
+		return rs_hashcons_hash_bytes(rs_string_data(obj),
+		                              rs_string_length(obj), _SEED_STRING);
+	} else if (rs_symbol_p(o)) {
+		const char *name = rs_symbol_cstr(obj);
+		return rs_hashcons_hash_bytes(name, strlen(name), _SEED_SYMBOL);
+	} else {
+		assert(rs_pair_p(o));
+		return rs_hashcons_hash_pair(rs_pair_car(obj), rs_pair_cdr(obj));
+	}
+}
+
+
+static rs_object rs_hashcons_find_string(const char *data, size_t len,
+                                         unsigned long hash)
+{
+	struct rs_vm *vm = rs_vm_current();
+	struct rs_hashcons_entry *table = vm->hashcons;
+	size_t cap = vm->hashcons_cap;
+	if (vm->hashcons_count == 0) {
+		return 0;
+	}
+	size_t i = hash & (cap - 1);
+	for (; table[i].obj != 0; i = (i + 1) & (cap - 1)) {
+		if (table[i].hash == hash && rs_string_p(table[i].obj)) {
+			rs_string *s = rs_obj_to_string(table[i].obj);
+			if (rs_string_length(s) == len &&
+			    memcmp(rs_string_data(s), data, len) == 0) {
+				return table[i].obj;
+			}
+		}
+	}
+	return 0;
+}
+
+
+static rs_object rs_hashcons_find_symbol(const char *name, unsigned long hash)
+{
+	struct rs_vm *vm = rs_vm_current();
+	struct rs_hashcons_entry *table = vm->hashcons;
+	size_t cap = vm->hashcons_cap;
+	if (vm->hashcons_count == 0) {
+		return 0;
+	}
+	size_t i = hash & (cap - 1);
+	for (; table[i].obj != 0; i = (i + 1) & (cap - 1)) {
+		if (table[i].hash == hash && rs_symbol_p(table[i].obj) &&
+		    strcmp(rs_symbol_cstr(rs_obj_to_symbol(table[i].obj)),
+		           name) == 0) {
+			return table[i].obj;
+		}
+	}
+	return 0;
+}
+
+
+static void rs_hashcons_insert(rs_object obj, unsigned long hash)
+{
+	struct rs_vm *vm = rs_vm_current();
+	if (4 * (vm->hashcons_count + 1) > 3 * vm->hashcons_cap) {
+		rs_hashcons_grow();
+	}
+
+	struct rs_hashcons_entry *table = vm->hashcons;
+	size_t cap = vm->hashcons_cap;
+	size_t i = hash & (cap - 1);
+	while (table[i].obj != 0) {
+		i = (i + 1) & (cap - 1);
+	}
+	table[i].obj = obj;
+	table[i].hash = hash;
+	vm->hashcons_count++;
+
+	struct rs_hobject *h = (struct rs_hobject *)obj;
+	h->flags |= _HOBJECT_FLAG_SHARED;
+	rs_gc_watch(h);
+}
+
+
+static void rs_hashcons_grow(void)
+{
+	struct rs_vm *vm = rs_vm_current();
+	size_t old_cap = vm->hashcons_cap;
+	struct rs_hashcons_entry *old = vm->hashcons;
+
+	size_t cap = old_cap == 0 ? _HASHCONS_MIN_CAP : old_cap * 2;
+	struct rs_hashcons_entry *table = calloc(cap,
+	                                         sizeof(struct rs_hashcons_entry));
+	if (table == NULL) {
+		rs_fatal("could not grow hash-consing table:");
+	}
+	vm->hashcons = table;
+	vm->hashcons_cap = cap;
+
+	for (size_t i = 0; i < old_cap; i++) {
+		if (old[i].obj != 0) {
+			size_t j = old[i].hash & (cap - 1);
+			while (table[j].obj != 0) {
+				j = (j + 1) & (cap - 1);
+			}
+			table[j] = old[i];
+		}
+	}
+	free(old);
+}
+
+
+/* A pair can only be shared if its car and cdr are, since it's found by
+   their identity.
+*/
+static int rs_hashcons_shareable_p(rs_object obj)
+{
+	return !rs_heap_p(obj) || rs_hobject_shared_p((struct rs_hobject *)obj);
+}
+
+
+
+/**** Testing. ****/
+
+static rs_object rs_hashcons_test_read(const char *src)
+{
+	struct rs_port *in = rs_port_open_mem(src, strlen(src));
+	rs_port_share(in, 1);
+	rs_object obj = rs_read(in);
+	rs_port_close(in);
+	return obj;
+}
+
+
+/* Return the car and cdr of the pair at the front of obj, which holds two
+   parts that should be equal.
+*/
+static void rs_hashcons_test_halves(rs_object obj, rs_object *a, rs_object *b)
+{
+	assert(rs_pair_p(obj));
+	*a = rs_pair_car(rs_obj_to_pair(obj));
+	*b = rs_pair_car(rs_obj_to_pair(rs_pair_cdr(rs_obj_to_pair(obj))));
+}
+
+
+void rs_hashcons_test(void)
+{
+	/* Identical lists of strings, symbols and fixnums are the same object. */
+	rs_object a, b;
+	rs_hashcons_test_halves(rs_hashcons_test_read(
+		"((x \"s\" 1 (y)) (x \"s\" 1 (y)))"), &a, &b);
+	if (a != b || !rs_hobject_shared_p(rs_obj_to_pair(a))) {
+		rs_fatal("identical lists were not shared");
+	}
+
+	/* So are their common tails. */
+	rs_hashcons_test_halves(rs_hashcons_test_read("((p q r) (z q r))"),
+	                        &a, &b);
+	if (a == b || rs_pair_cdr(rs_obj_to_pair(a)) !=
+	              rs_pair_cdr(rs_obj_to_pair(b))) {
+		rs_fatal("common tails were not shared");
+	}
+
+#ifdef RS_NAN_BOXING
+	/* Flonums are immediate, like fixnums, so lists of them can be shared. */
+	rs_hashcons_test_halves(rs_hashcons_test_read("((1.5 x) (1.5 x))"),
+	                        &a, &b);
+	if (a != b) {
+		rs_fatal("identical lists of flonums were not shared");
+	}
+#endif
+
+	/* Lists holding objects that are never shared stay apart, and mutable,
+	   but are still equal. */
+	const char *unshared[] = {
+#ifndef RS_NAN_BOXING
+		"((1.5 x) (1.5 x))",
+		"(((x 1.5)) ((x 1.5)))",
+#endif
+		"((123456789012345678901234567890 x) "
+		"(123456789012345678901234567890 x))",
+		"((#(1) x) (#(1) x))",
+		"((#u8(1) x) (#u8(1) x))",
+		"((x . #(1)) (x . #(1)))",
+		"(((x #u8(1))) ((x #u8(1))))",
+	};
+	for (size_t i = 0; i < sizeof(unshared) / sizeof(unshared[0]); i++) {
+		rs_object obj = rs_hashcons_test_read(unshared[i]);
+		rs_gc_push(obj);
+		rs_hashcons_test_halves(obj, &a, &b);
+		if (a == b || rs_hobject_shared_p(rs_obj_to_pair(a)) ||
+		    !rs_equal_p(a, b)) {
+			rs_fatal("wrongly shared %s", unshared[i]);
+		}
+		rs_gc_pop();
+	}
+	TRACE("passed");
+}
@@ -0,0 +1,522 @@
+#include "rescheme.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Hash tables use open addressing with linear probing, like the object table
+   (see objtab.c), and each entry caches its key's hash, like the hash-consing
+   table (see hashcons.c), so that probing only compares keys whose hashes
+   match, and resizing never hashes a key again. That matters for equal?
+   tables, where hashing a key can mean walking a whole structure.
+
+   A table grows once it's three-quarters full, but not all at once: a new
+   array of entries, twice as big, replaces the old one, and each insertion or
+   removal after that moves a few of the old entries across, until they've all
+   been moved. Until then, lookups check the new array and then the old one.
+   That spreads the cost of the resize over many updates, so that no single
+   insertion has to copy the whole table. Old entries that have been moved or
+   removed are marked with rs_undefined, which is never a key, so that the old
+   array's probe sequences stay intact. Removal from the new array shifts
+   later entries back into the hole instead, as in objtab.c.
+
+   Objects never move (see gc.c), so eq? and eqv? keys can be hashed by their
+   addresses, and a table never has to be rehashed after a collection.
+*/
+
+#define _HASHTABLE_MIN_CAP 16
+
+/* A resize starts when the new array would be more than 3/4 full, which
+   leaves it at most 3/8 full. Moving 4 old entries per update empties the old
+   array after cap/8 updates, by which time the new one is at most half full,
+   so one resize always finishes before the next is needed.
+*/
+#define _HASHTABLE_MOVE_STEP 4
+
+#define _HASHTABLE_GONE rs_undefined
+
+/* How many pairs and vectors an equal? hash looks at. Beyond that, structures
+   that differ only deep inside share a hash, but cycles can't hang it.
+*/
+#define _HASH_BUDGET 64
+
+
+static struct rs_hashtable_entry *rs_hashtable_find(
+	struct rs_hashtable_entry *entries, size_t cap,
+	enum rs_hashtable_kind kind, rs_object key, unsigned long hash);
+static struct rs_hashtable_entry *rs_hashtable_lookup(struct rs_hashtable *t,
+                                                      rs_object key,
+                                                      unsigned long hash);
+static void rs_hashtable_insert(struct rs_hashtable *t, rs_object key,
+                                rs_object val, unsigned long hash);
+static void rs_hashtable_delete(struct rs_hashtable *t, size_t i);
+static void rs_hashtable_grow(struct rs_hashtable *t);
+static void rs_hashtable_move(struct rs_hashtable *t, size_t n);
+static rs_object rs_hashtable_list(rs_object table, int part);
+static int rs_hashtable_same(enum rs_hashtable_kind kind, rs_object a,
+                             rs_object b);
+
+static unsigned long rs_hash_mix(uint64_t h);
+static unsigned long rs_hash_bytes(const void *data, size_t len);
+static unsigned long rs_hash_eq(rs_object obj);
+static unsigned long rs_hash_eqv(rs_object obj);
+static unsigned long rs_hash_equal(rs_object obj, int *budget);
+
+
+rs_object rs_hashtable_create(enum rs_hashtable_kind kind)
+{
+	struct rs_hashtable *t = calloc(1, sizeof(struct rs_hashtable));
+	if (t == NULL) {
+		rs_fatal("could not create hash table:");
+	}
+	t->kind = kind;
+
+	rs_hashtable *table = rs_gc_alloc_hobject();
+	table->type = RS_HASHTABLE;
+	table->val.table = t;
+	return rs_hashtable_to_obj(table);
+}
+
+
+int rs_hashtable_get(rs_hashtable *table, rs_object key, rs_object *val)
+{
+	assert(rs_hashtable_p((rs_object)table));
+
+	struct rs_hashtable *t = table->val.table;
+	if (t->count == 0) {
+		return 0;
+	}
+	struct rs_hashtable_entry *e =
+		rs_hashtable_lookup(t, key, rs_hash(key, t->kind));
+	if (e == NULL) {
+		return 0;
+	}
+	if (val != NULL) {
+		*val = e->val;
+	}
+	return 1;
+}
+
+
+void rs_hashtable_put(rs_hashtable *table, rs_object key, rs_object val)
+{
+	assert(rs_hashtable_p((rs_object)table));
+	assert(key != 0 && key != _HASHTABLE_GONE);
+
+	struct rs_hashtable *t = table->val.table;
+	unsigned long hash = rs_hash(key, t->kind);
+	struct rs_hashtable_entry *e = rs_hashtable_lookup(t, key, hash);
+	if (e != NULL) {
+		e->val = val;
+		return;
+	}
+
+	if (4 * (t->used + 1) > 3 * t->cap) {
+		rs_hashtable_grow(t);
+	}
+	rs_hashtable_insert(t, key, val, hash);
+	t->count++;
+	rs_hashtable_move(t, _HASHTABLE_MOVE_STEP);
+}
+
+
+int rs_hashtable_remove(rs_hashtable *table, rs_object key)
+{
+	assert(rs_hashtable_p((rs_object)table));
+
+	struct rs_hashtable *t = table->val.table;
+	if (t->count == 0) {
+		return 0;
+	}
+	unsigned long hash = rs_hash(key, t->kind);
+	struct rs_hashtable_entry *e = NULL;
+	if (t->used > 0) {
+		e = rs_hashtable_find(t->entries, t->cap, t->kind, key, hash);
+	}
+	if (e != NULL) {
+		rs_hashtable_delete(t, (size_t)(e - t->entries));
+	} else if (t->old != NULL &&
+	           (e = rs_hashtable_find(t->old, t->old_cap, t->kind, key,
+	                                  hash)) != NULL) {
+		e->key = _HASHTABLE_GONE;
+		e->val = rs_unspecified;
+	} else {
+		return 0;
+	}
+	t->count--;
+	rs_hashtable_move(t, _HASHTABLE_MOVE_STEP);
+	return 1;
+}
+
+
+void rs_hashtable_clear(rs_hashtable *table)
+{
+	assert(rs_hashtable_p((rs_object)table));
+
+	struct rs_hashtable *t = table->val.table;
+	free(t->entries);
+	free(t->old);
+	enum rs_hashtable_kind kind = t->kind;
+	memset(t, 0, sizeof(struct rs_hashtable));
+	t->kind = kind;
+}
+
+
+void rs_hashtable_release(rs_hashtable *table)
+{
+	assert(rs_hashtable_p((rs_object)table));
+
+	struct rs_hashtable *t = table->val.table;
+	free(t->entries);
+	free(t->old);
+	free(t);
+}
+
+
+rs_object rs_hashtable_keys(rs_object table)
+{
+	return rs_hashtable_list(table, 'k');
+}
+
+
+rs_object rs_hashtable_values(rs_object table)
+{
+	return rs_hashtable_list(table, 'v');
+}
+
+
+rs_object rs_hashtable_to_alist(rs_object table)
+{
+	return rs_hashtable_list(table, 'a');
+}
+
+
+unsigned long rs_hash(rs_object obj, enum rs_hashtable_kind kind)
+{
+	int budget = _HASH_BUDGET;
+	switch (kind) {
+	case RS_HASH_EQ:
+		return rs_hash_eq(obj);
+	case RS_HASH_EQV:
+		return rs_hash_eqv(obj);
+	default:
+		return rs_hash_equal(obj, &budget);
+	}
+}
+
+
+/* Find key's entry in an array of entries, or return NULL. */
+static struct rs_hashtable_entry *rs_hashtable_find(
+	struct rs_hashtable_entry *entries, size_t cap,
+	enum rs_hashtable_kind kind, rs_object key, unsigned long hash)
+{
+	for (size_t i = hash & (cap - 1); entries[i].key != 0;
+	     i = (i + 1) & (cap - 1)) {
+		struct rs_hashtable_entry *e = &entries[i];
+		if (e->hash == hash && e->key != _HASHTABLE_GONE &&
+		    rs_hashtable_same(kind, e->key, key)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+
+/* Find key's entry in either array, or return NULL. */
+static struct rs_hashtable_entry *rs_hashtable_lookup(struct rs_hashtable *t,
+                                                      rs_object key,
+                                                      unsigned long hash)
+{
+	struct rs_hashtable_entry *e = NULL;
+	if (t->used > 0) {
+		e = rs_hashtable_find(t->entries, t->cap, t->kind, key, hash);
+	}
+	if (e == NULL && t->old != NULL) {
+		e = rs_hashtable_find(t->old, t->old_cap, t->kind, key, hash);
+	}
+	return e;
+}
+
+
+/* Add an entry for a key that isn't in the table to the new array. */
+static void rs_hashtable_insert(struct rs_hashtable *t, rs_object key,
+                                rs_object val, unsigned long hash)
+{
+	assert(4 * (t->used + 1) <= 3 * t->cap);
+
+	size_t i = hash & (t->cap - 1);
+	while (t->entries[i].key != 0) {
+		i = (i + 1) & (t->cap - 1);
+	}
+	t->entries[i].key = key;
+	t->entries[i].val = val;
+	t->entries[i].hash = hash;
+	t->used++;
+}
+
+
+/* Empty entry i of the new array, and move entries after it back into the
+   hole if their home slot doesn't lie (cyclically) between the hole and their
+   current position.
+*/
+static void rs_hashtable_delete(struct rs_hashtable *t, size_t i)
+{
+	size_t mask = t->cap - 1;
+	size_t j = i;
+	for (;;) {
+		t->entries[i].key = 0;
+		size_t home;
+		do {
+			j = (j + 1) & mask;
+			if (t->entries[j].key == 0) {
+				t->used--;
+				return;
+			}
+			home = t->entries[j].hash & mask;
+		} while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+		t->entries[i] = t->entries[j];
+		i = j;
+	}
+}
+
+
+/* Start a resize. If the last one hasn't finished (which only happens if
+   there are more inserts than _HASHTABLE_MOVE_STEP allows for), finish it
+   first.
+*/
+static void rs_hashtable_grow(struct rs_hashtable *t)
+{
+	if (t->old != NULL) {
+		rs_hashtable_move(t, t->old_cap);
+		if (4 * (t->used + 1) <= 3 * t->cap) {
+			return;
+		}
+	}
+
+	size_t cap = t->cap == 0 ? _HASHTABLE_MIN_CAP : t->cap * 2;
+	struct rs_hashtable_entry *entries =
+		calloc(cap, sizeof(struct rs_hashtable_entry));
+	if (entries == NULL) {
+		rs_fatal("could not grow hash table:");
+	}
+
+	if (t->used > 0) {
+		t->old = t->entries;
+		t->old_cap = t->cap;
+		t->moved = 0;
+	} else {
+		free(t->entries);
+	}
+	t->entries = entries;
+	t->cap = cap;
+	t->used = 0;
+}
+
+
+/* Move up to n entries from the old array to the new one. */
+static void rs_hashtable_move(struct rs_hashtable *t, size_t n)
+{
+	if (t->old == NULL) {
+		return;
+	}
+	for (; n > 0 && t->moved < t->old_cap; n--, t->moved++) {
+		struct rs_hashtable_entry *e = &t->old[t->moved];
+		if (e->key != 0 && e->key != _HASHTABLE_GONE) {
+			rs_hashtable_insert(t, e->key, e->val, e->hash);
+			e->key = _HASHTABLE_GONE;
+			e->val = rs_unspecified;
+		}
+	}
+	if (t->moved == t->old_cap) {
+		free(t->old);
+		t->old = NULL;
+		t->old_cap = 0;
+	}
+}
+
+
+/* Make a list of a table's keys (if part is 'k'), values ('v'), or entries
+   ('a').
+*/
+static rs_object rs_hashtable_list(rs_object table, int part)
+{
+	struct rs_hashtable *t = rs_obj_to_hashtable(table)->val.table;
+	rs_object list = rs_null;
+	rs_gc_push(table);
+	rs_gc_push(list);
+
+	for (int pass = 0; pass < 2; pass++) {
+		struct rs_hashtable_entry *entries = pass == 0 ? t->entries : t->old;
+		size_t cap = pass == 0 ? t->cap : t->old_cap;
+		for (size_t i = 0; i < cap; i++) {
+			struct rs_hashtable_entry *e = &entries[i];
+			if (e->key == 0 || e->key == _HASHTABLE_GONE) {
+				continue;
+			}
+			rs_object item = part == 'k' ? e->key :
+			                 part == 'v' ? e->val :
+			                 rs_pair_create(e->key, e->val);
+			list = rs_pair_create(item, list);
+			rs_gc_pop();
+			rs_gc_push(list);
+		}
+	}
+
+	rs_gc_pop();
+	rs_gc_pop();
+	return list;
+}
+
+
+/* String tables only ever get strings as keys (the primitives check), so
+   comparing them with equal? is the same as with string=?.
+*/
+static int rs_hashtable_same(enum rs_hashtable_kind kind, rs_object a,
+                             rs_object b)
+{
+	switch (kind) {
+	case RS_HASH_EQ:
+		return rs_primitive_eq(a, b);
+	case RS_HASH_EQV:
+		return rs_primitive_eqv(a, b);
+	default:
+		return rs_equal_p(a, b);
+	}
+}
+
+
+/* Probing uses the low bits of a hash, so every input bit should affect
+   them. This is the finalizer from MurmurHash3.
+*/
+static unsigned long rs_hash_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= UINT64_C(0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	h *= UINT64_C(0xc4ceb9fe1a85ec53);
+	h ^= h >> 33;
+	return (unsigned long)h;
+}
+
+
+static unsigned long rs_hash_bytes(const void *data, size_t len)
+{
+	// DJB2 hash, as in symtab.c, followed by a final mix.
+	const unsigned char *s = data;
+	uint64_t h = 5381;
+	for (size_t i = 0; i < len; i++) {
+		h = ((h << 5) + h) + s[i];
+	}
+	return rs_hash_mix(h);
+}
+
+
+/* Symbols with the same name can be different objects, but their names are
+   interned (see rs_primitive_eq()), so hash the name's address instead.
+*/
+static unsigned long rs_hash_eq(rs_object obj)
+{
+	if (rs_symbol_p(obj)) {
+		return rs_hash_mix((uint64_t)(uintptr_t)
+		                   rs_symbol_cstr(rs_obj_to_symbol(obj)));
+	}
+	return rs_hash_mix((uint64_t)(unsigned long)obj);
+}
+
+
+static unsigned long rs_hash_eqv(rs_object obj)
+{
+	if (rs_flonum_p(obj)) {
+		double x = rs_flonum_value(obj);
+		uint64_t bits;
+		memcpy(&bits, &x, sizeof(bits));
+		return rs_hash_mix(bits);
+	}
+	if (rs_bignum_p(obj)) {
+		const uint32_t *digits;
+		int neg;
+		size_t len = rs_bignum_digits(rs_obj_to_bignum(obj), &digits, &neg);
+		return rs_hash_bytes(digits, len * sizeof(uint32_t)) ^ (unsigned)neg;
+	}
+	return rs_hash_eq(obj);
+}
+
+
+/* Structures are hashed on their first _HASH_BUDGET pairs and vectors, in
+   the order equal? compares them.
+*/
+static unsigned long rs_hash_equal(rs_object obj, int *budget)
+{
+	uint64_t h = 0;
+	for (;;) {
+		if (*budget <= 0) {
+			return rs_hash_mix(h);
+		}
+		if (rs_pair_p(obj)) {
+			(*budget)--;
+			rs_pair *pair = rs_obj_to_pair(obj);
+			h = h * 31 + rs_hash_equal(rs_pair_car(pair), budget);
+			obj = rs_pair_cdr(pair);
+		} else if (rs_vector_p(obj)) {
+			(*budget)--;
+			rs_vector *vec = rs_obj_to_vector(obj);
+			h = h * 31 + rs_vector_length(vec);
+			for (size_t i = 0; i < rs_vector_length(vec) && *budget > 0; i++) {
+				h = h * 31 + rs_hash_equal(rs_vector_ref(vec, i), budget);
+			}
+			return rs_hash_mix(h);
+		} else if (rs_string_p(obj)) {
+			rs_string *str = rs_obj_to_string(obj);
+			return rs_hash_mix(h * 31 + rs_hash_bytes(rs_string_data(str),
+			                                          rs_string_length(str)));
+		} else if (rs_bytevector_p(obj)) {
+			rs_bytevector *bv = rs_obj_to_bytevector(obj);
+			return rs_hash_mix(h * 31 + rs_hash_bytes(rs_bytevector_data(bv),
+			                                          rs_bytevector_length(bv)));
+		} else {
+			return rs_hash_mix(h * 31 + rs_hash_eqv(obj));
+		}
+	}
+}
+
+
+void rs_hashtable_test(void)
+{
+	rs_object obj = rs_hashtable_create(RS_HASH_EQV);
+	rs_gc_push(obj);
+	rs_hashtable *table = rs_obj_to_hashtable(obj);
+
+	// Enough keys for several resizes, checking as they're added.
+	for (long i = 0; i < 5000; i++) {
+		rs_hashtable_put(table, rs_fixnum_to_obj(i), rs_fixnum_to_obj(-i));
+		rs_object val;
+		if (!rs_hashtable_get(table, rs_fixnum_to_obj(i / 2), &val) ||
+		    val != rs_fixnum_to_obj(-(i / 2))) {
+			rs_fatal("lost key %ld after adding %ld", i / 2, i);
+		}
+	}
+	assert(rs_hashtable_count(table) == 5000);
+
+	// Remove every other key, and make sure the rest can still be found.
+	for (long i = 0; i < 5000; i += 2) {
+		if (!rs_hashtable_remove(table, rs_fixnum_to_obj(i))) {
+			rs_fatal("could not remove key %ld", i);
+		}
+	}
+	for (long i = 0; i < 5000; i++) {
+		rs_object val = 0;
+		int found = rs_hashtable_get(table, rs_fixnum_to_obj(i), &val);
+		if (found != (i % 2 == 1) ||
+		    (found && val != rs_fixnum_to_obj(-i))) {
+			rs_fatal("wrong entry for key %ld", i);
+		}
+	}
+	assert(rs_hashtable_count(table) == 2500);
+
+	rs_hashtable_clear(table);
+	assert(rs_hashtable_count(table) == 0);
+	assert(!rs_hashtable_get(table, rs_fixnum_to_obj(1), NULL));
+
+	rs_gc_pop();
+	TRACE("passed");
+}
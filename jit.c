@@ -0,0 +1,1249 @@
+/* For MAP_ANONYMOUS. */
+#define _DEFAULT_SOURCE
+#include "rescheme.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A baseline compiler from bytecode to x86-64 machine code, for procedures the
+   VM finds itself calling often (see rs_vm_run()). Each instruction becomes a
+   fixed template that works on the VM's own stacks, with sp in rbx, fp in r12,
+   and the procedure's free variables in r14, so that the native code and the
+   interpreter can take turns running the same frame.
+
+   Native code does the common cases of the open-coded instructions inline:
+   fixnum and flonum arithmetic and comparisons, car and cdr, and the type
+   predicates, and calls the primitive for the rest, like the interpreter does.
+   Calls and returns between compiled procedures push and pop the VM's control
+   stack as usual, but jump straight to native code. Anything else, such as a
+   call to a procedure that hasn't been compiled, or a redefined primitive,
+   leaves the native code, and hands the address of the instruction to the
+   interpreter. The interpreter goes back into native code when a call
+   returns into it, or the procedure is called again.
+*/
+
+#ifdef _JIT_SUPPORTED
+#include <sys/mman.h>
+#include <unistd.h>
+
+typedef union rs_insn *(*rs_jit_entry)(rs_object **sp, rs_object **fp,
+                                       const void *at);
+
+struct rs_jit_code {
+	unsigned char *mem;    // mapped read-only and executable
+	size_t size;
+	uint32_t *entries;     // native offset of each instruction, or 0
+	rs_jit_entry enter;
+	const void *start;     // where native calls go
+};
+
+enum {
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+/* Registers that hold the VM's state. They're all callee-saved, so they
+   survive calls to C.
+*/
+#define SP RBX
+#define FP R12
+#define SPP R13
+#define FREE R14
+#define FPP R15
+
+/* SPP points at the sp field of the thread's mutator (see struct rs_mutator),
+   so the rest of the mutator is found by its offset from there.
+*/
+#define MUTATOR(field) \
+	((long)offsetof(struct rs_mutator, field) - \
+	 (long)offsetof(struct rs_mutator, sp))
+
+/* Condition codes. The opposite of each is itself with the low bit flipped. */
+enum { CC_O = 0x0, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_P = 0xa,
+       CC_L = 0xc, CC_GE = 0xd, CC_LE = 0xe, CC_G = 0xf };
+
+/* SSE2 instructions, after their 0x0f. */
+enum { SSE_MOVSD = 0x10, SSE_UCOMISD = 0x2e, SSE_MULSD = 0x59,
+       SSE_ADDSD = 0x58, SSE_SUBSD = 0x5c, SSE_MOVQ_TO = 0x6e,
+       SSE_MOVQ_FROM = 0x7e, SSE_CMPSD = 0xc2 };
+
+/* Arithmetic instructions, by their "op r/m, reg" opcodes. The same operation
+   on an immediate is opcode 0x81 or 0x83, with the top five bits as its
+   extension.
+*/
+enum { ALU_ADD = 0x01, ALU_OR = 0x09, ALU_AND = 0x21, ALU_SUB = 0x29,
+       ALU_XOR = 0x31, ALU_CMP = 0x39 };
+
+#define W 8
+
+struct jit_fixup {
+	size_t at;             // where the rel32 is
+	long label;
+};
+
+struct jit_state {
+	struct rs_code *code;
+	long *ops;             // each instruction's opcode, or -1 for operands
+	char *targets;         // true if an instruction is jumped to
+	char *exits;           // true if an instruction has an exit stub
+	unsigned char *buf;
+	size_t len;
+	size_t cap;
+	long *labels;          // native offsets, or -1 if not yet placed
+	long nlabels;
+	long caplabels;
+	long grow;             // a procedure's frame needs a new stack segment
+	struct jit_fixup *fixups;
+	size_t nfixups;
+	size_t capfixups;
+};
+
+/* Labels 0 to ninsns - 1 are the instructions themselves, and the next ninsns
+   are their exit stubs. Any others are local to a template.
+*/
+#define INSN(j, i) (i)
+#define EXIT(j, i) ((j)->exits[i] = 1, (long)(j)->code->ninsns + (i))
+
+static const int operand_count[] = {
+#define _RS_OPCODE_OPERANDS(op, n) n,
+	RS_OPCODES(_RS_OPCODE_OPERANDS)
+#undef _RS_OPCODE_OPERANDS
+};
+
+
+static void emit(struct jit_state *j, int byte)
+{
+	if (j->len == j->cap) {
+		j->cap = j->cap == 0 ? 1024 : j->cap * 2;
+		unsigned char *b = realloc(j->buf, j->cap);
+		if (b == NULL) {
+			rs_fatal("could not grow native code buffer:");
+		}
+		j->buf = b;
+	}
+	j->buf[j->len++] = (unsigned char)byte;
+}
+
+
+static void emit32(struct jit_state *j, long v)
+{
+	for (int i = 0; i < 4; i++) {
+		emit(j, (int)((unsigned long)v >> (8 * i)) & 0xff);
+	}
+}
+
+
+static void emit64(struct jit_state *j, long v)
+{
+	for (int i = 0; i < 8; i++) {
+		emit(j, (int)((unsigned long)v >> (8 * i)) & 0xff);
+	}
+}
+
+
+static int fits8(long v)
+{
+	return v >= -128 && v < 128;
+}
+
+
+static int fits32(long v)
+{
+	return v >= INT32_MIN && v <= INT32_MAX;
+}
+
+
+/** Labels **/
+
+static long new_label(struct jit_state *j)
+{
+	if (j->nlabels == j->caplabels) {
+		j->caplabels *= 2;
+		long *l = realloc(j->labels, j->caplabels * sizeof(long));
+		if (l == NULL) {
+			rs_fatal("could not grow native code labels:");
+		}
+		j->labels = l;
+	}
+	j->labels[j->nlabels] = -1;
+	return j->nlabels++;
+}
+
+
+static void bind(struct jit_state *j, long label)
+{
+	assert(j->labels[label] == -1);
+	j->labels[label] = (long)j->len;
+}
+
+
+/* Emit a rel32 that will point at label, once everything is placed. */
+static void emit_rel(struct jit_state *j, long label)
+{
+	if (j->nfixups == j->capfixups) {
+		j->capfixups = j->capfixups == 0 ? 64 : j->capfixups * 2;
+		struct jit_fixup *f = realloc(j->fixups,
+		                              j->capfixups * sizeof(struct jit_fixup));
+		if (f == NULL) {
+			rs_fatal("could not grow native code fixups:");
+		}
+		j->fixups = f;
+	}
+	j->fixups[j->nfixups].at = j->len;
+	j->fixups[j->nfixups].label = label;
+	j->nfixups++;
+	emit32(j, 0);
+}
+
+
+/** Instruction encoding **/
+
+static void rex(struct jit_state *j, int w, int reg, int rm)
+{
+	int r = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+	if (r != 0x40) {
+		emit(j, r);
+	}
+}
+
+
+static void modrm_reg(struct jit_state *j, int reg, int rm)
+{
+	emit(j, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+
+/* [base + disp]. rsp and r12 need a SIB byte as a base, and rbp and r13 can't
+   do without a displacement.
+*/
+static void modrm_mem(struct jit_state *j, int reg, int base, long disp)
+{
+	int mod = (disp == 0 && (base & 7) != RBP) ? 0 : fits8(disp) ? 1 : 2;
+	emit(j, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+	if ((base & 7) == RSP) {
+		emit(j, 0x24);
+	}
+	if (mod == 1) {
+		emit(j, (int)(disp & 0xff));
+	} else if (mod == 2) {
+		emit32(j, disp);
+	}
+}
+
+
+/* mov dst, [base + disp] */
+static void emit_load(struct jit_state *j, int dst, int base, long disp)
+{
+	rex(j, 1, dst, base);
+	emit(j, 0x8b);
+	modrm_mem(j, dst, base, disp);
+}
+
+
+/* mov [base + disp], src */
+static void emit_store(struct jit_state *j, int base, long disp, int src)
+{
+	rex(j, 1, src, base);
+	emit(j, 0x89);
+	modrm_mem(j, src, base, disp);
+}
+
+
+/* mov qword [base + disp], imm */
+static void emit_store_imm(struct jit_state *j, int base, long disp, long imm)
+{
+	assert(fits32(imm));
+	rex(j, 1, 0, base);
+	emit(j, 0xc7);
+	modrm_mem(j, 0, base, disp);
+	emit32(j, imm);
+}
+
+
+/* mov dst, src */
+static void emit_mov(struct jit_state *j, int dst, int src)
+{
+	rex(j, 1, src, dst);
+	emit(j, 0x89);
+	modrm_reg(j, src, dst);
+}
+
+
+/* mov dst, imm */
+static void emit_mov_imm(struct jit_state *j, int dst, long imm)
+{
+	if (fits32(imm)) {
+		rex(j, 1, 0, dst);
+		emit(j, 0xc7);
+		modrm_reg(j, 0, dst);
+		emit32(j, imm);
+	} else {
+		rex(j, 1, 0, dst);
+		emit(j, 0xb8 + (dst & 7));
+		emit64(j, imm);
+	}
+}
+
+
+/* lea dst, [base + disp]. Unlike add and sub, it leaves the flags alone. */
+static void emit_lea(struct jit_state *j, int dst, int base, long disp)
+{
+	rex(j, 1, dst, base);
+	emit(j, 0x8d);
+	modrm_mem(j, dst, base, disp);
+}
+
+
+/* op dst, src */
+static void emit_alu(struct jit_state *j, int op, int dst, int src)
+{
+	rex(j, 1, src, dst);
+	emit(j, op);
+	modrm_reg(j, src, dst);
+}
+
+
+/* op dst, imm */
+static void emit_alu_imm(struct jit_state *j, int op, int dst, long imm)
+{
+	assert(fits32(imm));
+	rex(j, 1, 0, dst);
+	emit(j, fits8(imm) ? 0x83 : 0x81);
+	modrm_reg(j, op >> 3, dst);
+	if (fits8(imm)) {
+		emit(j, (int)(imm & 0xff));
+	} else {
+		emit32(j, imm);
+	}
+}
+
+
+/* cmp qword [base + disp], imm, or cmp dword if wide is false. */
+static void emit_cmp_mem_imm(struct jit_state *j, int wide, int base, long disp,
+                             long imm)
+{
+	assert(fits32(imm));
+	rex(j, wide, 0, base);
+	emit(j, fits8(imm) ? 0x83 : 0x81);
+	modrm_mem(j, ALU_CMP >> 3, base, disp);
+	if (fits8(imm)) {
+		emit(j, (int)(imm & 0xff));
+	} else {
+		emit32(j, imm);
+	}
+}
+
+
+/* test reg, imm */
+static void emit_test_imm(struct jit_state *j, int reg, long imm)
+{
+	rex(j, 1, 0, reg);
+	emit(j, 0xf7);
+	modrm_reg(j, 0, reg);
+	emit32(j, imm);
+}
+
+
+/* imul dst, src */
+static void emit_imul(struct jit_state *j, int dst, int src)
+{
+	rex(j, 1, dst, src);
+	emit(j, 0x0f);
+	emit(j, 0xaf);
+	modrm_reg(j, dst, src);
+}
+
+
+/* sar reg, n */
+static void emit_sar(struct jit_state *j, int reg, int n)
+{
+	rex(j, 1, 0, reg);
+	emit(j, 0xc1);
+	modrm_reg(j, 7, reg);
+	emit(j, n);
+}
+
+
+/* cmovcc dst, src */
+static void emit_cmov(struct jit_state *j, int cc, int dst, int src)
+{
+	rex(j, 1, dst, src);
+	emit(j, 0x0f);
+	emit(j, 0x40 + cc);
+	modrm_reg(j, dst, src);
+}
+
+
+static void emit_jcc(struct jit_state *j, int cc, long label)
+{
+	emit(j, 0x0f);
+	emit(j, 0x80 + cc);
+	emit_rel(j, label);
+}
+
+
+static void emit_jmp(struct jit_state *j, long label)
+{
+	emit(j, 0xe9);
+	emit_rel(j, label);
+}
+
+
+static void emit_call(struct jit_state *j, long addr)
+{
+	emit_mov_imm(j, RAX, addr);
+	emit(j, 0xff);
+	modrm_reg(j, 2, RAX);
+}
+
+
+/* test a, b */
+static void emit_test(struct jit_state *j, int a, int b)
+{
+	rex(j, 1, b, a);
+	emit(j, 0x85);
+	modrm_reg(j, b, a);
+}
+
+
+/* An SSE2 instruction on xmm and a general register or another xmm. */
+static void emit_sse(struct jit_state *j, int prefix, int op, int xmm, int rm,
+                     int w)
+{
+	emit(j, prefix);
+	rex(j, w, xmm, rm);
+	emit(j, 0x0f);
+	emit(j, op);
+	modrm_reg(j, xmm, rm);
+}
+
+
+/* jmp reg */
+static void emit_jmp_reg(struct jit_state *j, int reg)
+{
+	rex(j, 0, 0, reg);
+	emit(j, 0xff);
+	modrm_reg(j, 4, reg);
+}
+
+
+/* lea reg, [rip + label] */
+static void emit_lea_label(struct jit_state *j, int reg, long label)
+{
+	rex(j, 1, reg, 0);
+	emit(j, 0x8d);
+	emit(j, ((reg & 7) << 3) | RBP);
+	emit_rel(j, label);
+}
+
+
+static void emit_push(struct jit_state *j, int reg)
+{
+	rex(j, 0, 0, reg);
+	emit(j, 0x50 + (reg & 7));
+}
+
+
+static void emit_pop(struct jit_state *j, int reg)
+{
+	rex(j, 0, 0, reg);
+	emit(j, 0x58 + (reg & 7));
+}
+
+
+/** Templates **/
+
+#define TYPE_OFFSET offsetof(struct rs_hobject, type)
+
+/* Push reg onto the VM's stack. */
+static void push_value(struct jit_state *j, int reg)
+{
+	emit_store(j, SP, 0, reg);
+	emit_alu_imm(j, ALU_ADD, SP, W);
+}
+
+
+/* Make the VM's copy of sp current, before calling anything that can
+   allocate, like SYNC in vm.c.
+*/
+static void sync_sp(struct jit_state *j)
+{
+	emit_store(j, SPP, 0, SP);
+}
+
+
+/* Leave the native code, and let the interpreter do instruction i. */
+static void exit_to_vm(struct jit_state *j, long i)
+{
+	emit_jmp(j, EXIT(j, i));
+}
+
+
+/* Jump to fail if reg isn't a tagged word. Uses rsi. */
+static void check_tagged(struct jit_state *j, int reg, long fail)
+{
+#ifdef RS_NAN_BOXING
+	/* Tagged words are in [-2^50, 2^50), so their top 14 bits are all the
+	   same. */
+	assert(_NAN_BOX_RANGE == 1UL << 50);
+	emit_mov(j, RSI, reg);
+	emit_sar(j, RSI, 50);
+	emit_alu_imm(j, ALU_ADD, RSI, 1);
+	emit_alu_imm(j, ALU_CMP, RSI, 1);
+	emit_jcc(j, CC_A, fail);
+#else
+	(void) j;
+	(void) reg;
+	(void) fail;
+#endif
+}
+
+
+/* Jump to fail unless reg is a heap object of the given type. Uses rsi. */
+static void check_type(struct jit_state *j, int reg, int type, long fail)
+{
+	assert(sizeof(enum rs_hobject_type) == 4);
+	emit_test_imm(j, reg, _TAG_MASK);
+	emit_jcc(j, CC_NE, fail);
+	check_tagged(j, reg, fail);
+	emit_cmp_mem_imm(j, 0, reg, TYPE_OFFSET, type);
+	emit_jcc(j, CC_NE, fail);
+}
+
+
+/* Jump to fail unless a and b are both fixnums. Uses rdx and rsi. */
+static void check_fixnums(struct jit_state *j, int a, int b, long fail)
+{
+	emit_mov(j, RDX, a);
+	emit_alu_imm(j, ALU_XOR, RDX, _FIXNUM_TAG);
+	emit_mov(j, RSI, b);
+	emit_alu_imm(j, ALU_XOR, RSI, _FIXNUM_TAG);
+	emit_alu(j, ALU_OR, RDX, RSI);
+	emit_test_imm(j, RDX, _TAG_MASK);
+	emit_jcc(j, CC_NE, fail);
+	check_tagged(j, a, fail);
+	check_tagged(j, b, fail);
+}
+
+
+/* Jump to fail unless reg is in the fixnum range. Uses rsi. */
+static void check_fixnum_range(struct jit_state *j, int reg, long fail)
+{
+	emit_mov_imm(j, RSI, _FIXNUM_OBJ_MIN);
+	emit_alu(j, ALU_CMP, reg, RSI);
+	emit_jcc(j, CC_L, fail);
+	emit_mov_imm(j, RSI, _FIXNUM_OBJ_MAX);
+	emit_alu(j, ALU_CMP, reg, RSI);
+	emit_jcc(j, CC_G, fail);
+}
+
+
+/* Leave unless the global in an open-coded instruction's first operand still
+   holds the primitive in its second, like PRIM_GUARD in vm.c.
+*/
+static void guard_primitive(struct jit_state *j, long i)
+{
+	union rs_insn *insns = j->code->insns;
+	emit_mov_imm(j, RAX, insns[i + 1].obj);
+	emit_load(j, RAX, RAX, offsetof(struct rs_hobject, val.sym.value));
+	emit_mov_imm(j, RCX, insns[i + 2].obj);
+	emit_alu(j, ALU_CMP, RAX, RCX);
+	emit_jcc(j, CC_NE, EXIT(j, i));
+}
+
+
+/* Give the instruction at i, which pops npop values, the boolean result of
+   condition cc. If a JUMP_FALSE comes straight after, and nothing else jumps
+   to it, just jump on the condition instead. Return how many instructions
+   were done.
+*/
+static long boolean_result(struct jit_state *j, long i, int cc, int npop)
+{
+	long next = i + 3;
+	if (next < (long)j->code->ninsns && j->ops[next] == OP_JUMP_FALSE &&
+	    !j->targets[next]) {
+		long target = next + 1 + j->code->insns[next + 1].n;
+		emit_lea(j, SP, SP, -npop * W);
+		emit_jcc(j, cc ^ 1, INSN(j, target));
+		return 2;
+	}
+	emit_mov_imm(j, RDX, rs_false);
+	emit_mov_imm(j, RSI, rs_true);
+	emit_cmov(j, cc, RDX, RSI);
+	emit_lea(j, SP, SP, -(npop - 1) * W);
+	emit_store(j, SP, -W, RDX);
+	return 1;
+}
+
+
+/* Load the two arguments of a binary instruction into rax and rcx, jumping to
+   slow unless they're fixnums.
+*/
+static void fixnum_args(struct jit_state *j, long i, long slow)
+{
+	guard_primitive(j, i);
+	emit_load(j, RAX, SP, -2 * W);
+	emit_load(j, RCX, SP, -W);
+	check_fixnums(j, RAX, RCX, slow);
+}
+
+
+/* Unbox the flonums in rax and rcx into xmm0 and xmm1, jumping to slow unless
+   they're both flonums. Uses rdx, rsi and r8.
+*/
+static void flonum_args(struct jit_state *j, long slow)
+{
+#ifdef RS_NAN_BOXING
+	long fail = new_label(j), ok = new_label(j);
+	check_tagged(j, RAX, ok);
+	emit_jmp(j, fail);
+	bind(j, ok);
+	ok = new_label(j);
+	check_tagged(j, RCX, ok);
+	bind(j, fail);
+	emit_jmp(j, slow);
+	bind(j, ok);
+	emit_mov_imm(j, RDX, _NAN_BOX_OFFSET);
+	emit_mov(j, R8, RAX);
+	emit_alu(j, ALU_SUB, R8, RDX);
+	emit_sse(j, 0x66, SSE_MOVQ_TO, 0, R8, 1);
+	emit_mov(j, R8, RCX);
+	emit_alu(j, ALU_SUB, R8, RDX);
+	emit_sse(j, 0x66, SSE_MOVQ_TO, 1, R8, 1);
+#else
+	check_type(j, RAX, RS_FLONUM, slow);
+	check_type(j, RCX, RS_FLONUM, slow);
+	emit(j, 0xf2);
+	emit(j, 0x0f);
+	emit(j, SSE_MOVSD);
+	modrm_mem(j, 0, RAX, offsetof(struct rs_hobject, val.flo));
+	emit(j, 0xf2);
+	emit(j, 0x0f);
+	emit(j, SSE_MOVSD);
+	modrm_mem(j, 1, RCX, offsetof(struct rs_hobject, val.flo));
+#endif
+}
+
+
+/* Box the double in xmm0 into rax, like rs_flonum_create(). */
+static void flonum_result(struct jit_state *j)
+{
+#ifdef RS_NAN_BOXING
+	emit_sse(j, 0x66, SSE_MOVQ_FROM, 0, RAX, 1);
+	emit_mov_imm(j, RSI, _NAN_BOX_NAN);
+	emit_sse(j, 0x66, SSE_UCOMISD, 0, 0, 0);
+	emit_cmov(j, CC_P, RAX, RSI);
+	emit_mov_imm(j, RSI, _NAN_BOX_OFFSET);
+	emit_alu(j, ALU_ADD, RAX, RSI);
+#else
+	sync_sp(j);
+	emit_call(j, (long)(uintptr_t)&rs_flonum_create);
+#endif
+}
+
+
+/* Replace the two arguments of a binary instruction with rax. */
+static void binary_result(struct jit_state *j)
+{
+	emit_alu_imm(j, ALU_SUB, SP, W);
+	emit_store(j, SP, -W, RAX);
+}
+
+
+/* Call the primitive in an open-coded instruction's second operand on the top
+   nargs values of the stack, leaving its value in rax, like PRIM_SLOW in vm.c.
+*/
+static void call_primitive(struct jit_state *j, long i, long nargs)
+{
+	const struct rs_primitive_def *def =
+		rs_obj_to_primitive(j->code->insns[i + 2].obj)->val.prim;
+	sync_sp(j);
+	emit_lea(j, RDI, SP, -nargs * W);
+	emit_mov_imm(j, RSI, nargs);
+	emit_call(j, (long)(uintptr_t)def->fn);
+}
+
+
+/* Load the closure under the n arguments on top of the stack into rax, and
+   its native code into rcx, leaving unless it can be called natively with n
+   arguments. Calls also leave if another thread is waiting to collect, so
+   that the interpreter can stop at its safepoint.
+*/
+static void native_callee(struct jit_state *j, long i, long n)
+{
+	emit_cmp_mem_imm(j, 0, SPP, MUTATOR(stop), 0);
+	emit_jcc(j, CC_NE, EXIT(j, i));
+	emit_load(j, RAX, SP, -(n + 1) * W);
+	check_type(j, RAX, RS_CLOSURE, EXIT(j, i));
+	emit_load(j, RDX, RAX, offsetof(struct rs_hobject, val.closure.code));
+	emit_load(j, RDX, RDX, offsetof(struct rs_hobject, val.code));
+	emit_load(j, RCX, RDX, offsetof(struct rs_code, jit));
+	emit_alu_imm(j, ALU_CMP, RCX, 0);
+	emit_jcc(j, CC_E, EXIT(j, i));
+	emit_cmp_mem_imm(j, 0, RDX, offsetof(struct rs_code, nargs), n);
+	emit_jcc(j, CC_NE, EXIT(j, i));
+	emit_cmp_mem_imm(j, 0, RDX, offsetof(struct rs_code, rest), 0);
+	emit_jcc(j, CC_NE, EXIT(j, i));
+}
+
+
+/* Calls to compiled closures push a frame that returns to the next
+   instruction's native code, and jump to the callee's start. Anything else,
+   including growing the control stack, is left to the interpreter.
+*/
+static void call(struct jit_state *j, long i)
+{
+	long n = j->code->insns[i + 1].n;
+	if (i + 2 >= (long)j->code->ninsns) {
+		exit_to_vm(j, i);
+		return;
+	}
+
+	native_callee(j, i, n);
+	emit_lea(j, RSI, SPP, MUTATOR(stacks));
+	emit_load(j, RDI, RSI, offsetof(struct rs_vm_stacks, frame));
+	emit_load(j, R8, RSI, offsetof(struct rs_vm_stacks, frames_end));
+	emit_alu(j, ALU_CMP, RDI, R8);
+	emit_jcc(j, CC_E, EXIT(j, i));
+	emit_mov_imm(j, R8, (long)(uintptr_t)&j->code->insns[i + 2]);
+	emit_store(j, RDI, offsetof(struct rs_vm_frame, pc), R8);
+	emit_store(j, RDI, offsetof(struct rs_vm_frame, fp), FP);
+	emit_lea_label(j, R8, INSN(j, i + 2));
+	emit_store(j, RDI, offsetof(struct rs_vm_frame, native), R8);
+	emit_alu_imm(j, ALU_ADD, RDI, sizeof(struct rs_vm_frame));
+	emit_store(j, RSI, offsetof(struct rs_vm_stacks, frame), RDI);
+	emit_load(j, RCX, RCX, offsetof(struct rs_jit_code, start));
+	emit_jmp_reg(j, RCX);
+}
+
+
+/* Tail calls to compiled closures slide the procedure and arguments down
+   over the current frame, like TAIL_CALL in vm.c, and jump to the callee's
+   start.
+*/
+static void tail_call(struct jit_state *j, long i)
+{
+	long n = j->code->insns[i + 1].n;
+
+	native_callee(j, i, n);
+	for (long k = 0; k <= n; k++) {
+		emit_load(j, RDX, SP, (k - n - 1) * W);
+		emit_store(j, FP, (k - 1) * W, RDX);
+	}
+	emit_lea(j, SP, FP, n * W);
+	emit_load(j, RCX, RCX, offsetof(struct rs_jit_code, start));
+	emit_jmp_reg(j, RCX);
+}
+
+
+/* Return to a caller that's waiting in native code. Callers that are being
+   interpreted, or C, are left to the interpreter, as are frames at the base
+   of a stack segment, which has to be dropped.
+*/
+static void ret(struct jit_state *j, long i)
+{
+	emit_lea(j, RSI, SPP, MUTATOR(stacks));
+	emit_load(j, R8, RSI, offsetof(struct rs_vm_stacks, stack_base));
+	emit_lea(j, RDI, FP, -W);
+	emit_alu(j, ALU_CMP, RDI, R8);
+	emit_jcc(j, CC_E, EXIT(j, i));
+	emit_load(j, RDI, RSI, offsetof(struct rs_vm_stacks, frame));
+	emit_load(j, RDX, RDI,
+	          offsetof(struct rs_vm_frame, native) -
+	          (long)sizeof(struct rs_vm_frame));
+	emit_alu_imm(j, ALU_CMP, RDX, 0);
+	emit_jcc(j, CC_E, EXIT(j, i));
+
+	emit_alu_imm(j, ALU_SUB, RDI, sizeof(struct rs_vm_frame));
+	emit_store(j, RSI, offsetof(struct rs_vm_stacks, frame), RDI);
+	emit_load(j, RAX, SP, -W);
+	emit_lea(j, SP, FP, -W);
+	emit_load(j, FP, RDI, offsetof(struct rs_vm_frame, fp));
+	push_value(j, RAX);
+	emit_load(j, RAX, FP, -W);
+	emit_load(j, FREE, RAX, offsetof(struct rs_hobject, val.closure.free));
+	emit_jmp_reg(j, RDX);
+}
+
+
+/* Emit the template for the instruction at i, and return how many
+   instructions were done.
+*/
+static long emit_insn(struct jit_state *j, long i)
+{
+	union rs_insn *insns = j->code->insns;
+	long a = i + 1 < (long)j->code->ninsns ? insns[i + 1].n : 0;
+	long fail, slow, done, n;
+
+	switch (j->ops[i]) {
+	case OP_CONST:
+		if (fits32(a)) {
+			emit_store_imm(j, SP, 0, a);
+			emit_alu_imm(j, ALU_ADD, SP, W);
+		} else {
+			emit_mov_imm(j, RAX, a);
+			push_value(j, RAX);
+		}
+		break;
+
+	case OP_LOCAL:
+		emit_load(j, RAX, FP, a * W);
+		push_value(j, RAX);
+		break;
+
+	case OP_LOCAL_BOXED:
+		emit_load(j, RAX, FP, a * W);
+		emit_load(j, RAX, RAX, offsetof(struct rs_hobject, val.box));
+		push_value(j, RAX);
+		break;
+
+	case OP_SET_LOCAL:
+		emit_alu_imm(j, ALU_SUB, SP, W);
+		emit_load(j, RAX, SP, 0);
+		emit_store(j, FP, a * W, RAX);
+		break;
+
+	case OP_SET_LOCAL_BOXED:
+		emit_alu_imm(j, ALU_SUB, SP, W);
+		emit_load(j, RAX, SP, 0);
+		emit_load(j, RCX, FP, a * W);
+		emit_store(j, RCX, offsetof(struct rs_hobject, val.box), RAX);
+		break;
+
+	case OP_FREE:
+		emit_load(j, RAX, FREE, a * W);
+		push_value(j, RAX);
+		break;
+
+	case OP_FREE_BOXED:
+		emit_load(j, RAX, FREE, a * W);
+		emit_load(j, RAX, RAX, offsetof(struct rs_hobject, val.box));
+		push_value(j, RAX);
+		break;
+
+	case OP_SET_FREE_BOXED:
+		emit_alu_imm(j, ALU_SUB, SP, W);
+		emit_load(j, RAX, SP, 0);
+		emit_load(j, RCX, FREE, a * W);
+		emit_store(j, RCX, offsetof(struct rs_hobject, val.box), RAX);
+		break;
+
+	case OP_GLOBAL:
+		emit_mov_imm(j, RAX, a);
+		emit_load(j, RAX, RAX, offsetof(struct rs_hobject, val.sym.value));
+		emit_alu_imm(j, ALU_CMP, RAX, rs_undefined);
+		emit_jcc(j, CC_E, EXIT(j, i));
+		push_value(j, RAX);
+		break;
+
+	case OP_POP:
+		emit_alu_imm(j, ALU_SUB, SP, W);
+		break;
+
+	case OP_DUP:
+		emit_load(j, RAX, SP, -W);
+		push_value(j, RAX);
+		break;
+
+	case OP_JUMP:
+		emit_jmp(j, INSN(j, i + 1 + a));
+		break;
+
+	case OP_JUMP_FALSE:
+		emit_alu_imm(j, ALU_SUB, SP, W);
+		emit_cmp_mem_imm(j, 1, SP, 0, rs_false);
+		emit_jcc(j, CC_E, INSN(j, i + 1 + a));
+		break;
+
+	case OP_CALL:
+		call(j, i);
+		break;
+
+	case OP_TAIL_CALL:
+		tail_call(j, i);
+		break;
+
+	case OP_RETURN:
+		ret(j, i);
+		break;
+
+	case OP_PRIM_CALL:
+		n = insns[i + 3].n;
+		guard_primitive(j, i);
+		call_primitive(j, i, n);
+		emit_lea(j, SP, SP, -n * W);
+		push_value(j, RAX);
+		break;
+
+	case OP_CAR:
+	case OP_CDR:
+		guard_primitive(j, i);
+		emit_load(j, RAX, SP, -W);
+		check_type(j, RAX, RS_PAIR, EXIT(j, i));
+		emit_load(j, RAX, RAX, j->ops[i] == OP_CAR ?
+		          offsetof(struct rs_hobject, val.pair.car) :
+		          offsetof(struct rs_hobject, val.pair.cdr));
+		emit_store(j, SP, -W, RAX);
+		break;
+
+	case OP_CONS:
+		guard_primitive(j, i);
+		sync_sp(j);
+		emit_load(j, RDI, SP, -2 * W);
+		emit_load(j, RSI, SP, -W);
+		emit_call(j, (long)(uintptr_t)&rs_pair_create);
+		binary_result(j);
+		break;
+
+	case OP_NULL_P:
+		guard_primitive(j, i);
+		emit_cmp_mem_imm(j, 1, SP, -W, rs_null);
+		return boolean_result(j, i, CC_E, 1);
+
+	case OP_NOT:
+		guard_primitive(j, i);
+		emit_cmp_mem_imm(j, 1, SP, -W, rs_false);
+		return boolean_result(j, i, CC_E, 1);
+
+	case OP_PAIR_P:
+		guard_primitive(j, i);
+		fail = new_label(j);
+		emit_load(j, RAX, SP, -W);
+		emit_mov_imm(j, RDX, rs_false);
+		check_type(j, RAX, RS_PAIR, fail);
+		emit_mov_imm(j, RDX, rs_true);
+		bind(j, fail);
+		emit_store(j, SP, -W, RDX);
+		break;
+
+	case OP_EQ_P:
+		/* Only distinct symbols need rs_primitive_eq(). */
+		guard_primitive(j, i);
+		fail = new_label(j);
+		emit_load(j, RAX, SP, -2 * W);
+		emit_load(j, RCX, SP, -W);
+		emit_mov_imm(j, RDX, rs_true);
+		emit_alu(j, ALU_CMP, RAX, RCX);
+		emit_jcc(j, CC_E, fail);
+		emit_mov_imm(j, RDX, rs_false);
+		check_type(j, RAX, RS_SYMBOL, fail);
+		exit_to_vm(j, i);
+		bind(j, fail);
+		emit_mov(j, RAX, RDX);
+		binary_result(j);
+		break;
+
+	/* The same arithmetic on tagged words as rs_fixnum_add() and friends.
+	   Anything else, including overflow, is left to the primitive. */
+	case OP_ADD:
+	case OP_SUB:
+	case OP_MUL: {
+		static const int sse[] = {
+			[OP_ADD] = SSE_ADDSD, [OP_SUB] = SSE_SUBSD, [OP_MUL] = SSE_MULSD
+		};
+		long flo = new_label(j);
+		slow = new_label(j);
+		done = new_label(j);
+		fixnum_args(j, i, flo);
+		if (j->ops[i] == OP_MUL) {
+			emit_alu_imm(j, ALU_SUB, RAX, _FIXNUM_TAG);
+			emit_sar(j, RCX, _TAG_BITS);
+			emit_imul(j, RAX, RCX);
+			emit_jcc(j, CC_O, slow);
+			emit_alu_imm(j, ALU_ADD, RAX, _FIXNUM_TAG);
+		} else {
+			emit_alu_imm(j, ALU_SUB, RCX, _FIXNUM_TAG);
+			emit_alu(j, j->ops[i] == OP_ADD ? ALU_ADD : ALU_SUB, RAX, RCX);
+			emit_jcc(j, CC_O, slow);
+		}
+		check_fixnum_range(j, RAX, slow);
+		emit_jmp(j, done);
+		bind(j, flo);
+		flonum_args(j, slow);
+		emit_sse(j, 0xf2, sse[j->ops[i]], 0, 1, 0);
+		flonum_result(j);
+		emit_jmp(j, done);
+		bind(j, slow);
+		call_primitive(j, i, 2);
+		bind(j, done);
+		binary_result(j);
+		break;
+	}
+
+	/* Flonums are compared with cmpsd, which gives all ones if a predicate
+	   holds, and nothing if it doesn't, including for NaNs. It only has
+	   =, <, and <=, so > and >= swap their arguments. */
+	case OP_NUM_EQ:
+	case OP_LT:
+	case OP_GT:
+	case OP_LE:
+	case OP_GE: {
+		static const int ccs[] = {
+			[OP_NUM_EQ] = CC_E, [OP_LT] = CC_L, [OP_GT] = CC_G,
+			[OP_LE] = CC_LE, [OP_GE] = CC_GE
+		};
+		static const int preds[] = {
+			[OP_NUM_EQ] = 0, [OP_LT] = 1, [OP_GT] = 1, [OP_LE] = 2,
+			[OP_GE] = 2
+		};
+		int swap = j->ops[i] == OP_GT || j->ops[i] == OP_GE;
+		long flo = new_label(j);
+		slow = new_label(j);
+		done = new_label(j);
+		fixnum_args(j, i, flo);
+		emit_alu(j, ALU_CMP, RAX, RCX);
+		boolean_result(j, i, ccs[j->ops[i]], 2);
+		emit_jmp(j, done);
+		bind(j, flo);
+		flonum_args(j, slow);
+		emit_sse(j, 0xf2, SSE_CMPSD, swap, !swap, 0);
+		emit(j, preds[j->ops[i]]);
+		emit_sse(j, 0x66, SSE_MOVQ_FROM, swap, RAX, 1);
+		emit_test(j, RAX, RAX);
+		boolean_result(j, i, CC_NE, 2);
+		emit_jmp(j, done);
+		bind(j, slow);
+		call_primitive(j, i, 2);
+		emit_alu_imm(j, ALU_CMP, RAX, rs_false);
+		n = boolean_result(j, i, CC_NE, 2);
+		bind(j, done);
+		return n;
+	}
+
+	default:
+		exit_to_vm(j, i);
+		break;
+	}
+	return 1;
+}
+
+
+/* The code that every entry from the interpreter goes through: save the
+   registers the native code uses, load the VM's state into them, and jump to
+   the instruction at rdx. The shared exit, leave, stores the state back, and
+   returns the address in rax.
+
+   Then comes the procedure's start, where native calls enter with the
+   arguments on the stack, which sets up the frame like the interpreter does
+   on entering a procedure, moving to a new stack segment if it doesn't fit.
+*/
+static void emit_prologue(struct jit_state *j, long leave, long start)
+{
+	struct rs_code *code = j->code;
+
+	emit_push(j, RBX);
+	emit_push(j, R12);
+	emit_push(j, R13);
+	emit_push(j, R14);
+	emit_push(j, R15);     // which also leaves the C stack aligned for calls
+	emit_mov(j, SPP, RDI);
+	emit_mov(j, FPP, RSI);
+	emit_load(j, SP, SPP, 0);
+	emit_load(j, FP, FPP, 0);
+	emit_load(j, RAX, FP, -W);
+	emit_load(j, FREE, RAX, offsetof(struct rs_hobject, val.closure.free));
+	emit_jmp_reg(j, RDX);
+
+	bind(j, leave);
+	sync_sp(j);
+	emit_store(j, FPP, 0, FP);
+	emit_pop(j, R15);
+	emit_pop(j, R14);
+	emit_pop(j, R13);
+	emit_pop(j, R12);
+	emit_pop(j, RBX);
+	emit(j, 0xc3);         // ret
+
+	long frame = new_label(j);
+	bind(j, j->grow);
+	emit_mov(j, RDI, SP);
+	emit_mov_imm(j, RSI, code->nargs + 1);
+	emit_mov_imm(j, RDX, code->nlocals - code->nargs + code->maxdepth);
+	emit_call(j, (long)(uintptr_t)&rs_vm_stack_grow);
+	emit_mov(j, SP, RAX);
+	emit_lea(j, FP, SP, -code->nargs * W);
+	emit_jmp(j, frame);
+
+	bind(j, start);
+	emit_lea(j, FP, SP, -code->nargs * W);
+	emit_load(j, RSI, SPP, MUTATOR(stacks.stack_end));
+	emit_lea(j, RDI, FP, (code->nlocals + code->maxdepth) * W);
+	emit_alu(j, ALU_CMP, RDI, RSI);
+	emit_jcc(j, CC_A, j->grow);
+	bind(j, frame);
+	for (long k = code->nargs; k < code->nlocals; k++) {
+		emit_store_imm(j, FP, k * W, rs_unspecified);
+	}
+	emit_lea(j, SP, FP, code->nlocals * W);
+	emit_load(j, RAX, FP, -W);
+	emit_load(j, FREE, RAX, offsetof(struct rs_hobject, val.closure.free));
+	emit_jmp(j, INSN(j, 0));
+}
+
+
+static void jit_state_free(struct jit_state *j)
+{
+	free(j->ops);
+	free(j->targets);
+	free(j->exits);
+	free(j->buf);
+	free(j->labels);
+	free(j->fixups);
+}
+
+
+void rs_jit_compile(rs_object code_obj)
+{
+	struct rs_code *code = rs_obj_to_code(code_obj)->val.code;
+	assert(code->jit == NULL);
+
+	long ninsns = (long)code->ninsns;
+	struct jit_state j = { .code = code };
+	j.ops = malloc(ninsns * sizeof(long));
+	j.targets = calloc(ninsns, 1);
+	j.exits = calloc(ninsns, 1);
+	j.caplabels = 2 * ninsns + 16;
+	j.labels = malloc(j.caplabels * sizeof(long));
+	if (j.ops == NULL || j.targets == NULL || j.exits == NULL ||
+	    j.labels == NULL) {
+		rs_fatal("could not allocate native code tables:");
+	}
+	for (long i = 0; i < j.caplabels; i++) {
+		j.labels[i] = -1;
+	}
+	j.nlabels = 2 * ninsns;
+
+	/* Find the instructions, and the ones that are jumped to. */
+	for (long i = 0; i < ninsns; i++) {
+		j.ops[i] = -1;
+	}
+	for (long i = 0; i < ninsns; ) {
+		long op = rs_vm_opcode(code->insns[i]);
+		j.ops[i] = op;
+		if (op == OP_JUMP || op == OP_JUMP_FALSE) {
+			long target = i + 1 + code->insns[i + 1].n;
+			assert(target >= 0 && target < ninsns);
+			j.targets[target] = 1;
+		}
+		i += 1 + operand_count[op];
+	}
+
+	long leave = new_label(&j);
+	long start = new_label(&j);
+	j.grow = new_label(&j);
+	emit_prologue(&j, leave, start);
+	for (long i = 0; i < ninsns; ) {
+		bind(&j, INSN(&j, i));
+		long done = emit_insn(&j, i);
+		for (long k = 0; k < done; k++) {
+			i += 1 + operand_count[j.ops[i]];
+		}
+	}
+	for (long i = 0; i < ninsns; i++) {
+		if (j.exits[i]) {
+			bind(&j, ninsns + i);
+			emit_mov_imm(&j, RAX, (long)(uintptr_t)&code->insns[i]);
+			emit_jmp(&j, leave);
+		}
+	}
+
+	for (size_t k = 0; k < j.nfixups; k++) {
+		long to = j.labels[j.fixups[k].label];
+		assert(to >= 0);
+		long rel = to - (long)(j.fixups[k].at + 4);
+		for (int b = 0; b < 4; b++) {
+			j.buf[j.fixups[k].at + b] =
+				(unsigned char)(((unsigned long)rel >> (8 * b)) & 0xff);
+		}
+	}
+
+	/* Map the code, and make it executable once it's in place. If that can't
+	   be done, the procedure just stays interpreted. */
+	long page = sysconf(_SC_PAGESIZE);
+	size_t size = (j.len + page - 1) / page * page;
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		jit_state_free(&j);
+		return;
+	}
+	memcpy(mem, j.buf, j.len);
+	if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+		munmap(mem, size);
+		jit_state_free(&j);
+		return;
+	}
+
+	struct rs_jit_code *jit = malloc(sizeof(struct rs_jit_code));
+	uint32_t *entries = malloc(ninsns * sizeof(uint32_t));
+	if (jit == NULL || entries == NULL) {
+		rs_fatal("could not allocate native code:");
+	}
+	for (long i = 0; i < ninsns; i++) {
+		entries[i] = j.ops[i] >= 0 && j.labels[i] >= 0 ?
+			(uint32_t)j.labels[i] : 0;
+	}
+	jit->mem = mem;
+	jit->size = size;
+	jit->entries = entries;
+	jit->start = jit->mem + j.labels[start];
+	/* ISO C has no conversion from an object pointer to a function
+	   pointer. */
+	memcpy(&jit->enter, &mem, sizeof(mem));
+	_VM_STORE(&code->jit, jit);
+
+	TRACE("compiled %s to %zu bytes of native code",
+	      code->name != NULL ? code->name : "#<procedure>", j.len);
+	jit_state_free(&j);
+}
+
+
+union rs_insn *rs_jit_run(struct rs_code *code, union rs_insn *pc,
+                          rs_object **sp, rs_object **fp)
+{
+	assert(code->jit != NULL);
+	assert(pc >= code->insns && pc < code->insns + code->ninsns);
+
+	struct rs_jit_code *jit = code->jit;
+	uint32_t at = jit->entries[pc - code->insns];
+	if (at == 0) {
+		return pc;
+	}
+	return jit->enter(sp, fp, jit->mem + at);
+}
+
+
+void rs_jit_release(struct rs_jit_code *jit)
+{
+	assert(jit != NULL);
+
+	munmap(jit->mem, jit->size);
+	free(jit->entries);
+	free(jit);
+}
+
+#else
+
+void rs_jit_compile(rs_object code_obj)
+{
+	(void) code_obj;
+}
+
+
+union rs_insn *rs_jit_run(struct rs_code *code, union rs_insn *pc,
+                          rs_object **sp, rs_object **fp)
+{
+	(void) code;
+	(void) sp;
+	(void) fp;
+	return pc;
+}
+
+
+void rs_jit_release(struct rs_jit_code *jit)
+{
+	(void) jit;
+}
+
+#endif
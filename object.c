@@ -2,27 +2,44 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include <string.h>
 
 
-const long rs_fixnum_min = ((((rs_fixnum)1) << (8 * sizeof(rs_object) - 1)) >>
-                            _TAG_BITS) + 1;
+/* The range is kept symmetric, so that negating a fixnum never overflows. */
+const long rs_fixnum_min = (_FIXNUM_WORD_MIN >> _TAG_BITS) + 1;
 
 /* It would be nicer to just say rs_fixnum_max = -rs_fixnum_min, but not all
    compilers allow it. */
-const long rs_fixnum_max = -(((((rs_fixnum)1) << (8 * sizeof(rs_object) - 1)) >>
-                              _TAG_BITS) + 1);
+const long rs_fixnum_max = -((_FIXNUM_WORD_MIN >> _TAG_BITS) + 1);
 
 
 const rs_object rs_true  = 3;   // 0011
 const rs_object rs_false = 7;   // 0111
 const rs_object rs_null  = 11;  // 1011
 const rs_object rs_eof   = 15;  // 1111
+const rs_object rs_unspecified = 19;  // 10011
+const rs_object rs_undefined   = 23;  // 10111
 
 
 static void rs_symbol_release(rs_symbol *sym);
 static void rs_string_release(rs_string *str);
 
+/* Pairs of objects that rs_equal_p() still has to compare. Data can be nested
+   far deeper than the C stack could follow, so it doesn't recurse. The first
+   few pairs fit in small, and the rest go in a malloc'd array.
+*/
+struct rs_equal_todo {
+	rs_object *objs;
+	size_t n;
+	size_t cap;
+	rs_object small[64];
+};
+
+static int rs_equal_step(rs_object a, rs_object b, struct rs_equal_todo *todo);
+static void rs_equal_push(struct rs_equal_todo *todo, rs_object a,
+                          rs_object b);
+
 
 void rs_hobject_release(struct rs_hobject *obj)
 {
@@ -30,7 +47,25 @@ void rs_hobject_release(struct rs_hobject *obj)
 		rs_symbol_release(obj);
 	} else if (rs_string_p((rs_object)obj)) {
 		rs_string_release(obj);
-	} else if (rs_pair_p((rs_object)obj)) {
+	} else if (rs_bignum_p((rs_object)obj)) {
+		rs_bignum_release(obj);
+	} else if (rs_closure_p((rs_object)obj)) {
+		free(obj->val.closure.free);
+	} else if (rs_vector_p((rs_object)obj)) {
+		free(obj->val.vec.elts);
+	} else if (rs_hashtable_p((rs_object)obj)) {
+		rs_hashtable_release(obj);
+	} else if (rs_bytevector_p((rs_object)obj)) {
+		if (!(obj->flags & _HOBJECT_FLAG_SLICE)) {
+			free(obj->val.bytes.data);
+		}
+	} else if (rs_channel_p((rs_object)obj)) {
+		rs_channel_release(obj);
+	} else if (rs_code_p((rs_object)obj)) {
+		rs_code_release(obj->val.code);
+	} else if (rs_pair_p((rs_object)obj) || rs_primitive_p((rs_object)obj) ||
+	           rs_box_p((rs_object)obj) || rs_future_p((rs_object)obj) ||
+	           obj->type == RS_FLONUM) {
 		// do nothing
 	} else {
 		rs_fatal("unknown object type");
@@ -38,12 +73,114 @@ void rs_hobject_release(struct rs_hobject *obj)
 }
 
 
+int rs_equal_p(rs_object a, rs_object b)
+{
+	struct rs_equal_todo todo;
+	todo.objs = todo.small;
+	todo.n = 0;
+	todo.cap = sizeof(todo.small) / sizeof(todo.small[0]);
+
+	int equal = rs_equal_step(a, b, &todo);
+	while (equal && todo.n > 0) {
+		todo.n -= 2;
+		equal = rs_equal_step(todo.objs[todo.n], todo.objs[todo.n + 1], &todo);
+	}
+	if (todo.objs != todo.small) {
+		free(todo.objs);
+	}
+	return equal;
+}
+
+
+/* Compare a and b as far as they go without branching: down the cdrs of
+   lists. Cars, and vector elements, are left in todo.
+*/
+static int rs_equal_step(rs_object a, rs_object b, struct rs_equal_todo *todo)
+{
+	while (a != b) {
+		if (!rs_heap_p(a) || !rs_heap_p(b)) {
+			return 0;
+		}
+		struct rs_hobject *ha = (struct rs_hobject *)a;
+		struct rs_hobject *hb = (struct rs_hobject *)b;
+		if (ha->type != hb->type) {
+			return 0;
+		}
+		/* Equal shared objects are always the same object. */
+		if (rs_hobject_shared_p(ha) && rs_hobject_shared_p(hb)) {
+			return 0;
+		}
+
+		switch (ha->type) {
+		case RS_SYMBOL:
+			/* Symbol names are interned, so compare the pointers. */
+			return rs_symbol_cstr(ha) == rs_symbol_cstr(hb);
+		case RS_STRING:
+			return rs_string_length(ha) == rs_string_length(hb) &&
+			       memcmp(rs_string_data(ha), rs_string_data(hb),
+			              rs_string_length(ha)) == 0;
+		case RS_BIGNUM:
+			return rs_bignum_cmp(a, b) == 0;
+		case RS_FLONUM:
+			return memcmp(&ha->val.flo, &hb->val.flo, sizeof(double)) == 0;
+		case RS_VECTOR: {
+			size_t len = rs_vector_length(ha);
+			if (rs_vector_length(hb) != len) {
+				return 0;
+			}
+			/* Push the elements last first, so they're compared in order. */
+			for (size_t i = len; i-- > 0; ) {
+				rs_equal_push(todo, rs_vector_ref(ha, i), rs_vector_ref(hb, i));
+			}
+			return 1;
+		}
+		case RS_BYTEVECTOR:
+			return rs_bytevector_length(ha) == rs_bytevector_length(hb) &&
+			       memcmp(rs_bytevector_data(ha), rs_bytevector_data(hb),
+			              rs_bytevector_length(ha)) == 0;
+		case RS_PAIR:
+			rs_equal_push(todo, rs_pair_car(ha), rs_pair_car(hb));
+			a = rs_pair_cdr(ha);
+			b = rs_pair_cdr(hb);
+			break;
+		default:
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+static void rs_equal_push(struct rs_equal_todo *todo, rs_object a,
+                          rs_object b)
+{
+	if (a == b) {
+		return;
+	}
+	if (todo->n == todo->cap) {
+		rs_object *objs = malloc(2 * todo->cap * sizeof(rs_object));
+		if (objs == NULL) {
+			rs_fatal("could not grow equal? stack:");
+		}
+		memcpy(objs, todo->objs, todo->n * sizeof(rs_object));
+		if (todo->objs != todo->small) {
+			free(todo->objs);
+		}
+		todo->objs = objs;
+		todo->cap *= 2;
+	}
+	todo->objs[todo->n++] = a;
+	todo->objs[todo->n++] = b;
+}
+
+
 rs_object rs_symbol_create(const char *name)
 {
 	assert(name != NULL);
 	rs_symbol *sym = rs_gc_alloc_hobject();
 	sym->type = RS_SYMBOL;
-	sym->val.sym = rs_symtab_insert(name);
+	sym->val.sym.name = rs_symtab_insert(name);
+	sym->val.sym.value = rs_undefined;
 
 	return rs_symbol_to_obj(sym);
 }
@@ -52,21 +189,52 @@ rs_object rs_symbol_create(const char *name)
 static void rs_symbol_release(rs_symbol *sym)
 {
 	assert(rs_symbol_p((rs_object)sym));
-	assert(sym->val.sym != NULL);
+	assert(sym->val.sym.name != NULL);
 
-	rs_symtab_remove(sym->val.sym);
+	rs_symtab_remove(sym->val.sym.name);
 }
 
 
 rs_object rs_string_create(const char *cstr)
 {
 	assert(cstr != NULL);
-	rs_string *str = rs_gc_alloc_hobject();
-	str->type = RS_STRING;
-	str->val.str = strdup(cstr);
-	if (str->val.str == NULL) {
+	return rs_string_create_n(cstr, strlen(cstr));
+}
+
+
+rs_object rs_string_create_n(const char *data, size_t len)
+{
+	assert(data != NULL || len == 0);
+
+	/* Copies are NUL-terminated anyway, to make life easier for debuggers. */
+	char *copy = malloc(len + 1);
+	if (copy == NULL) {
 		rs_fatal("could not create string object:");
 	}
+	if (len > 0) {
+		memcpy(copy, data, len);
+	}
+	copy[len] = '\0';
+
+	rs_string *str = rs_gc_alloc_hobject();
+	str->type = RS_STRING;
+	str->val.str.data = copy;
+	str->val.str.len = len;
+
+	return rs_string_to_obj(str);
+}
+
+
+rs_object rs_string_create_slice(const char *data, size_t len)
+{
+	assert(data != NULL);
+	assert(rs_source_contains(data));
+
+	rs_string *str = rs_gc_alloc_hobject();
+	str->type = RS_STRING;
+	str->flags |= _HOBJECT_FLAG_SLICE;
+	str->val.str.data = data;
+	str->val.str.len = len;
 
 	return rs_string_to_obj(str);
 }
@@ -75,9 +243,11 @@ rs_object rs_string_create(const char *cstr)
 static void rs_string_release(rs_string *str)
 {
 	assert(rs_string_p((rs_object)str));
-	assert(str->val.str != NULL);
+	assert(str->val.str.data != NULL);
 
-	free(str->val.str);
+	if (!(str->flags & _HOBJECT_FLAG_SLICE)) {
+		free((char *)str->val.str.data);
+	}
 }
 
 
@@ -96,3 +266,88 @@ rs_object rs_pair_create(rs_object car, rs_object cdr)
 
 	return rs_pair_to_obj(pair);
 }
+
+
+rs_object rs_closure_create(rs_object code, size_t nfree)
+{
+	assert(rs_code_p(code));
+
+	rs_object *free_vals = NULL;
+	if (nfree > 0) {
+		free_vals = malloc(nfree * sizeof(rs_object));
+		if (free_vals == NULL) {
+			rs_fatal("could not create closure:");
+		}
+		for (size_t i = 0; i < nfree; i++) {
+			free_vals[i] = rs_unspecified;
+		}
+	}
+
+	rs_gc_push(code);
+	rs_closure *clo = rs_gc_alloc_hobject();
+	clo->type = RS_CLOSURE;
+	clo->val.closure.code = code;
+	clo->val.closure.free = free_vals;
+	rs_gc_pop();
+
+	return (rs_object)clo;
+}
+
+
+rs_object rs_primitive_create(const struct rs_primitive_def *def)
+{
+	assert(def != NULL);
+
+	rs_primitive *prim = rs_gc_alloc_hobject();
+	prim->type = RS_PRIMITIVE;
+	prim->val.prim = def;
+	return (rs_object)prim;
+}
+
+
+const char *rs_procedure_name(rs_object proc)
+{
+	if (rs_primitive_p(proc)) {
+		return rs_obj_to_primitive(proc)->val.prim->name;
+	}
+	rs_closure *clo = rs_obj_to_closure(proc);
+	return rs_obj_to_code(clo->val.closure.code)->val.code->name;
+}
+
+
+rs_object rs_code_create(void)
+{
+	struct rs_code *c = calloc(1, sizeof(struct rs_code));
+	if (c == NULL) {
+		rs_fatal("could not create code object:");
+	}
+
+	rs_code *code = rs_gc_alloc_hobject();
+	code->type = RS_CODE;
+	code->val.code = c;
+	return (rs_object)code;
+}
+
+
+#ifndef RS_NAN_BOXING
+rs_object rs_flonum_create(double val)
+{
+	struct rs_hobject *flo = rs_gc_alloc_hobject();
+	flo->type = RS_FLONUM;
+	flo->val.flo = val;
+
+	return (rs_object)flo;
+}
+#endif
+
+
+rs_object rs_box_create(rs_object val)
+{
+	rs_gc_push(val);
+	rs_box *box = rs_gc_alloc_hobject();
+	box->type = RS_BOX;
+	box->val.box = val;
+	rs_gc_pop();
+
+	return (rs_object)box;
+}
@@ -0,0 +1,181 @@
+#include "rescheme.h"
+
+#include <assert.h>
+#include <string.h>
+
+/* The object table is an open-addressed hash table with linear probing. A key
+   of 0 marks an empty slot (0 is never a valid object: heap objects are
+   non-NULL pointers, and every immediate has a non-zero tag). Removal shifts
+   later entries back into the hole, so there are no tombstones, and lookups
+   never have to skip over deleted entries.
+*/
+
+#define _OBJTAB_MIN_CAP 16
+
+
+static size_t rs_objtab_hash(rs_object key, size_t cap);
+static void rs_objtab_grow(struct rs_objtab *tab);
+
+
+void rs_objtab_init(struct rs_objtab *tab)
+{
+	assert(tab != NULL);
+
+	tab->entries = NULL;
+	tab->cap = 0;
+	tab->count = 0;
+}
+
+
+void rs_objtab_reset(struct rs_objtab *tab)
+{
+	assert(tab != NULL);
+
+	free(tab->entries);
+	rs_objtab_init(tab);
+}
+
+
+int rs_objtab_get(struct rs_objtab *tab, rs_object key, long *val)
+{
+	assert(tab != NULL);
+	assert(key != 0);
+
+	if (tab->count == 0) {
+		return 0;
+	}
+	size_t i = rs_objtab_hash(key, tab->cap);
+	while (tab->entries[i].key != 0) {
+		if (tab->entries[i].key == key) {
+			if (val != NULL) {
+				*val = tab->entries[i].val;
+			}
+			return 1;
+		}
+		i = (i + 1) & (tab->cap - 1);
+	}
+	return 0;
+}
+
+
+void rs_objtab_put(struct rs_objtab *tab, rs_object key, long val)
+{
+	assert(tab != NULL);
+	assert(key != 0);
+
+	/* Keep the load factor under 3/4. */
+	if (4 * (tab->count + 1) > 3 * tab->cap) {
+		rs_objtab_grow(tab);
+	}
+
+	size_t i = rs_objtab_hash(key, tab->cap);
+	while (tab->entries[i].key != 0) {
+		if (tab->entries[i].key == key) {
+			tab->entries[i].val = val;
+			return;
+		}
+		i = (i + 1) & (tab->cap - 1);
+	}
+	tab->entries[i].key = key;
+	tab->entries[i].val = val;
+	tab->count++;
+}
+
+
+int rs_objtab_remove(struct rs_objtab *tab, rs_object key)
+{
+	assert(tab != NULL);
+	assert(key != 0);
+
+	if (tab->count == 0) {
+		return 0;
+	}
+	size_t mask = tab->cap - 1;
+	size_t i = rs_objtab_hash(key, tab->cap);
+	while (tab->entries[i].key != key) {
+		if (tab->entries[i].key == 0) {
+			return 0;
+		}
+		i = (i + 1) & mask;
+	}
+
+	/* Move entries after the hole back into it, if their home slot doesn't lie
+	   (cyclically) between the hole and their current position. */
+	size_t j = i;
+	for (;;) {
+		tab->entries[i].key = 0;
+		size_t home;
+		do {
+			j = (j + 1) & mask;
+			if (tab->entries[j].key == 0) {
+				tab->count--;
+				return 1;
+			}
+			home = rs_objtab_hash(tab->entries[j].key, tab->cap);
+		} while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+		tab->entries[i] = tab->entries[j];
+		i = j;
+	}
+}
+
+
+static size_t rs_objtab_hash(rs_object key, size_t cap)
+{
+	/* Heap objects are aligned, so the low bits carry no information. Mix
+	   the rest with a multiplicative (Fibonacci) hash. */
+	uint64_t h = (uint64_t)(unsigned long)key >> _TAG_BITS;
+	h *= UINT64_C(11400714819323198485);
+	return (size_t)(h >> 32) & (cap - 1);
+}
+
+
+static void rs_objtab_grow(struct rs_objtab *tab)
+{
+	size_t old_cap = tab->cap;
+	struct rs_objtab_entry *old = tab->entries;
+
+	tab->cap = old_cap == 0 ? _OBJTAB_MIN_CAP : old_cap * 2;
+	tab->entries = calloc(tab->cap, sizeof(struct rs_objtab_entry));
+	if (tab->entries == NULL) {
+		rs_fatal("could not grow object table:");
+	}
+	tab->count = 0;
+
+	for (size_t i = 0; i < old_cap; i++) {
+		if (old[i].key != 0) {
+			rs_objtab_put(tab, old[i].key, old[i].val);
+		}
+	}
+	free(old);
+}
+
+
+void rs_objtab_test(void)
+{
+	struct rs_objtab tab;
+	rs_objtab_init(&tab);
+
+	// Fake, but properly aligned, heap object keys.
+	for (long i = 1; i <= 1000; i++) {
+		rs_objtab_put(&tab, (rs_object)(i * 32), i);
+	}
+	assert(tab.count == 1000);
+
+	// Remove every other key, and make sure the rest can still be found.
+	for (long i = 1; i <= 1000; i += 2) {
+		if (!rs_objtab_remove(&tab, (rs_object)(i * 32))) {
+			rs_fatal("could not remove key %ld", i);
+		}
+	}
+	for (long i = 1; i <= 1000; i++) {
+		long val = 0;
+		int found = rs_objtab_get(&tab, (rs_object)(i * 32), &val);
+		if (found != (i % 2 == 0) || (found && val != i)) {
+			rs_fatal("wrong entry for key %ld", i);
+		}
+	}
+	assert(tab.count == 500);
+
+	rs_objtab_reset(&tab);
+	TRACE("passed");
+}
@@ -0,0 +1,283 @@
+#include "rescheme.h"
+
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Output ports collect characters in a buffer of their own, so that writing a
+   character is just a compare and a store. What happens when the buffer fills
+   up depends on the kind of port:
+     * file descriptor ports write the buffer out with write(2), and start over,
+     * string ports grow the buffer, and
+     * memory ports write into a fixed block of the caller's memory. Once that
+       is full, everything else is written into a small scratch area and
+       thrown away, and the number of lost characters is counted.
+*/
+
+#define _OUTPORT_BUFSIZE 65536
+#define _OUTPORT_STRING_MIN 256
+
+
+static struct rs_outport *rs_outport_alloc(enum rs_outport_kind kind);
+static int rs_outport_write_fd(int fd, const char *data, size_t len);
+
+
+struct rs_outport *rs_outport_open_fd(int fd)
+{
+	assert(fd >= 0);
+
+	struct rs_outport *port = rs_outport_alloc(OUT_FD);
+	port->fd = fd;
+	port->buf = malloc(_OUTPORT_BUFSIZE);
+	if (port->buf == NULL) {
+		rs_fatal("could not allocate port buffer:");
+	}
+	port->cap = _OUTPORT_BUFSIZE;
+	return port;
+}
+
+
+struct rs_outport *rs_outport_open_mem(char *data, size_t cap)
+{
+	assert(data != NULL || cap == 0);
+
+	struct rs_outport *port = rs_outport_alloc(OUT_MEM);
+	port->buf = data;
+	port->cap = cap;
+	return port;
+}
+
+
+struct rs_outport *rs_outport_open_string(void)
+{
+	struct rs_outport *port = rs_outport_alloc(OUT_STRING);
+	port->buf = malloc(_OUTPORT_STRING_MIN);
+	if (port->buf == NULL) {
+		rs_fatal("could not allocate port buffer:");
+	}
+	port->cap = _OUTPORT_STRING_MIN;
+	return port;
+}
+
+
+void rs_outport_close(struct rs_outport *port)
+{
+	assert(port != NULL);
+
+	rs_outport_flush(port);
+	if (port->kind != OUT_MEM) {
+		free(port->buf);
+	}
+	free(port);
+}
+
+
+void rs_outport_flush(struct rs_outport *port)
+{
+	if (!rs_outport_try_flush(port)) {
+		rs_fatal("could not write to port:");
+	}
+}
+
+
+/* What was buffered is dropped even if it couldn't be written, so it isn't
+   tried again.
+*/
+int rs_outport_try_flush(struct rs_outport *port)
+{
+	assert(port != NULL);
+
+	int ok = 1;
+	if (port->kind == OUT_FD && port->pos > 0) {
+		ok = rs_outport_write_fd(port->fd, port->buf, port->pos);
+		port->base += port->pos;
+		port->pos = 0;
+	}
+	return ok;
+}
+
+
+int rs_outport_try_write(struct rs_outport *port, const char *data,
+                         size_t len)
+{
+	assert(port != NULL);
+	assert(data != NULL || len == 0);
+
+	if (port->kind != OUT_FD) {
+		rs_outport_write(port, data, len);
+		return 1;
+	}
+	if (!rs_outport_try_flush(port)) {
+		return 0;
+	}
+	port->base += len;
+	return rs_outport_write_fd(port->fd, data, len);
+}
+
+
+const char *rs_outport_data(struct rs_outport *port, size_t *len)
+{
+	assert(port != NULL);
+	assert(port->kind != OUT_FD);
+	assert(len != NULL);
+
+	if (port->kind == OUT_MEM && port->buf == port->sink) {
+		*len = port->base;
+		return port->mem;
+	}
+	*len = port->pos;
+	return port->buf;
+}
+
+
+size_t rs_outport_dropped(struct rs_outport *port)
+{
+	assert(port != NULL);
+	if (port->kind == OUT_MEM && port->buf == port->sink) {
+		return port->dropped + port->pos;
+	}
+	return 0;
+}
+
+
+void rs_outport_make_room(struct rs_outport *port)
+{
+	assert(port != NULL);
+	assert(port->pos == port->cap);
+
+	switch (port->kind) {
+	case OUT_FD:
+		rs_outport_flush(port);
+		break;
+	case OUT_STRING: {
+		size_t cap = port->cap * 2;
+		char *b = realloc(port->buf, cap);
+		if (b == NULL) {
+			rs_fatal("could not grow port buffer:");
+		}
+		port->buf = b;
+		port->cap = cap;
+		break;
+	}
+	case OUT_MEM:
+		/* The first time the memory fills up, put it aside (base counts what
+		   it holds from then on). After that, just count what's thrown
+		   away. */
+		if (port->buf != port->sink) {
+			port->mem = port->buf;
+			port->base = port->cap;
+			port->buf = port->sink;
+			port->cap = sizeof(port->sink);
+		} else {
+			port->dropped += port->pos;
+		}
+		port->pos = 0;
+		break;
+	}
+}
+
+
+void rs_outport_write(struct rs_outport *port, const char *data, size_t len)
+{
+	assert(port != NULL);
+	assert(data != NULL || len == 0);
+
+	/* Big writes to a file descriptor skip the buffer. */
+	if (port->kind == OUT_FD && len >= port->cap) {
+		rs_outport_flush(port);
+		if (!rs_outport_write_fd(port->fd, data, len)) {
+			rs_fatal("could not write to port:");
+		}
+		port->base += len;
+		return;
+	}
+
+	while (len > 0) {
+		if (port->pos == port->cap) {
+			rs_outport_make_room(port);
+		}
+		size_t n = port->cap - port->pos;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(port->buf + port->pos, data, n);
+		port->pos += n;
+		data += n;
+		len -= n;
+	}
+}
+
+
+void rs_outport_puts(struct rs_outport *port, const char *cstr)
+{
+	assert(cstr != NULL);
+	rs_outport_write(port, cstr, strlen(cstr));
+}
+
+
+void rs_outport_long(struct rs_outport *port, long n)
+{
+	static const char pairs[] =
+		"00010203040506070809101112131415161718192021222324"
+		"25262728293031323334353637383940414243444546474849"
+		"50515253545556575859606162636465666768697071727374"
+		"75767778798081828384858687888990919293949596979899";
+
+	/* Work on the magnitude as an unsigned long, so LONG_MIN is fine. */
+	unsigned long u = n < 0 ? -(unsigned long)n : (unsigned long)n;
+	char digits[24];
+	char *p = digits + sizeof(digits);
+	while (u >= 100) {
+		unsigned long i = (u % 100) * 2;
+		u /= 100;
+		*--p = pairs[i + 1];
+		*--p = pairs[i];
+	}
+	if (u >= 10) {
+		*--p = pairs[u * 2 + 1];
+		*--p = pairs[u * 2];
+	} else {
+		*--p = (char)('0' + u);
+	}
+	if (n < 0) {
+		*--p = '-';
+	}
+	rs_outport_write(port, p, digits + sizeof(digits) - p);
+}
+
+
+long rs_outport_offset(struct rs_outport *port)
+{
+	assert(port != NULL);
+	return (long)(port->base + port->pos + port->dropped);
+}
+
+
+static struct rs_outport *rs_outport_alloc(enum rs_outport_kind kind)
+{
+	struct rs_outport *port = calloc(1, sizeof(struct rs_outport));
+	if (port == NULL) {
+		rs_fatal("could not allocate port:");
+	}
+	port->kind = kind;
+	port->fd = -1;
+	return port;
+}
+
+
+/* Returns 0, with errno set, if the write fails. */
+static int rs_outport_write_fd(int fd, const char *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 0;
+		}
+		data += n;
+		len -= n;
+	}
+	return 1;
+}
@@ -0,0 +1,237 @@
+#include "rescheme.h"
+
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Input ports keep their own buffer, so the reader only needs a compare and an
+   increment to get the next character. Ports read from a file descriptor fill
+   the buffer with read(2) whenever it runs out; in-memory ports have all of
+   their input in the buffer from the start.
+
+   Line and column numbers are only kept when position tracking is turned on.
+   Even then, nothing happens per character: lines are counted in bulk, from
+   the last point that was located up to the next one, and whenever the buffer
+   is about to be refilled.
+*/
+
+#define _PORT_BUFSIZE 65536
+
+/* The scratch buffer keeps its memory between reads, unless it grew larger
+   than this (reading a very long string, say).
+*/
+#define _PORT_SCRATCH_MAX 65536
+
+
+static struct rs_port *rs_port_alloc(void);
+static void rs_port_scan(struct rs_port *port, size_t upto);
+
+
+struct rs_port *rs_port_open_fd(int fd)
+{
+	assert(fd >= 0);
+
+	struct rs_port *port = rs_port_alloc();
+	port->fd = fd;
+	port->owned = malloc(_PORT_BUFSIZE);
+	if (port->owned == NULL) {
+		rs_fatal("could not allocate port buffer:");
+	}
+	port->buf = port->owned;
+	port->cap = _PORT_BUFSIZE;
+	return port;
+}
+
+
+struct rs_port *rs_port_open_mem(const char *data, size_t len)
+{
+	assert(data != NULL);
+
+	struct rs_port *port = rs_port_alloc();
+	port->buf = (const unsigned char *)data;
+	port->end = len;
+	port->cap = len;
+	return port;
+}
+
+
+struct rs_port *rs_port_open_mmap(const char *path)
+{
+	assert(path != NULL);
+
+	struct rs_source *src = rs_source_map(path);
+	if (src == NULL) {
+		return NULL;
+	}
+	struct rs_port *port = rs_port_open_mem(rs_source_data(src),
+	                                        rs_source_len(src));
+	port->source = src;
+	return port;
+}
+
+
+void rs_port_close(struct rs_port *port)
+{
+	assert(port != NULL);
+
+	if (port->source != NULL) {
+		rs_source_release(port->source);
+	}
+	if (port->srcloc != NULL) {
+		rs_srcloc_free(port->srcloc);
+	}
+	rs_buf_reset(&port->scratch);
+	free(port->owned);
+	free(port);
+}
+
+
+void rs_port_track(struct rs_port *port, int on)
+{
+	assert(port != NULL);
+
+	if (on && port->srcloc == NULL) {
+		/* Catch the line count up to the current position. Anything that was
+		   already discarded from the buffer has to be assumed to be line-free,
+		   so tracking should be turned on before reading starts. */
+		port->scan = port->pos;
+		port->srcloc = rs_srcloc_create();
+	} else if (!on && port->srcloc != NULL) {
+		rs_srcloc_free(port->srcloc);
+		port->srcloc = NULL;
+	}
+}
+
+
+struct rs_source *rs_port_source(struct rs_port *port)
+{
+	assert(port != NULL);
+	return port->source;
+}
+
+
+struct rs_buf *rs_port_scratch(struct rs_port *port)
+{
+	assert(port != NULL);
+
+	if (rs_buf_cap(&port->scratch) > _PORT_SCRATCH_MAX) {
+		rs_buf_reset(&port->scratch);
+	} else {
+		rs_buf_clear(&port->scratch);
+	}
+	return &port->scratch;
+}
+
+
+void rs_port_share(struct rs_port *port, int on)
+{
+	assert(port != NULL);
+
+	if (on) {
+		port->flags |= _PORT_FLAG_SHARE;
+	} else {
+		port->flags &= ~_PORT_FLAG_SHARE;
+	}
+}
+
+
+int rs_port_share_p(struct rs_port *port)
+{
+	assert(port != NULL);
+	return (port->flags & _PORT_FLAG_SHARE) != 0;
+}
+
+
+struct rs_srcloc *rs_port_srcloc(struct rs_port *port)
+{
+	assert(port != NULL);
+	return port->srcloc;
+}
+
+
+void rs_port_locate(struct rs_port *port, long offset, struct rs_srcpos *pos)
+{
+	assert(port != NULL);
+	assert(pos != NULL);
+	assert(port->srcloc != NULL);
+	assert(offset <= port->base + (long)port->end);
+
+	/* Offsets before the last one located (which can happen after a push-back)
+	   just get the last position. */
+	if (offset > port->base + (long)port->scan) {
+		rs_port_scan(port, (size_t)(offset - port->base));
+	}
+	pos->line = port->line;
+	pos->col = port->col;
+}
+
+
+int rs_port_fill(struct rs_port *port)
+{
+	assert(port != NULL);
+	assert(port->pos == port->end);
+
+	if (port->fd < 0) {
+		return EOF;
+	}
+
+	if (port->srcloc != NULL) {
+		rs_port_scan(port, port->end);
+	}
+	port->base += port->end;
+	port->pos = port->end = port->scan = 0;
+
+	/* Let the other threads collect while this one waits for input. The
+	   readers keep what they've made so far rooted. */
+	int blocked = rs_vm_current() != NULL;
+	if (blocked) {
+		rs_gc_block();
+	}
+	ssize_t n;
+	do {
+		n = read(port->fd, port->owned, port->cap);
+	} while (n < 0 && errno == EINTR);
+	if (blocked) {
+		rs_gc_unblock();
+	}
+	if (n < 0) {
+		rs_fatal("could not read from port:");
+	} else if (n == 0) {
+		return EOF;
+	}
+
+	port->end = n;
+	return port->buf[port->pos++];
+}
+
+
+static struct rs_port *rs_port_alloc(void)
+{
+	struct rs_port *port = calloc(1, sizeof(struct rs_port));
+	if (port == NULL) {
+		rs_fatal("could not allocate port:");
+	}
+	port->fd = -1;
+	rs_buf_init(&port->scratch);
+	port->line = 1;
+	port->col = 1;
+	return port;
+}
+
+
+/* Advance the line and column counts to the given buffer index. */
+static void rs_port_scan(struct rs_port *port, size_t upto)
+{
+	assert(upto >= port->scan && upto <= port->end);
+
+	const unsigned char *p = port->buf + port->scan;
+	const unsigned char *end = port->buf + upto;
+	const unsigned char *nl;
+	while ((nl = memchr(p, '\n', end - p)) != NULL) {
+		port->line++;
+		port->col = 1;
+		p = nl + 1;
+	}
+	port->col += end - p;
+	port->scan = upto;
+}
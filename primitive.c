@@ -0,0 +1,1998 @@
+#include "rescheme.h"
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+/* Primitive procedures get their arguments as an array, which is part of the
+   VM's stack, so they stay alive while the primitive allocates. Primitives
+   may also overwrite their arguments, which is handy for keeping intermediate
+   results alive.
+*/
+
+static rs_pair *rs_primitive_pair(rs_object obj, const char *name);
+static rs_pair *rs_primitive_mutable_pair(rs_object obj, const char *name);
+static rs_vector *rs_primitive_vector(rs_object obj, const char *name);
+static rs_bytevector *rs_primitive_bytevector(rs_object obj, int mutable,
+                                              const char *name);
+static rs_hashtable *rs_primitive_table(rs_object obj, rs_object key,
+                                        const char *name);
+static void rs_primitive_channel(rs_object obj, const char *name);
+static size_t rs_primitive_index(rs_object obj, size_t limit,
+                                 const char *name);
+static int rs_primitive_fd(rs_object obj, const char *name);
+static rs_object rs_primitive_integer(rs_object obj, const char *name);
+static double rs_primitive_double(rs_object obj, const char *name);
+static int rs_primitive_cmp_exact(rs_object a, double y);
+static rs_object rs_primitive_bits(rs_object r);
+static rs_object rs_primitive_arith(rs_object a, rs_object b, int op,
+                                    const char *name);
+
+
+void rs_primitive_set_output(struct rs_outport *out)
+{
+	rs_vm_current()->output = out;
+}
+
+
+/** Numbers **/
+
+/* Arithmetic stays on fixnums for as long as it can, and only goes to
+   rs_primitive_arith() once a result overflows, or an argument isn't a
+   fixnum.
+*/
+static rs_object rs_prim_add(rs_object *args, int nargs)
+{
+	rs_object sum = rs_fixnum_to_obj(0);
+	for (int i = 0; i < nargs; i++) {
+		if (!rs_fixnum_add(sum, args[i], &sum)) {
+			sum = rs_primitive_arith(sum, args[i], '+', "+");
+		}
+		args[i] = sum;
+	}
+	return sum;
+}
+
+
+static rs_object rs_prim_sub(rs_object *args, int nargs)
+{
+	if (nargs == 1) {
+		rs_object r;
+		if (rs_fixnum_sub(rs_fixnum_to_obj(0), args[0], &r)) {
+			return r;
+		}
+		return rs_primitive_arith(rs_fixnum_to_obj(0), args[0], '-', "-");
+	}
+	for (int i = 1; i < nargs; i++) {
+		if (!rs_fixnum_sub(args[0], args[i], &args[0])) {
+			args[0] = rs_primitive_arith(args[0], args[i], '-', "-");
+		}
+	}
+	return args[0];
+}
+
+
+static rs_object rs_prim_mul(rs_object *args, int nargs)
+{
+	rs_object product = rs_fixnum_to_obj(1);
+	for (int i = 0; i < nargs; i++) {
+		if (!rs_fixnum_mul(product, args[i], &product)) {
+			product = rs_primitive_arith(product, args[i], '*', "*");
+		}
+		args[i] = product;
+	}
+	return product;
+}
+
+
+/* There are no exact rationals, so division is exact only when the result is
+   an integer.
+*/
+static rs_object rs_prim_div(rs_object *args, int nargs)
+{
+	if (nargs == 1) {
+		args[1] = args[0];
+		args[0] = rs_fixnum_to_obj(1);
+		nargs = 2;
+	}
+	for (int i = 1; i < nargs; i++) {
+		rs_object a = args[0], b = args[i];
+		if (rs_fixnums_p(a, b) && b != rs_fixnum_to_obj(0) &&
+		    (a - _FIXNUM_TAG) % (b - _FIXNUM_TAG) == 0) {
+			args[0] = rs_fixnum_to_obj(rs_obj_to_fixnum(a) /
+			                           rs_obj_to_fixnum(b));
+			continue;
+		}
+		double x = rs_primitive_double(a, "/");
+		double y = rs_primitive_double(b, "/");
+		if (y == 0 && !rs_flonum_p(a) && !rs_flonum_p(b)) {
+			rs_fatal("/: division by zero");
+		}
+		args[0] = rs_flonum_create(x / y);
+	}
+	return args[0];
+}
+
+
+/* quotient, remainder and modulo on integers. Fixnum remainders are taken from
+   the tagged objects: (4a) % (4b) is 4(a % b). Anything bigger goes to the
+   bignum code, and modulo is fixed up from the remainder.
+*/
+static rs_object rs_prim_divide(rs_object *args, const char *name, int op)
+{
+	rs_primitive_integer(args[0], name);
+	rs_primitive_integer(args[1], name);
+	if (args[1] == rs_fixnum_to_obj(0)) {
+		rs_fatal("%s: division by zero", name);
+	}
+	if (!rs_fixnums_p(args[0], args[1])) {
+		if (op == 'q') {
+			return rs_bignum_quotient(args[0], args[1]);
+		}
+		rs_object r = rs_bignum_remainder(args[0], args[1]);
+		if (op == 'm' && r != rs_fixnum_to_obj(0) &&
+		    (rs_bignum_cmp(r, rs_fixnum_to_obj(0)) < 0) !=
+		    (rs_bignum_cmp(args[1], rs_fixnum_to_obj(0)) < 0)) {
+			r = rs_bignum_add(r, args[1]);
+		}
+		return r;
+	}
+	long a = args[0] - _FIXNUM_TAG;
+	long b = args[1] - _FIXNUM_TAG;
+	long r = a % b;
+	switch (op) {
+	case 'q':
+		return rs_fixnum_to_obj(a / b);
+	case 'r':
+		return r + _FIXNUM_TAG;
+	default:
+		if (r != 0 && (r < 0) != (b < 0)) {
+			r += b;
+		}
+		return r + _FIXNUM_TAG;
+	}
+}
+
+static rs_object rs_prim_quotient(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_prim_divide(args, "quotient", 'q');
+}
+
+static rs_object rs_prim_remainder(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_prim_divide(args, "remainder", 'r');
+}
+
+static rs_object rs_prim_modulo(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_prim_divide(args, "modulo", 'm');
+}
+
+
+/* Compare each pair of neighbouring arguments. Fixnums are compared as
+   objects, and flonums as doubles. An integer compared with a flonum is
+   compared exactly, without being rounded to a double. NaN isn't less than,
+   equal to, or greater than anything.
+*/
+static rs_object rs_prim_compare(rs_object *args, int nargs, const char *name,
+                                 int lt, int eq, int gt)
+{
+	for (int i = 0; i < nargs; i++) {
+		rs_primitive_double(args[i], name);
+	}
+	for (int i = 0; i + 1 < nargs; i++) {
+		rs_object a = args[i], b = args[i + 1];
+		int c;
+		if (rs_fixnums_p(a, b)) {
+			c = (a > b) - (a < b);
+		} else if (rs_flonum_p(a) || rs_flonum_p(b)) {
+			double x = rs_primitive_double(a, name);
+			double y = rs_primitive_double(b, name);
+			if (x != x || y != y) {
+				return rs_false;
+			}
+			if (rs_flonum_p(a) && rs_flonum_p(b)) {
+				c = (x > y) - (x < y);
+			} else if (rs_flonum_p(b)) {
+				c = rs_primitive_cmp_exact(a, y);
+			} else {
+				c = -rs_primitive_cmp_exact(b, x);
+			}
+		} else {
+			c = rs_bignum_cmp(a, b);
+		}
+		if (!(c < 0 ? lt : c == 0 ? eq : gt)) {
+			return rs_false;
+		}
+	}
+	return rs_true;
+}
+
+static rs_object rs_prim_num_eq(rs_object *args, int nargs)
+{
+	return rs_prim_compare(args, nargs, "=", 0, 1, 0);
+}
+
+static rs_object rs_prim_lt(rs_object *args, int nargs)
+{
+	return rs_prim_compare(args, nargs, "<", 1, 0, 0);
+}
+
+static rs_object rs_prim_gt(rs_object *args, int nargs)
+{
+	return rs_prim_compare(args, nargs, ">", 0, 0, 1);
+}
+
+static rs_object rs_prim_le(rs_object *args, int nargs)
+{
+	return rs_prim_compare(args, nargs, "<=", 1, 1, 0);
+}
+
+static rs_object rs_prim_ge(rs_object *args, int nargs)
+{
+	return rs_prim_compare(args, nargs, ">=", 0, 1, 1);
+}
+
+
+/* Conversions between exact and inexact numbers. Without exact rationals,
+   only integral flonums can be made exact.
+*/
+static rs_object rs_prim_exact_to_inexact(rs_object *args, int nargs)
+{
+	(void) nargs;
+	if (rs_flonum_p(args[0])) {
+		return args[0];
+	}
+	return rs_flonum_create(rs_primitive_double(args[0], "exact->inexact"));
+}
+
+static rs_object rs_prim_inexact_to_exact(rs_object *args, int nargs)
+{
+	(void) nargs;
+	if (!rs_flonum_p(args[0])) {
+		return rs_primitive_integer(args[0], "inexact->exact");
+	}
+	double val = rs_flonum_value(args[0]);
+	if (!isfinite(val) || floor(val) != val) {
+		rs_fatal("inexact->exact: no exact representation");
+	}
+	return rs_bignum_from_double(val);
+}
+
+
+/* Rounding leaves integers alone, and rounds flonums to integral flonums. */
+static rs_object rs_primitive_round(rs_object *args, const char *name,
+                                    double (*fn)(double))
+{
+	if (!rs_flonum_p(args[0])) {
+		return rs_primitive_integer(args[0], name);
+	}
+	return rs_flonum_create(fn(rs_flonum_value(args[0])));
+}
+
+static rs_object rs_prim_floor(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_primitive_round(args, "floor", floor);
+}
+
+static rs_object rs_prim_ceiling(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_primitive_round(args, "ceiling", ceil);
+}
+
+static rs_object rs_prim_truncate(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_primitive_round(args, "truncate", trunc);
+}
+
+/* nearbyint() rounds halfway cases to even, in the default rounding mode. */
+static rs_object rs_prim_round(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_primitive_round(args, "round", nearbyint);
+}
+
+
+/* The rest of the math functions always give flonums, except that the square
+   root of an exact square is exact.
+*/
+static rs_object rs_primitive_math(rs_object *args, const char *name,
+                                   double (*fn)(double))
+{
+	return rs_flonum_create(fn(rs_primitive_double(args[0], name)));
+}
+
+static rs_object rs_prim_sqrt(rs_object *args, int nargs)
+{
+	(void) nargs;
+	if (rs_fixnum_p(args[0]) && rs_obj_to_fixnum(args[0]) >= 0) {
+		rs_fixnum n = rs_obj_to_fixnum(args[0]);
+		rs_fixnum r = (rs_fixnum)sqrt((double)n);
+		while (r * r > n) {
+			r--;
+		}
+		while ((r + 1) * (r + 1) <= n) {
+			r++;
+		}
+		if (r * r == n) {
+			return rs_fixnum_to_obj(r);
+		}
+	}
+	return rs_primitive_math(args, "sqrt", sqrt);
+}
+
+static rs_object rs_prim_exp(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_primitive_math(args, "exp", exp);
+}
+
+static rs_object rs_prim_log(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_primitive_math(args, "log", log);
+}
+
+static rs_object rs_prim_sin(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_primitive_math(args, "sin", sin);
+}
+
+static rs_object rs_prim_cos(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_primitive_math(args, "cos", cos);
+}
+
+static rs_object rs_prim_atan(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_primitive_math(args, "atan", atan);
+}
+
+
+/* The bitwise operations only work on fixnums, too. and and or leave the tag
+   as it is, and xor needs it put back.
+*/
+static rs_object rs_prim_bitwise(rs_object *args, int nargs, const char *name,
+                                 int op)
+{
+	rs_object r = op == '&' ? rs_fixnum_to_obj(-1) : rs_fixnum_to_obj(0);
+	for (int i = 0; i < nargs; i++) {
+		if (!rs_fixnum_p(args[i])) {
+			rs_fatal("%s: expected fixnums", name);
+		}
+		switch (op) {
+		case '&':
+			r &= args[i];
+			break;
+		case '|':
+			r |= args[i];
+			break;
+		default:
+			r = (r ^ args[i]) | _FIXNUM_TAG;
+			break;
+		}
+	}
+	return rs_primitive_bits(r);
+}
+
+static rs_object rs_prim_bitwise_and(rs_object *args, int nargs)
+{
+	return rs_prim_bitwise(args, nargs, "bitwise-and", '&');
+}
+
+static rs_object rs_prim_bitwise_ior(rs_object *args, int nargs)
+{
+	return rs_prim_bitwise(args, nargs, "bitwise-ior", '|');
+}
+
+static rs_object rs_prim_bitwise_xor(rs_object *args, int nargs)
+{
+	return rs_prim_bitwise(args, nargs, "bitwise-xor", '^');
+}
+
+static rs_object rs_prim_bitwise_not(rs_object *args, int nargs)
+{
+	(void) nargs;
+	if (!rs_fixnum_p(args[0])) {
+		rs_fatal("bitwise-not: expected fixnums");
+	}
+	return rs_primitive_bits(rs_fixnum_to_obj(~rs_obj_to_fixnum(args[0])));
+}
+
+
+/* Shifting left is multiplying by a power of two, which can overflow into a
+   bignum a few bits at a time.
+*/
+static rs_object rs_prim_arithmetic_shift(rs_object *args, int nargs)
+{
+	(void) nargs;
+	if (!rs_fixnums_p(args[0], args[1])) {
+		rs_fatal("arithmetic-shift: expected fixnums");
+	}
+	rs_fixnum n = rs_obj_to_fixnum(args[0]);
+	rs_fixnum k = rs_obj_to_fixnum(args[1]);
+	if (k <= 0) {
+		long width = sizeof(long) * CHAR_BIT;
+		return rs_fixnum_to_obj(n >> (-k < width ? -k : width - 1));
+	}
+	while (k > 0) {
+		int step = k < 16 ? (int)k : 16;
+		if (!rs_fixnum_mul(args[0], rs_fixnum_to_obj(1L << step), &args[0])) {
+			args[0] = rs_bignum_mul(args[0], rs_fixnum_to_obj(1L << step));
+		}
+		k -= step;
+	}
+	return args[0];
+}
+
+
+/** Pairs and lists **/
+
+static rs_object rs_prim_cons(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_pair_create(args[0], args[1]);
+}
+
+static rs_object rs_prim_car(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_pair_car(rs_primitive_pair(args[0], "car"));
+}
+
+static rs_object rs_prim_cdr(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_pair_cdr(rs_primitive_pair(args[0], "cdr"));
+}
+
+static rs_object rs_prim_set_car(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_pair_set_car(rs_primitive_mutable_pair(args[0], "set-car!"), args[1]);
+	return rs_unspecified;
+}
+
+static rs_object rs_prim_set_cdr(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_pair_set_cdr(rs_primitive_mutable_pair(args[0], "set-cdr!"), args[1]);
+	return rs_unspecified;
+}
+
+static rs_object rs_prim_cadr(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_object cdr = rs_pair_cdr(rs_primitive_pair(args[0], "cadr"));
+	return rs_pair_car(rs_primitive_pair(cdr, "cadr"));
+}
+
+static rs_object rs_prim_cddr(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_object cdr = rs_pair_cdr(rs_primitive_pair(args[0], "cddr"));
+	return rs_pair_cdr(rs_primitive_pair(cdr, "cddr"));
+}
+
+static rs_object rs_prim_caddr(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_object cdr = rs_pair_cdr(rs_primitive_pair(args[0], "caddr"));
+	cdr = rs_pair_cdr(rs_primitive_pair(cdr, "caddr"));
+	return rs_pair_car(rs_primitive_pair(cdr, "caddr"));
+}
+
+
+/* Build a list from the arguments, back to front. The list is kept in the
+   last argument's slot while it grows.
+*/
+static rs_object rs_prim_list(rs_object *args, int nargs)
+{
+	rs_object list = rs_null;
+	for (int i = nargs - 1; i >= 0; i--) {
+		list = rs_pair_create(args[i], list);
+		args[i] = list;
+	}
+	return list;
+}
+
+static rs_object rs_prim_length(rs_object *args, int nargs)
+{
+	(void) nargs;
+	long n = 0;
+	rs_object l = args[0];
+	for (; rs_pair_p(l); l = rs_pair_cdr(rs_obj_to_pair(l))) {
+		n++;
+	}
+	if (!rs_null_p(l)) {
+		rs_fatal("length: not a proper list");
+	}
+	return rs_fixnum_to_obj(n);
+}
+
+static rs_object rs_prim_reverse(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_object rev = rs_null;
+	rs_gc_push(rev);
+	for (rs_object l = args[0]; !rs_null_p(l);
+	     l = rs_pair_cdr(rs_obj_to_pair(l))) {
+		rev = rs_pair_create(rs_pair_car(rs_primitive_pair(l, "reverse")),
+		                     rev);
+		rs_gc_pop();
+		rs_gc_push(rev);
+	}
+	rs_gc_pop();
+	return rev;
+}
+
+/* Copy every list but the last, and join them up. The copy is made front to
+   back, with its head kept in the first argument's slot.
+*/
+static rs_object rs_prim_append(rs_object *args, int nargs)
+{
+	if (nargs == 0) {
+		return rs_null;
+	}
+	rs_object head = rs_null;
+	rs_pair *tail = NULL;
+	for (int i = 0; i < nargs - 1; i++) {
+		for (rs_object l = args[i]; !rs_null_p(l);
+		     l = rs_pair_cdr(rs_obj_to_pair(l))) {
+			/* args[0] is reused once the copy starts, so the rest of the
+			   first list needs rooting. */
+			rs_gc_push(l);
+			rs_object p = rs_pair_create(
+				rs_pair_car(rs_primitive_pair(l, "append")), rs_null);
+			rs_gc_pop();
+			if (tail == NULL) {
+				head = p;
+				args[0] = head;
+			} else {
+				rs_pair_set_cdr(tail, p);
+			}
+			tail = rs_obj_to_pair(p);
+		}
+	}
+	if (tail == NULL) {
+		return args[nargs - 1];
+	}
+	rs_pair_set_cdr(tail, args[nargs - 1]);
+	return head;
+}
+
+
+/** Vectors **/
+
+static rs_object rs_prim_make_vector(rs_object *args, int nargs)
+{
+	size_t len = rs_primitive_index(args[0], (size_t)rs_fixnum_max,
+	                                "make-vector");
+	return rs_vector_create(len, nargs > 1 ? args[1] : rs_unspecified);
+}
+
+static rs_object rs_prim_vector(rs_object *args, int nargs)
+{
+	rs_object vec = rs_vector_create(nargs, rs_unspecified);
+	if (nargs > 0) {
+		memcpy(rs_vector_data(rs_obj_to_vector(vec)), args,
+		       nargs * sizeof(rs_object));
+	}
+	return vec;
+}
+
+static rs_object rs_prim_vector_length(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_vector *vec = rs_primitive_vector(args[0], "vector-length");
+	return rs_fixnum_to_obj((rs_fixnum)rs_vector_length(vec));
+}
+
+static rs_object rs_prim_vector_ref(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_vector *vec = rs_primitive_vector(args[0], "vector-ref");
+	return rs_vector_ref(vec, rs_primitive_index(args[1],
+	                                             rs_vector_length(vec),
+	                                             "vector-ref"));
+}
+
+static rs_object rs_prim_vector_set(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_vector *vec = rs_primitive_vector(args[0], "vector-set!");
+	rs_vector_set(vec, rs_primitive_index(args[1], rs_vector_length(vec),
+	                                      "vector-set!"), args[2]);
+	return rs_unspecified;
+}
+
+static rs_object rs_prim_vector_to_list(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_primitive_vector(args[0], "vector->list");
+	return rs_vector_to_list(args[0]);
+}
+
+static rs_object rs_prim_list_to_vector(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_object l = args[0];
+	while (rs_pair_p(l)) {
+		l = rs_pair_cdr(rs_obj_to_pair(l));
+	}
+	if (!rs_null_p(l)) {
+		rs_fatal("list->vector: not a proper list");
+	}
+	return rs_vector_from_list(args[0]);
+}
+
+/* Get the optional start and end arguments of an operation on a vector (or
+   bytevector) of len elements, which are the last n arguments, and default to
+   the whole vector.
+*/
+static void rs_prim_range(size_t len, rs_object *range, int n,
+                          size_t *start, size_t *end, const char *name)
+{
+	*end = n > 1 ? rs_primitive_index(range[1], len + 1, name) : len;
+	*start = n > 0 ? rs_primitive_index(range[0], *end + 1, name) : 0;
+}
+
+static rs_object rs_prim_vector_fill(rs_object *args, int nargs)
+{
+	rs_vector *vec = rs_primitive_vector(args[0], "vector-fill!");
+	size_t start, end;
+	rs_prim_range(rs_vector_length(vec), args + 2, nargs - 2, &start, &end,
+	              "vector-fill!");
+	rs_vector_fill(vec, args[1], start, end);
+	return rs_unspecified;
+}
+
+static rs_object rs_prim_vector_copy(rs_object *args, int nargs)
+{
+	rs_vector *vec = rs_primitive_vector(args[0], "vector-copy");
+	size_t start, end;
+	rs_prim_range(rs_vector_length(vec), args + 1, nargs - 1, &start, &end,
+	              "vector-copy");
+	return rs_vector_copy(args[0], start, end);
+}
+
+/* The sum of a vector's elements. If they aren't all fixnums, or the sum
+   overflows, it's done like +, with the sum so far kept on the GC stack.
+*/
+static rs_object rs_prim_vector_sum(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_vector *vec = rs_primitive_vector(args[0], "vector-sum");
+	rs_object sum;
+	if (rs_vector_fixnum_sum(vec, &sum)) {
+		return sum;
+	}
+	sum = rs_fixnum_to_obj(0);
+	rs_gc_push(sum);
+	for (size_t i = 0; i < rs_vector_length(vec); i++) {
+		rs_object x = rs_vector_ref(vec, i);
+		if (!rs_fixnum_add(sum, x, &sum)) {
+			sum = rs_primitive_arith(sum, x, '+', "vector-sum");
+		}
+		rs_gc_pop();
+		rs_gc_push(sum);
+	}
+	rs_gc_pop();
+	return sum;
+}
+
+/* The smallest or largest of a vector's elements, compared like < and >. */
+static rs_object rs_prim_vector_pick(rs_object *args, int max,
+                                     const char *name)
+{
+	rs_vector *vec = rs_primitive_vector(args[0], name);
+	if (rs_vector_length(vec) == 0) {
+		rs_fatal("%s: empty vector", name);
+	}
+	rs_object best;
+	if (max ? rs_vector_fixnum_max(vec, &best)
+	        : rs_vector_fixnum_min(vec, &best)) {
+		return best;
+	}
+	best = rs_vector_ref(vec, 0);
+	rs_primitive_double(best, name);
+	for (size_t i = 1; i < rs_vector_length(vec); i++) {
+		rs_object pair[2] = { rs_vector_ref(vec, i), best };
+		if (rs_prim_compare(pair, 2, name, !max, 0, max) == rs_true) {
+			best = pair[0];
+		}
+	}
+	return best;
+}
+
+static rs_object rs_prim_vector_min(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_prim_vector_pick(args, 0, "vector-min");
+}
+
+static rs_object rs_prim_vector_max(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_prim_vector_pick(args, 1, "vector-max");
+}
+
+/* Add or subtract two vectors of numbers elementwise, into a new vector. This
+   is what (vector-map + a b) does (see eval.c).
+*/
+static rs_object rs_prim_vector_arith(rs_object *args, int op,
+                                      const char *name)
+{
+	rs_vector *a = rs_primitive_vector(args[0], name);
+	rs_vector *b = rs_primitive_vector(args[1], name);
+	size_t len = rs_vector_length(a);
+	if (rs_vector_length(b) != len) {
+		rs_fatal("%s: vectors of different lengths", name);
+	}
+
+	rs_object r = rs_vector_create(len, rs_unspecified);
+	rs_vector *dst = rs_obj_to_vector(r);
+	if (rs_vector_fixnum_map(dst, a, b, op)) {
+		return r;
+	}
+	rs_gc_push(r);
+	for (size_t i = 0; i < len; i++) {
+		rs_object x = rs_vector_ref(a, i), y = rs_vector_ref(b, i), s;
+		if (op == '+' ? !rs_fixnum_add(x, y, &s) : !rs_fixnum_sub(x, y, &s)) {
+			s = rs_primitive_arith(x, y, op, name);
+		}
+		rs_vector_set(dst, i, s);
+	}
+	rs_gc_pop();
+	return r;
+}
+
+static rs_object rs_prim_vector_add(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_prim_vector_arith(args, '+', "vector-add");
+}
+
+static rs_object rs_prim_vector_subtract(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_prim_vector_arith(args, '-', "vector-subtract");
+}
+
+
+/** Bytevectors **/
+
+static rs_object rs_prim_make_bytevector(rs_object *args, int nargs)
+{
+	size_t len = rs_primitive_index(args[0], (size_t)rs_fixnum_max,
+	                                "make-bytevector");
+	int fill = nargs > 1 ? (int)rs_primitive_index(args[1], 256,
+	                                               "make-bytevector") : 0;
+	return rs_bytevector_create(len, fill);
+}
+
+static rs_object rs_prim_bytevector(rs_object *args, int nargs)
+{
+	for (int i = 0; i < nargs; i++) {
+		rs_primitive_index(args[i], 256, "bytevector");
+	}
+	rs_object obj = rs_bytevector_create(nargs, 0);
+	unsigned char *data = rs_bytevector_data(rs_obj_to_bytevector(obj));
+	for (int i = 0; i < nargs; i++) {
+		data[i] = (unsigned char)rs_obj_to_fixnum(args[i]);
+	}
+	return obj;
+}
+
+static rs_object rs_prim_bytevector_length(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_bytevector *bv = rs_primitive_bytevector(args[0], 0,
+	                                            "bytevector-length");
+	return rs_fixnum_to_obj((rs_fixnum)rs_bytevector_length(bv));
+}
+
+static rs_object rs_prim_bytevector_copy(rs_object *args, int nargs)
+{
+	rs_bytevector *bv = rs_primitive_bytevector(args[0], 0,
+	                                            "bytevector-copy");
+	size_t start, end;
+	rs_prim_range(rs_bytevector_length(bv), args + 1, nargs - 1, &start, &end,
+	              "bytevector-copy");
+	return rs_bytevector_copy(args[0], start, end);
+}
+
+/* (bytevector-copy! to at from [start [end]]), as in R7RS. */
+static rs_object rs_prim_bytevector_copy_to(rs_object *args, int nargs)
+{
+	rs_bytevector *to = rs_primitive_bytevector(args[0], 1,
+	                                            "bytevector-copy!");
+	size_t at = rs_primitive_index(args[1], rs_bytevector_length(to) + 1,
+	                               "bytevector-copy!");
+	rs_bytevector *from = rs_primitive_bytevector(args[2], 0,
+	                                              "bytevector-copy!");
+	size_t start, end;
+	rs_prim_range(rs_bytevector_length(from), args + 3, nargs - 3, &start,
+	              &end, "bytevector-copy!");
+	if (end - start > rs_bytevector_length(to) - at) {
+		rs_fatal("bytevector-copy!: index out of range");
+	}
+	rs_bytevector_move(to, at, from, start, end);
+	return rs_unspecified;
+}
+
+static rs_object rs_prim_bytevector_fill(rs_object *args, int nargs)
+{
+	rs_bytevector *bv = rs_primitive_bytevector(args[0], 1,
+	                                            "bytevector-fill!");
+	int fill = (int)rs_primitive_index(args[1], 256, "bytevector-fill!");
+	size_t start, end;
+	rs_prim_range(rs_bytevector_length(bv), args + 2, nargs - 2, &start, &end,
+	              "bytevector-fill!");
+	memset(rs_bytevector_data(bv) + start, fill, end - start);
+	return rs_unspecified;
+}
+
+static rs_object rs_prim_utf8_to_string(rs_object *args, int nargs)
+{
+	rs_bytevector *bv = rs_primitive_bytevector(args[0], 0, "utf8->string");
+	size_t start, end;
+	rs_prim_range(rs_bytevector_length(bv), args + 1, nargs - 1, &start, &end,
+	              "utf8->string");
+	return rs_string_create_n((const char *)rs_bytevector_data(bv) + start,
+	                          end - start);
+}
+
+static rs_object rs_prim_string_to_utf8(rs_object *args, int nargs)
+{
+	(void) nargs;
+	if (!rs_string_p(args[0])) {
+		rs_fatal("string->utf8: not a string");
+	}
+	rs_string *str = rs_obj_to_string(args[0]);
+	rs_object obj = rs_bytevector_create(rs_string_length(str), 0);
+	memcpy(rs_bytevector_data(rs_obj_to_bytevector(obj)),
+	       rs_string_data(str), rs_string_length(str));
+	return obj;
+}
+
+/* (file->bytevector path [start [end]]) maps a file, or part of one, instead
+   of reading it.
+*/
+static rs_object rs_prim_file_to_bytevector(rs_object *args, int nargs)
+{
+	if (!rs_string_p(args[0])) {
+		rs_fatal("file->bytevector: not a string");
+	}
+	size_t start = nargs > 1 ? rs_primitive_index(args[1],
+	                                              (size_t)rs_fixnum_max,
+	                                              "file->bytevector") : 0;
+	size_t end = nargs > 2 ? rs_primitive_index(args[2],
+	                                            (size_t)rs_fixnum_max,
+	                                            "file->bytevector") : SIZE_MAX;
+
+	rs_string *str = rs_obj_to_string(args[0]);
+	char *path = malloc(rs_string_length(str) + 1);
+	if (path == NULL) {
+		rs_fatal("file->bytevector:");
+	}
+	memcpy(path, rs_string_data(str), rs_string_length(str));
+	path[rs_string_length(str)] = '\0';
+
+	rs_object obj = rs_bytevector_map(path, start, end);
+	if (obj == rs_false) {
+		rs_fatal("file->bytevector: could not map %s:", path);
+	}
+	free(path);
+	return obj;
+}
+
+/* The endianness argument, if there is one, is the symbol big or little. */
+static int rs_prim_endianness(rs_object *args, int nargs, int i,
+                              const char *name)
+{
+	if (nargs <= i) {
+		return rs_bytevector_native_big();
+	}
+	if (rs_symbol_p(args[i])) {
+		const char *e = rs_symbol_cstr(rs_obj_to_symbol(args[i]));
+		if (strcmp(e, "big") == 0) {
+			return 1;
+		} else if (strcmp(e, "little") == 0) {
+			return 0;
+		}
+	}
+	rs_fatal("%s: endianness must be big or little", name);
+	return 0;
+}
+
+/* Check that a size-byte value at obj fits in a bytevector. */
+static size_t rs_prim_offset(rs_bytevector *bv, rs_object obj, int size,
+                             const char *name)
+{
+	size_t len = rs_bytevector_length(bv);
+	return rs_primitive_index(obj, len >= (size_t)size ? len - size + 1 : 0,
+	                          name);
+}
+
+/* Integers are stored as size-byte bit patterns, in two's complement if
+   they're signed.
+*/
+static rs_object rs_prim_from_bits(uint64_t bits, int size, int sign)
+{
+	uint64_t mag = bits;
+	int neg = 0;
+	if (sign && (bits >> (8 * size - 1)) != 0) {
+		if (size < 8) {
+			bits |= ~UINT64_C(0) << (8 * size);
+		}
+		mag = -bits;
+		neg = 1;
+	}
+	if (mag <= (uint64_t)rs_fixnum_max) {
+		return rs_fixnum_to_obj(neg ? -(rs_fixnum)mag : (rs_fixnum)mag);
+	}
+	uint32_t digits[2] = { (uint32_t)mag, (uint32_t)(mag >> 32) };
+	return rs_bignum_from_digits(digits, 2, neg);
+}
+
+static uint64_t rs_prim_to_bits(rs_object obj, int size, int sign,
+                                const char *name)
+{
+	uint64_t mag;
+	int neg;
+	if (rs_fixnum_p(obj)) {
+		rs_fixnum f = rs_obj_to_fixnum(obj);
+		neg = f < 0;
+		mag = neg ? -(uint64_t)f : (uint64_t)f;
+	} else if (rs_bignum_p(obj)) {
+		const uint32_t *digits;
+		size_t len = rs_bignum_digits(rs_obj_to_bignum(obj), &digits, &neg);
+		if (len > 2) {
+			rs_fatal("%s: value out of range", name);
+		}
+		mag = digits[0] | (len > 1 ? (uint64_t)digits[1] << 32 : 0);
+	} else {
+		rs_fatal("%s: not an integer", name);
+		return 0;
+	}
+
+	int bits = 8 * size;
+	int ok;
+	if (sign) {
+		uint64_t half = UINT64_C(1) << (bits - 1);
+		ok = neg ? mag <= half : mag < half;
+	} else {
+		ok = !neg && (bits == 64 || mag < UINT64_C(1) << bits);
+	}
+	if (!ok) {
+		rs_fatal("%s: value out of range", name);
+	}
+	return neg ? -mag : mag;
+}
+
+static rs_object rs_prim_bytevector_int_ref(rs_object *args, int nargs,
+                                            int size, int sign,
+                                            const char *name)
+{
+	rs_bytevector *bv = rs_primitive_bytevector(args[0], 0, name);
+	size_t i = rs_prim_offset(bv, args[1], size, name);
+	int big = rs_prim_endianness(args, nargs, 2, name);
+	return rs_prim_from_bits(rs_bytevector_ref_uint(bv, i, size, big), size,
+	                         sign);
+}
+
+static rs_object rs_prim_bytevector_int_set(rs_object *args, int nargs,
+                                            int size, int sign,
+                                            const char *name)
+{
+	rs_bytevector *bv = rs_primitive_bytevector(args[0], 1, name);
+	size_t i = rs_prim_offset(bv, args[1], size, name);
+	uint64_t bits = rs_prim_to_bits(args[2], size, sign, name);
+	int big = rs_prim_endianness(args, nargs, 3, name);
+	rs_bytevector_set_uint(bv, i, size, big, bits);
+	return rs_unspecified;
+}
+
+static rs_object rs_prim_bytevector_float_ref(rs_object *args, int nargs,
+                                              int size, const char *name)
+{
+	rs_bytevector *bv = rs_primitive_bytevector(args[0], 0, name);
+	size_t i = rs_prim_offset(bv, args[1], size, name);
+	uint64_t bits = rs_bytevector_ref_uint(bv, i, size,
+	                                       rs_prim_endianness(args, nargs, 2,
+	                                                          name));
+	if (size == 4) {
+		uint32_t b = (uint32_t)bits;
+		float f;
+		memcpy(&f, &b, sizeof(f));
+		return rs_flonum_create(f);
+	}
+	double d;
+	memcpy(&d, &bits, sizeof(d));
+	return rs_flonum_create(d);
+}
+
+static rs_object rs_prim_bytevector_float_set(rs_object *args, int nargs,
+                                              int size, const char *name)
+{
+	rs_bytevector *bv = rs_primitive_bytevector(args[0], 1, name);
+	size_t i = rs_prim_offset(bv, args[1], size, name);
+	double d = rs_primitive_double(args[2], name);
+	uint64_t bits;
+	if (size == 4) {
+		float f = (float)d;
+		uint32_t b;
+		memcpy(&b, &f, sizeof(b));
+		bits = b;
+	} else {
+		memcpy(&bits, &d, sizeof(bits));
+	}
+	rs_bytevector_set_uint(bv, i, size, rs_prim_endianness(args, nargs, 3, name),
+	                       bits);
+	return rs_unspecified;
+}
+
+static rs_object rs_prim_bytevector_u8_ref(rs_object *args, int nargs)
+{
+	return rs_prim_bytevector_int_ref(args, nargs, 1, 0, "bytevector-u8-ref");
+}
+
+static rs_object rs_prim_bytevector_u8_set(rs_object *args, int nargs)
+{
+	return rs_prim_bytevector_int_set(args, nargs, 1, 0, "bytevector-u8-set!");
+}
+
+static rs_object rs_prim_bytevector_s8_ref(rs_object *args, int nargs)
+{
+	return rs_prim_bytevector_int_ref(args, nargs, 1, 1, "bytevector-s8-ref");
+}
+
+static rs_object rs_prim_bytevector_s8_set(rs_object *args, int nargs)
+{
+	return rs_prim_bytevector_int_set(args, nargs, 1, 1, "bytevector-s8-set!");
+}
+
+static rs_object rs_prim_bytevector_u16_ref(rs_object *args, int nargs)
+{
+	return rs_prim_bytevector_int_ref(args, nargs, 2, 0, "bytevector-u16-ref");
+}
+
+static rs_object rs_prim_bytevector_u16_set(rs_object *args, int nargs)
+{
+	return rs_prim_bytevector_int_set(args, nargs, 2, 0,
+	                                  "bytevector-u16-set!");
+}
+
+static rs_object rs_prim_bytevector_s16_ref(rs_object *args, int nargs)
+{
+	return rs_prim_bytevector_int_ref(args, nargs, 2, 1, "bytevector-s16-ref");
+}
+
+static rs_object rs_prim_bytevector_s16_set(rs_object *args, int nargs)
+{
+	return rs_prim_bytevector_int_set(args, nargs, 2, 1,
+	                                  "bytevector-s16-set!");
+}
+
+static rs_object rs_prim_bytevector_u32_ref(rs_object *args, int nargs)
+{
+	return rs_prim_bytevector_int_ref(args, nargs, 4, 0, "bytevector-u32-ref");
+}
+
+static rs_object rs_prim_bytevector_u32_set(rs_object *args, int nargs)
+{
+	return rs_prim_bytevector_int_set(args, nargs, 4, 0,
+	                                  "bytevector-u32-set!");
+}
+
+static rs_object rs_prim_bytevector_s32_ref(rs_object *args, int nargs)
+{
+	return rs_prim_bytevector_int_ref(args, nargs, 4, 1, "bytevector-s32-ref");
+}
+
+static rs_object rs_prim_bytevector_s32_set(rs_object *args, int nargs)
+{
+	return rs_prim_bytevector_int_set(args, nargs, 4, 1,
+	                                  "bytevector-s32-set!");
+}
+
+static rs_object rs_prim_bytevector_u64_ref(rs_object *args, int nargs)
+{
+	return rs_prim_bytevector_int_ref(args, nargs, 8, 0, "bytevector-u64-ref");
+}
+
+static rs_object rs_prim_bytevector_u64_set(rs_object *args, int nargs)
+{
+	return rs_prim_bytevector_int_set(args, nargs, 8, 0,
+	                                  "bytevector-u64-set!");
+}
+
+static rs_object rs_prim_bytevector_s64_ref(rs_object *args, int nargs)
+{
+	return rs_prim_bytevector_int_ref(args, nargs, 8, 1, "bytevector-s64-ref");
+}
+
+static rs_object rs_prim_bytevector_s64_set(rs_object *args, int nargs)
+{
+	return rs_prim_bytevector_int_set(args, nargs, 8, 1,
+	                                  "bytevector-s64-set!");
+}
+
+static rs_object rs_prim_bytevector_ieee_single_ref(rs_object *args,
+                                                    int nargs)
+{
+	return rs_prim_bytevector_float_ref(args, nargs, 4,
+	                                    "bytevector-ieee-single-ref");
+}
+
+static rs_object rs_prim_bytevector_ieee_single_set(rs_object *args,
+                                                    int nargs)
+{
+	return rs_prim_bytevector_float_set(args, nargs, 4,
+	                                    "bytevector-ieee-single-set!");
+}
+
+static rs_object rs_prim_bytevector_ieee_double_ref(rs_object *args,
+                                                    int nargs)
+{
+	return rs_prim_bytevector_float_ref(args, nargs, 8,
+	                                    "bytevector-ieee-double-ref");
+}
+
+static rs_object rs_prim_bytevector_ieee_double_set(rs_object *args,
+                                                    int nargs)
+{
+	return rs_prim_bytevector_float_set(args, nargs, 8,
+	                                    "bytevector-ieee-double-set!");
+}
+
+
+/** Predicates **/
+
+static rs_object rs_prim_null_p(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_null_p(args[0]) ? rs_true : rs_false;
+}
+
+static rs_object rs_prim_pair_p(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_pair_p(args[0]) ? rs_true : rs_false;
+}
+
+static rs_object rs_prim_number_p(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_fixnum_p(args[0]) || rs_bignum_p(args[0]) ||
+	       rs_flonum_p(args[0]) ? rs_true : rs_false;
+}
+
+static rs_object rs_prim_integer_p(rs_object *args, int nargs)
+{
+	(void) nargs;
+	if (rs_flonum_p(args[0])) {
+		double val = rs_flonum_value(args[0]);
+		return isfinite(val) && floor(val) == val ? rs_true : rs_false;
+	}
+	return rs_fixnum_p(args[0]) || rs_bignum_p(args[0]) ? rs_true : rs_false;
+}
+
+static rs_object rs_prim_exact_p(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_primitive_double(args[0], "exact?");
+	return rs_flonum_p(args[0]) ? rs_false : rs_true;
+}
+
+static rs_object rs_prim_inexact_p(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_primitive_double(args[0], "inexact?");
+	return rs_flonum_p(args[0]) ? rs_true : rs_false;
+}
+
+static rs_object rs_prim_symbol_p(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_symbol_p(args[0]) ? rs_true : rs_false;
+}
+
+static rs_object rs_prim_string_p(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_string_p(args[0]) ? rs_true : rs_false;
+}
+
+static rs_object rs_prim_char_p(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_character_p(args[0]) ? rs_true : rs_false;
+}
+
+static rs_object rs_prim_boolean_p(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_boolean_p(args[0]) ? rs_true : rs_false;
+}
+
+static rs_object rs_prim_procedure_p(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_procedure_p(args[0]) ? rs_true : rs_false;
+}
+
+static rs_object rs_prim_vector_p(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_vector_p(args[0]) ? rs_true : rs_false;
+}
+
+static rs_object rs_prim_bytevector_p(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_bytevector_p(args[0]) ? rs_true : rs_false;
+}
+
+static rs_object rs_prim_hash_table_p(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_hashtable_p(args[0]) ? rs_true : rs_false;
+}
+
+static rs_object rs_prim_channel_p(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_channel_p(args[0]) ? rs_true : rs_false;
+}
+
+static rs_object rs_prim_future_p(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_future_p(args[0]) ? rs_true : rs_false;
+}
+
+static rs_object rs_prim_not(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return args[0] == rs_false ? rs_true : rs_false;
+}
+
+
+/* Symbols with the same name aren't always the same object, but their names
+   are interned, so they can still be compared by address.
+*/
+int rs_primitive_eq(rs_object a, rs_object b)
+{
+	return a == b || (rs_symbol_p(a) && rs_symbol_p(b) &&
+	                  rs_symbol_cstr(rs_obj_to_symbol(a)) ==
+	                  rs_symbol_cstr(rs_obj_to_symbol(b)));
+}
+
+static rs_object rs_prim_eq_p(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_primitive_eq(args[0], args[1]) ? rs_true : rs_false;
+}
+
+static rs_object rs_prim_eqv_p(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_primitive_eqv(args[0], args[1]) ? rs_true : rs_false;
+}
+
+static rs_object rs_prim_equal_p(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_equal_p(args[0], args[1]) ? rs_true : rs_false;
+}
+
+static rs_object rs_prim_string_eq_p(rs_object *args, int nargs)
+{
+	rs_object r = rs_true;
+	for (int i = 0; i < nargs; i++) {
+		if (!rs_string_p(args[i])) {
+			rs_fatal("string=?: not a string");
+		}
+		if (i > 0 && !rs_equal_p(args[i - 1], args[i])) {
+			r = rs_false;
+		}
+	}
+	return r;
+}
+
+
+/** Hash tables **/
+
+/* A table's kind comes from the equality procedure it's made with. A hash
+   function can be given too, as in SRFI 69, but the table always uses its
+   own, which agrees with the equality procedure anyway.
+*/
+static rs_object rs_prim_make_hash_table(rs_object *args, int nargs)
+{
+	enum rs_hashtable_kind kind = RS_HASH_EQUAL;
+	if (nargs > 0) {
+		rs_object (*fn)(rs_object *, int) = NULL;
+		if (rs_primitive_p(args[0])) {
+			fn = rs_obj_to_primitive(args[0])->val.prim->fn;
+		}
+		if (fn == rs_prim_eq_p) {
+			kind = RS_HASH_EQ;
+		} else if (fn == rs_prim_eqv_p) {
+			kind = RS_HASH_EQV;
+		} else if (fn == rs_prim_equal_p) {
+			kind = RS_HASH_EQUAL;
+		} else if (fn == rs_prim_string_eq_p) {
+			kind = RS_HASH_STRING;
+		} else {
+			rs_fatal("make-hash-table: equality must be eq?, eqv?, equal?, "
+			         "or string=?");
+		}
+	}
+	if (nargs > 1 && !rs_procedure_p(args[1])) {
+		rs_fatal("make-hash-table: not a procedure");
+	}
+	return rs_hashtable_create(kind);
+}
+
+static rs_object rs_prim_hash_table_ref(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_hashtable *table = rs_primitive_table(args[0], args[1],
+	                                         "hash-table-ref");
+	rs_object val;
+	if (!rs_hashtable_get(table, args[1], &val)) {
+		rs_fatal("hash-table-ref: no such key");
+	}
+	return val;
+}
+
+static rs_object rs_prim_hash_table_ref_default(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_hashtable *table = rs_primitive_table(args[0], args[1],
+	                                         "hash-table-ref/default");
+	rs_object val;
+	return rs_hashtable_get(table, args[1], &val) ? val : args[2];
+}
+
+static rs_object rs_prim_hash_table_set(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_hashtable *table = rs_primitive_table(args[0], args[1],
+	                                         "hash-table-set!");
+	rs_hashtable_put(table, args[1], args[2]);
+	return rs_unspecified;
+}
+
+static rs_object rs_prim_hash_table_delete(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_hashtable *table = rs_primitive_table(args[0], args[1],
+	                                         "hash-table-delete!");
+	rs_hashtable_remove(table, args[1]);
+	return rs_unspecified;
+}
+
+static rs_object rs_prim_hash_table_exists_p(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_hashtable *table = rs_primitive_table(args[0], args[1],
+	                                         "hash-table-exists?");
+	return rs_hashtable_get(table, args[1], NULL) ? rs_true : rs_false;
+}
+
+static rs_object rs_prim_hash_table_size(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_hashtable *table = rs_primitive_table(args[0], 0, "hash-table-size");
+	return rs_fixnum_to_obj((rs_fixnum)rs_hashtable_count(table));
+}
+
+static rs_object rs_prim_hash_table_keys(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_primitive_table(args[0], 0, "hash-table-keys");
+	return rs_hashtable_keys(args[0]);
+}
+
+static rs_object rs_prim_hash_table_values(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_primitive_table(args[0], 0, "hash-table-values");
+	return rs_hashtable_values(args[0]);
+}
+
+static rs_object rs_prim_hash_table_to_alist(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_primitive_table(args[0], 0, "hash-table->alist");
+	return rs_hashtable_to_alist(args[0]);
+}
+
+static rs_object rs_prim_hash_table_clear(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_hashtable_clear(rs_primitive_table(args[0], 0, "hash-table-clear!"));
+	return rs_unspecified;
+}
+
+/* Hashes are reduced to fixnums, below bound if one's given. */
+static rs_object rs_prim_hash_with(rs_object *args, int nargs,
+                                   enum rs_hashtable_kind kind,
+                                   const char *name)
+{
+	unsigned long bound = (unsigned long)rs_fixnum_max;
+	if (nargs > 1) {
+		if (!rs_fixnum_p(args[1]) || rs_obj_to_fixnum(args[1]) <= 0) {
+			rs_fatal("%s: bound must be a positive fixnum", name);
+		}
+		bound = (unsigned long)rs_obj_to_fixnum(args[1]);
+	}
+	return rs_fixnum_to_obj((rs_fixnum)(rs_hash(args[0], kind) % bound));
+}
+
+static rs_object rs_prim_hash(rs_object *args, int nargs)
+{
+	return rs_prim_hash_with(args, nargs, RS_HASH_EQUAL, "hash");
+}
+
+static rs_object rs_prim_string_hash(rs_object *args, int nargs)
+{
+	if (!rs_string_p(args[0])) {
+		rs_fatal("string-hash: not a string");
+	}
+	return rs_prim_hash_with(args, nargs, RS_HASH_STRING, "string-hash");
+}
+
+static rs_object rs_prim_hash_by_identity(rs_object *args, int nargs)
+{
+	return rs_prim_hash_with(args, nargs, RS_HASH_EQ, "hash-by-identity");
+}
+
+
+/** Output **/
+
+static rs_object rs_prim_display(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_display(rs_vm_current()->output, args[0]);
+	return rs_unspecified;
+}
+
+static rs_object rs_prim_write(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_write(rs_vm_current()->output, args[0]);
+	return rs_unspecified;
+}
+
+static rs_object rs_prim_write_shared(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_write_shared(rs_vm_current()->output, args[0]);
+	return rs_unspecified;
+}
+
+static rs_object rs_prim_newline(rs_object *args, int nargs)
+{
+	(void) args;
+	(void) nargs;
+	rs_outport_putc(rs_vm_current()->output, '\n');
+	return rs_unspecified;
+}
+
+
+/** Tasks **/
+
+/* The primitives that suspend the running task only ask the VM to, and return
+   straight away (see task.c).
+*/
+static rs_object rs_prim_spawn(rs_object *args, int nargs)
+{
+	(void) nargs;
+	if (!rs_closure_p(args[0])) {
+		rs_fatal("spawn: not a procedure made by lambda");
+	}
+	rs_task_spawn(args[0]);
+	return rs_unspecified;
+}
+
+static rs_object rs_prim_yield(rs_object *args, int nargs)
+{
+	(void) args;
+	(void) nargs;
+	rs_task_yield();
+	return rs_unspecified;
+}
+
+static rs_object rs_prim_sleep(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_task_sleep(rs_primitive_double(args[0], "sleep"));
+	return rs_unspecified;
+}
+
+static rs_object rs_prim_make_channel(rs_object *args, int nargs)
+{
+	(void) args;
+	(void) nargs;
+	return rs_channel_create();
+}
+
+static rs_object rs_prim_channel_put(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_primitive_channel(args[0], "channel-put!");
+	rs_channel_put(args[0], args[1]);
+	return rs_unspecified;
+}
+
+static rs_object rs_prim_channel_get(rs_object *args, int nargs)
+{
+	(void) nargs;
+	rs_primitive_channel(args[0], "channel-get");
+	return rs_channel_get(args[0]);
+}
+
+/* (fd-read! fd bytevector [start [end]]) reads into the bytevector, and
+   (fd-write! fd bytevector [start [end]]) writes from it. Each returns how
+   many bytes it read (0 at end of file) or wrote, and suspends the task
+   while fd isn't ready.
+*/
+static rs_object rs_prim_fd_read(rs_object *args, int nargs)
+{
+	int fd = rs_primitive_fd(args[0], "fd-read!");
+	rs_bytevector *bv = rs_primitive_bytevector(args[1], 1, "fd-read!");
+	size_t start, end;
+	rs_prim_range(rs_bytevector_length(bv), args + 2, nargs - 2, &start, &end,
+	              "fd-read!");
+	long n = rs_task_read(fd, rs_bytevector_data(bv) + start, end - start);
+	return n < 0 ? rs_unspecified : rs_fixnum_to_obj(n);
+}
+
+static rs_object rs_prim_fd_write(rs_object *args, int nargs)
+{
+	int fd = rs_primitive_fd(args[0], "fd-write!");
+	rs_bytevector *bv = rs_primitive_bytevector(args[1], 0, "fd-write!");
+	size_t start, end;
+	rs_prim_range(rs_bytevector_length(bv), args + 2, nargs - 2, &start, &end,
+	              "fd-write!");
+	long n = rs_task_write(fd, rs_bytevector_data(bv) + start, end - start);
+	return n < 0 ? rs_unspecified : rs_fixnum_to_obj(n);
+}
+
+int rs_primitive_suspends_p(const struct rs_primitive_def *def)
+{
+	return def->fn == rs_prim_yield || def->fn == rs_prim_sleep ||
+	       def->fn == rs_prim_channel_get || def->fn == rs_prim_fd_read ||
+	       def->fn == rs_prim_fd_write;
+}
+
+
+/** Futures **/
+
+static rs_object rs_prim_future(rs_object *args, int nargs)
+{
+	(void) nargs;
+	if (!rs_closure_p(args[0])) {
+		rs_fatal("future: not a procedure made by lambda");
+	}
+	return rs_future_create(args[0]);
+}
+
+/* (touch obj) returns a future's value, and any other object itself. */
+static rs_object rs_prim_touch(rs_object *args, int nargs)
+{
+	(void) nargs;
+	return rs_future_p(args[0]) ? rs_future_touch(args[0]) : args[0];
+}
+
+
+/** Control **/
+
+/* (apply f a ... list) spreads the list out after the other arguments. The VM
+   does calls to apply from Scheme code itself, so this is only used from C.
+*/
+rs_object rs_primitive_apply(rs_object *args, int nargs)
+{
+	if (!rs_procedure_p(args[0])) {
+		rs_fatal("apply: not a procedure");
+	}
+	long n = nargs - 2;
+	rs_object l;
+	for (l = args[nargs - 1]; rs_pair_p(l); l = rs_pair_cdr(rs_obj_to_pair(l))) {
+		n++;
+	}
+	if (!rs_null_p(l)) {
+		rs_fatal("apply: not a proper list");
+	}
+
+	rs_object *spread = malloc((n > 0 ? n : 1) * sizeof(rs_object));
+	if (spread == NULL) {
+		rs_fatal("could not allocate arguments:");
+	}
+	memcpy(spread, args + 1, (nargs - 2) * sizeof(rs_object));
+	long i = nargs - 2;
+	for (l = args[nargs - 1]; rs_pair_p(l); l = rs_pair_cdr(rs_obj_to_pair(l))) {
+		spread[i++] = rs_pair_car(rs_obj_to_pair(l));
+	}
+	rs_object result = rs_vm_apply(args[0], spread, (int)n);
+	free(spread);
+	return result;
+}
+
+/* (exit [status]) ends the program, with an exit status of 0 if status is
+   missing or #t, 1 if it's #f, and otherwise status itself, which must be a
+   fixnum. Output that's still buffered is up to the program's atexit(3)
+   handlers.
+*/
+static rs_object rs_prim_exit(rs_object *args, int nargs)
+{
+	int status = EXIT_SUCCESS;
+	if (nargs == 1 && args[0] == rs_false) {
+		status = EXIT_FAILURE;
+	} else if (nargs == 1 && args[0] != rs_true) {
+		if (!rs_fixnum_p(args[0])) {
+			rs_fatal("exit: not an exit status");
+		}
+		status = (int) rs_obj_to_fixnum(args[0]);
+	}
+	exit(status);
+}
+
+
+static const struct rs_primitive_def primitives[] = {
+	{ "+", rs_prim_add, 0, -1 },
+	{ "-", rs_prim_sub, 1, -1 },
+	{ "*", rs_prim_mul, 0, -1 },
+	{ "/", rs_prim_div, 1, -1 },
+	{ "quotient", rs_prim_quotient, 2, 2 },
+	{ "remainder", rs_prim_remainder, 2, 2 },
+	{ "modulo", rs_prim_modulo, 2, 2 },
+	{ "=", rs_prim_num_eq, 1, -1 },
+	{ "<", rs_prim_lt, 1, -1 },
+	{ ">", rs_prim_gt, 1, -1 },
+	{ "<=", rs_prim_le, 1, -1 },
+	{ ">=", rs_prim_ge, 1, -1 },
+	{ "exact->inexact", rs_prim_exact_to_inexact, 1, 1 },
+	{ "inexact->exact", rs_prim_inexact_to_exact, 1, 1 },
+	{ "floor", rs_prim_floor, 1, 1 },
+	{ "ceiling", rs_prim_ceiling, 1, 1 },
+	{ "truncate", rs_prim_truncate, 1, 1 },
+	{ "round", rs_prim_round, 1, 1 },
+	{ "sqrt", rs_prim_sqrt, 1, 1 },
+	{ "exp", rs_prim_exp, 1, 1 },
+	{ "log", rs_prim_log, 1, 1 },
+	{ "sin", rs_prim_sin, 1, 1 },
+	{ "cos", rs_prim_cos, 1, 1 },
+	{ "atan", rs_prim_atan, 1, 1 },
+	{ "bitwise-and", rs_prim_bitwise_and, 0, -1 },
+	{ "bitwise-ior", rs_prim_bitwise_ior, 0, -1 },
+	{ "bitwise-xor", rs_prim_bitwise_xor, 0, -1 },
+	{ "bitwise-not", rs_prim_bitwise_not, 1, 1 },
+	{ "arithmetic-shift", rs_prim_arithmetic_shift, 2, 2 },
+
+	{ "cons", rs_prim_cons, 2, 2 },
+	{ "car", rs_prim_car, 1, 1 },
+	{ "cdr", rs_prim_cdr, 1, 1 },
+	{ "set-car!", rs_prim_set_car, 2, 2 },
+	{ "set-cdr!", rs_prim_set_cdr, 2, 2 },
+	{ "cadr", rs_prim_cadr, 1, 1 },
+	{ "cddr", rs_prim_cddr, 1, 1 },
+	{ "caddr", rs_prim_caddr, 1, 1 },
+	{ "list", rs_prim_list, 0, -1 },
+	{ "length", rs_prim_length, 1, 1 },
+	{ "reverse", rs_prim_reverse, 1, 1 },
+	{ "append", rs_prim_append, 0, -1 },
+
+	{ "make-vector", rs_prim_make_vector, 1, 2 },
+	{ "vector", rs_prim_vector, 0, -1 },
+	{ "vector-length", rs_prim_vector_length, 1, 1 },
+	{ "vector-ref", rs_prim_vector_ref, 2, 2 },
+	{ "vector-set!", rs_prim_vector_set, 3, 3 },
+	{ "vector->list", rs_prim_vector_to_list, 1, 1 },
+	{ "list->vector", rs_prim_list_to_vector, 1, 1 },
+	{ "vector-fill!", rs_prim_vector_fill, 2, 4 },
+	{ "vector-copy", rs_prim_vector_copy, 1, 3 },
+	{ "vector-sum", rs_prim_vector_sum, 1, 1 },
+	{ "vector-min", rs_prim_vector_min, 1, 1 },
+	{ "vector-max", rs_prim_vector_max, 1, 1 },
+	{ "vector-add", rs_prim_vector_add, 2, 2 },
+	{ "vector-subtract", rs_prim_vector_subtract, 2, 2 },
+
+	{ "make-bytevector", rs_prim_make_bytevector, 1, 2 },
+	{ "bytevector", rs_prim_bytevector, 0, -1 },
+	{ "bytevector-length", rs_prim_bytevector_length, 1, 1 },
+	{ "bytevector-u8-ref", rs_prim_bytevector_u8_ref, 2, 2 },
+	{ "bytevector-u8-set!", rs_prim_bytevector_u8_set, 3, 3 },
+	{ "bytevector-s8-ref", rs_prim_bytevector_s8_ref, 2, 2 },
+	{ "bytevector-s8-set!", rs_prim_bytevector_s8_set, 3, 3 },
+	{ "bytevector-u16-ref", rs_prim_bytevector_u16_ref, 2, 3 },
+	{ "bytevector-u16-set!", rs_prim_bytevector_u16_set, 3, 4 },
+	{ "bytevector-s16-ref", rs_prim_bytevector_s16_ref, 2, 3 },
+	{ "bytevector-s16-set!", rs_prim_bytevector_s16_set, 3, 4 },
+	{ "bytevector-u32-ref", rs_prim_bytevector_u32_ref, 2, 3 },
+	{ "bytevector-u32-set!", rs_prim_bytevector_u32_set, 3, 4 },
+	{ "bytevector-s32-ref", rs_prim_bytevector_s32_ref, 2, 3 },
+	{ "bytevector-s32-set!", rs_prim_bytevector_s32_set, 3, 4 },
+	{ "bytevector-u64-ref", rs_prim_bytevector_u64_ref, 2, 3 },
+	{ "bytevector-u64-set!", rs_prim_bytevector_u64_set, 3, 4 },
+	{ "bytevector-s64-ref", rs_prim_bytevector_s64_ref, 2, 3 },
+	{ "bytevector-s64-set!", rs_prim_bytevector_s64_set, 3, 4 },
+	{ "bytevector-ieee-single-ref", rs_prim_bytevector_ieee_single_ref, 2, 3 },
+	{ "bytevector-ieee-single-set!", rs_prim_bytevector_ieee_single_set, 3, 4 },
+	{ "bytevector-ieee-double-ref", rs_prim_bytevector_ieee_double_ref, 2, 3 },
+	{ "bytevector-ieee-double-set!", rs_prim_bytevector_ieee_double_set, 3, 4 },
+	{ "bytevector-copy", rs_prim_bytevector_copy, 1, 3 },
+	{ "bytevector-copy!", rs_prim_bytevector_copy_to, 3, 5 },
+	{ "bytevector-fill!", rs_prim_bytevector_fill, 2, 4 },
+	{ "utf8->string", rs_prim_utf8_to_string, 1, 3 },
+	{ "string->utf8", rs_prim_string_to_utf8, 1, 1 },
+	{ "file->bytevector", rs_prim_file_to_bytevector, 1, 3 },
+
+	{ "null?", rs_prim_null_p, 1, 1 },
+	{ "pair?", rs_prim_pair_p, 1, 1 },
+	{ "number?", rs_prim_number_p, 1, 1 },
+	{ "real?", rs_prim_number_p, 1, 1 },
+	{ "integer?", rs_prim_integer_p, 1, 1 },
+	{ "exact?", rs_prim_exact_p, 1, 1 },
+	{ "inexact?", rs_prim_inexact_p, 1, 1 },
+	{ "symbol?", rs_prim_symbol_p, 1, 1 },
+	{ "string?", rs_prim_string_p, 1, 1 },
+	{ "char?", rs_prim_char_p, 1, 1 },
+	{ "boolean?", rs_prim_boolean_p, 1, 1 },
+	{ "procedure?", rs_prim_procedure_p, 1, 1 },
+	{ "vector?", rs_prim_vector_p, 1, 1 },
+	{ "bytevector?", rs_prim_bytevector_p, 1, 1 },
+	{ "hash-table?", rs_prim_hash_table_p, 1, 1 },
+	{ "channel?", rs_prim_channel_p, 1, 1 },
+	{ "future?", rs_prim_future_p, 1, 1 },
+	{ "not", rs_prim_not, 1, 1 },
+	{ "eq?", rs_prim_eq_p, 2, 2 },
+	{ "eqv?", rs_prim_eqv_p, 2, 2 },
+	{ "equal?", rs_prim_equal_p, 2, 2 },
+	{ "string=?", rs_prim_string_eq_p, 1, -1 },
+
+	{ "make-hash-table", rs_prim_make_hash_table, 0, 2 },
+	{ "hash-table-ref", rs_prim_hash_table_ref, 2, 2 },
+	{ "hash-table-ref/default", rs_prim_hash_table_ref_default, 3, 3 },
+	{ "hash-table-set!", rs_prim_hash_table_set, 3, 3 },
+	{ "hash-table-delete!", rs_prim_hash_table_delete, 2, 2 },
+	{ "hash-table-exists?", rs_prim_hash_table_exists_p, 2, 2 },
+	{ "hash-table-contains?", rs_prim_hash_table_exists_p, 2, 2 },
+	{ "hash-table-size", rs_prim_hash_table_size, 1, 1 },
+	{ "hash-table-keys", rs_prim_hash_table_keys, 1, 1 },
+	{ "hash-table-values", rs_prim_hash_table_values, 1, 1 },
+	{ "hash-table->alist", rs_prim_hash_table_to_alist, 1, 1 },
+	{ "hash-table-clear!", rs_prim_hash_table_clear, 1, 1 },
+	{ "hash", rs_prim_hash, 1, 2 },
+	{ "string-hash", rs_prim_string_hash, 1, 2 },
+	{ "hash-by-identity", rs_prim_hash_by_identity, 1, 2 },
+
+	{ "display", rs_prim_display, 1, 1 },
+	{ "write", rs_prim_write, 1, 1 },
+	{ "write-shared", rs_prim_write_shared, 1, 1 },
+	{ "newline", rs_prim_newline, 0, 0 },
+
+	{ "spawn", rs_prim_spawn, 1, 1 },
+	{ "yield", rs_prim_yield, 0, 0 },
+	{ "sleep", rs_prim_sleep, 1, 1 },
+	{ "make-channel", rs_prim_make_channel, 0, 0 },
+	{ "channel-put!", rs_prim_channel_put, 2, 2 },
+	{ "channel-get", rs_prim_channel_get, 1, 1 },
+	{ "fd-read!", rs_prim_fd_read, 2, 4 },
+	{ "fd-write!", rs_prim_fd_write, 2, 4 },
+
+	{ "future", rs_prim_future, 1, 1 },
+	{ "touch", rs_prim_touch, 1, 1 },
+
+	{ "apply", rs_primitive_apply, 2, -1 },
+	{ "exit", rs_prim_exit, 0, 1 },
+};
+
+
+void rs_primitive_init(void)
+{
+	size_t n = sizeof(primitives) / sizeof(primitives[0]);
+	for (size_t i = 0; i < n; i++) {
+		rs_object sym = rs_hashcons_symbol(primitives[i].name);
+		rs_gc_push(sym);
+		rs_global_define(sym, rs_primitive_create(&primitives[i]));
+		rs_gc_pop();
+	}
+}
+
+
+static rs_pair *rs_primitive_pair(rs_object obj, const char *name)
+{
+	if (!rs_pair_p(obj)) {
+		rs_fatal("%s: not a pair", name);
+	}
+	return rs_obj_to_pair(obj);
+}
+
+
+/* Check that obj is a pair that can be changed: one that hasn't been
+   hash-consed, since every datum that looks the same would change too.
+*/
+static rs_pair *rs_primitive_mutable_pair(rs_object obj, const char *name)
+{
+	rs_pair *pair = rs_primitive_pair(obj, name);
+	if (rs_hobject_shared_p(pair)) {
+		rs_fatal("%s: pair is read-only", name);
+	}
+	return pair;
+}
+
+
+static rs_vector *rs_primitive_vector(rs_object obj, const char *name)
+{
+	if (!rs_vector_p(obj)) {
+		rs_fatal("%s: not a vector", name);
+	}
+	return rs_obj_to_vector(obj);
+}
+
+
+/* Check that obj is a bytevector, and, if it's going to be changed, that it
+   isn't a read-only mapping.
+*/
+static rs_bytevector *rs_primitive_bytevector(rs_object obj, int mutable,
+                                              const char *name)
+{
+	if (!rs_bytevector_p(obj)) {
+		rs_fatal("%s: not a bytevector", name);
+	}
+	rs_bytevector *bv = rs_obj_to_bytevector(obj);
+	if (mutable && !rs_bytevector_mutable_p(bv)) {
+		rs_fatal("%s: bytevector is read-only", name);
+	}
+	return bv;
+}
+
+
+/* Check that obj is a hash table, and, unless key is 0, that key can be used
+   with it.
+*/
+static rs_hashtable *rs_primitive_table(rs_object obj, rs_object key,
+                                        const char *name)
+{
+	if (!rs_hashtable_p(obj)) {
+		rs_fatal("%s: not a hash table", name);
+	}
+	rs_hashtable *table = rs_obj_to_hashtable(obj);
+	if (key != 0 && rs_hashtable_kind(table) == RS_HASH_STRING &&
+	    !rs_string_p(key)) {
+		rs_fatal("%s: not a string", name);
+	}
+	return table;
+}
+
+
+static void rs_primitive_channel(rs_object obj, const char *name)
+{
+	if (!rs_channel_p(obj)) {
+		rs_fatal("%s: not a channel", name);
+	}
+}
+
+
+/* Check that obj is a fixnum from 0 up to, but not including, limit. */
+static size_t rs_primitive_index(rs_object obj, size_t limit,
+                                 const char *name)
+{
+	if (!rs_fixnum_p(obj) || rs_obj_to_fixnum(obj) < 0 ||
+	    (size_t)rs_obj_to_fixnum(obj) >= limit) {
+		rs_fatal("%s: index out of range", name);
+	}
+	return (size_t)rs_obj_to_fixnum(obj);
+}
+
+
+static int rs_primitive_fd(rs_object obj, const char *name)
+{
+	if (!rs_fixnum_p(obj) || rs_obj_to_fixnum(obj) < 0 ||
+	    rs_obj_to_fixnum(obj) > INT_MAX) {
+		rs_fatal("%s: not a file descriptor", name);
+	}
+	return (int)rs_obj_to_fixnum(obj);
+}
+
+
+static rs_object rs_primitive_integer(rs_object obj, const char *name)
+{
+	if (!rs_fixnum_p(obj) && !rs_bignum_p(obj)) {
+		rs_fatal("%s: not an integer", name);
+	}
+	return obj;
+}
+
+
+static double rs_primitive_double(rs_object obj, const char *name)
+{
+	if (rs_flonum_p(obj)) {
+		return rs_flonum_value(obj);
+	} else if (rs_fixnum_p(obj)) {
+		return (double)rs_obj_to_fixnum(obj);
+	} else if (rs_bignum_p(obj)) {
+		return rs_bignum_to_double(obj);
+	}
+	rs_fatal("%s: not a number", name);
+	return 0;
+}
+
+
+/* Compare an integer with a double that isn't NaN, exactly: return a
+   negative number if a is less than y, zero if they're equal, and a positive
+   number if a is greater.
+*/
+static int rs_primitive_cmp_exact(rs_object a, double y)
+{
+	if (isinf(y)) {
+		return y > 0 ? -1 : 1;
+	}
+	/* Fixnums up to 2^53 convert to doubles exactly. */
+	if (rs_fixnum_p(a)) {
+		long v = rs_obj_to_fixnum(a);
+		if (v >= -9007199254740992 && v <= 9007199254740992) {
+			double x = (double)v;
+			return (x > y) - (x < y);
+		}
+	}
+	double f = floor(y);
+	int c = rs_bignum_cmp(a, rs_bignum_from_double(f));
+	return c != 0 ? c : (f < y ? -1 : 0);
+}
+
+
+/* Bitwise operations on fixnums can land on the one tagged word that's just
+   outside the fixnum range (see rescheme_p.h), which has to be a bignum.
+*/
+static rs_object rs_primitive_bits(rs_object r)
+{
+	if (r < _FIXNUM_OBJ_MIN) {
+		return rs_bignum_sub(rs_fixnum_to_obj(rs_fixnum_min),
+		                     rs_fixnum_to_obj(1));
+	}
+	return r;
+}
+
+
+/* The slow path for +, - and *: integers go to the bignum functions, and if
+   either argument is a flonum, so is the result.
+*/
+static rs_object rs_primitive_arith(rs_object a, rs_object b, int op,
+                                    const char *name)
+{
+	double x = rs_primitive_double(a, name);
+	double y = rs_primitive_double(b, name);
+	if (rs_flonum_p(a) || rs_flonum_p(b)) {
+		return rs_flonum_create(op == '+' ? x + y : op == '-' ? x - y : x * y);
+	}
+	return op == '+' ? rs_bignum_add(a, b) :
+	       op == '-' ? rs_bignum_sub(a, b) : rs_bignum_mul(a, b);
+}
+
+
+int rs_primitive_eqv(rs_object a, rs_object b)
+{
+	if (rs_primitive_eq(a, b)) {
+		return 1;
+	}
+	if (rs_flonum_p(a) && rs_flonum_p(b)) {
+		double x = rs_flonum_value(a), y = rs_flonum_value(b);
+		return memcmp(&x, &y, sizeof(x)) == 0;
+	}
+	return rs_bignum_p(a) && rs_bignum_p(b) && rs_bignum_cmp(a, b) == 0;
+}
@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <limits.h>
+#include <math.h>
 #include <string.h>
 
 /* The ReScheme parser is a state machine. It consists of a large switch inside
@@ -12,24 +13,36 @@
    what the next state should be. The loop ends when the current state is
    ST_END.
 
-   NOTE: Later, when lists are added to ReScheme, the parser will have a stack
-   to handle recursion. That will make it a pushdown automata, and it will be
-   equivalent to the recursive descent parsers that are typically used to parse
-   Lisps. Switching states is analogous to calling functions, except 1) they
-   don't return to the previous state when they're finished (no call stack),
-   and 2) a new character is read in automatically at each state change.
+   Lists are handled with a stack of frames, one for each list that has been
+   opened but not yet closed. That makes the parser a pushdown automaton, which
+   is equivalent to the recursive descent parsers that are typically used to
+   parse Lisps. When an object is recognized while there is a list on the
+   stack, the object is added to the end of the list, and the parser goes back
+   to ST_START instead of ending.
+
+   'datum is read as (quote datum), using a frame for the quote form that ends
+   by itself as soon as the datum has been read. A vector (or bytevector) is
+   read as a list too, and made into a vector when its ')' is read.
 */
-enum state { ST_START, ST_DECIMAL, ST_HASH, ST_BINARY, ST_OCTAL, ST_HEX,
-             ST_CHARACTER, ST_CHAR_N, ST_CHAR_S, ST_CHAR_T, ST_SYMBOL,
+enum state { ST_START, ST_DECIMAL, ST_FLONUM, ST_HASH, ST_BINARY, ST_OCTAL,
+             ST_HEX, ST_CHARACTER, ST_CHAR_N, ST_CHAR_S, ST_CHAR_T, ST_SYMBOL,
              ST_STRING, ST_ESCAPE, ST_END };
 
 /* More can happen inside a state than just choosing the next state. The input
    character can be pushed back so that the next state (or the next call to the
    parser) will see it.
  */
-#define PUSH_BACK(c, in) \
-	if (c != EOF && ungetc(c, in) == EOF) \
-		rs_fatal("ungetc failed:");
+#define PUSH_BACK(c, in) rs_port_ungetc((in), (c))
+
+/* Syntax errors are fatal. If the port is tracking positions, the line and
+   column of the error are reported first.
+*/
+#define READ_FATAL(in, ...) do { \
+		rs_read_where(in); \
+		rs_fatal(__VA_ARGS__); \
+	} while (0)
+
+static void rs_read_where(struct rs_port *in);
 
 /* Characters can also be pushed into a buffer. This can be done to gather the
    digits of a number, or the characters of a symbol.
@@ -37,16 +50,82 @@ enum state { ST_START, ST_DECIMAL, ST_HASH, ST_BINARY, ST_OCTAL, ST_HEX,
 #define BUF_PUSH(buf, c) \
 	if (rs_buf_push((buf), (c)) == NULL) \
 		rs_fatal("could not write to buffer:");
+#define BUF_APPEND(buf, data, len) \
+	if (rs_buf_append((buf), (data), (len)) == NULL) \
+		rs_fatal("could not write to buffer:");
 
-/* This fuction turns a buffer full of digits into a ReScheme fixnum. */
-static inline rs_object rs_read_check_num(struct rs_buf *buf, int base);
+/* Numbers don't go through the buffer. Instead, their value is accumulated as
+   each digit is read, with checks for overflow. If the value gets too large for
+   a fixnum, the rest of the digits are gathered in a bignum accumulator, a
+   word-sized chunk at a time.
+*/
+struct rs_read_num {
+	int base;
+	int neg;
+	int ndigits;
+	int big;
+	rs_fixnum val;
+	uint32_t chunk;
+	uint32_t chunk_mul;
+	struct rs_bignum_acc acc;
+};
+
+/* Start reading a number in the given base. */
+static inline void rs_read_num_init(struct rs_read_num *num, int base);
+
+/* Add a digit to the end of a number. */
+static inline void rs_read_num_digit(struct rs_read_num *num, int c);
+
+/* Turn the digits read so far into a fixnum or a bignum. */
+static rs_object rs_read_num_finish(struct rs_read_num *num,
+                                    struct rs_port *in);
+
+/* Decimal numbers with a fraction or an exponent are flonums. Once one turns
+   up, the integer part read so far is written into the buffer, and the rest
+   of the number is gathered there too, to be converted all at once.
+*/
+static void rs_read_num_to_buf(struct rs_read_num *num, struct rs_buf *buf,
+                               struct rs_port *in);
+static rs_object rs_read_flonum(struct rs_buf *buf, struct rs_port *in);
+
+/* A list that is being read. Elements are added to the tail, and the head is
+   pushed onto the GC stack as soon as it exists. The dot field keeps track of
+   dotted lists: it's 1 after a '.' has been read, and 2 after the datum
+   following the '.' has been read. The quote field is set for the frames of
+   'datum abbreviations, and the vector field is 1 for #( ... ) and 2 for
+   #u8( ... ).
+*/
+struct rs_read_frame {
+	rs_object head;
+	rs_object tail;
+	int dot;
+	int quote;
+	int vector;
+	struct rs_srcpos start;
+};
+
+/* Push a new frame, and return it. */
+static struct rs_read_frame *rs_read_open(struct rs_stack **frames,
+                                          struct rs_srcpos *start);
+
+/* Add obj to the end of the list being read. */
+static void rs_read_append(struct rs_read_frame *frame, rs_object obj,
+                           struct rs_port *in);
+
+/* When a port is in sharing mode, every string, symbol, and list that is read
+   is hash-consed, so identical data is only stored once. These functions make
+   a new object or find the shared one, depending on the mode.
+*/
+static inline rs_object rs_read_symbol(const char *name, int share);
+static inline rs_object rs_read_string(struct rs_buf *buf, int share);
 
 /* Sometimes it's helpful to take a shortcut, and read in several characters at
    once. This function reads characters into a buffer, starting with c, and
    reading the rest from in. It stops when either n characters have been read,
    or it reads in a delimiter (see below).
 */
-static void rs_read_get_word(struct rs_buf *buf, FILE *in, int c, int n);
+static void rs_read_get_word(struct rs_buf *buf, struct rs_port *in, int c,
+                             int n);
 
 /* Inside each state (most of them, anyway) is an inner switch that checks the
    input character to determine what actions to take. Since many character will
@@ -55,7 +134,7 @@ static void rs_read_get_word(struct rs_buf *buf, FILE *in, int c, int n);
 */
 #define WS \
 	' ': case '\t': case '\r': case '\n'
-#define DELIM WS: case ';'
+#define DELIM WS: case ';': case '(': case ')': case '"': case EOF
 #define BIN_DIGIT '0': case '1'
 #define OCT_DIGIT \
 	BIN_DIGIT: case '2': case '3': case '4': case '5': case '6': case '7'
@@ -85,7 +164,7 @@ static void rs_read_get_word(struct rs_buf *buf, FILE *in, int c, int n);
 /* The parser function. It reads characters from in, and turns them into an
    object. Or it dies when there's a syntax error.
 */
-rs_object rs_read(FILE *in)
+rs_object rs_read(struct rs_port *in)
 {
 	assert(in != NULL);
 
@@ -100,14 +179,31 @@ rs_object rs_read(FILE *in)
 	enum state cur_state = ST_START;
 
 	/* The buffer is used to store characters, so that they can be used when
-	   creating objects. Buffers have to be initialized before use.
+	   creating objects. Each port has its own, which is reused from one call
+	   to the next.
 	 */
-	struct rs_buf buf;
-	rs_buf_init(&buf);
+	struct rs_buf *buf = rs_port_scratch(in);
+
+	/* Numbers are accumulated here, instead of in the buffer. */
+	struct rs_read_num num;
+
+	/* Lists that are still being read. */
+	struct rs_stack *frames = NULL;
+
+	/* If the port is tracking positions, tok_start is set to the position of
+	   the first character of each object.
+	*/
+	struct rs_srcloc *srcloc = rs_port_srcloc(in);
+	struct rs_srcpos tok_start;
+
+	int share = rs_port_share_p(in);
 
 
 	while (cur_state != ST_END) {
-		int c = getc(in);
+		int c = rs_port_getc(in);
+		if (srcloc != NULL && cur_state == ST_START) {
+			rs_port_locate(in, rs_port_offset(in) - 1, &tok_start);
+		}
 
 		switch (cur_state) {
 		case ST_START:
@@ -117,70 +213,187 @@ rs_object rs_read(FILE *in)
 				break;
 			case ';':
 				/* skip comments */
-				while ((c = getc(in)) != '\n' && c != EOF) ;
+				while ((c = rs_port_getc(in)) != '\n' && c != EOF) ;
 				break;
 			case EOF:
+				if (frames != NULL) {
+					READ_FATAL(in, "unexpected EOF in a list");
+				}
 				obj = rs_eof;
 				cur_state = ST_END;
 				break;
 			case DIGIT:
-				BUF_PUSH(&buf, c);
+				rs_read_num_init(&num, 10);
+				rs_read_num_digit(&num, c);
 				cur_state = ST_DECIMAL;
 				break;
-			case '+': case '-':
-				BUF_PUSH(&buf, c);
+			case '+': case '-': {
+				int sign = c;
 				/* Look ahead to see if it's a number or a symbol. */
-				c = getc(in);
+				c = rs_port_getc(in);
 				switch (c) {
 				case DIGIT:
-					BUF_PUSH(&buf, c);
+					rs_read_num_init(&num, 10);
+					num.neg = (sign == '-');
+					rs_read_num_digit(&num, c);
 					cur_state = ST_DECIMAL;
 					break;
 				case DELIM:
 					PUSH_BACK(c, in);
-					obj = rs_symbol_create(rs_buf_cstr(&buf));
+					obj = rs_read_symbol(sign == '-' ? "-" : "+", share);
+					cur_state = ST_END;
+					break;
+				case 'i': case 'I': case 'n': case 'N':
+					/* See if we have an infinity or a NaN, the way the writer
+					   prints them. */
+					rs_read_get_word(buf, in, c, 6);
+					if (strcmp("inf.0", rs_buf_cstr(buf)) == 0) {
+						obj = rs_flonum_create(sign == '-' ? -HUGE_VAL
+						                                   : HUGE_VAL);
+					} else if (strcmp("nan.0", rs_buf_cstr(buf)) == 0) {
+						obj = rs_flonum_create(NAN);
+					} else {
+						READ_FATAL(in, "expected a digit or a delimiter");
+					}
 					cur_state = ST_END;
 					break;
 				default:
-					rs_fatal("expected a digit or a delimiter");
+					READ_FATAL(in, "expected a digit or a delimiter");
 				}
+			}
 				break;
 			case '#':
 				cur_state = ST_HASH;
 				break;
 			case '(':
-				c = getc(in);
-				if (c == ')') {
-					obj = rs_null;
-					cur_state = ST_END;
-				} else {
-					rs_fatal("non-empty lists have not been implemented");
+				rs_read_open(&frames, &tok_start);
+				break;
+			case '\'': {
+				struct rs_read_frame *frame = rs_read_open(&frames, &tok_start);
+				frame->quote = 1;
+				rs_read_append(frame, rs_read_symbol("quote", share), in);
+			}
+				break;
+			case ')': {
+				if (frames == NULL ||
+				    ((struct rs_read_frame *)rs_stack_top(frames))->quote) {
+					READ_FATAL(in, "unexpected ')'");
 				}
+				struct rs_read_frame *frame = rs_stack_pop(&frames);
+				if (frame->dot == 1) {
+					READ_FATAL(in, "expected a datum after '.'");
+				}
+				obj = frame->head;
+				if (frame->vector == 2) {
+					for (rs_object l = obj; !rs_null_p(l);
+					     l = rs_pair_cdr(rs_obj_to_pair(l))) {
+						rs_object b = rs_pair_car(rs_obj_to_pair(l));
+						if (!rs_fixnum_p(b) || rs_obj_to_fixnum(b) < 0 ||
+						    rs_obj_to_fixnum(b) > 255) {
+							READ_FATAL(in, "expected a byte in a bytevector");
+						}
+					}
+					obj = rs_bytevector_from_list(obj);
+					if (!rs_null_p(frame->head)) {
+						rs_gc_pop();
+					}
+				} else if (frame->vector) {
+					obj = rs_vector_from_list(obj);
+					if (!rs_null_p(frame->head)) {
+						rs_gc_pop();
+					}
+				} else if (!rs_null_p(obj)) {
+					if (share) {
+						obj = rs_hashcons_list(obj);
+					}
+					rs_gc_pop();
+				}
+				tok_start = frame->start;
+				free(frame);
+				cur_state = ST_END;
+			}
+				break;
+			case '.': {
+				/* A '.' on its own marks the last cdr of a list. */
+				struct rs_read_frame *frame =
+					frames != NULL ? rs_stack_top(frames) : NULL;
+				if (frame == NULL || rs_null_p(frame->head) ||
+				    frame->dot != 0 || frame->quote || frame->vector) {
+					READ_FATAL(in, "unexpected '.'");
+				}
+				c = rs_port_getc(in);
+				switch (c) {
+				case DELIM:
+					PUSH_BACK(c, in);
+					frame->dot = 1;
+					break;
+				default:
+					READ_FATAL(in, "expected a delimiter after '.'");
+				}
+			}
 				break;
 			case SYMBOL_INIT:
-				BUF_PUSH(&buf, tolower(c));
+				BUF_PUSH(buf, tolower(c));
 				cur_state = ST_SYMBOL;
 				break;
-			case '"':
-				cur_state = ST_STRING;
+			case '"': {
+				/* Strings without escapes in a mapped file don't need to be
+				   copied: they can point right into the mapping. */
+				const char *run;
+				size_t len = 0, n = 0;
+				if (rs_port_source(in) != NULL) {
+					len = rs_port_avail(in, &run);
+					while (n < len && run[n] != '"' && run[n] != '\\') {
+						n++;
+					}
+				}
+				if (n < len && run[n] == '"') {
+					obj = share ? rs_hashcons_string(run, n, 1)
+					            : rs_string_create_slice(run, n);
+					rs_port_skip(in, n + 1);
+					cur_state = ST_END;
+				} else {
+					cur_state = ST_STRING;
+				}
+			}
 				break;
 			default:
-				rs_fatal("invalid expression");
+				READ_FATAL(in, "invalid expression");
 			}
 			break;
 
 		case ST_DECIMAL:
 			switch (c) {
 			case DIGIT:
-				BUF_PUSH(&buf, c);
+				rs_read_num_digit(&num, c);
+				break;
+			case '.': case 'e': case 'E':
+				rs_read_num_to_buf(&num, buf, in);
+				BUF_PUSH(buf, c);
+				cur_state = ST_FLONUM;
+				break;
+			case DELIM:
+				PUSH_BACK(c, in);
+				obj = rs_read_num_finish(&num, in);
+				cur_state = ST_END;
+				break;
+			default:
+				READ_FATAL(in, "expected a digit, or a delimiter");
+			}
+			break;
+
+		case ST_FLONUM:
+			switch (c) {
+			case DIGIT: case '.': case 'e': case 'E': case '+': case '-':
+				BUF_PUSH(buf, c);
 				break;
 			case DELIM:
 				PUSH_BACK(c, in);
-				obj = rs_read_check_num(&buf, 10);
+				obj = rs_read_flonum(buf, in);
 				cur_state = ST_END;
 				break;
 			default:
-				rs_fatal("expected a digit, or a delimiter");
+				READ_FATAL(in, "expected a digit, or a delimiter");
 			}
 			break;
 
@@ -192,15 +405,19 @@ rs_object rs_read(FILE *in)
 			int is_fixnum = 1;
 			switch (c) {
 			case 'b': case 'B':
+				rs_read_num_init(&num, 2);
 				cur_state = ST_BINARY;
 				break;
 			case 'o': case 'O':
+				rs_read_num_init(&num, 8);
 				cur_state = ST_OCTAL;
 				break;
 			case 'd': case 'D':
+				rs_read_num_init(&num, 10);
 				cur_state = ST_DECIMAL;
 				break;
 			case 'x': case 'X':
+				rs_read_num_init(&num, 16);
 				cur_state = ST_HEX;
 				break;
 			case '\\':
@@ -217,19 +434,33 @@ rs_object rs_read(FILE *in)
 				is_fixnum = 0;
 				cur_state = ST_END;
 				break;
+			case '(':
+				rs_read_open(&frames, &tok_start)->vector = 1;
+				is_fixnum = 0;
+				cur_state = ST_START;
+				break;
+			case 'u': case 'U':
+				if (rs_port_getc(in) != '8' || rs_port_getc(in) != '(') {
+					READ_FATAL(in, "expected #u8(");
+				}
+				rs_read_open(&frames, &tok_start)->vector = 2;
+				is_fixnum = 0;
+				cur_state = ST_START;
+				break;
 			default:
-				rs_fatal("expected a radix, or a character literal");
+				READ_FATAL(in, "expected a radix, a character literal, "
+				           "a vector, or a bytevector");
 			}
 			/* If we're expecting a fixnum, look ahead to see if the next
 			   character is a + or -. */
 			if (is_fixnum) {
-				c = getc(in);
+				c = rs_port_getc(in);
 				switch (c) {
 				case '+': case '-':
-					BUF_PUSH(&buf, c);
+					num.neg = (c == '-');
 					break;
 				case DELIM:
-					rs_fatal("expected a digit");
+					READ_FATAL(in, "expected a digit");
 				default:
 					PUSH_BACK(c, in);
 				}
@@ -240,45 +471,45 @@ rs_object rs_read(FILE *in)
 		case ST_BINARY:
 			switch (c) {
 			case BIN_DIGIT:
-				BUF_PUSH(&buf, c);
+				rs_read_num_digit(&num, c);
 				break;
 			case DELIM:
 				PUSH_BACK(c, in);
-				obj = rs_read_check_num(&buf, 2);
+				obj = rs_read_num_finish(&num, in);
 				cur_state = ST_END;
 				break;
 			default:
-				rs_fatal("expected a binary digit, or a delimiter");
+				READ_FATAL(in, "expected a binary digit, or a delimiter");
 			}
 			break;
 
 		case ST_OCTAL:
 			switch (c) {
 			case OCT_DIGIT:
-				BUF_PUSH(&buf, c);
+				rs_read_num_digit(&num, c);
 				break;
 			case DELIM:
 				PUSH_BACK(c, in);
-				obj = rs_read_check_num(&buf, 8);
+				obj = rs_read_num_finish(&num, in);
 				cur_state = ST_END;
 				break;
 			default:
-				rs_fatal("expected an octal digit, or a delimiter");
+				READ_FATAL(in, "expected an octal digit, or a delimiter");
 			}
 			break;
 
 		case ST_HEX:
 			switch (c) {
 			case HEX_DIGIT:
-				BUF_PUSH(&buf, c);
+				rs_read_num_digit(&num, c);
 				break;
 			case DELIM:
 				PUSH_BACK(c, in);
-				obj = rs_read_check_num(&buf, 16);
+				obj = rs_read_num_finish(&num, in);
 				cur_state = ST_END;
 				break;
 			default:
-				rs_fatal("expected a hex digit, or a delimiter");
+				READ_FATAL(in, "expected a hex digit, or a delimiter");
 			}
 			break;
 
@@ -304,7 +535,7 @@ rs_object rs_read(FILE *in)
 				/* Otherwise, read in a character, and make sure that it's
 				   followed by a delimiter. */
 				if (isgraph(c)) {
-					char d = getc(in);
+					int d = rs_port_getc(in);
 					switch(d) {
 					case DELIM:
 						PUSH_BACK(d, in);
@@ -312,10 +543,10 @@ rs_object rs_read(FILE *in)
 						cur_state = ST_END;
 						break;
 					default:
-						rs_fatal("unknown character literal");
+						READ_FATAL(in, "unknown character literal");
 					}
 				} else {
-					rs_fatal("expected a character literal");
+					READ_FATAL(in, "expected a character literal");
 				}
 			}
 			break;
@@ -323,14 +554,14 @@ rs_object rs_read(FILE *in)
 		case ST_CHAR_N:
 			assert(c == 'n' || c == 'N');
 			/* See if we have #\newline. */
-			rs_read_get_word(&buf, in, c, 7);
-			if (strcmp("n", rs_buf_cstr(&buf)) == 0) {
+			rs_read_get_word(buf, in, c, 7);
+			if (strcmp("n", rs_buf_cstr(buf)) == 0) {
 				obj = rs_character_to_obj(c);
-			} else if (strcmp("newline", rs_buf_cstr(&buf)) == 0) {
+			} else if (strcmp("newline", rs_buf_cstr(buf)) == 0) {
 				obj = rs_character_to_obj('\n');
 			} else {
-				rs_fatal("unknown character literal (#\\%s)",
-				         rs_buf_cstr(&buf));
+				READ_FATAL(in, "unknown character literal (#\\%s)",
+				               rs_buf_cstr(buf));
 			}
 			cur_state = ST_END;
 			break;
@@ -338,14 +569,14 @@ rs_object rs_read(FILE *in)
 		case ST_CHAR_S:
 			assert(c == 's' || c == 'S');
 			/* See if we have #\space. */
-			rs_read_get_word(&buf, in, c, 5);
-			if (strcmp("s", rs_buf_cstr(&buf)) == 0) {
+			rs_read_get_word(buf, in, c, 5);
+			if (strcmp("s", rs_buf_cstr(buf)) == 0) {
 				obj = rs_character_to_obj(c);
-			} else if (strcmp("space", rs_buf_cstr(&buf)) == 0) {
+			} else if (strcmp("space", rs_buf_cstr(buf)) == 0) {
 				obj = rs_character_to_obj(' ');
 			} else {
-				rs_fatal("unknown character literal (#\\%s)",
-				         rs_buf_cstr(&buf));
+				READ_FATAL(in, "unknown character literal (#\\%s)",
+				               rs_buf_cstr(buf));
 			}
 			cur_state = ST_END;
 			break;
@@ -353,14 +584,14 @@ rs_object rs_read(FILE *in)
 		case ST_CHAR_T:
 			assert(c == 't' || c == 'T');
 			/* See if we have #\tab (which is non-standard). */
-			rs_read_get_word(&buf, in, c, 3);
-			if (strcmp("t", rs_buf_cstr(&buf)) == 0) {
+			rs_read_get_word(buf, in, c, 3);
+			if (strcmp("t", rs_buf_cstr(buf)) == 0) {
 				obj = rs_character_to_obj(c);
-			} else if (strcmp("tab", rs_buf_cstr(&buf)) == 0) {
+			} else if (strcmp("tab", rs_buf_cstr(buf)) == 0) {
 				obj = rs_character_to_obj('\t');
 			} else {
-				rs_fatal("unknown character literal (#\\%s)",
-				         rs_buf_cstr(&buf));
+				READ_FATAL(in, "unknown character literal (#\\%s)",
+				               rs_buf_cstr(buf));
 			}
 			cur_state = ST_END;
 			break;
@@ -368,18 +599,18 @@ rs_object rs_read(FILE *in)
 		case ST_SYMBOL:
 			switch (c) {
 			case SYMBOL_SUB:
-				BUF_PUSH(&buf, tolower(c));
+				BUF_PUSH(buf, tolower(c));
 				break;
 			case DELIM:
 				PUSH_BACK(c, in);
-				obj = rs_symbol_create(rs_buf_cstr(&buf));
+				obj = rs_read_symbol(rs_buf_cstr(buf), share);
 				cur_state = ST_END;
 				break;
 			default:
 				if (isgraph(c)) {
-					rs_fatal("'%c' cannot appear in an identifier", c);
+					READ_FATAL(in, "'%c' cannot appear in an identifier", c);
 				} else {
-					rs_fatal("'\\x%02x' cannot appear in an identifier", c);
+					READ_FATAL(in, "'\\x%02x' cannot appear in an identifier", c);
 				}
 			}
 			break;
@@ -387,45 +618,58 @@ rs_object rs_read(FILE *in)
 		case ST_STRING:
 			switch (c) {
 			case '"':
-				obj = rs_string_create(rs_buf_cstr(&buf));
+				obj = rs_read_string(buf, share);
 				cur_state = ST_END;
 				break;
 			case '\\':
 				cur_state = ST_ESCAPE;
 				break;
-			default:
-				BUF_PUSH(&buf, c);
+			case EOF:
+				READ_FATAL(in, "unexpected EOF in a string");
+			default: {
+				/* Copy the rest of the run of ordinary characters that's
+				   already in the port's buffer all at once. */
+				BUF_PUSH(buf, c);
+				const char *run;
+				size_t len = rs_port_avail(in, &run);
+				size_t n = 0;
+				while (n < len && run[n] != '"' && run[n] != '\\') {
+					n++;
+				}
+				BUF_APPEND(buf, run, n);
+				rs_port_skip(in, n);
+			}
 			}
 			break;
 
 		case ST_ESCAPE:
 			switch (c) {
 			case 'n':
-				BUF_PUSH(&buf, '\n');
+				BUF_PUSH(buf, '\n');
 				break;
 			case 't':
-				BUF_PUSH(&buf, '\t');
+				BUF_PUSH(buf, '\t');
 				break;
 			case '"':
-				BUF_PUSH(&buf, '"');
+				BUF_PUSH(buf, '"');
 				break;
 			case '\\':
-				BUF_PUSH(&buf, '\\');
+				BUF_PUSH(buf, '\\');
 				break;
 			case 'r':
-				BUF_PUSH(&buf, '\r');
+				BUF_PUSH(buf, '\r');
 				break;
 			case 'b':
-				BUF_PUSH(&buf, '\b');
+				BUF_PUSH(buf, '\b');
 				break;
 			case 'a':
-				BUF_PUSH(&buf, '\a');
+				BUF_PUSH(buf, '\a');
 				break;
 			default:
 				if (isgraph(c)) {
-					rs_fatal("unknown string escape sequence: \\%c", c);
+					READ_FATAL(in, "unknown string escape sequence: \\%c", c);
 				} else {
-					rs_fatal("unknown string escape sequence: \\x%02x", c);
+					READ_FATAL(in, "unknown string escape sequence: \\x%02x", c);
 				}
 			}
 			cur_state = ST_STRING;
@@ -434,27 +678,214 @@ rs_object rs_read(FILE *in)
 		default:
 			rs_fatal("got into an impossible state");
 		}
+
+		if (cur_state == ST_END) {
+			if (srcloc != NULL) {
+				struct rs_span span;
+				span.start = tok_start;
+				rs_port_locate(in, rs_port_offset(in), &span.end);
+				rs_srcloc_add(srcloc, obj, &span);
+			}
+			while (frames != NULL) {
+				struct rs_read_frame *frame = rs_stack_top(frames);
+				rs_read_append(frame, obj, in);
+				if (!frame->quote) {
+					rs_buf_clear(buf);
+					cur_state = ST_START;
+					break;
+				}
+				/* The quoted datum has been read, so the quote form is
+				   finished too. */
+				rs_stack_pop(&frames);
+				obj = share ? rs_hashcons_list(frame->head) : frame->head;
+				rs_gc_pop();
+				if (srcloc != NULL) {
+					struct rs_span span;
+					span.start = frame->start;
+					rs_port_locate(in, rs_port_offset(in), &span.end);
+					rs_srcloc_add(srcloc, obj, &span);
+				}
+				free(frame);
+			}
+		}
 	}
 
-	rs_buf_reset(&buf);
 	return obj;
 }
 
 
-static inline rs_object rs_read_check_num(struct rs_buf *buf, int base)
+static inline void rs_read_num_init(struct rs_read_num *num, int base)
 {
-	assert(buf != NULL);
+	assert(num != NULL);
 	assert(base == 10 || base == 2 || base == 8 || base == 16);
 
-	long value = strtol(rs_buf_cstr(buf), NULL, base);
-	if (value < rs_fixnum_min || value > rs_fixnum_max) {
-		rs_fatal("number out of range");
+	num->base = base;
+	num->neg = 0;
+	num->ndigits = 0;
+	num->big = 0;
+	num->val = 0;
+}
+
+
+static inline void rs_read_num_digit(struct rs_read_num *num, int c)
+{
+	assert(num != NULL);
+	assert(isxdigit(c));
+
+	int d = (c <= '9') ? c - '0' : tolower(c) - 'a' + 10;
+	assert(d < num->base);
+	num->ndigits++;
+
+	if (!num->big) {
+		rs_fixnum t;
+		if (!__builtin_mul_overflow(num->val, (rs_fixnum)num->base, &t) &&
+		    !__builtin_add_overflow(t, (rs_fixnum)d, &t) &&
+		    t <= rs_fixnum_max) {
+			num->val = t;
+			return;
+		}
+		/* Out of fixnum range, so switch to the slow path. */
+		rs_bignum_acc_init(&num->acc, num->val);
+		num->big = 1;
+		num->chunk = 0;
+		num->chunk_mul = 1;
+	}
+
+	/* Digits are gathered into a chunk until it would overflow 32 bits, and
+	   then the whole chunk is pushed into the accumulator at once. */
+	if (num->chunk_mul > UINT32_MAX / (uint32_t)num->base) {
+		rs_bignum_acc_push(&num->acc, num->chunk_mul, num->chunk);
+		num->chunk = 0;
+		num->chunk_mul = 1;
+	}
+	num->chunk = num->chunk * num->base + d;
+	num->chunk_mul *= num->base;
+}
+
+
+static rs_object rs_read_num_finish(struct rs_read_num *num,
+                                    struct rs_port *in)
+{
+	assert(num != NULL);
+
+	if (num->ndigits == 0) {
+		READ_FATAL(in, "expected a digit");
+	}
+	if (!num->big) {
+		return rs_fixnum_to_obj(num->neg ? -num->val : num->val);
+	}
+	if (num->chunk_mul > 1) {
+		rs_bignum_acc_push(&num->acc, num->chunk_mul, num->chunk);
+	}
+	num->big = 0;
+	return rs_bignum_acc_finish(&num->acc, num->neg);
+}
+
+
+static void rs_read_num_to_buf(struct rs_read_num *num, struct rs_buf *buf,
+                               struct rs_port *in)
+{
+	assert(num != NULL);
+	assert(num->base == 10);
+
+	/* The sign is written separately, so that -0.5 keeps it. */
+	if (num->neg) {
+		BUF_PUSH(buf, '-');
+		num->neg = 0;
+	}
+	rs_object n = rs_read_num_finish(num, in);
+	if (rs_fixnum_p(n)) {
+		char digits[32];
+		snprintf(digits, sizeof(digits), "%ld", (long)rs_obj_to_fixnum(n));
+		BUF_APPEND(buf, digits, strlen(digits));
+	} else {
+		char *digits = rs_bignum_to_cstr(n, 10);
+		BUF_APPEND(buf, digits, strlen(digits));
+		free(digits);
+	}
+}
+
+
+static rs_object rs_read_flonum(struct rs_buf *buf, struct rs_port *in)
+{
+	const char *text = rs_buf_cstr(buf);
+	char *end;
+	double val = strtod(text, &end);
+	if (*end != '\0') {
+		READ_FATAL(in, "malformed number");
+	}
+	return rs_flonum_create(val);
+}
+
+
+static void rs_read_append(struct rs_read_frame *frame, rs_object obj,
+                           struct rs_port *in)
+{
+	assert(frame != NULL);
+
+	if (frame->dot == 2) {
+		READ_FATAL(in, "expected ')' after the last cdr of a list");
+	} else if (frame->dot == 1) {
+		rs_pair_set_cdr(rs_obj_to_pair(frame->tail), obj);
+		frame->dot = 2;
+		return;
+	}
+
+	rs_object pair = rs_pair_create(obj, rs_null);
+	if (rs_null_p(frame->head)) {
+		frame->head = pair;
+		rs_gc_push(pair);
+	} else {
+		rs_pair_set_cdr(rs_obj_to_pair(frame->tail), pair);
+	}
+	frame->tail = pair;
+}
+
+
+static struct rs_read_frame *rs_read_open(struct rs_stack **frames,
+                                          struct rs_srcpos *start)
+{
+	struct rs_read_frame *frame = malloc(sizeof(struct rs_read_frame));
+	if (frame == NULL) {
+		rs_fatal("could not allocate list frame:");
+	}
+	frame->head = frame->tail = rs_null;
+	frame->dot = 0;
+	frame->quote = 0;
+	frame->vector = 0;
+	frame->start = *start;
+	*frames = rs_stack_push(*frames, frame);
+	return frame;
+}
+
+
+static inline rs_object rs_read_symbol(const char *name, int share)
+{
+	return share ? rs_hashcons_symbol(name) : rs_symbol_create(name);
+}
+
+
+static inline rs_object rs_read_string(struct rs_buf *buf, int share)
+{
+	const char *data = rs_buf_cstr(buf);
+	size_t len = rs_buf_len(buf);
+	return share ? rs_hashcons_string(data, len, 0)
+	             : rs_string_create_n(data, len);
+}
+
+
+static void rs_read_where(struct rs_port *in)
+{
+	if (rs_port_srcloc(in) != NULL) {
+		struct rs_srcpos pos;
+		rs_port_locate(in, rs_port_offset(in) - 1, &pos);
+		rs_nonfatal("syntax error at line %ld, column %ld", pos.line, pos.col);
 	}
-	return rs_fixnum_to_obj(value);
 }
 
 
-static void rs_read_get_word(struct rs_buf *buf, FILE *in, int c, int n)
+static void rs_read_get_word(struct rs_buf *buf, struct rs_port *in, int c,
+                             int n)
 {
 	assert(buf != NULL);
 	assert(in != NULL);
@@ -462,14 +893,12 @@ static void rs_read_get_word(struct rs_buf *buf, FILE *in, int c, int n)
 	BUF_PUSH(buf, tolower(c));
 	int loop = 1;
 	while (loop) {
-		c = getc(in);
+		c = rs_port_getc(in);
 		switch (c) {
 		case DELIM:
 			loop = 0;
 			PUSH_BACK(c, in);
 			break;
-		case EOF:
-			rs_fatal("unexpected EOF");
 		default:
 			BUF_PUSH(buf, tolower(c));
 		}
@@ -0,0 +1,366 @@
+#include "rescheme.h"
+
+#include <assert.h>
+#include <unistd.h>
+
+/* The pipelined loop splits reading, evaluating and writing between three
+   threads, which pass their work along through bounded queues, so that each
+   can run ahead of the next by a few datums:
+
+       reader --datums--> evaluator --output--> writer
+
+   The reader is a thread of the interpreter, since reading makes objects. The
+   datums it has read wait in the slots of a vector that the evaluator keeps
+   rooted, so the GC sees them however far they've got. The evaluator is the
+   calling thread. It sends display, write and newline, and then the value,
+   to a string port for each datum, and hands that to the writer, which never
+   touches an object, and so stays out of the interpreter altogether. It
+   writes through a buffered port, which it only flushes when it has caught
+   up.
+
+   An error still exits, from whichever thread found it, but first the datums
+   before the one that failed are finished, and their output written, along
+   with whatever the failing one had written so far (see rs_repl_drain()), as
+   it would have been without the pipeline.
+*/
+
+#define _REPL_QUEUE_SIZE 64
+
+struct rs_repl_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	size_t head;
+	size_t count;
+	int waiting;           // set while someone waits for it to change
+};
+
+struct rs_repl {
+	struct rs_vm *vm;
+	struct rs_port *in;
+	rs_object datums;      // a vector, for the datum queue
+	struct rs_repl_queue read;
+	struct rs_outport *chunks[_REPL_QUEUE_SIZE];
+	struct rs_repl_queue eval;
+	struct rs_outport *out;
+	struct rs_outport *current;  // the evaluator's chunk, until it's queued
+	pthread_t reader;      // set by the reader itself, for rs_repl_drain()
+	pthread_t evaluator;
+	pthread_t writer;
+	int writing;           // set while the writer has a chunk
+};
+
+static pthread_once_t rs_repl_drain_once = PTHREAD_ONCE_INIT;
+
+
+static void *rs_repl_reader(void *arg);
+static void *rs_repl_writer(void *arg);
+static void rs_repl_result(struct rs_outport *out, rs_object val);
+static void rs_repl_queue_init(struct rs_repl_queue *q);
+static void rs_repl_queue_free(struct rs_repl_queue *q);
+static size_t rs_repl_queue_wait(struct rs_repl_queue *q, int room, int gc);
+static void rs_repl_queue_done(struct rs_repl_queue *q, int put);
+static void rs_repl_register_drain(void);
+static void rs_repl_drain(void);
+
+
+void rs_repl(struct rs_port *in, struct rs_outport *out)
+{
+	assert(in != NULL);
+	assert(out != NULL);
+
+	rs_primitive_set_output(out);
+	for (;;) {
+		rs_outport_puts(out, "> ");
+		rs_outport_flush(out);
+		rs_object obj = rs_read(in);
+		if (rs_eof_p(obj)) {
+			break;
+		}
+		rs_repl_result(out, rs_eval(obj));
+	}
+}
+
+
+void rs_repl_pipelined(struct rs_port *in, int fd)
+{
+	assert(in != NULL);
+	assert(fd >= 0);
+
+	struct rs_repl *r = calloc(1, sizeof(struct rs_repl));
+	if (r == NULL) {
+		rs_fatal("could not allocate pipeline:");
+	}
+	r->vm = rs_vm_current();
+	r->in = in;
+	r->out = rs_outport_open_fd(fd);
+	r->evaluator = pthread_self();
+	r->datums = rs_vector_create(_REPL_QUEUE_SIZE, rs_unspecified);
+	rs_gc_push(r->datums);
+	rs_repl_queue_init(&r->read);
+	rs_repl_queue_init(&r->eval);
+
+	pthread_once(&rs_repl_drain_once, rs_repl_register_drain);
+	if (r->vm->repl != NULL) {
+		rs_fatal("a pipelined loop is already running");
+	}
+	_VM_STORE(&r->vm->repl, r);
+
+	/* Each datum's output ends with the prompt for the next one. */
+	rs_outport_puts(r->out, "> ");
+	rs_outport_flush(r->out);
+
+	pthread_t reader;
+	if (pthread_create(&reader, NULL, rs_repl_reader, r) != 0 ||
+	    pthread_create(&r->writer, NULL, rs_repl_writer, r) != 0) {
+		rs_fatal("could not start pipeline threads");
+	}
+
+	struct rs_outport *prev = r->vm->output;
+	rs_vector *datums = rs_obj_to_vector(r->datums);
+	for (;;) {
+		size_t i = rs_repl_queue_wait(&r->read, 0, 1);
+		rs_object obj = rs_vector_ref(datums, i);
+		rs_vector_set(datums, i, rs_unspecified);
+		rs_repl_queue_done(&r->read, 0);
+
+		/* The writer stops at a NULL chunk. */
+		struct rs_outport *chunk = NULL;
+		if (!rs_eof_p(obj)) {
+			chunk = rs_outport_open_string();
+			r->current = chunk;
+			rs_primitive_set_output(chunk);
+			rs_repl_result(chunk, rs_eval(obj));
+			rs_outport_puts(chunk, "> ");
+		}
+
+		i = rs_repl_queue_wait(&r->eval, 1, 1);
+		r->chunks[i] = chunk;
+		r->current = NULL;
+		rs_repl_queue_done(&r->eval, 1);
+		if (chunk == NULL) {
+			break;
+		}
+	}
+
+	rs_gc_block();
+	pthread_join(reader, NULL);
+	pthread_join(r->writer, NULL);
+	rs_gc_unblock();
+	rs_primitive_set_output(prev);
+	_VM_STORE(&r->vm->repl, NULL);
+
+	rs_gc_pop();
+	rs_outport_close(r->out);
+	rs_repl_queue_free(&r->read);
+	rs_repl_queue_free(&r->eval);
+	free(r);
+}
+
+
+void rs_repl_batch(struct rs_port *in, struct rs_outport *out, int print)
+{
+	assert(in != NULL);
+	assert(out != NULL);
+
+	rs_primitive_set_output(out);
+	rs_object obj;
+	while (!rs_eof_p(obj = rs_read(in))) {
+		rs_object val = rs_eval(obj);
+		if (print) {
+			rs_repl_result(out, val);
+		}
+	}
+}
+
+
+static void *rs_repl_reader(void *arg)
+{
+	struct rs_repl *r = arg;
+	r->reader = pthread_self();
+	rs_vm_enter(r->vm);
+
+	rs_object obj;
+	do {
+		obj = rs_read(r->in);
+		rs_gc_push(obj);
+		size_t i = rs_repl_queue_wait(&r->read, 1, 1);
+		rs_vector_set(rs_obj_to_vector(r->datums), i, obj);
+		rs_repl_queue_done(&r->read, 1);
+		rs_gc_pop();
+	} while (!rs_eof_p(obj));
+
+	rs_vm_leave();
+	return NULL;
+}
+
+
+static void *rs_repl_writer(void *arg)
+{
+	struct rs_repl *r = arg;
+	for (;;) {
+		size_t i = rs_repl_queue_wait(&r->eval, 0, 0);
+		struct rs_outport *chunk = r->chunks[i];
+		r->writing = chunk != NULL;
+		rs_repl_queue_done(&r->eval, 0);
+		if (chunk == NULL) {
+			break;
+		}
+
+		size_t len;
+		const char *data = rs_outport_data(chunk, &len);
+		rs_outport_write(r->out, data, len);
+		rs_outport_close(chunk);
+
+		pthread_mutex_lock(&r->eval.lock);
+		int idle = r->eval.count == 0;
+		pthread_mutex_unlock(&r->eval.lock);
+		if (idle) {
+			rs_outport_flush(r->out);
+		}
+
+		pthread_mutex_lock(&r->eval.lock);
+		r->writing = 0;
+		pthread_cond_broadcast(&r->eval.changed);
+		pthread_mutex_unlock(&r->eval.lock);
+	}
+	return NULL;
+}
+
+
+/* Write a datum's value, as the loop shows it. */
+static void rs_repl_result(struct rs_outport *out, rs_object val)
+{
+	if (val != rs_unspecified) {
+		rs_write(out, val);
+		rs_outport_putc(out, '\n');
+	}
+}
+
+
+/** Queues **/
+
+/* A queue is just its bookkeeping. The slots are wherever its user keeps
+   them, and are numbered from 0 to _REPL_QUEUE_SIZE - 1.
+*/
+static void rs_repl_queue_init(struct rs_repl_queue *q)
+{
+	if (pthread_mutex_init(&q->lock, NULL) != 0 ||
+	    pthread_cond_init(&q->changed, NULL) != 0) {
+		rs_fatal("could not create pipeline lock");
+	}
+	q->head = q->count = 0;
+}
+
+
+static void rs_repl_queue_free(struct rs_repl_queue *q)
+{
+	pthread_cond_destroy(&q->changed);
+	pthread_mutex_destroy(&q->lock);
+}
+
+
+/* Wait for a free slot to put something in, if room is true, or else for a
+   full one to take from, and return it, with the queue locked. A thread of
+   the interpreter passes true for gc, so that collections go on while it
+   waits.
+*/
+static size_t rs_repl_queue_wait(struct rs_repl_queue *q, int room, int gc)
+{
+	pthread_mutex_lock(&q->lock);
+	if (room ? q->count == _REPL_QUEUE_SIZE : q->count == 0) {
+		if (gc) {
+			pthread_mutex_unlock(&q->lock);
+			rs_gc_block();
+			pthread_mutex_lock(&q->lock);
+		}
+		q->waiting = 1;
+		pthread_cond_broadcast(&q->changed);
+		while (room ? q->count == _REPL_QUEUE_SIZE : q->count == 0) {
+			pthread_cond_wait(&q->changed, &q->lock);
+		}
+		q->waiting = 0;
+		if (gc) {
+			pthread_mutex_unlock(&q->lock);
+			rs_gc_unblock();
+			pthread_mutex_lock(&q->lock);
+		}
+	}
+	return room ? (q->head + q->count) % _REPL_QUEUE_SIZE : q->head;
+}
+
+
+/* Finish putting something in the slot rs_repl_queue_wait() returned, or
+   taking it out, and unlock the queue.
+*/
+static void rs_repl_queue_done(struct rs_repl_queue *q, int put)
+{
+	if (put) {
+		q->count++;
+	} else {
+		q->head = (q->head + 1) % _REPL_QUEUE_SIZE;
+		q->count--;
+	}
+	pthread_cond_broadcast(&q->changed);
+	pthread_mutex_unlock(&q->lock);
+}
+
+
+static void rs_repl_register_drain(void)
+{
+	atexit(rs_repl_drain);
+}
+
+
+/* Run at exit: write out what the writer hasn't, once it's finished the
+   chunk it's on, and stop it from taking any more. If it's the reader that's
+   exiting, the evaluator gets to finish the datums it had already read
+   first. If it's the evaluator, the output of the datum it failed on goes
+   last. The reader and the evaluator find the loop through their
+   interpreter. The writer isn't in it, and if it's the one exiting, there's
+   nothing to be done anyway. Neither is there for the failing datum's output
+   when a future's worker exits, since the evaluator may still be writing it.
+   Being an exit handler, it can't die with rs_fatal() if the writes fail.
+*/
+static void rs_repl_drain(void)
+{
+	struct rs_vm *vm = rs_vm_current();
+	struct rs_repl *r = vm != NULL ? _VM_LOAD(&vm->repl) : NULL;
+	if (r == NULL) {
+		return;
+	}
+	_VM_STORE(&vm->repl, NULL);
+
+	if (pthread_equal(pthread_self(), r->reader)) {
+		rs_gc_block();
+		pthread_mutex_lock(&r->read.lock);
+		while (r->read.count > 0 || !r->read.waiting) {
+			pthread_cond_wait(&r->read.changed, &r->read.lock);
+		}
+		pthread_mutex_unlock(&r->read.lock);
+	}
+
+	pthread_mutex_lock(&r->eval.lock);
+	while (r->writing) {
+		pthread_cond_wait(&r->eval.changed, &r->eval.lock);
+	}
+	int ok = 1;
+	for (; r->eval.count > 0; r->eval.count--) {
+		struct rs_outport *chunk = r->chunks[r->eval.head];
+		r->eval.head = (r->eval.head + 1) % _REPL_QUEUE_SIZE;
+		if (chunk != NULL && ok) {
+			size_t len;
+			const char *data = rs_outport_data(chunk, &len);
+			ok = rs_outport_try_write(r->out, data, len);
+		}
+	}
+	if (pthread_equal(pthread_self(), r->evaluator) && r->current != NULL &&
+	    ok) {
+		size_t len;
+		const char *data = rs_outport_data(r->current, &len);
+		ok = rs_outport_try_write(r->out, data, len);
+	}
+	if (!ok || !rs_outport_try_flush(r->out)) {
+		rs_nonfatal("could not write the loop's output:");
+		_exit(EXIT_FAILURE);
+	}
+}
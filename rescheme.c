@@ -1,27 +1,134 @@
 #include "rescheme.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
-int main(void)
+/* With no arguments, ReScheme runs a REPL on standard input. Otherwise, it
+   runs each argument in turn, as a script: a file, which is mapped rather
+   than read, "-" for standard input, or "-e" and an expression, whose values
+   are written out. Scripts don't prompt, and their output is only flushed when
+   the buffer fills up, or the program exits, including on an error. "-s" and
+   a path starts a REPL server on a socket there, which runs until it's
+   interrupted, with whatever the arguments before it defined.
+*/
+
+static struct rs_outport *output = NULL;
+
+
+/* This runs at exit, so a failed write can't go through rs_fatal(). */
+static void flush_output(void)
+{
+	struct rs_outport *out = output;
+	output = NULL;
+	if (out != NULL && !rs_outport_try_flush(out)) {
+		rs_nonfatal("could not write to standard output:");
+		_exit(EXIT_FAILURE);
+	}
+}
+
+
+/* Check the arguments before running any of them. */
+static void check_args(int argc, char **argv)
+{
+	for (int i = 1; i < argc; i++) {
+		int bad;
+		if (strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "-s") == 0) {
+			bad = ++i == argc;
+		} else {
+			bad = argv[i][0] == '-' && argv[i][1] != '\0';
+		}
+		if (bad) {
+			fprintf(stderr, "usage: rescheme "
+			        "[-e expr | -s socket | file | -]...\n");
+			exit(2);
+		}
+	}
+}
+
+
+static void run_scripts(int argc, char **argv, struct rs_outport *out)
 {
-	printf("ReScheme v0.3\n");
+	for (int i = 1; i < argc; i++) {
+		struct rs_port *in;
+		int print = 0;
+		if (strcmp(argv[i], "-s") == 0) {
+			rs_outport_flush(out);
+			rs_server(argv[++i]);
+			continue;
+		} else if (strcmp(argv[i], "-e") == 0) {
+			i++;
+			in = rs_port_open_mem(argv[i], strlen(argv[i]));
+			print = 1;
+		} else if (strcmp(argv[i], "-") == 0) {
+			in = rs_port_open_fd(STDIN_FILENO);
+		} else if ((in = rs_port_open_mmap(argv[i])) == NULL) {
+			rs_fatal("could not open %s:", argv[i]);
+		}
+		rs_repl_batch(in, out, print);
+		rs_port_close(in);
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	check_args(argc, argv);
+
+	struct rs_outport *out = rs_outport_open_fd(STDOUT_FILENO);
+	output = out;
+	atexit(flush_output);
+	if (argc == 1) {
+		rs_outport_puts(out, "ReScheme v0.3\n");
+	}
 
 #ifdef DEBUG
 	rs_buf_test();
 	rs_stack_test();
+	rs_objtab_test();
 #endif
 
-	rs_gc_init();
+	struct rs_vm *vm = rs_vm_create();
+	rs_vm_enter(vm);
+
+#ifdef DEBUG
+	rs_gc_test();
+	rs_bignum_test();
+	rs_hashtable_test();
+	rs_srcloc_test();
+	rs_hashcons_test();
+	rs_write_test();
+	rs_fasl_test();
+	rs_vector_test();
+	rs_bytevector_test();
+	rs_task_test();
+	rs_future_test();
+#endif
+
+	rs_primitive_set_output(out);
+	if (getenv("RESCHEME_NO_JIT") != NULL) {
+		rs_vm_set_jit(0);
+	}
+	if (getenv("RESCHEME_WORKERS") != NULL) {
+		rs_future_set_workers(atoi(getenv("RESCHEME_WORKERS")));
+	}
 
-	rs_object obj;
-	for (;;) {
-		printf("> ");
-		obj = rs_read(stdin);
-		if (rs_eof_p(obj)) break;
-		obj = rs_eval(obj);
-		rs_write(stdout, obj);
-		printf("\n");
+	if (argc > 1) {
+		run_scripts(argc, argv, out);
+	} else {
+		struct rs_port *in = rs_port_open_fd(STDIN_FILENO);
+		if (getenv("RESCHEME_PIPELINE") != NULL) {
+			rs_outport_flush(out);
+			rs_repl_pipelined(in, STDOUT_FILENO);
+		} else {
+			rs_repl(in, out);
+		}
+		rs_port_close(in);
 	}
 
-	rs_gc_shutdown();
+	output = NULL;
+	rs_outport_close(out);
+	rs_vm_destroy(vm);
 	return 0;
 }
@@ -8,6 +8,7 @@
 */
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -16,8 +17,8 @@
 /**** object.c - object model. ****/
 
 /* An rs_object can be any ReScheme data type. Right now there are fixnums,
-   characters, booleans, symbols, strings, null, and end-of-file, but soon there
-   will be others.
+   bignums, characters, booleans, symbols, strings, pairs, procedures, null,
+   and end-of-file, but soon there will be others.
 */
 typedef long rs_object;
 
@@ -43,6 +44,19 @@ static inline int rs_fixnum_p(rs_object obj);
 static inline rs_object rs_fixnum_to_obj(rs_fixnum val);
 static inline rs_fixnum rs_obj_to_fixnum(rs_object obj);
 
+/* Fixnum arithmetic, done directly on the tagged objects. Each stores the
+   result in *r and returns true, or returns false if an argument isn't a
+   fixnum or the result doesn't fit in one, in which case the caller should
+   use the bignum functions instead. Fixnums compare the same way as their
+   objects, so comparisons don't need functions of their own.
+*/
+static inline int rs_fixnum_add(rs_object a, rs_object b, rs_object *r);
+static inline int rs_fixnum_sub(rs_object a, rs_object b, rs_object *r);
+static inline int rs_fixnum_mul(rs_object a, rs_object b, rs_object *r);
+
+/* Return true if a and b are both fixnums. */
+static inline int rs_fixnums_p(rs_object a, rs_object b);
+
 
 /** Characters **/
 
@@ -68,6 +82,14 @@ static inline int rs_boolean_p(rs_object obj);
 static inline int rs_null_p(rs_object obj);
 static inline int rs_eof_p(rs_object obj);
 
+/* The value of expressions that don't have a useful one, like (set! x 1). */
+extern const rs_object rs_unspecified;
+
+/* The value of variables that haven't been given a value yet. It is never
+   visible to Scheme code.
+*/
+extern const rs_object rs_undefined;
+
 
 /* Symbols, strings, lists, etc. are all heap objects. They have an additional
    function:
@@ -81,6 +103,9 @@ struct rs_hobject;
 /* Perform any type-specific cleanup required for obj. */
 void rs_hobject_release(struct rs_hobject *obj);
 
+/* Return true if a and b are structurally equal, as with Scheme's equal?. */
+int rs_equal_p(rs_object a, rs_object b);
+
 
 /** Symbols **/
 typedef struct rs_hobject rs_symbol;
@@ -93,6 +118,11 @@ rs_object rs_symbol_create(const char *name);
 /* Get the C string representation of sym. */
 static inline const char *rs_symbol_cstr(rs_symbol *sym);
 
+/* Return the value of the global variable named by a shared symbol, or
+   rs_undefined if it's unbound (see rs_global_define()).
+*/
+static inline rs_object rs_symbol_value(rs_symbol *sym);
+
 
 /** Strings **/
 typedef struct rs_hobject rs_string;
@@ -102,8 +132,47 @@ static inline rs_object rs_string_to_obj(rs_string *str);
 static inline rs_string *rs_obj_to_string(rs_object obj);
 rs_object rs_string_create(const char *cstr);
 
-/* Get the C string representation of str. */
-static inline char *rs_string_cstr(rs_string *str);
+/* Strings are length-counted, and can contain NULs. */
+rs_object rs_string_create_n(const char *data, size_t len);
+
+/* Make a string that points straight into a mapped source (see source.c),
+   instead of copying its characters. The source stays mapped for as long as
+   the string is alive.
+*/
+rs_object rs_string_create_slice(const char *data, size_t len);
+
+/* Get a pointer to str's characters, and the number of characters. The
+   characters are NOT necessarily followed by a NUL.
+*/
+static inline const char *rs_string_data(rs_string *str);
+static inline size_t rs_string_length(rs_string *str);
+
+
+/** Bignums **/
+/* Integers that don't fit in a fixnum are bignums. A bignum never holds a value
+   that could be a fixnum, so integer arithmetic (see bignum.c) always gives
+   back a fixnum when it can.
+*/
+typedef struct rs_hobject rs_bignum;
+
+static inline int rs_bignum_p(rs_object obj);
+static inline rs_object rs_bignum_to_obj(rs_bignum *big);
+static inline rs_bignum *rs_obj_to_bignum(rs_object obj);
+
+
+/** Flonums **/
+/* Inexact numbers are doubles. Each one is normally a heap object, but if
+   RS_NAN_BOXING is defined, rs_object is NaN-boxed instead (see rescheme_p.h),
+   and flonums are immediate, so making one never allocates. That comes at the
+   cost of fixnum range: fixnums have 48 bits instead of 62.
+*/
+static inline int rs_flonum_p(rs_object obj);
+#ifdef RS_NAN_BOXING
+static inline rs_object rs_flonum_create(double val);
+#else
+rs_object rs_flonum_create(double val);
+#endif
+static inline double rs_flonum_value(rs_object obj);
 
 
 /** Pairs **/
@@ -121,48 +190,927 @@ static inline void rs_pair_set_car(rs_pair *pair, rs_object car);
 static inline void rs_pair_set_cdr(rs_pair *pair, rs_object cdr);
 
 
+/** Vectors **/
+/* A vector's elements are stored contiguously, outside the heap object (see
+   vector.c). Vectors are never hash-consed, so the reader always makes a
+   fresh, mutable one.
+*/
+typedef struct rs_hobject rs_vector;
+
+static inline int rs_vector_p(rs_object obj);
+static inline rs_object rs_vector_to_obj(rs_vector *vec);
+static inline rs_vector *rs_obj_to_vector(rs_object obj);
+
+static inline size_t rs_vector_length(rs_vector *vec);
+static inline rs_object *rs_vector_data(rs_vector *vec);
+static inline rs_object rs_vector_ref(rs_vector *vec, size_t i);
+static inline void rs_vector_set(rs_vector *vec, size_t i, rs_object obj);
+
+
+/** Bytevectors **/
+/* A bytevector is a sequence of bytes. The bytes are either malloc'd, or part
+   of a mapped file (see bytevector.c), in which case they're read-only.
+*/
+typedef struct rs_hobject rs_bytevector;
+
+static inline int rs_bytevector_p(rs_object obj);
+static inline rs_object rs_bytevector_to_obj(rs_bytevector *bv);
+static inline rs_bytevector *rs_obj_to_bytevector(rs_object obj);
+
+static inline size_t rs_bytevector_length(rs_bytevector *bv);
+static inline unsigned char *rs_bytevector_data(rs_bytevector *bv);
+static inline int rs_bytevector_mutable_p(rs_bytevector *bv);
+
+
+/** Hash tables **/
+/* A hash table maps keys to values, comparing keys with eq?, eqv?, equal?, or
+   (for tables whose keys are all strings) string=?. Its entries are stored
+   outside the heap object (see hashtable.c).
+*/
+typedef struct rs_hobject rs_hashtable;
+
+enum rs_hashtable_kind {
+	RS_HASH_EQ, RS_HASH_EQV, RS_HASH_EQUAL, RS_HASH_STRING
+};
+
+static inline int rs_hashtable_p(rs_object obj);
+static inline rs_object rs_hashtable_to_obj(rs_hashtable *table);
+static inline rs_hashtable *rs_obj_to_hashtable(rs_object obj);
+
+
+/** Channels **/
+/* A channel passes values from one task (see task.c) to another, in the order
+   they were put in it.
+*/
+typedef struct rs_hobject rs_channel;
+
+static inline int rs_channel_p(rs_object obj);
+static inline rs_object rs_channel_to_obj(rs_channel *chan);
+static inline rs_channel *rs_obj_to_channel(rs_object obj);
+
+
+/** Futures **/
+/* A future is the value of a procedure that's being called in parallel (see
+   future.c), or will be.
+*/
+typedef struct rs_hobject rs_future;
+
+static inline int rs_future_p(rs_object obj);
+static inline rs_object rs_future_to_obj(rs_future *fut);
+static inline rs_future *rs_obj_to_future(rs_object obj);
+
+
+/** Procedures **/
+/* A procedure is either a closure, made by evaluating a lambda expression, or
+   a primitive, which is written in C. Primitives get their arguments as an
+   array, and return their result.
+*/
+typedef struct rs_hobject rs_closure;
+typedef struct rs_hobject rs_primitive;
+
+struct rs_primitive_def {
+	const char *name;
+	rs_object (*fn)(rs_object *args, int nargs);
+	int min_args;
+	int max_args;      // or -1, for any number
+};
+
+static inline int rs_procedure_p(rs_object obj);
+static inline int rs_closure_p(rs_object obj);
+static inline int rs_primitive_p(rs_object obj);
+static inline rs_closure *rs_obj_to_closure(rs_object obj);
+static inline rs_primitive *rs_obj_to_primitive(rs_object obj);
+
+/* Make a closure over compiled code, with room for nfree captured values. */
+rs_object rs_closure_create(rs_object code, size_t nfree);
+rs_object rs_primitive_create(const struct rs_primitive_def *def);
+
+/* Get a procedure's name, or NULL if it doesn't have one. */
+const char *rs_procedure_name(rs_object proc);
+
+
+/** Code **/
+/* Code objects hold the bytecode for a lambda expression (see compile.c and
+   vm.c). They aren't visible to Scheme code.
+*/
+typedef struct rs_hobject rs_code;
+
+static inline int rs_code_p(rs_object obj);
+static inline rs_code *rs_obj_to_code(rs_object obj);
+rs_object rs_code_create(void);
+
+
+/** Boxes **/
+/* A box is a mutable cell. The compiler keeps assigned variables in boxes, so
+   that closures can share them. Boxes aren't visible to Scheme code either.
+*/
+typedef struct rs_hobject rs_box;
+
+static inline int rs_box_p(rs_object obj);
+rs_object rs_box_create(rs_object val);
+static inline rs_object rs_box_ref(rs_object box);
+static inline void rs_box_set(rs_object box, rs_object val);
+
+
+
+/**** port.c - input ports. ****/
+
+/* An input port is a source of characters for the reader. */
+struct rs_port;
+
+/* Open a port that reads from a file descriptor. The descriptor is not closed
+   when the port is. While a thread waits for input from it, the other threads
+   in its interpreter can collect (see rs_gc_block()).
+*/
+struct rs_port *rs_port_open_fd(int fd);
+
+/* Open a port that reads from len bytes of memory. The memory must stay valid
+   until the port is closed.
+*/
+struct rs_port *rs_port_open_mem(const char *data, size_t len);
+
+/* Open a port that reads from a memory-mapped file. String literals without
+   escapes are read as slices of the mapping, without being copied. Returns
+   NULL (and sets errno) if the file can't be mapped.
+*/
+struct rs_port *rs_port_open_mmap(const char *path);
+
+/* Return the source that a port is reading from, or NULL if it isn't reading
+   from a mapped file.
+*/
+struct rs_source *rs_port_source(struct rs_port *port);
+
+/* Close a port, and free its resources. */
+void rs_port_close(struct rs_port *port);
+
+/* Get the next character from a port, or EOF. */
+static inline int rs_port_getc(struct rs_port *port);
+
+/* Push the last character that was read back into the port. Only one
+   character of push-back is guaranteed. Pushing back EOF does nothing.
+*/
+static inline void rs_port_ungetc(struct rs_port *port, int c);
+
+/* Get a pointer to the characters that are already buffered in a port, and
+   return how many there are. The reader uses this to copy long runs of
+   characters at once.
+*/
+static inline size_t rs_port_avail(struct rs_port *port, const char **data);
+
+/* Skip over n characters that are already buffered. */
+static inline void rs_port_skip(struct rs_port *port, size_t n);
+
+/* The offset of the next character, from the start of the input. */
+static inline long rs_port_offset(struct rs_port *port);
+
+/* Each port has a scratch buffer, which the reader reuses from one datum to
+   the next, so that it doesn't have to allocate a new one every time.
+*/
+struct rs_buf *rs_port_scratch(struct rs_port *port);
+
+/* Turn position tracking on or off. It costs nothing when it's off, and should
+   be turned on before anything is read from the port.
+*/
+void rs_port_track(struct rs_port *port, int on);
+
+/* Turn sharing mode on or off. In sharing mode, the reader hash-conses every
+   string, symbol, and list it reads (see hashcons.c), so that identical data
+   is only stored once. The resulting objects must not be modified.
+*/
+void rs_port_share(struct rs_port *port, int on);
+
+/* Return true if the port is in sharing mode. */
+int rs_port_share_p(struct rs_port *port);
+
+/* Return the port's source location table, or NULL if it isn't tracking
+   positions.
+*/
+struct rs_srcloc *rs_port_srcloc(struct rs_port *port);
+
+/* Find the line and column of an offset into the input. Only works on a
+   tracking port. Offsets have to be located in increasing order: an offset
+   before the last one located gets the last one's position.
+*/
+struct rs_srcpos;
+void rs_port_locate(struct rs_port *port, long offset, struct rs_srcpos *pos);
+
+
+
+/**** source.c - memory-mapped source files. ****/
+
+/* A read-only file mapping. */
+struct rs_source;
+
+/* Map a whole file into memory. Returns NULL (and sets errno) on failure. */
+struct rs_source *rs_source_map(const char *path);
+
+/* Let go of a source. It is unmapped once no object points into it. */
+void rs_source_release(struct rs_source *src);
+
+/* Get the mapped data, and its length. */
+const char *rs_source_data(struct rs_source *src);
+size_t rs_source_len(struct rs_source *src);
+
+/* Return true if ptr points into some source. */
+int rs_source_contains(const void *ptr);
+
+/* Used by the GC: keep the source that ptr points into mapped through the
+   next sweep, and unmap sources that nothing needs.
+*/
+void rs_source_pin(const void *ptr);
+void rs_source_sweep(void);
+
+/* Unmap every source. Used by rs_gc_shutdown(). */
+void rs_source_shutdown(void);
+
+
+
+/**** outport.c - output ports. ****/
+
+/* An output port is a buffered sink for characters. */
+struct rs_outport;
+
+/* Open a port that writes to a file descriptor. The descriptor is not closed
+   when the port is.
+*/
+struct rs_outport *rs_outport_open_fd(int fd);
+
+/* Open a port that writes into cap bytes of memory. Anything written after the
+   memory fills up is lost (see rs_outport_dropped()).
+*/
+struct rs_outport *rs_outport_open_mem(char *data, size_t cap);
+
+/* Open a port that writes into a string that grows as needed. */
+struct rs_outport *rs_outport_open_string(void);
+
+/* Flush a port, then close it and free its resources. */
+void rs_outport_close(struct rs_outport *port);
+
+/* Write out everything that is buffered in a file descriptor port. Other ports
+   have nothing to flush.
+*/
+void rs_outport_flush(struct rs_outport *port);
+
+/* Like rs_outport_flush(), and rs_outport_write() followed by it, but these
+   return 0 when the write fails, instead of dying. They're for exit handlers,
+   which must not call exit() again.
+*/
+int rs_outport_try_flush(struct rs_outport *port);
+int rs_outport_try_write(struct rs_outport *port, const char *data,
+                         size_t len);
+
+/* Get what has been written to a memory or string port so far. The data is
+   NOT NUL-terminated, and only stays valid until the next write.
+*/
+const char *rs_outport_data(struct rs_outport *port, size_t *len);
+
+/* Return the number of characters that didn't fit into a memory port. */
+size_t rs_outport_dropped(struct rs_outport *port);
+
+/* Write a character, some characters, a C string, or a number in decimal. */
+static inline void rs_outport_putc(struct rs_outport *port, int c);
+void rs_outport_write(struct rs_outport *port, const char *data, size_t len);
+void rs_outport_puts(struct rs_outport *port, const char *cstr);
+void rs_outport_long(struct rs_outport *port, long n);
+
+/* Return the number of characters that have been written to a port. */
+long rs_outport_offset(struct rs_outport *port);
+
+
 
 /**** read.c - s-expression parsing. ****/
 
-/* Read an s-expression from a file, and return the resulting object. */
-rs_object rs_read(FILE *in);
+/* Read an s-expression from a port, and return the resulting object. If the
+   port has position tracking turned on, the source location of each heap
+   object that is read is recorded in the port's location table.
+*/
+rs_object rs_read(struct rs_port *in);
 
 
 
 /**** eval.c - object evaluation. ****/
 
+/* Set up the global environment, with the primitive procedures and the ones
+   defined in Scheme. Must be called after rs_gc_init(). Used by
+   rs_vm_create().
+*/
+void rs_eval_init(void);
+void rs_eval_shutdown(void);
+
 /* Evaluate expr, and return the result. */
 rs_object rs_eval(rs_object expr);
 
+/* Read and evaluate each datum in src, and return the last one's value. */
+rs_object rs_eval_string(const char *src);
+
+/* For the self-tests: check that evaluating src gives a value equal? to the
+   datum in expected, or that it's an error.
+*/
+void rs_eval_expect(const char *src, const char *expected);
+void rs_eval_expect_error(const char *src);
+
+
+
+/**** repl.c - read-eval-print loops. ****/
+
+/* Prompt with "> ", read a datum from in, evaluate it, and write its value to
+   out, unless it's unspecified, until the end of the input. display, write
+   and newline write to out as well.
+*/
+void rs_repl(struct rs_port *in, struct rs_outport *out);
+
+/* Do what rs_repl() does, writing to fd, with the next datums being read on
+   one thread, and the output of the last ones being written on another, while
+   the calling thread evaluates. The output is the same. Nothing else may be
+   reading from in, or writing to fd, until it returns.
+*/
+void rs_repl_pipelined(struct rs_port *in, int fd);
+
+/* Evaluate each datum from in, without prompting, for scripts. The values
+   are written to out too if print is true. Nothing is flushed, so that
+   output goes out in big writes.
+*/
+void rs_repl_batch(struct rs_port *in, struct rs_outport *out, int print);
+
+
+
+/**** server.c - REPL server. ****/
+
+/* Listen on a Unix domain socket at path, and run a REPL, like rs_repl()'s,
+   for each connection, in a process forked from this one, so that it starts
+   with this interpreter's heap and environment. Anything written to stdout
+   must be flushed first. Return when the server gets SIGINT or SIGTERM;
+   sessions that have started carry on until their clients are done.
+*/
+void rs_server(const char *path);
+
+
+
+/**** compile.c - bytecode compiler. ****/
+
+/* Compile expr, which is evaluated in the global environment, into a code
+   object taking no arguments.
+*/
+rs_object rs_compile(rs_object expr);
+
+
+
+/**** vm.c - bytecode virtual machine. ****/
+
+/* An interpreter: a heap, a symbol table, and global variables. Everything
+   else works on the calling thread's current interpreter, so a thread runs
+   one interpreter at a time. Several threads can be in the same interpreter
+   at once, sharing its heap and globals, and each gets its own VM stacks and
+   GC roots when it first enters it. Interpreters share nothing with each
+   other, and objects belong to the interpreter that made them, and mustn't be
+   given to another.
+*/
+struct rs_vm;
+
+/* Create an interpreter, with the global environment set up, ready to
+   evaluate. The calling thread's current interpreter doesn't change.
+*/
+struct rs_vm *rs_vm_create(void);
+
+/* Free an interpreter, and everything in it. Every other thread must have
+   left it. If it's current on this thread, nothing is afterwards.
+*/
+void rs_vm_destroy(struct rs_vm *vm);
+
+/* Make vm (which may be NULL) the calling thread's current interpreter, and
+   return the one that was current before. A thread that enters an interpreter
+   again picks up its stacks and roots where it left them.
+*/
+struct rs_vm *rs_vm_enter(struct rs_vm *vm);
+static inline struct rs_vm *rs_vm_current(void);
+
+/* Leave the calling thread's current interpreter for good, freeing its stacks
+   and roots, so that nothing is current afterwards. A thread should do this
+   before it exits.
+*/
+void rs_vm_leave(void);
+
+/* Set up the VM, and free its global variables. Used by rs_eval_init() and
+   rs_eval_shutdown().
+*/
+void rs_vm_init(void);
+void rs_vm_shutdown(void);
+
+/* Run a code object from rs_compile(), and return its value. */
+rs_object rs_vm_execute(rs_object code);
+
+/* Call a procedure with nargs arguments, and return its value. */
+rs_object rs_vm_apply(rs_object proc, rs_object *args, int nargs);
+
+/* Turn compiling hot procedures to native code (see jit.c) on or off. It is
+   on by default on x86-64 Linux, and can't be turned on anywhere else. While
+   it's off, everything is interpreted, including code that was compiled
+   before.
+*/
+void rs_vm_set_jit(int on);
+
+/* Each global variable's value is kept in its name's shared symbol (see
+   rs_hashcons_symbol()), so that compiled code can get at it directly.
+   rs_global_ref() returns rs_undefined if the variable is unbound, and
+   rs_global_set() fails if it is. Global variables are never unbound once
+   they've been defined.
+*/
+void rs_global_define(rs_object sym, rs_object val);
+rs_object rs_global_ref(rs_object sym);
+void rs_global_set(rs_object sym, rs_object val);
+
+
+
+/**** primitive.c - primitive procedures. ****/
+
+/* Define the primitive procedures as global variables. */
+void rs_primitive_init(void);
+
+/* The port that display, write and newline write to. */
+void rs_primitive_set_output(struct rs_outport *out);
+
+/* Return true if a and b are eq?, or eqv?. equal? is rs_equal_p(). */
+int rs_primitive_eq(rs_object a, rs_object b);
+int rs_primitive_eqv(rs_object a, rs_object b);
+
+/* The apply primitive. Calls to it from compiled code are made by the VM, so
+   that they can be tail calls.
+*/
+rs_object rs_primitive_apply(rs_object *args, int nargs);
+
+/* Return true if a primitive may suspend the running task (see task.c). Calls
+   to them from compiled code are always made by the VM, which then switches
+   tasks.
+*/
+int rs_primitive_suspends_p(const struct rs_primitive_def *def);
+
 
 
 /**** write.c - s-expression output. ****/
 
-/* Write obj's corresponding s-expression to a file, and return the
-   number of bytes written */
-int rs_write(FILE *out, rs_object obj);
+/* Write obj's corresponding s-expression to a port, and return the
+   number of bytes written. This never recurses, so any depth or length of list
+   can be written. The pairs and vectors that cycles lead back to are given
+   datum labels (see rs_write_shared()), so that circular structure is
+   written in full, once.
+*/
+int rs_write(struct rs_outport *out, rs_object obj);
+
+/* Like rs_write(), but every pair or vector that appears more than once
+   (including in a cycle) is given a datum label: it's written as #n=(...) the
+   first time, and as #n# after that.
+*/
+int rs_write_shared(struct rs_outport *out, rs_object obj);
+
+/* Like rs_write(), but strings and characters are written as their contents,
+   without quotes or escapes.
+*/
+int rs_display(struct rs_outport *out, rs_object obj);
+
+/* Check cyclic, shared, long and deeply nested data. */
+void rs_write_test(void);
+
+
+
+/**** fasl.c - binary object serialization. ****/
+
+/* Write obj to a port as a self-contained fasl record, and return the number
+   of bytes written. Shared structure and cycles are preserved.
+*/
+int rs_write_fasl(struct rs_outport *out, rs_object obj);
+
+/* Read the next fasl record from a port, and return the object it holds, or
+   the EOF object if there are no more records. Strings read from a mapped
+   file (see rs_port_open_mmap()) point into the mapping.
+*/
+rs_object rs_read_fasl(struct rs_port *in);
+
+/* Check round trips of several records in one stream, and that truncated or
+   corrupt records are errors.
+*/
+void rs_fasl_test(void);
 
 
 
 /**** gc.c - memory allocation and garbage collection. ****/
 
-/* Initialize the heap and GC. */
+/* Initialize the current interpreter's heap and GC. Used by
+   rs_vm_create().
+*/
 void rs_gc_init(void);
 
 /* Release all of the resources used by every object, and free the memory
-   used for the heap.
+   used for the heap. Used by rs_vm_destroy().
 */
 void rs_gc_shutdown(void);
 
 /* Allocate an object on the heap. */
 struct rs_hobject *rs_gc_alloc_hobject(void);
 
-/* Push an object onto the GC stack. */
+/* Push an object onto the calling thread's GC stack. */
 void rs_gc_push(rs_object obj);
 
-/* Pop an object from the GC stack. */
+/* Pop an object from the calling thread's GC stack. */
 void rs_gc_pop(void);
 
+/* Collections stop every thread in the interpreter, which they each do the
+   next time they allocate or call a procedure. A thread that's about to wait
+   for something else, like input, should call rs_gc_block() first, so that
+   collections go on without it, and rs_gc_unblock() afterwards, which waits
+   for any collection that's under way. In between, it mustn't touch any
+   objects, and the ones it's holding must be rooted.
+*/
+void rs_gc_block(void);
+void rs_gc_unblock(void);
+
+/* Register a function that marks extra roots, by calling rs_gc_mark_range()
+   on them, at the start of each collection. Registering one again, as the
+   futures pool does each time it's started, has no effect.
+*/
+void rs_gc_add_root_hook(void (*hook)(void));
+void rs_gc_mark_range(const rs_object *objs, size_t n);
+
+/* Ask to be told when obj is collected. This is for tables that refer to
+   objects without keeping them alive, like the source location tables.
+*/
+void rs_gc_watch(struct rs_hobject *obj);
+
+/* Check that data nested a million deep can be collected, compared, and read,
+   without running out of C stack.
+*/
+void rs_gc_test(void);
+
+
+
+/**** bignum.c - arbitrary-precision integers. ****/
+
+/* Integer arithmetic. The arguments can be fixnums or bignums, and the result
+   is a fixnum whenever it fits in one.
+*/
+rs_object rs_bignum_add(rs_object a, rs_object b);
+rs_object rs_bignum_sub(rs_object a, rs_object b);
+rs_object rs_bignum_mul(rs_object a, rs_object b);
+rs_object rs_bignum_neg(rs_object a);
+
+/* Truncating division: the quotient is rounded toward zero, and the remainder
+   has the sign of a. b must not be zero.
+*/
+rs_object rs_bignum_quotient(rs_object a, rs_object b);
+rs_object rs_bignum_remainder(rs_object a, rs_object b);
+
+/* Compare two integers. Returns a negative number, zero, or a positive number
+   when a is less than, equal to, or greater than b.
+*/
+int rs_bignum_cmp(rs_object a, rs_object b);
+
+/* Convert an integer to a string, in the given base (2 to 16). The caller is
+   responsible for freeing the result.
+*/
+char *rs_bignum_to_cstr(rs_object obj, int base);
+
+/* Convert between integers and doubles. rs_bignum_to_double() rounds integers
+   that are too large to be exact, and rs_bignum_from_double() only takes finite
+   doubles with integral values.
+*/
+double rs_bignum_to_double(rs_object obj);
+rs_object rs_bignum_from_double(double val);
+
+/* An accumulator for building a bignum one chunk of digits at a time. Used by
+   the reader when a numeric literal overflows the fixnum range.
+*/
+struct rs_bignum_acc;
+
+/* Start accumulating, with an initial non-negative value. */
+void rs_bignum_acc_init(struct rs_bignum_acc *acc, rs_fixnum val);
+
+/* Set the accumulated value to (value * mul + add). */
+void rs_bignum_acc_push(struct rs_bignum_acc *acc, uint32_t mul, uint32_t add);
+
+/* Turn the accumulated value into an integer object, and release the
+   accumulator's resources. */
+rs_object rs_bignum_acc_finish(struct rs_bignum_acc *acc, int neg);
+
+/* Get a bignum's magnitude, as base 2^32 digits from least to most
+   significant, and its sign. Returns the number of digits.
+*/
+size_t rs_bignum_digits(rs_bignum *big, const uint32_t **digits, int *neg);
+
+/* Make an integer from a magnitude like the one rs_bignum_digits() gives. */
+rs_object rs_bignum_from_digits(const uint32_t *digits, size_t len, int neg);
+
+/* Free a bignum's digits. Used by rs_hobject_release(). */
+void rs_bignum_release(rs_bignum *big);
+
+/* Run a basic test of the bignum functions. */
+void rs_bignum_test(void);
+
+
+
+/**** vector.c - vector operations. ****/
+
+/* Make a vector of len elements, each of them fill. */
+rs_object rs_vector_create(size_t len, rs_object fill);
+
+/* Convert between vectors and proper lists. */
+rs_object rs_vector_from_list(rs_object list);
+rs_object rs_vector_to_list(rs_object vec);
+
+/* Set the elements from start up to end to fill. */
+void rs_vector_fill(rs_vector *vec, rs_object fill, size_t start, size_t end);
+
+/* Make a new vector of the elements from start up to end. */
+rs_object rs_vector_copy(rs_object vec, size_t start, size_t end);
+
+/* Bulk arithmetic on vectors of fixnums. Each returns false, and leaves the
+   work to the caller, if any element isn't a fixnum, or if a result doesn't
+   fit in one. rs_vector_fixnum_min() and rs_vector_fixnum_max() also fail on
+   empty vectors.
+*/
+int rs_vector_fixnum_sum(rs_vector *vec, rs_object *r);
+int rs_vector_fixnum_min(rs_vector *vec, rs_object *r);
+int rs_vector_fixnum_max(rs_vector *vec, rs_object *r);
+
+/* Set each element of dst to the sum (if op is '+') or difference (if it's
+   '-') of the corresponding elements of a and b, which are all the same
+   length.
+*/
+int rs_vector_fixnum_map(rs_vector *dst, rs_vector *a, rs_vector *b, int op);
+
+/* Check indexing, the bulk operations, and that bad indexes are errors. */
+void rs_vector_test(void);
+
+
+
+/**** bytevector.c - bytevector operations. ****/
+
+/* Make a bytevector of len bytes, each of them fill. */
+rs_object rs_bytevector_create(size_t len, int fill);
+
+/* Make a read-only bytevector of the bytes from start up to end (or the end
+   of the file, if end is SIZE_MAX) of a file, by mapping it. Returns
+   rs_false (and sets errno) if the file can't be mapped.
+*/
+rs_object rs_bytevector_map(const char *path, size_t start, size_t end);
+
+/* Make a bytevector from a proper list of fixnums from 0 to 255. */
+rs_object rs_bytevector_from_list(rs_object list);
+
+/* Make a new bytevector of the bytes from start up to end. */
+rs_object rs_bytevector_copy(rs_object bv, size_t start, size_t end);
+
+/* Copy src's bytes from start up to end into dst, starting at at. The ranges
+   may overlap.
+*/
+void rs_bytevector_move(rs_bytevector *dst, size_t at, rs_bytevector *src,
+                        size_t start, size_t end);
+
+/* Get or set the unsigned size-byte integer (size is 1, 2, 4, or 8) at byte
+   i, which is stored big-endian if big is true, and little-endian otherwise.
+*/
+uint64_t rs_bytevector_ref_uint(rs_bytevector *bv, size_t i, int size,
+                                int big);
+void rs_bytevector_set_uint(rs_bytevector *bv, size_t i, int size, int big,
+                            uint64_t val);
+
+/* Return true if the machine is big-endian. */
+int rs_bytevector_native_big(void);
+
+/* Check reading and writing bytes and wider integers, and that bad indexes
+   and values are errors.
+*/
+void rs_bytevector_test(void);
+
+
+
+/**** hashtable.c - hash tables. ****/
+
+/* Make an empty hash table. */
+rs_object rs_hashtable_create(enum rs_hashtable_kind kind);
+
+static inline enum rs_hashtable_kind rs_hashtable_kind(rs_hashtable *table);
+static inline size_t rs_hashtable_count(rs_hashtable *table);
+
+/* Look up key, and return true and store its value in *val (if val isn't
+   NULL) if it's there.
+*/
+int rs_hashtable_get(rs_hashtable *table, rs_object key, rs_object *val);
+
+/* Add key, or change its value if it's already there. This never allocates
+   heap objects, so it can't start a collection.
+*/
+void rs_hashtable_put(rs_hashtable *table, rs_object key, rs_object val);
+
+/* Remove key, and return true if it was there. */
+int rs_hashtable_remove(rs_hashtable *table, rs_object key);
+
+/* Remove every entry. */
+void rs_hashtable_clear(rs_hashtable *table);
+
+/* Make a list of a table's keys, its values, or its entries as (key . value)
+   pairs, in no particular order.
+*/
+rs_object rs_hashtable_keys(rs_object table);
+rs_object rs_hashtable_values(rs_object table);
+rs_object rs_hashtable_to_alist(rs_object table);
+
+/* Hash obj consistently with the kind of table's key comparison: objects that
+   compare equal always have the same hash.
+*/
+unsigned long rs_hash(rs_object obj, enum rs_hashtable_kind kind);
+
+void rs_hashtable_test(void);
+
+
+
+/**** task.c - lightweight threads. ****/
+
+/* Tasks are threads of Scheme code that a thread of the interpreter runs one
+   at a time, switching between them only when the running one suspends
+   itself: by yielding, sleeping, waiting on a channel, or waiting for a file
+   descriptor. The code a thread was already running is its root task. Each
+   task has VM stacks of its own, which start small and grow as needed, and
+   switching tasks just switches stacks, so there can be many thousands of
+   them. Tasks belong to the thread that spawned them, and so do the channels
+   they wait on.
+
+   The functions that suspend the running task only queue it, and ask the VM
+   to switch tasks when the primitive that called them returns, so they may
+   only be called by primitives, and not ones called from C (through
+   rs_vm_apply()). Those primitives must be listed by rs_primitive_suspends_p().
+*/
+
+/* Add a task that will call thunk, a closure, with no arguments. It runs once
+   the tasks ahead of it in the run queue have suspended.
+*/
+void rs_task_spawn(rs_object thunk);
+
+/* Suspend the running task, putting it at the back of the run queue. */
+void rs_task_yield(void);
+
+/* Suspend the running task for at least secs seconds. */
+void rs_task_sleep(double secs);
+
+/* Make an empty channel. */
+rs_object rs_channel_create(void);
+
+/* Add val to a channel, and wake up the first task waiting on it, if any,
+   which gets the value. This never suspends the running task.
+*/
+void rs_channel_put(rs_object chan, rs_object val);
+
+/* Take the oldest value from a channel, or suspend the running task until
+   there is one, which it gets as the value of the primitive's call. Either
+   way, the primitive returns what this does.
+*/
+rs_object rs_channel_get(rs_object chan);
+
+/* Read up to len bytes from fd into buf, or write up to len bytes from buf
+   to fd, and return how many were read (0 at end of file) or written. If fd
+   isn't ready, they suspend the running task instead, and return -1, and the
+   primitive's whole call is made again once fd is ready. Writes are at most
+   PIPE_BUF bytes, so that they never block the thread.
+*/
+long rs_task_read(int fd, void *buf, size_t len);
+long rs_task_write(int fd, const void *buf, size_t len);
+
+/* Check the order that tasks run in as they yield, sleep, and pass values
+   through channels.
+*/
+void rs_task_test(void);
+
+
+
+/**** future.c - parallel evaluation. ****/
+
+/* A future calls a procedure on one of a pool of worker threads, which are
+   threads of the interpreter like any other (see rs_vm_enter()), and share
+   its heap. The pool is started by the first future. Touching a future waits
+   for its value, and runs it right away if no worker has started it yet, so
+   code that makes futures and touches them in turn still works, only without
+   the parallelism, however few workers there are. A future's procedure is
+   called from C, so it can't suspend a task.
+*/
+
+/* Set how many worker threads the pool gets. It has one fewer than there are
+   processors online by default, and at least one, since the thread that
+   touches a future helps with the others. Only has an effect before the first
+   future is made.
+*/
+void rs_future_set_workers(int n);
+
+/* Make a future that will call thunk, a closure, with no arguments. */
+rs_object rs_future_create(rs_object thunk);
+
+/* Return a future's value, once its thunk has returned it. While another
+   thread is running it, the calling one runs other futures, or waits.
+*/
+rs_object rs_future_touch(rs_object fut);
+
+/* Check futures' values, including nested ones, and that an error in one
+   ends the program, wherever it runs. Stops the pool again afterwards.
+*/
+void rs_future_test(void);
+
+
+
+/**** srcloc.c - source location tables. ****/
+
+/* A position in the source, and a span of source text. Lines and columns are
+   counted from 1, and a span's end is just past its last character.
+*/
+struct rs_srcpos {
+	long line;
+	long col;
+};
+
+struct rs_span {
+	struct rs_srcpos start;
+	struct rs_srcpos end;
+};
+
+/* A table mapping heap objects to the spans they were read from. It holds
+   onto its objects weakly: entries for objects that are collected are dropped.
+*/
+struct rs_srcloc;
+
+/* Create and free a table. */
+struct rs_srcloc *rs_srcloc_create(void);
+void rs_srcloc_free(struct rs_srcloc *tab);
+
+/* Record where obj came from. Immediate objects are ignored, and so are
+   objects that are already in the table.
+*/
+void rs_srcloc_add(struct rs_srcloc *tab, rs_object obj,
+                   const struct rs_span *span);
+
+/* Look up where obj came from. Returns zero if it isn't in the table. */
+int rs_srcloc_lookup(struct rs_srcloc *tab, rs_object obj,
+                     struct rs_span *span);
+
+/* Like rs_srcloc_lookup(), but searches every table. */
+int rs_srcloc_find(rs_object obj, struct rs_span *span);
+
+/* Remove an object from every table. Used by the GC. */
+void rs_srcloc_forget(struct rs_hobject *obj);
+
+/* Check the locations recorded for a file that's read in several pieces. */
+void rs_srcloc_test(void);
+
+
+
+/**** hashcons.c - hash-consing. ****/
+
+/* Return the shared string or symbol with the given characters, creating it if
+   it doesn't exist yet. If slice is true, a new string is created as a slice
+   (see rs_string_create_slice()).
+*/
+rs_object rs_hashcons_string(const char *data, size_t len, int slice);
+rs_object rs_hashcons_symbol(const char *name);
+
+/* Share a newly-built list, whose elements should already be shared where
+   they can be. A pair whose car or cdr isn't shared (or immediate) stays
+   unshared, and so do the pairs before it. The list's own pairs are reused
+   where possible, and are not usable afterwards: use the returned list
+   instead.
+*/
+rs_object rs_hashcons_list(rs_object list);
+
+/* Remove an object from the hash-consing table. Used by the GC. */
+void rs_hashcons_forget(struct rs_hobject *obj);
+
+/* Free the hash-consing table. Used by rs_gc_shutdown(). */
+void rs_hashcons_shutdown(void);
+
+/* Run a basic test of hash-consing. */
+void rs_hashcons_test(void);
+
+
+
+/**** objtab.c - object-keyed hash table. ****/
+
+/* A hash table mapping objects (by identity) to longs. */
+struct rs_objtab;
+
+/* Initialize an empty table. Doesn't allocate anything. */
+void rs_objtab_init(struct rs_objtab *tab);
+
+/* Free the table's memory, and make it empty again. */
+void rs_objtab_reset(struct rs_objtab *tab);
+
+/* Look up key. If it's found, store its value in *val (if val isn't NULL) and
+   return 1. Otherwise, return 0.
+*/
+int rs_objtab_get(struct rs_objtab *tab, rs_object key, long *val);
+
+/* Add key to the table, or change its value if it's already there. */
+void rs_objtab_put(struct rs_objtab *tab, rs_object key, long val);
+
+/* Remove key from the table. Returns 1 if it was there, and 0 otherwise. */
+int rs_objtab_remove(struct rs_objtab *tab, rs_object key);
+
+/* Run a basic test of the object table functions. */
+void rs_objtab_test(void);
+
 
 
 /**** symtab.c - symbol table. ****/
@@ -173,6 +1121,9 @@ const char *rs_symtab_insert(const char *sym);
 /* Remove a symbol from the table. Used by rs_object_release(). */
 void rs_symtab_remove(const char *sym);
 
+/* Free every symbol that's left. Used by rs_vm_destroy(). */
+void rs_symtab_shutdown(void);
+
 
 
 /**** buffer.c - character buffer data structure. ****/
@@ -191,15 +1142,29 @@ void rs_buf_init(struct rs_buf *buf);
 */
 void rs_buf_reset(struct rs_buf *buf);
 
+/* Empty a buffer, but keep its memory, so that it can be refilled without
+   allocating.
+*/
+void rs_buf_clear(struct rs_buf *buf);
+
 /* Push a character into a buffer, and then return the buffer. */
 struct rs_buf *rs_buf_push(struct rs_buf *buf, char c);
 
+/* Push len characters into a buffer at once, and then return the buffer. */
+struct rs_buf *rs_buf_append(struct rs_buf *buf, const char *data, size_t len);
+
 /* Returns the C string held in buf. Guaranteed to be NUL-terminated.
    NOTE: The string may be modified after it is returned. If you're going to
    keep it around for long, make a copy and use that instead.
  */
 const char *rs_buf_cstr(struct rs_buf *buf);
 
+/* Return the number of characters in buf, and the number it can hold without
+   growing.
+*/
+size_t rs_buf_len(struct rs_buf *buf);
+size_t rs_buf_cap(struct rs_buf *buf);
+
 /* Run a basic test of the buffer functions. */
 void rs_buf_test(void);
 
@@ -248,6 +1213,13 @@ void rs_stack_test(void);
 #define rs_nonfatal(...) eprintf(errno, __func__, __VA_ARGS__)
 #define rs_nonfatal_s(status, ...) eprintf(status, __func__, __VA_ARGS__);
 
+/* Run fn(arg) in a child process, with its output thrown away, and return
+   true if it exits with EXIT_FAILURE, as an error makes it. The self-tests
+   use this to check that errors are caught. The calling thread must be the
+   only one in its interpreter, or the child may wait forever to collect.
+*/
+int rs_fails_p(void (*fn)(void *), void *arg);
+
 /* Debugging messages. */
 #ifndef DEBUG
 # define TRACE(...)
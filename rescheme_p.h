@@ -6,6 +6,9 @@
 #define _RESCHEME_P_H
 
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
 
 /* Inline function defintions, and declarations that need to be globally
    visible, but should not be directly used.
@@ -19,18 +22,55 @@
 #define _FIXNUM_TAG 1
 #define _CHARACTER_TAG 2
 
+#ifdef RS_NAN_BOXING
+#if LONG_MAX != 0x7fffffffffffffff
+#error NaN-boxing needs 64-bit longs.
+#endif
+
+/* A NaN-boxed flonum is its double's bits plus 2^51, wrapping around. That
+   moves every double outside of [-2^50, 2^50), except for some NaNs, which are
+   never stored: all NaNs are stored as the one that doesn't land there.
+   Everything else is a tagged word inside that range, as usual, which is
+   plenty for pointers, but leaves fixnums with 48 bits.
+*/
+#define _NAN_BOX_OFFSET (1UL << 51)
+#define _NAN_BOX_RANGE (1UL << 50)
+#define _NAN_BOX_NAN 0x7ff8000000000000UL
+
+#define _FIXNUM_WORD_MIN (-(long)_NAN_BOX_RANGE)
+
+/* Return true if obj is a tagged word, and not a flonum. */
+static inline int rs_tagged_p(rs_object obj) {
+	return (unsigned long)obj + _NAN_BOX_RANGE < 2 * _NAN_BOX_RANGE;
+}
+#else
+#define _FIXNUM_WORD_MIN LONG_MIN
+
+static inline int rs_tagged_p(rs_object obj) {
+	(void) obj;
+	return 1;
+}
+#endif
+
+/* The smallest and largest fixnum objects. The fixnum range is kept symmetric
+   (see object.c), so the smallest tagged word that looks like a fixnum isn't
+   one.
+*/
+#define _FIXNUM_OBJ_MIN (_FIXNUM_WORD_MIN + (1L << _TAG_BITS) + _FIXNUM_TAG)
+#define _FIXNUM_OBJ_MAX (-(_FIXNUM_WORD_MIN + (1L << _TAG_BITS)) + _FIXNUM_TAG)
+
 
 static inline int rs_immediate_p(rs_object obj) {
-	return (obj & _TAG_MASK) != _HOBJECT_TAG;
+	return !rs_heap_p(obj);
 }
 
 static inline int rs_heap_p(rs_object obj) {
 	assert((void*)obj != NULL);
-	return (obj & _TAG_MASK) == _HOBJECT_TAG;
+	return (obj & _TAG_MASK) == _HOBJECT_TAG && rs_tagged_p(obj);
 }
 
 static inline int rs_fixnum_p(rs_object obj) {
-	return ((rs_fixnum)obj & _TAG_MASK) == _FIXNUM_TAG;
+	return ((rs_fixnum)obj & _TAG_MASK) == _FIXNUM_TAG && rs_tagged_p(obj);
 }
 
 static inline rs_object rs_fixnum_to_obj(rs_fixnum val) {
@@ -42,8 +82,49 @@ static inline rs_fixnum rs_obj_to_fixnum(rs_object obj) {
 	return (rs_fixnum)(obj >> _TAG_BITS);
 }
 
+static inline int rs_fixnums_p(rs_object a, rs_object b) {
+	return (((a ^ _FIXNUM_TAG) | (b ^ _FIXNUM_TAG)) & _TAG_MASK) == 0 &&
+	       rs_tagged_p(a) && rs_tagged_p(b);
+}
+
+/* A fixnum object is 4n + 1, so the sum of two is one tag too many, and their
+   product is (4a)b + 1.
+*/
+static inline int rs_fixnum_add(rs_object a, rs_object b, rs_object *r) {
+	long s;
+	if (!rs_fixnums_p(a, b) ||
+	    __builtin_add_overflow(a, b - _FIXNUM_TAG, &s) ||
+	    s < _FIXNUM_OBJ_MIN || s > _FIXNUM_OBJ_MAX) {
+		return 0;
+	}
+	*r = s;
+	return 1;
+}
+
+static inline int rs_fixnum_sub(rs_object a, rs_object b, rs_object *r) {
+	long s;
+	if (!rs_fixnums_p(a, b) ||
+	    __builtin_sub_overflow(a, b - _FIXNUM_TAG, &s) ||
+	    s < _FIXNUM_OBJ_MIN || s > _FIXNUM_OBJ_MAX) {
+		return 0;
+	}
+	*r = s;
+	return 1;
+}
+
+static inline int rs_fixnum_mul(rs_object a, rs_object b, rs_object *r) {
+	long p;
+	if (!rs_fixnums_p(a, b) ||
+	    __builtin_mul_overflow(a - _FIXNUM_TAG, b >> _TAG_BITS, &p) ||
+	    p + _FIXNUM_TAG < _FIXNUM_OBJ_MIN || p + _FIXNUM_TAG > _FIXNUM_OBJ_MAX) {
+		return 0;
+	}
+	*r = p + _FIXNUM_TAG;
+	return 1;
+}
+
 static inline int rs_character_p(rs_object obj) {
-	return ((rs_character)obj & _TAG_MASK) == _CHARACTER_TAG;
+	return (obj & _TAG_MASK) == _CHARACTER_TAG && rs_tagged_p(obj);
 }
 
 static inline rs_object rs_character_to_obj(rs_character val) {
@@ -69,22 +150,74 @@ static inline int rs_eof_p(rs_object obj) {
 
 
 enum rs_hobject_type {
-	RS_SYMBOL, RS_STRING, RS_PAIR
+	RS_SYMBOL, RS_STRING, RS_PAIR, RS_BIGNUM, RS_CLOSURE, RS_PRIMITIVE,
+	RS_CODE, RS_BOX, RS_FLONUM, RS_VECTOR, RS_HASHTABLE, RS_BYTEVECTOR,
+	RS_CHANNEL, RS_FUTURE
 };
 
 struct rs_hobject {
 	enum rs_hobject_type type;
 	union {
-		const char *sym;
-		char *str;
+		struct {
+			const char *name;
+			rs_object value;
+		} sym;
+		struct {
+			const char *data;
+			size_t len;
+		} str;
 		struct {
 			rs_object car;
 			rs_object cdr;
 		} pair;
+		struct {
+			uint32_t *digits;
+			long size;
+		} big;
+		struct {
+			rs_object code;
+			rs_object *free;
+		} closure;
+		const struct rs_primitive_def *prim;
+		struct rs_code *code;
+		rs_object box;
+		double flo;
+		struct {
+			rs_object *elts;
+			size_t len;
+		} vec;
+		struct rs_hashtable *table;
+		struct {
+			unsigned char *data;
+			size_t len;
+		} bytes;
+		struct rs_channel *chan;
+		struct {
+			rs_object value;   // the thunk, until it has returned
+			int state;
+		} future;
+		struct {
+			struct rs_hobject *next;
+			struct rs_hobject *end;
+		} span;
 	} val;
 	char flags;
 };
 
+/* The low bits of flags belong to the GC (see gc.c). The rest describe the
+   object itself.
+*/
+#define _HOBJECT_FLAG_SHARED 16
+#define _HOBJECT_FLAG_SLICE 32
+
+/* Shared objects have been hash-consed (see hashcons.c). They may be reachable
+   from anywhere, so they must never be modified.
+*/
+static inline int rs_hobject_shared_p(struct rs_hobject *obj) {
+	assert(obj != NULL);
+	return (obj->flags & _HOBJECT_FLAG_SHARED) != 0;
+}
+
 static inline int rs_symbol_p(rs_object obj) {
 	return rs_heap_p(obj) && ((struct rs_hobject*)obj)->type == RS_SYMBOL;
 }
@@ -103,8 +236,14 @@ static inline rs_symbol *rs_obj_to_symbol(rs_object obj) {
 static inline const char *rs_symbol_cstr(rs_symbol *sym) {
 	assert(sym != NULL);
 	assert(sym->type == RS_SYMBOL);
-	assert(sym->val.sym != NULL);
-	return sym->val.sym;
+	assert(sym->val.sym.name != NULL);
+	return sym->val.sym.name;
+}
+
+static inline rs_object rs_symbol_value(rs_symbol *sym) {
+	assert(sym != NULL);
+	assert(sym->type == RS_SYMBOL);
+	return sym->val.sym.value;
 }
 
 static inline int rs_string_p(rs_object obj) {
@@ -122,13 +261,65 @@ static inline rs_string *rs_obj_to_string(rs_object obj) {
 	return (rs_string*)obj;
 }
 
-static inline char *rs_string_cstr(rs_string *str) {
+static inline const char *rs_string_data(rs_string *str) {
 	assert(str != NULL);
 	assert(str->type == RS_STRING);
-	assert(str->val.str != NULL);
-	return str->val.str;
+	assert(str->val.str.data != NULL);
+	return str->val.str.data;
+}
+
+static inline size_t rs_string_length(rs_string *str) {
+	assert(str != NULL);
+	assert(str->type == RS_STRING);
+	return str->val.str.len;
+}
+
+static inline int rs_bignum_p(rs_object obj) {
+	return rs_heap_p(obj) && ((struct rs_hobject*)obj)->type == RS_BIGNUM;
+}
+
+static inline rs_object rs_bignum_to_obj(rs_bignum *big) {
+	assert(big != NULL);
+	assert(big->type == RS_BIGNUM);
+	return (rs_object)big;
+}
+
+static inline rs_bignum *rs_obj_to_bignum(rs_object obj) {
+	assert(rs_bignum_p(obj));
+	return (rs_bignum*)obj;
+}
+
+#ifdef RS_NAN_BOXING
+static inline int rs_flonum_p(rs_object obj) {
+	return !rs_tagged_p(obj);
+}
+
+static inline rs_object rs_flonum_create(double val) {
+	unsigned long bits = _NAN_BOX_NAN;
+	if (val == val) {
+		memcpy(&bits, &val, sizeof(val));
+	}
+	return (rs_object)(bits + _NAN_BOX_OFFSET);
 }
 
+static inline double rs_flonum_value(rs_object obj) {
+	assert(rs_flonum_p(obj));
+	unsigned long bits = (unsigned long)obj - _NAN_BOX_OFFSET;
+	double val;
+	memcpy(&val, &bits, sizeof(val));
+	return val;
+}
+#else
+static inline int rs_flonum_p(rs_object obj) {
+	return rs_heap_p(obj) && ((struct rs_hobject*)obj)->type == RS_FLONUM;
+}
+
+static inline double rs_flonum_value(rs_object obj) {
+	assert(rs_flonum_p(obj));
+	return ((struct rs_hobject*)obj)->val.flo;
+}
+#endif
+
 static inline int rs_pair_p(rs_object obj) {
 	return rs_heap_p(obj) && ((struct rs_hobject*)obj)->type == RS_PAIR;
 }
@@ -165,6 +356,7 @@ static inline void rs_pair_set_car(rs_pair *pair, rs_object obj)
 {
 	assert(pair != NULL);
 	assert(pair->type == RS_PAIR);
+	assert(!rs_hobject_shared_p(pair));
 	pair->val.pair.car = obj;
 }
 
@@ -172,15 +364,676 @@ static inline void rs_pair_set_cdr(rs_pair *pair, rs_object obj)
 {
 	assert(pair != NULL);
 	assert(pair->type == RS_PAIR);
+	assert(!rs_hobject_shared_p(pair));
 	pair->val.pair.cdr = obj;
 }
 
 
+static inline int rs_vector_p(rs_object obj) {
+	return rs_heap_p(obj) && ((struct rs_hobject*)obj)->type == RS_VECTOR;
+}
+
+static inline rs_object rs_vector_to_obj(rs_vector *vec) {
+	assert(vec != NULL);
+	assert(vec->type == RS_VECTOR);
+	return (rs_object)vec;
+}
+
+static inline rs_vector *rs_obj_to_vector(rs_object obj) {
+	assert(rs_vector_p(obj));
+	return (rs_vector*)obj;
+}
+
+static inline size_t rs_vector_length(rs_vector *vec) {
+	assert(vec != NULL);
+	assert(vec->type == RS_VECTOR);
+	return vec->val.vec.len;
+}
+
+static inline rs_object *rs_vector_data(rs_vector *vec) {
+	assert(vec != NULL);
+	assert(vec->type == RS_VECTOR);
+	return vec->val.vec.elts;
+}
+
+static inline rs_object rs_vector_ref(rs_vector *vec, size_t i) {
+	assert(vec != NULL);
+	assert(vec->type == RS_VECTOR);
+	assert(i < vec->val.vec.len);
+	return vec->val.vec.elts[i];
+}
+
+static inline void rs_vector_set(rs_vector *vec, size_t i, rs_object obj) {
+	assert(vec != NULL);
+	assert(vec->type == RS_VECTOR);
+	assert(i < vec->val.vec.len);
+	vec->val.vec.elts[i] = obj;
+}
+
+
+static inline int rs_bytevector_p(rs_object obj) {
+	return rs_heap_p(obj) && ((struct rs_hobject*)obj)->type == RS_BYTEVECTOR;
+}
+
+static inline rs_object rs_bytevector_to_obj(rs_bytevector *bv) {
+	assert(bv != NULL);
+	assert(bv->type == RS_BYTEVECTOR);
+	return (rs_object)bv;
+}
+
+static inline rs_bytevector *rs_obj_to_bytevector(rs_object obj) {
+	assert(rs_bytevector_p(obj));
+	return (rs_bytevector*)obj;
+}
+
+static inline size_t rs_bytevector_length(rs_bytevector *bv) {
+	assert(bv != NULL);
+	assert(bv->type == RS_BYTEVECTOR);
+	return bv->val.bytes.len;
+}
+
+static inline unsigned char *rs_bytevector_data(rs_bytevector *bv) {
+	assert(bv != NULL);
+	assert(bv->type == RS_BYTEVECTOR);
+	return bv->val.bytes.data;
+}
+
+/* Mapped bytevectors are slices, like strings that point into a source. */
+static inline int rs_bytevector_mutable_p(rs_bytevector *bv) {
+	assert(bv != NULL);
+	assert(bv->type == RS_BYTEVECTOR);
+	return !(bv->flags & _HOBJECT_FLAG_SLICE);
+}
+
+
+static inline int rs_hashtable_p(rs_object obj) {
+	return rs_heap_p(obj) && ((struct rs_hobject*)obj)->type == RS_HASHTABLE;
+}
+
+static inline rs_object rs_hashtable_to_obj(rs_hashtable *table) {
+	assert(table != NULL);
+	assert(table->type == RS_HASHTABLE);
+	return (rs_object)table;
+}
+
+static inline rs_hashtable *rs_obj_to_hashtable(rs_object obj) {
+	assert(rs_hashtable_p(obj));
+	return (rs_hashtable*)obj;
+}
+
+
+static inline int rs_channel_p(rs_object obj) {
+	return rs_heap_p(obj) && ((struct rs_hobject*)obj)->type == RS_CHANNEL;
+}
+
+static inline rs_object rs_channel_to_obj(rs_channel *chan) {
+	assert(chan != NULL);
+	assert(chan->type == RS_CHANNEL);
+	return (rs_object)chan;
+}
+
+static inline rs_channel *rs_obj_to_channel(rs_object obj) {
+	assert(rs_channel_p(obj));
+	return (rs_channel*)obj;
+}
+
+
+static inline int rs_future_p(rs_object obj) {
+	return rs_heap_p(obj) && ((struct rs_hobject*)obj)->type == RS_FUTURE;
+}
+
+static inline rs_object rs_future_to_obj(rs_future *fut) {
+	assert(fut != NULL);
+	assert(fut->type == RS_FUTURE);
+	return (rs_object)fut;
+}
+
+static inline rs_future *rs_obj_to_future(rs_object obj) {
+	assert(rs_future_p(obj));
+	return (rs_future*)obj;
+}
+
+
+static inline int rs_closure_p(rs_object obj) {
+	return rs_heap_p(obj) && ((struct rs_hobject*)obj)->type == RS_CLOSURE;
+}
+
+static inline int rs_primitive_p(rs_object obj) {
+	return rs_heap_p(obj) && ((struct rs_hobject*)obj)->type == RS_PRIMITIVE;
+}
+
+static inline int rs_procedure_p(rs_object obj) {
+	return rs_closure_p(obj) || rs_primitive_p(obj);
+}
+
+static inline rs_closure *rs_obj_to_closure(rs_object obj) {
+	assert(rs_closure_p(obj));
+	return (rs_closure*)obj;
+}
+
+static inline rs_primitive *rs_obj_to_primitive(rs_object obj) {
+	assert(rs_primitive_p(obj));
+	return (rs_primitive*)obj;
+}
+
+static inline int rs_code_p(rs_object obj) {
+	return rs_heap_p(obj) && ((struct rs_hobject*)obj)->type == RS_CODE;
+}
+
+static inline rs_code *rs_obj_to_code(rs_object obj) {
+	assert(rs_code_p(obj));
+	return (rs_code*)obj;
+}
+
+static inline int rs_box_p(rs_object obj) {
+	return rs_heap_p(obj) && ((struct rs_hobject*)obj)->type == RS_BOX;
+}
+
+static inline rs_object rs_box_ref(rs_object box) {
+	assert(rs_box_p(box));
+	return ((struct rs_hobject*)box)->val.box;
+}
+
+static inline void rs_box_set(rs_object box, rs_object val) {
+	assert(rs_box_p(box));
+	((struct rs_hobject*)box)->val.box = val;
+}
+
+
+/**** bignum.c ****/
+struct rs_bignum_acc {
+	uint32_t *digits;      // the value before the chunks
+	size_t len;
+	uint32_t *chunks;      // most significant first, all multiplied by mul
+	size_t nchunks;
+	size_t capchunks;
+	uint32_t mul;
+};
+
+
+/**** hashtable.c ****/
+struct rs_hashtable_entry {
+	rs_object key;         // 0 if the slot is empty
+	rs_object val;
+	unsigned long hash;
+};
+
+struct rs_hashtable {
+	enum rs_hashtable_kind kind;
+	struct rs_hashtable_entry *entries;
+	size_t cap;
+	size_t used;           // entries in use
+	size_t count;          // keys, counting the ones still in old
+	struct rs_hashtable_entry *old;   // the entries before a resize, or NULL
+	size_t old_cap;
+	size_t moved;          // old entries before this one have been moved
+};
+
+static inline enum rs_hashtable_kind rs_hashtable_kind(rs_hashtable *table) {
+	assert(rs_hashtable_p((rs_object)table));
+	return table->val.table->kind;
+}
+
+static inline size_t rs_hashtable_count(rs_hashtable *table) {
+	assert(rs_hashtable_p((rs_object)table));
+	return table->val.table->count;
+}
+
+/* Free a hash table's entries. Used by rs_hobject_release(). */
+void rs_hashtable_release(rs_hashtable *table);
+
+
 /**** buffer.c ****/
+#define _RS_BUF_SMALL 64
+
 struct rs_buf {
 	char *buf;
 	size_t off;
 	size_t cap;
+	char small[_RS_BUF_SMALL];
+};
+
+
+/**** port.c ****/
+struct rs_port {
+	int fd;
+	const unsigned char *buf;
+	unsigned char *owned;
+	size_t pos;
+	size_t end;
+	size_t cap;
+	long base;
+	int flags;
+	struct rs_source *source;
+	struct rs_buf scratch;
+	/* Position tracking. */
+	struct rs_srcloc *srcloc;
+	size_t scan;
+	long line;
+	long col;
+};
+
+#define _PORT_FLAG_SHARE 1
+
+/* Refill a port's buffer, and return the next character (or EOF). */
+int rs_port_fill(struct rs_port *port);
+
+static inline int rs_port_getc(struct rs_port *port)
+{
+	assert(port != NULL);
+	if (port->pos < port->end) {
+		return port->buf[port->pos++];
+	}
+	return rs_port_fill(port);
+}
+
+static inline void rs_port_ungetc(struct rs_port *port, int c)
+{
+	assert(port != NULL);
+	if (c != EOF) {
+		assert(port->pos > 0);
+		assert(port->buf[port->pos - 1] == (unsigned char)c);
+		port->pos--;
+	}
+}
+
+static inline size_t rs_port_avail(struct rs_port *port, const char **data)
+{
+	assert(port != NULL);
+	assert(data != NULL);
+	*data = (const char *)port->buf + port->pos;
+	return port->end - port->pos;
+}
+
+static inline void rs_port_skip(struct rs_port *port, size_t n)
+{
+	assert(port != NULL);
+	assert(n <= port->end - port->pos);
+	port->pos += n;
+}
+
+static inline long rs_port_offset(struct rs_port *port)
+{
+	assert(port != NULL);
+	return port->base + (long)port->pos;
+}
+
+
+/**** outport.c ****/
+enum rs_outport_kind { OUT_FD, OUT_MEM, OUT_STRING };
+
+struct rs_outport {
+	char *buf;
+	size_t pos;
+	size_t cap;
+	size_t base;       // characters flushed, or held in mem
+	enum rs_outport_kind kind;
+	int fd;
+	char *mem;         // a memory port's memory, once it fills up
+	size_t dropped;
+	char sink[64];
+};
+
+/* Make space in a full port's buffer. */
+void rs_outport_make_room(struct rs_outport *port);
+
+static inline void rs_outport_putc(struct rs_outport *port, int c)
+{
+	assert(port != NULL);
+	if (port->pos == port->cap) {
+		rs_outport_make_room(port);
+	}
+	port->buf[port->pos++] = (char)c;
+}
+
+
+/**** vm.c ****/
+/* The instruction set. Each instruction is an opcode followed by a fixed
+   number of operands, each one word long (see vm.c for what they do).
+*/
+#define RS_OPCODES(X) \
+	X(CONST, 1) X(LOCAL, 1) X(LOCAL_BOXED, 1) X(SET_LOCAL, 1) \
+	X(SET_LOCAL_BOXED, 1) X(BOX_LOCAL, 1) X(FREE, 1) X(FREE_BOXED, 1) \
+	X(SET_FREE_BOXED, 1) X(GLOBAL, 1) X(SET_GLOBAL, 1) X(DEFINE_GLOBAL, 1) \
+	X(POP, 0) X(DUP, 0) X(JUMP, 1) X(JUMP_FALSE, 1) X(CLOSURE, 2) X(FIX, 3) \
+	X(CALL, 1) X(TAIL_CALL, 1) X(PRIM_CALL, 3) X(RETURN, 0) \
+	X(CAR, 2) X(CDR, 2) X(CONS, 2) X(NULL_P, 2) X(PAIR_P, 2) X(NOT, 2) \
+	X(EQ_P, 2) X(ADD, 2) X(SUB, 2) X(MUL, 2) X(NUM_EQ, 2) X(LT, 2) X(GT, 2) \
+	X(LE, 2) X(GE, 2)
+
+#define _RS_OPCODE_ENUM(op, n) OP_##op,
+enum rs_opcode { RS_OPCODES(_RS_OPCODE_ENUM) OP_COUNT };
+#undef _RS_OPCODE_ENUM
+
+/* Once a code object is finished, its opcodes are replaced by the addresses
+   of their handlers in the VM, if the compiler supports it.
+*/
+struct rs_jit_code;
+
+union rs_insn {
+	const void *addr;
+	long n;
+	rs_object obj;
+};
+
+struct rs_code {
+	union rs_insn *insns;
+	size_t ninsns;
+	size_t capinsns;
+	rs_object *consts;     // heap objects used by the code, for the GC
+	size_t nconsts;
+	size_t capconsts;
+	int nargs;             // required arguments
+	int rest;              // true if extra arguments are collected in a list
+	int nlocals;           // arguments, plus let-bound variables
+	int nfree;
+	int maxdepth;          // deepest the value stack gets above the locals
+	char *name;
+	unsigned long calls;   // times it's been called, until it's compiled
+	struct rs_jit_code *jit;   // native code (see jit.c), or NULL
+};
+
+/* Free a code object's resources. Used by rs_hobject_release(). */
+void rs_code_release(struct rs_code *code);
+
+/* Replace a finished code object's opcodes with handler addresses. */
+void rs_vm_thread(struct rs_code *code);
+
+/* Return the opcode of a finished code object's instruction. */
+long rs_vm_opcode(union rs_insn insn);
+
+/* A return address and saved frame pointer, on the VM's control stack. */
+struct rs_vm_frame {
+	union rs_insn *pc;     // NULL when returning to C
+	rs_object *fp;
+	const void *native;    // where to return to in native code, or NULL
+};
+
+/* The bounds of the current segment of the VM's value stack, and its control
+   stack, which native code (see jit.c) works on directly.
+*/
+struct rs_vm_stacks {
+	rs_object *stack_base;
+	rs_object *stack_end;
+	struct rs_vm_frame *frame;
+	struct rs_vm_frame *frames_end;
+};
+
+/* Move the top carry values of the value stack, which ends at sp, into a new
+   segment with room for need more values after them, and return the new top.
+*/
+rs_object *rs_vm_stack_grow(rs_object *sp, long carry, long need);
+
+#define _GC_MAX_HOOKS 8
+
+/* Everything that belongs to one interpreter. Each module keeps its state
+   here, rather than in globals of its own, and gets at it through the
+   calling thread's current interpreter. Several threads can be in one
+   interpreter at once, each with a mutator of its own (see below). What's
+   here is shared between them, and lock guards the parts that can change
+   once the interpreter is running.
+*/
+struct rs_vm {
+	pthread_mutex_t lock;
+
+	/* gc.c: the heap, and the runs of free objects in it */
+	struct rs_gc_chunk *heap;
+	size_t heap_size;
+	struct rs_hobject *free_spans;
+	size_t free_count;
+	size_t extra_words;
+	void (*root_hooks[_GC_MAX_HOOKS])(void);
+	int nhooks;
+	struct rs_gc_range *marking;    // the mark stack, kept for the next one
+	size_t nmarking;
+	size_t capmarking;
+
+	/* gc.c: stopping the world. Threads wait on stopped for a collection to
+	   finish, and the collector waits on it for the others to stop. */
+	struct rs_mutator *mutators;
+	int nrunning;
+	int stopping;
+	pthread_cond_t stopped;
+
+	/* symtab.c */
+	struct rs_symtab_entry **symtab;
+
+	/* hashcons.c */
+	struct rs_hashcons_entry *hashcons;
+	size_t hashcons_cap;
+	size_t hashcons_count;
+
+	/* source.c and srcloc.c */
+	struct rs_source *sources;
+	struct rs_srcloc *srclocs;
+
+	/* compile.c: the interned names of the keywords */
+	const char **keywords;
+
+	/* primitive.c */
+	struct rs_outport *output;
+
+	/* vm.c */
+	rs_object *globals;
+	size_t nglobals;
+	size_t capglobals;
+	int jit_on;
+	const void *const *handlers;
+
+	/* future.c: the worker threads, started by the first future */
+	struct rs_pool *pool;
+	int nworkers;
+
+	/* repl.c: the pipelined loop that's running, if any */
+	struct rs_repl *repl;
+};
+
+/* A thread's part of an interpreter: its GC roots, the allocation buffer it
+   takes new objects from (see gc.c), and its VM stacks.
+*/
+struct rs_mutator {
+	struct rs_vm *vm;
+	struct rs_mutator *next;
+	pthread_t owner;
+	int stop;              // set while a collection is waiting for it
+
+	/* gc.c */
+	struct rs_hobject *tlab_next;
+	struct rs_hobject *tlab_end;
+	rs_object *roots;
+	size_t nroots;
+	size_t caproots;
+
+	/* vm.c. Native code finds stacks and stop by their offsets from sp. */
+	rs_object *sp;
+	rs_object *fp;
+	struct rs_vm_stacks stacks;
+	struct rs_vm_segment *segment;
+	struct rs_vm_segment *spare;    // the last one dropped, for reuse
+	struct rs_vm_frame *frames;
+	int depth;             // calls to rs_vm_run() under way
+
+	/* task.c */
+	struct rs_task *task;  // the running task, or NULL before there are any
+	struct rs_task *tasks; // all of them, including the running one
+	struct rs_sched *sched;
+	int suspend;           // set by a primitive that suspends the task
+
+	/* future.c */
+	struct rs_deque *deque;     // a worker's own futures, or NULL
+};
+
+/* C99 has no thread-local storage, or atomics, but every compiler that
+   matters has them as extensions. Elsewhere, the atomics are plain loads and
+   stores, which is as much as most machines need for a flag or a pointer.
+   _VM_CAS() sets *p to v if it's still old, and returns whether it did.
+*/
+#if defined(__GNUC__)
+#define _VM_THREAD_LOCAL __thread
+#define _VM_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define _VM_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define _VM_ADD(p, n) __atomic_add_fetch((p), (n), __ATOMIC_RELAXED)
+#define _VM_CAS(p, old, v) __sync_bool_compare_and_swap((p), (old), (v))
+#define _VM_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+#define _VM_THREAD_LOCAL _Thread_local
+#define _VM_LOAD(p) (*(p))
+#define _VM_STORE(p, v) (*(p) = (v))
+#define _VM_ADD(p, n) (*(p) += (n))
+#define _VM_CAS(p, old, v) (*(p) == (old) ? (*(p) = (v), 1) : 0)
+#define _VM_FENCE() ((void) 0)
+#endif
+
+extern _VM_THREAD_LOCAL struct rs_mutator *rs_mutator_self;
+
+static inline struct rs_mutator *rs_mutator_current(void) {
+	return rs_mutator_self;
+}
+
+static inline struct rs_vm *rs_vm_current(void) {
+	return rs_mutator_self != NULL ? rs_mutator_self->vm : NULL;
+}
+
+/* Add a new mutator to its interpreter, and count it as running, once any
+   collection that's under way has finished. Used by rs_vm_enter().
+*/
+void rs_gc_attach(struct rs_mutator *m);
+
+/* Take the calling thread's mutator out of its interpreter, and free its
+   roots. Used by rs_vm_leave().
+*/
+void rs_gc_detach(void);
+
+/* Wait for the collection that set the calling thread's stop flag to finish.
+   Everything the thread is holding must be where the GC can see it.
+*/
+void rs_gc_safepoint(void);
+
+/* Make a task (see task.c) that will call thunk, a closure, with no
+   arguments, on stacks of its own, which start out small.
+*/
+struct rs_task *rs_vm_task_create(rs_object thunk);
+
+/* Free a task that isn't running, and its stacks. */
+void rs_vm_task_free(struct rs_task *t);
+
+/* Save the VM state of the running task, and make t the running task. */
+void rs_vm_task_load(struct rs_task *t);
+
+
+/**** task.c ****/
+/* How a call to a primitive that suspended its task carries on once the task
+   is woken up: by returning the task's value, or by being made again.
+*/
+enum rs_task_resume {
+	RS_RESUME_NONE, RS_RESUME_RETURN, RS_RESUME_RETRY
+};
+
+/* A lightweight thread. While it's suspended, its VM stacks, and where it
+   stopped, are kept here. While it's running, they're its mutator's.
+*/
+struct rs_task {
+	struct rs_task *next;  // in the run queue, or whatever it's waiting in
+	struct rs_task *prev_all;
+	struct rs_task *next_all;   // in its mutator's list of tasks
+	int spawned;           // false for the root task, which the thread started
+
+	/* vm.c */
+	rs_object *sp;
+	rs_object *fp;
+	struct rs_vm_stacks stacks;
+	struct rs_vm_segment *segment;
+	struct rs_vm_frame *frames;
+	union rs_insn *pc;     // after the call that suspended it
+	long nargs;            // that call's arguments
+	int tail;              // true if that call was in tail position
+	enum rs_task_resume resume;
+	rs_object value;       // the value that call returns
+
+	/* task.c */
+	double wake;           // when a sleeping task is due
+	int fd;                // the descriptor a task is waiting on
+	short events;
+};
+
+/* A channel queues values in a list, and tasks waiting for a value when
+   there are none.
+*/
+struct rs_channel {
+	struct rs_mutator *owner;   // the thread whose tasks use it
+	rs_object head;        // oldest value first, or rs_null
+	rs_object tail;        // the last pair of head
+	struct rs_task *waiting;
+	struct rs_task *waiting_tail;
+};
+
+/* Make the next runnable task the running one, waiting until there is one,
+   and return it. The running task must already be queued wherever it's
+   waiting. Used by rs_vm_run().
+*/
+struct rs_task *rs_task_switch(void);
+
+/* Free the running task, whose procedure has returned, and switch to the
+   next one, like rs_task_switch(). Used by rs_vm_run().
+*/
+struct rs_task *rs_task_finish(void);
+
+/* Free a mutator's tasks, apart from the running one, whose stacks are the
+   mutator's. Used when the mutator is freed.
+*/
+void rs_task_shutdown(struct rs_mutator *m);
+
+/* Free a channel's struct rs_channel. Used by rs_hobject_release(). */
+void rs_channel_release(rs_channel *chan);
+
+
+/**** future.c ****/
+/* A future's state, which only ever moves forward. Whichever thread moves it
+   from queued to running is the one that runs it.
+*/
+enum rs_future_state {
+	RS_FUTURE_QUEUED, RS_FUTURE_RUNNING, RS_FUTURE_DONE
+};
+
+/* Stop the worker threads, once they've finished the futures they're
+   running, and free the pool. Used by rs_vm_destroy().
+*/
+void rs_future_shutdown(void);
+
+
+/**** jit.c ****/
+#if defined(__x86_64__) && defined(__linux__) && !defined(RS_NO_JIT)
+#define _JIT_SUPPORTED 1
+#endif
+
+/* Compile a code object to native code, and set its jit field, unless the
+   native code can't be mapped.
+*/
+void rs_jit_compile(rs_object code);
+
+/* Run a procedure's native code, starting at the instruction at pc, in the
+   frame at *fp, with *sp as the top of the stack. Native code calls and
+   returns to other compiled procedures itself, so it may finish in another
+   frame. Return the address of the first instruction it leaves for the
+   interpreter, with *sp and *fp updated.
+*/
+union rs_insn *rs_jit_run(struct rs_code *code, union rs_insn *pc,
+                          rs_object **sp, rs_object **fp);
+
+/* Free native code. Used by rs_code_release(). */
+void rs_jit_release(struct rs_jit_code *jit);
+
+
+/**** objtab.c ****/
+struct rs_objtab_entry {
+	rs_object key;
+	long val;
+};
+
+struct rs_objtab {
+	struct rs_objtab_entry *entries;
+	size_t cap;
+	size_t count;
 };
 
 
@@ -0,0 +1,253 @@
+/* For kill() and signal sets. */
+#define _DEFAULT_SOURCE
+#include "rescheme.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Each session gets a process of its own, forked from the server, which has
+   the interpreter warmed up: the prelude and any scripts run before the
+   server started are already in its heap, and their symbols interned. The
+   child shares all of that with the server, copy-on-write, so a session
+   starts out with everything the server had defined, and nothing it defines
+   is seen by any other. An error only ends the session it happened in, which
+   matters, since errors exit.
+
+   The server keeps a few children forked ahead of time, each waiting in
+   accept(2) on the listening socket, so a new connection is served straight
+   away, without waiting for a fork. A child that gets a connection writes its
+   pid to a pipe back to the server, which forks another to take its place.
+   The server waits on that pipe, and on signals (through a signalfd), with
+   epoll, or, elsewhere, just polls the pipe, and checks for children that
+   have exited every so often.
+*/
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#define _SERVER_EPOLL 1
+#else
+#include <poll.h>
+#endif
+
+/* Children waiting for a connection. */
+#define _SERVER_SPARES 4
+
+struct rs_server {
+	int listener;
+	int notify[2];         // children write their pid here when they start
+	pid_t spares[_SERVER_SPARES];
+	int nspares;
+#ifdef _SERVER_EPOLL
+	int epfd;
+	int sigfd;
+#endif
+};
+
+
+static int rs_server_listen(const char *path);
+static void rs_server_fork(struct rs_server *s, sigset_t *old);
+static void rs_server_session(struct rs_server *s, sigset_t *old);
+static int rs_server_wait(struct rs_server *s);
+static void rs_server_forget(struct rs_server *s, pid_t pid);
+
+
+void rs_server(const char *path)
+{
+	assert(path != NULL);
+
+	/* Forked children only get the thread that forked them, so the worker
+	   pool has to go; each session starts its own, if it needs one. */
+	rs_future_shutdown();
+
+	struct rs_server s;
+	s.listener = rs_server_listen(path);
+	s.nspares = 0;
+	if (pipe(s.notify) != 0) {
+		rs_fatal("could not create server pipe:");
+	}
+
+	/* SIGCHLD, SIGINT and SIGTERM are only ever delivered through the
+	   signalfd, and children put the old mask back. */
+	sigset_t mask, old;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &mask, &old);
+#ifdef _SERVER_EPOLL
+	struct epoll_event ev;
+	s.epfd = epoll_create1(EPOLL_CLOEXEC);
+	s.sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (s.epfd < 0 || s.sigfd < 0) {
+		rs_fatal("could not set up server:");
+	}
+	ev.events = EPOLLIN;
+	ev.data.fd = s.notify[0];
+	epoll_ctl(s.epfd, EPOLL_CTL_ADD, s.notify[0], &ev);
+	ev.data.fd = s.sigfd;
+	epoll_ctl(s.epfd, EPOLL_CTL_ADD, s.sigfd, &ev);
+#endif
+
+	do {
+		while (s.nspares < _SERVER_SPARES) {
+			rs_server_fork(&s, &old);
+		}
+	} while (rs_server_wait(&s));
+
+	for (int i = 0; i < s.nspares; i++) {
+		kill(s.spares[i], SIGTERM);
+	}
+	unlink(path);
+	close(s.listener);
+	close(s.notify[0]);
+	close(s.notify[1]);
+#ifdef _SERVER_EPOLL
+	close(s.epfd);
+	close(s.sigfd);
+#endif
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+
+/* Make the listening socket, replacing whatever socket a previous server
+   left at path.
+*/
+static int rs_server_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		rs_fatal("socket path is too long: %s", path);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	struct stat st;
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(path);
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(fd, SOMAXCONN) != 0) {
+		rs_fatal("could not listen on %s:", path);
+	}
+	return fd;
+}
+
+
+static void rs_server_fork(struct rs_server *s, sigset_t *old)
+{
+	/* Anything buffered would be written twice. */
+	fflush(NULL);
+	pid_t pid = fork();
+	if (pid < 0) {
+		rs_fatal("could not fork session:");
+	} else if (pid == 0) {
+		rs_server_session(s, old);
+	}
+	s->spares[s->nspares++] = pid;
+}
+
+
+/* In a child: wait for a connection, and run a REPL on it until the client
+   is done. Errors are written to the client too, since they end the session.
+*/
+static void rs_server_session(struct rs_server *s, sigset_t *old)
+{
+#ifdef _SERVER_EPOLL
+	close(s->epfd);
+	close(s->sigfd);
+#endif
+	close(s->notify[0]);
+	pthread_sigmask(SIG_SETMASK, old, NULL);
+
+	int fd;
+	do {
+		fd = accept(s->listener, NULL, NULL);
+	} while (fd < 0 && errno == EINTR);
+	if (fd < 0) {
+		rs_fatal("could not accept connection:");
+	}
+	pid_t pid = getpid();
+	if (write(s->notify[1], &pid, sizeof(pid)) != sizeof(pid)) {
+		rs_fatal("could not notify server:");
+	}
+	close(s->notify[1]);
+	close(s->listener);
+	dup2(fd, STDERR_FILENO);
+
+	struct rs_port *in = rs_port_open_fd(fd);
+	struct rs_outport *out = rs_outport_open_fd(fd);
+	rs_repl(in, out);
+	rs_outport_close(out);
+	rs_port_close(in);
+	close(fd);
+	exit(EXIT_SUCCESS);
+}
+
+
+/* Wait for children to start sessions, or exit, and keep track of which are
+   still spare. Return false once the server has been asked to stop.
+*/
+static int rs_server_wait(struct rs_server *s)
+{
+	int notified = 0;
+#ifdef _SERVER_EPOLL
+	struct epoll_event evs[2];
+	int n = epoll_wait(s->epfd, evs, 2, -1);
+	if (n < 0 && errno != EINTR) {
+		rs_fatal("could not wait for sessions:");
+	}
+	for (int i = 0; i < n; i++) {
+		if (evs[i].data.fd == s->notify[0]) {
+			notified = 1;
+			continue;
+		}
+		struct signalfd_siginfo si;
+		if (read(s->sigfd, &si, sizeof(si)) == sizeof(si) &&
+		    si.ssi_signo != SIGCHLD) {
+			return 0;
+		}
+	}
+#else
+	struct pollfd pfd = { s->notify[0], POLLIN, 0 };
+	if (poll(&pfd, 1, 1000) > 0) {
+		notified = 1;
+	}
+#endif
+
+	if (notified) {
+		pid_t pids[64];
+		ssize_t n = read(s->notify[0], pids, sizeof(pids));
+		for (ssize_t i = 0; i < n / (ssize_t) sizeof(pid_t); i++) {
+			rs_server_forget(s, pids[i]);
+		}
+	}
+
+	/* A spare can only exit if something went wrong. */
+	pid_t pid;
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+		rs_server_forget(s, pid);
+	}
+	return 1;
+}
+
+
+static void rs_server_forget(struct rs_server *s, pid_t pid)
+{
+	for (int i = 0; i < s->nspares; i++) {
+		if (s->spares[i] == pid) {
+			s->spares[i] = s->spares[--s->nspares];
+			return;
+		}
+	}
+}
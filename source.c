@@ -0,0 +1,168 @@
+#include "rescheme.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* A source is a file that has been mapped into memory, read-only. Objects can
+   point straight into a source instead of copying their contents out of it
+   (see rs_string_create_slice()), so a source stays mapped for as long as its
+   owner holds onto it, or any object points into it. The GC pins the sources
+   that live objects point into during marking, and then unmaps the ones that
+   nobody needs anymore. Each interpreter keeps track of its own sources.
+*/
+
+struct rs_source {
+	const char *data;
+	size_t len;
+	int owned;
+	int pinned;
+	struct rs_source *next;
+};
+
+
+
+static void rs_source_free(struct rs_source *src);
+
+
+struct rs_source *rs_source_map(const char *path)
+{
+	assert(path != NULL);
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+
+	/* mmap(2) won't map zero bytes, so empty files are a special case. */
+	const char *data = "";
+	if (st.st_size > 0) {
+		void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			int err = errno;
+			close(fd);
+			errno = err;
+			return NULL;
+		}
+		data = p;
+	}
+	close(fd);
+
+	struct rs_source *src = malloc(sizeof(struct rs_source));
+	if (src == NULL) {
+		rs_fatal("could not allocate source:");
+	}
+	src->data = data;
+	src->len = st.st_size;
+	src->owned = 1;
+	src->pinned = 0;
+	struct rs_vm *vm = rs_vm_current();
+	pthread_mutex_lock(&vm->lock);
+	src->next = vm->sources;
+	vm->sources = src;
+	pthread_mutex_unlock(&vm->lock);
+
+	TRACE("mapped %s (%zu bytes)", path, src->len);
+	return src;
+}
+
+
+void rs_source_release(struct rs_source *src)
+{
+	assert(src != NULL);
+	assert(src->owned);
+
+	/* The mapping goes away at the next collection, if nothing points into
+	   it by then. */
+	src->owned = 0;
+}
+
+
+const char *rs_source_data(struct rs_source *src)
+{
+	assert(src != NULL);
+	return src->data;
+}
+
+
+size_t rs_source_len(struct rs_source *src)
+{
+	assert(src != NULL);
+	return src->len;
+}
+
+
+int rs_source_contains(const void *ptr)
+{
+	const char *p = ptr;
+	struct rs_vm *vm = rs_vm_current();
+	int found = 0;
+	pthread_mutex_lock(&vm->lock);
+	for (struct rs_source *src = vm->sources; src != NULL && !found;
+	     src = src->next) {
+		found = p >= src->data && p <= src->data + src->len;
+	}
+	pthread_mutex_unlock(&vm->lock);
+	return found;
+}
+
+
+void rs_source_pin(const void *ptr)
+{
+	const char *p = ptr;
+	for (struct rs_source *src = rs_vm_current()->sources; src != NULL;
+	     src = src->next) {
+		if (p >= src->data && p <= src->data + src->len) {
+			src->pinned = 1;
+			return;
+		}
+	}
+	assert(!"pinned a pointer that isn't in any source");
+}
+
+
+void rs_source_sweep(void)
+{
+	struct rs_source **p = &rs_vm_current()->sources;
+	while (*p != NULL) {
+		struct rs_source *src = *p;
+		if (!src->owned && !src->pinned) {
+			*p = src->next;
+			rs_source_free(src);
+		} else {
+			src->pinned = 0;
+			p = &src->next;
+		}
+	}
+}
+
+
+void rs_source_shutdown(void)
+{
+	struct rs_vm *vm = rs_vm_current();
+	while (vm->sources != NULL) {
+		struct rs_source *src = vm->sources;
+		vm->sources = src->next;
+		rs_source_free(src);
+	}
+}
+
+
+static void rs_source_free(struct rs_source *src)
+{
+	TRACE("unmapping %zu bytes", src->len);
+	if (src->len > 0 && munmap((void *)src->data, src->len) < 0) {
+		rs_nonfatal("could not unmap source:");
+	}
+	free(src);
+}
@@ -0,0 +1,309 @@
+#include "rescheme.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Source locations are kept out of the objects themselves, in a side table.
+   The table maps each object to an entry number, and the entries are stored
+   as a stream of variable-length deltas, which usually takes only 4 bytes per
+   span. Each entry is encoded as:
+     * the change in starting line from the previous entry (zigzag-encoded),
+     * the starting column: a (zigzag) change from the previous entry's column
+       if the line didn't change, or the column itself if it did,
+     * the number of lines spanned, and
+     * the ending column: relative to the starting column if the span is on
+       one line, or absolute otherwise.
+   To find an entry without decoding the whole stream, the absolute position of
+   every _SRCLOC_MARK_EVERY'th entry is kept in a separate array.
+*/
+
+#define _SRCLOC_MARK_EVERY 32
+
+struct rs_srcloc_mark {
+	size_t off;
+	struct rs_srcpos prev;
+};
+
+struct rs_srcloc {
+	struct rs_objtab map;
+	unsigned char *bytes;
+	size_t nbytes;
+	size_t capbytes;
+	struct rs_srcloc_mark *marks;
+	size_t nmarks;
+	size_t capmarks;
+	size_t count;
+	struct rs_srcpos prev;
+	struct rs_srcloc *next;
+};
+
+
+static void rs_srcloc_put(struct rs_srcloc *tab, unsigned long v);
+static unsigned long rs_srcloc_get(const unsigned char **p);
+static unsigned long rs_srcloc_zigzag(long v);
+static long rs_srcloc_unzigzag(unsigned long v);
+static void rs_srcloc_decode(struct rs_srcloc *tab, const unsigned char **p,
+                             struct rs_srcpos *prev, struct rs_span *span);
+
+
+struct rs_srcloc *rs_srcloc_create(void)
+{
+	struct rs_srcloc *tab = calloc(1, sizeof(struct rs_srcloc));
+	if (tab == NULL) {
+		rs_fatal("could not allocate source location table:");
+	}
+	rs_objtab_init(&tab->map);
+	tab->prev.line = 1;
+	tab->prev.col = 1;
+
+	/* The interpreter keeps every table, so that the GC can tell them about
+	   dead objects. */
+	struct rs_vm *vm = rs_vm_current();
+	pthread_mutex_lock(&vm->lock);
+	tab->next = vm->srclocs;
+	vm->srclocs = tab;
+	pthread_mutex_unlock(&vm->lock);
+	return tab;
+}
+
+
+void rs_srcloc_free(struct rs_srcloc *tab)
+{
+	assert(tab != NULL);
+
+	struct rs_vm *vm = rs_vm_current();
+	pthread_mutex_lock(&vm->lock);
+	struct rs_srcloc **p = &vm->srclocs;
+	while (*p != tab) {
+		assert(*p != NULL);
+		p = &(*p)->next;
+	}
+	*p = tab->next;
+	pthread_mutex_unlock(&vm->lock);
+
+	rs_objtab_reset(&tab->map);
+	free(tab->bytes);
+	free(tab->marks);
+	free(tab);
+}
+
+
+void rs_srcloc_add(struct rs_srcloc *tab, rs_object obj,
+                   const struct rs_span *span)
+{
+	assert(tab != NULL);
+	assert(span != NULL);
+	assert(span->end.line >= span->start.line);
+
+	/* Immediates have no identity, so there's nothing to key them on. */
+	if (!rs_heap_p(obj) || rs_objtab_get(&tab->map, obj, NULL)) {
+		return;
+	}
+
+	if (tab->count % _SRCLOC_MARK_EVERY == 0) {
+		if (tab->nmarks == tab->capmarks) {
+			tab->capmarks = tab->capmarks == 0 ? 16 : tab->capmarks * 2;
+			struct rs_srcloc_mark *m = realloc(tab->marks,
+				tab->capmarks * sizeof(struct rs_srcloc_mark));
+			if (m == NULL) {
+				rs_fatal("could not grow source location table:");
+			}
+			tab->marks = m;
+		}
+		tab->marks[tab->nmarks].off = tab->nbytes;
+		tab->marks[tab->nmarks].prev = tab->prev;
+		tab->nmarks++;
+	}
+
+	long dl = span->start.line - tab->prev.line;
+	rs_srcloc_put(tab, rs_srcloc_zigzag(dl));
+	if (dl == 0) {
+		rs_srcloc_put(tab, rs_srcloc_zigzag(span->start.col - tab->prev.col));
+	} else {
+		rs_srcloc_put(tab, span->start.col);
+	}
+	long lines = span->end.line - span->start.line;
+	rs_srcloc_put(tab, lines);
+	if (lines == 0) {
+		assert(span->end.col >= span->start.col);
+		rs_srcloc_put(tab, span->end.col - span->start.col);
+	} else {
+		rs_srcloc_put(tab, span->end.col);
+	}
+	tab->prev = span->start;
+
+	rs_gc_watch((struct rs_hobject *)obj);
+	rs_objtab_put(&tab->map, obj, tab->count++);
+}
+
+
+int rs_srcloc_lookup(struct rs_srcloc *tab, rs_object obj,
+                     struct rs_span *span)
+{
+	assert(tab != NULL);
+	assert(span != NULL);
+
+	long idx;
+	if (!rs_heap_p(obj) || !rs_objtab_get(&tab->map, obj, &idx)) {
+		return 0;
+	}
+
+	struct rs_srcloc_mark *mark = &tab->marks[idx / _SRCLOC_MARK_EVERY];
+	const unsigned char *p = tab->bytes + mark->off;
+	struct rs_srcpos prev = mark->prev;
+	for (long i = idx % _SRCLOC_MARK_EVERY; i >= 0; i--) {
+		rs_srcloc_decode(tab, &p, &prev, span);
+	}
+	return 1;
+}
+
+
+int rs_srcloc_find(rs_object obj, struct rs_span *span)
+{
+	struct rs_vm *vm = rs_vm_current();
+	int found = 0;
+	pthread_mutex_lock(&vm->lock);
+	for (struct rs_srcloc *tab = vm->srclocs; tab != NULL && !found;
+	     tab = tab->next) {
+		found = rs_srcloc_lookup(tab, obj, span);
+	}
+	pthread_mutex_unlock(&vm->lock);
+	return found;
+}
+
+
+void rs_srcloc_forget(struct rs_hobject *obj)
+{
+	for (struct rs_srcloc *tab = rs_vm_current()->srclocs; tab != NULL;
+	     tab = tab->next) {
+		(void) rs_objtab_remove(&tab->map, (rs_object)obj);
+	}
+}
+
+
+/* Append an unsigned LEB128 number to the stream. */
+static void rs_srcloc_put(struct rs_srcloc *tab, unsigned long v)
+{
+	if (tab->nbytes + 10 > tab->capbytes) {
+		tab->capbytes = tab->capbytes == 0 ? 256 : tab->capbytes * 2;
+		unsigned char *b = realloc(tab->bytes, tab->capbytes);
+		if (b == NULL) {
+			rs_fatal("could not grow source location table:");
+		}
+		tab->bytes = b;
+	}
+	while (v >= 0x80) {
+		tab->bytes[tab->nbytes++] = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	tab->bytes[tab->nbytes++] = (unsigned char)v;
+}
+
+
+static unsigned long rs_srcloc_get(const unsigned char **p)
+{
+	unsigned long v = 0;
+	int shift = 0;
+	unsigned char b;
+	do {
+		b = *(*p)++;
+		v |= (unsigned long)(b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
+	return v;
+}
+
+
+static unsigned long rs_srcloc_zigzag(long v)
+{
+	return v < 0 ? ((unsigned long)-(v + 1) << 1) | 1 : (unsigned long)v << 1;
+}
+
+
+static long rs_srcloc_unzigzag(unsigned long v)
+{
+	return (v & 1) ? -(long)(v >> 1) - 1 : (long)(v >> 1);
+}
+
+
+static void rs_srcloc_decode(struct rs_srcloc *tab, const unsigned char **p,
+                             struct rs_srcpos *prev, struct rs_span *span)
+{
+	assert(*p < tab->bytes + tab->nbytes);
+	(void) tab;
+
+	long dl = rs_srcloc_unzigzag(rs_srcloc_get(p));
+	span->start.line = prev->line + dl;
+	if (dl == 0) {
+		span->start.col = prev->col + rs_srcloc_unzigzag(rs_srcloc_get(p));
+	} else {
+		span->start.col = rs_srcloc_get(p);
+	}
+	long lines = rs_srcloc_get(p);
+	span->end.line = span->start.line + lines;
+	if (lines == 0) {
+		span->end.col = span->start.col + rs_srcloc_get(p);
+	} else {
+		span->end.col = rs_srcloc_get(p);
+	}
+	*prev = span->start;
+}
+
+
+
+/**** Testing. ****/
+
+void rs_srcloc_test(void)
+{
+	/* Enough lines that the port's buffer is refilled a few times, with
+	   datums at different columns, and every tenth one split over two
+	   lines. Read them from a file, and check where each list, and the string
+	   in it, was found. */
+	FILE *f = tmpfile();
+	if (f == NULL) {
+		rs_fatal("could not create test file:");
+	}
+	const long n = 10000;
+	for (long i = 0; i < n; i++) {
+		if (i % 10 == 9) {
+			fprintf(f, "%*s(y\n  %ld \"s\")\n", (int)(i % 5), "", i);
+		} else {
+			fprintf(f, "%*s(x %ld \"s\")\n", (int)(i % 5), "", i);
+		}
+	}
+	fflush(f);
+	rewind(f);
+
+	struct rs_port *in = rs_port_open_fd(fileno(f));
+	rs_port_track(in, 1);
+	long line = 1;
+	for (long i = 0; i < n; i++) {
+		rs_object obj = rs_read(in);
+		assert(rs_pair_p(obj));
+		rs_object str = rs_pair_car(rs_obj_to_pair(rs_pair_cdr(
+			rs_obj_to_pair(rs_pair_cdr(rs_obj_to_pair(obj))))));
+		assert(rs_string_p(str));
+
+		/* Where the list and the string should start and end. */
+		long digits = snprintf(NULL, 0, "%ld", i);
+		long col = i % 5 + 1, lines = i % 10 == 9;
+		long scol = lines ? 3 + digits + 1 : col + 3 + digits + 1;
+		struct rs_span span;
+		if (!rs_srcloc_lookup(rs_port_srcloc(in), obj, &span) ||
+		    span.start.line != line || span.start.col != col ||
+		    span.end.line != line + lines || span.end.col != scol + 4) {
+			rs_fatal("wrong location for datum %ld", i);
+		}
+		if (!rs_srcloc_lookup(rs_port_srcloc(in), str, &span) ||
+		    span.start.line != line + lines || span.start.col != scol ||
+		    span.end.line != line + lines || span.end.col != scol + 3) {
+			rs_fatal("wrong location for string %ld", i);
+		}
+		line += 1 + lines;
+	}
+	assert(rs_eof_p(rs_read(in)));
+	rs_port_close(in);
+	fclose(f);
+	TRACE("passed");
+}
@@ -53,7 +53,7 @@ void rs_stack_test(void)
 	stack = rs_stack_push(stack, (void *) 2);
 	stack = rs_stack_push(stack, (void *) 3);
 	for (int i = 3; i > 0; i--) {
-		int data = (int) rs_stack_pop(&stack);
+		int data = (int)(long) rs_stack_pop(&stack);
 		if (data != i) {
 			rs_fatal("expected %d, got %d", i, data);
 		}
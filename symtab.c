@@ -9,18 +9,69 @@ struct rs_symtab_entry {
 	int count;
 };
 
+/* Each interpreter has a table of its own, which is allocated when its first
+   symbol is inserted. Any thread in the interpreter can insert and remove
+   symbols, so the table is only touched with the interpreter's lock held.
+*/
 #define _SYMTAB_SIZE 1439
-static struct rs_symtab_entry *rs_symtab[_SYMTAB_SIZE];
 
 
+static const char *rs_symtab_add(const char *sym);
+static void rs_symtab_drop(const char *sym);
 static struct rs_symtab_entry *rs_symtab_lookup(const char *sym);
 static unsigned long rs_symtab_hash(const char *sym);
 
 
 const char *rs_symtab_insert(const char *sym)
+{
+	struct rs_vm *vm = rs_vm_current();
+	pthread_mutex_lock(&vm->lock);
+	const char *s = rs_symtab_add(sym);
+	pthread_mutex_unlock(&vm->lock);
+	return s;
+}
+
+
+void rs_symtab_remove(const char *sym)
+{
+	struct rs_vm *vm = rs_vm_current();
+	pthread_mutex_lock(&vm->lock);
+	rs_symtab_drop(sym);
+	pthread_mutex_unlock(&vm->lock);
+}
+
+
+void rs_symtab_shutdown(void)
+{
+	struct rs_vm *vm = rs_vm_current();
+	if (vm->symtab == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < _SYMTAB_SIZE; i++) {
+		while (vm->symtab[i] != NULL) {
+			struct rs_symtab_entry *entry = vm->symtab[i];
+			vm->symtab[i] = entry->next;
+			free((char *)entry->sym);
+			free(entry);
+		}
+	}
+	free(vm->symtab);
+	vm->symtab = NULL;
+}
+
+
+static const char *rs_symtab_add(const char *sym)
 {
 	assert(sym != NULL);
 
+	struct rs_vm *vm = rs_vm_current();
+	if (vm->symtab == NULL) {
+		vm->symtab = calloc(_SYMTAB_SIZE, sizeof(struct rs_symtab_entry *));
+		if (vm->symtab == NULL) {
+			rs_fatal("could not allocate symbol table:");
+		}
+	}
+
 	struct rs_symtab_entry *entry = rs_symtab_lookup(sym);
 	if (entry != NULL) {
 		entry->count++;
@@ -37,7 +88,7 @@ const char *rs_symtab_insert(const char *sym)
 
 	unsigned long hashval = rs_symtab_hash(sym);
 #ifdef DEBUG
-	if (rs_symtab[hashval] != NULL) {
+	if (vm->symtab[hashval] != NULL) {
 		TRACE("collision while inserting symbol \"%s\" (%lu)",
 		      sym, hashval);
 	}
@@ -48,19 +99,20 @@ const char *rs_symtab_insert(const char *sym)
 		rs_fatal("could not copy symbol value:");
 	}
 	entry->count = 1;
-	entry->next = rs_symtab[hashval];
-	rs_symtab[hashval] = entry;
+	entry->next = vm->symtab[hashval];
+	vm->symtab[hashval] = entry;
 
 	return entry->sym;
 }
 
 
-void rs_symtab_remove(const char *sym)
+static void rs_symtab_drop(const char *sym)
 {
 	assert(sym != NULL);
 
+	struct rs_symtab_entry **symtab = rs_vm_current()->symtab;
 	unsigned long hashval = rs_symtab_hash(sym);
-	struct rs_symtab_entry *tmp, *entry = rs_symtab[hashval];
+	struct rs_symtab_entry *tmp, *entry = symtab[hashval];
 	if (entry == NULL) {
 		rs_nonfatal("symbol \"%s\" is not in the table", sym);
 		return;
@@ -71,7 +123,7 @@ void rs_symtab_remove(const char *sym)
 	if (strcmp(entry->sym, sym) == 0) {
 		entry->count--;
 		if (entry->count == 0) {
-			rs_symtab[hashval] = entry->next;
+			symtab[hashval] = entry->next;
 			free((char *)entry->sym);
 			free(entry);
 		}
@@ -100,7 +152,8 @@ static struct rs_symtab_entry *rs_symtab_lookup(const char *sym)
 {
 	assert(sym != NULL);
 
-	struct rs_symtab_entry *entry = rs_symtab[rs_symtab_hash(sym)];
+	struct rs_symtab_entry *entry =
+		rs_vm_current()->symtab[rs_symtab_hash(sym)];
 
 	while (entry != NULL) {
 		assert(entry->sym != NULL);
@@ -0,0 +1,598 @@
+/* For clock_gettime() and PIPE_BUF. */
+#define _DEFAULT_SOURCE
+#include "rescheme.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Each thread of an interpreter gets a scheduler for its tasks the first time
+   one is spawned or suspends. Runnable tasks wait their turn in a run queue.
+   Sleeping ones wait in a heap ordered by when they're due, and ones waiting
+   for a file descriptor are registered with epoll (or, elsewhere, polled with
+   poll()). Every so often, and whenever there's nothing left to run, the
+   scheduler moves the ones that are due or ready to the run queue, waiting
+   for some if it has to. While it waits, the thread is blocked (see
+   rs_gc_block()), so the interpreter's other threads can still collect.
+
+   Switching tasks is done by the VM (see rs_vm_run()), which only has to swap
+   a few pointers, so a task that suspends costs about as much as a call to a
+   primitive.
+*/
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#define _TASK_EPOLL 1
+#endif
+
+/* Switches between checks on the sleeping and waiting tasks. */
+#define _TASK_POLL_INTERVAL 64
+
+struct rs_sched {
+	struct rs_task *head;  // the run queue
+	struct rs_task *tail;
+	struct rs_task **sleepers;  // a heap, with the soonest due first
+	size_t nsleepers;
+	size_t capsleepers;
+	size_t nwaiting;       // tasks waiting for a descriptor
+	unsigned switches;
+#ifdef _TASK_EPOLL
+	int epfd;
+#else
+	struct rs_task *waiting;
+#endif
+};
+
+
+static struct rs_sched *rs_task_sched(void);
+static void rs_task_suspend(enum rs_task_resume resume);
+static void rs_task_enqueue(struct rs_sched *s, struct rs_task *t);
+static struct rs_channel *rs_task_channel(rs_object chan);
+static void rs_task_wait(int fd, short events);
+static int rs_task_ready(int fd, short events);
+static void rs_task_poll(struct rs_sched *s, int block);
+static void rs_task_poll_fds(struct rs_sched *s, int timeout);
+static void rs_task_sleepers_push(struct rs_sched *s, struct rs_task *t);
+static struct rs_task *rs_task_sleepers_pop(struct rs_sched *s);
+static double rs_task_now(void);
+
+
+void rs_task_spawn(rs_object thunk)
+{
+	assert(rs_closure_p(thunk));
+
+	struct rs_mutator *self = rs_mutator_current();
+	struct rs_sched *s = rs_task_sched();
+	struct rs_task *t = rs_vm_task_create(thunk);
+	t->spawned = 1;
+	t->fd = -1;
+	t->next_all = self->tasks;
+	self->tasks->prev_all = t;
+	self->tasks = t;
+	rs_task_enqueue(s, t);
+}
+
+
+void rs_task_yield(void)
+{
+	struct rs_sched *s = rs_task_sched();
+	rs_task_suspend(RS_RESUME_RETURN);
+	rs_task_enqueue(s, rs_mutator_current()->task);
+}
+
+
+void rs_task_sleep(double secs)
+{
+	struct rs_sched *s = rs_task_sched();
+	struct rs_task *t = rs_mutator_current()->task;
+	rs_task_suspend(RS_RESUME_RETURN);
+	t->wake = rs_task_now() + (secs > 0 ? secs : 0);
+	rs_task_sleepers_push(s, t);
+}
+
+
+struct rs_task *rs_task_switch(void)
+{
+	struct rs_mutator *self = rs_mutator_current();
+	struct rs_sched *s = self->sched;
+	assert(s != NULL);
+
+	if (++s->switches % _TASK_POLL_INTERVAL == 0) {
+		rs_task_poll(s, 0);
+	}
+	while (s->head == NULL) {
+		rs_task_poll(s, 1);
+	}
+	struct rs_task *t = s->head;
+	s->head = t->next;
+	t->next = NULL;
+	if (t != self->task) {
+		rs_vm_task_load(t);
+	}
+	return t;
+}
+
+
+struct rs_task *rs_task_finish(void)
+{
+	struct rs_mutator *self = rs_mutator_current();
+	struct rs_task *done = self->task;
+	assert(done->spawned);
+
+	/* It isn't queued anywhere, so another task is bound to be next. */
+	struct rs_task *t = rs_task_switch();
+	if (done->prev_all != NULL) {
+		done->prev_all->next_all = done->next_all;
+	} else {
+		self->tasks = done->next_all;
+	}
+	if (done->next_all != NULL) {
+		done->next_all->prev_all = done->prev_all;
+	}
+	rs_vm_task_free(done);
+	return t;
+}
+
+
+void rs_task_shutdown(struct rs_mutator *m)
+{
+	struct rs_sched *s = m->sched;
+	if (s == NULL) {
+		return;
+	}
+	while (m->tasks != NULL) {
+		struct rs_task *t = m->tasks;
+		m->tasks = t->next_all;
+		if (t == m->task) {
+			free(t);
+		} else {
+			rs_vm_task_free(t);
+		}
+	}
+#ifdef _TASK_EPOLL
+	close(s->epfd);
+#endif
+	free(s->sleepers);
+	free(s);
+	m->sched = NULL;
+	m->task = NULL;
+}
+
+
+/** Channels **/
+
+rs_object rs_channel_create(void)
+{
+	struct rs_channel *c = malloc(sizeof(struct rs_channel));
+	if (c == NULL) {
+		rs_fatal("could not create channel:");
+	}
+	c->owner = rs_mutator_current();
+	c->head = c->tail = rs_null;
+	c->waiting = c->waiting_tail = NULL;
+
+	rs_channel *chan = rs_gc_alloc_hobject();
+	chan->type = RS_CHANNEL;
+	chan->val.chan = c;
+	return rs_channel_to_obj(chan);
+}
+
+
+void rs_channel_release(rs_channel *chan)
+{
+	assert(rs_channel_p((rs_object)chan));
+	free(chan->val.chan);
+}
+
+
+void rs_channel_put(rs_object chan, rs_object val)
+{
+	struct rs_channel *c = rs_task_channel(chan);
+	if (c->waiting != NULL) {
+		struct rs_task *t = c->waiting;
+		c->waiting = t->next;
+		t->value = val;
+		rs_task_enqueue(rs_mutator_current()->sched, t);
+		return;
+	}
+
+	rs_gc_push(chan);
+	rs_gc_push(val);
+	rs_object pair = rs_pair_create(val, rs_null);
+	rs_gc_pop();
+	rs_gc_pop();
+	if (rs_null_p(c->head)) {
+		c->head = pair;
+	} else {
+		rs_pair_set_cdr(rs_obj_to_pair(c->tail), pair);
+	}
+	c->tail = pair;
+}
+
+
+rs_object rs_channel_get(rs_object chan)
+{
+	struct rs_channel *c = rs_task_channel(chan);
+	if (!rs_null_p(c->head)) {
+		rs_pair *first = rs_obj_to_pair(c->head);
+		c->head = rs_pair_cdr(first);
+		if (rs_null_p(c->head)) {
+			c->tail = rs_null;
+		}
+		return rs_pair_car(first);
+	}
+
+	rs_task_sched();
+	struct rs_task *t = rs_mutator_current()->task;
+	rs_task_suspend(RS_RESUME_RETURN);
+	/* Until a value arrives, the task's value keeps the channel alive. */
+	t->value = chan;
+	if (c->waiting == NULL) {
+		c->waiting = t;
+	} else {
+		c->waiting_tail->next = t;
+	}
+	c->waiting_tail = t;
+	return rs_unspecified;
+}
+
+
+/* Get a channel's queues, which only its own thread may use. */
+static struct rs_channel *rs_task_channel(rs_object chan)
+{
+	struct rs_channel *c = rs_obj_to_channel(chan)->val.chan;
+	if (c->owner != rs_mutator_current()) {
+		rs_fatal("channel belongs to another thread");
+	}
+	return c;
+}
+
+
+/** Descriptors **/
+
+long rs_task_read(int fd, void *buf, size_t len)
+{
+	for (;;) {
+		if (!rs_task_ready(fd, POLLIN)) {
+			rs_task_wait(fd, POLLIN);
+			return -1;
+		}
+		ssize_t n = read(fd, buf, len);
+		if (n >= 0) {
+			return n;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			rs_task_wait(fd, POLLIN);
+			return -1;
+		} else if (errno != EINTR) {
+			rs_fatal("could not read from descriptor %d:", fd);
+		}
+	}
+}
+
+
+long rs_task_write(int fd, const void *buf, size_t len)
+{
+	if (len > PIPE_BUF) {
+		len = PIPE_BUF;
+	}
+	for (;;) {
+		if (!rs_task_ready(fd, POLLOUT)) {
+			rs_task_wait(fd, POLLOUT);
+			return -1;
+		}
+		ssize_t n = write(fd, buf, len);
+		if (n >= 0) {
+			return n;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			rs_task_wait(fd, POLLOUT);
+			return -1;
+		} else if (errno != EINTR) {
+			rs_fatal("could not write to descriptor %d:", fd);
+		}
+	}
+}
+
+
+/* Return true if reading from or writing to fd (as events says) won't block,
+   or will fail straight away.
+*/
+static int rs_task_ready(int fd, short events)
+{
+	struct pollfd p;
+	p.fd = fd;
+	p.events = events;
+	p.revents = 0;
+	return poll(&p, 1, 0) > 0;
+}
+
+
+/* Suspend the running task until fd is ready, and then make the call again. */
+static void rs_task_wait(int fd, short events)
+{
+	struct rs_sched *s = rs_task_sched();
+	struct rs_task *t = rs_mutator_current()->task;
+	rs_task_suspend(RS_RESUME_RETRY);
+	t->fd = fd;
+	t->events = events;
+#ifdef _TASK_EPOLL
+	struct epoll_event ev;
+	ev.events = (events == POLLIN ? EPOLLIN : EPOLLOUT) | EPOLLONESHOT;
+	ev.data.ptr = t;
+	if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		if (errno == EEXIST) {
+			rs_fatal("another task is waiting for descriptor %d", fd);
+		}
+		rs_fatal("could not wait for descriptor %d:", fd);
+	}
+#else
+	t->next = s->waiting;
+	s->waiting = t;
+#endif
+	s->nwaiting++;
+}
+
+
+/** Scheduling **/
+
+/* Get the calling thread's scheduler, making it, and the root task, if they
+   don't exist yet.
+*/
+static struct rs_sched *rs_task_sched(void)
+{
+	struct rs_mutator *self = rs_mutator_current();
+	if (self->sched != NULL) {
+		return self->sched;
+	}
+
+	struct rs_sched *s = calloc(1, sizeof(struct rs_sched));
+	struct rs_task *root = calloc(1, sizeof(struct rs_task));
+	if (s == NULL || root == NULL) {
+		rs_fatal("could not allocate scheduler:");
+	}
+#ifdef _TASK_EPOLL
+	s->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (s->epfd < 0) {
+		rs_fatal("could not allocate scheduler:");
+	}
+#endif
+	root->value = rs_unspecified;
+	root->fd = -1;
+	self->sched = s;
+	self->task = root;
+	self->tasks = root;
+	return s;
+}
+
+
+/* Have the VM suspend the running task once the calling primitive returns. */
+static void rs_task_suspend(enum rs_task_resume resume)
+{
+	struct rs_mutator *self = rs_mutator_current();
+	assert(self->suspend == RS_RESUME_NONE);
+	self->suspend = resume;
+	self->task->value = rs_unspecified;
+}
+
+
+static void rs_task_enqueue(struct rs_sched *s, struct rs_task *t)
+{
+	t->next = NULL;
+	if (s->head == NULL) {
+		s->head = t;
+	} else {
+		s->tail->next = t;
+	}
+	s->tail = t;
+}
+
+
+/* Move the sleeping tasks that are due, and the ones whose descriptors are
+   ready, to the run queue. If block is true, wait until there's at least
+   one.
+*/
+static void rs_task_poll(struct rs_sched *s, int block)
+{
+	int timeout = 0;
+	if (block) {
+		if (s->nsleepers == 0 && s->nwaiting == 0) {
+			rs_fatal("deadlock: every task is waiting on a channel");
+		}
+		timeout = -1;
+		if (s->nsleepers > 0) {
+			/* Round up, so as not to wake up just before it's due. */
+			double ms = (s->sleepers[0]->wake - rs_task_now()) * 1000;
+			timeout = ms <= 0 ? 0 : ms >= INT_MAX ? INT_MAX : (int)ms + 1;
+		}
+	}
+
+	if (timeout != 0) {
+		rs_gc_block();
+		rs_task_poll_fds(s, timeout);
+		rs_gc_unblock();
+	} else if (s->nwaiting > 0) {
+		rs_task_poll_fds(s, 0);
+	}
+	if (s->nsleepers > 0) {
+		double now = rs_task_now();
+		while (s->nsleepers > 0 && s->sleepers[0]->wake <= now) {
+			rs_task_enqueue(s, rs_task_sleepers_pop(s));
+		}
+	}
+}
+
+
+/* Wait up to timeout milliseconds (or forever, if it's negative) for any of
+   the waiting tasks' descriptors to be ready, and queue those tasks.
+*/
+static void rs_task_poll_fds(struct rs_sched *s, int timeout)
+{
+#ifdef _TASK_EPOLL
+	struct epoll_event ev[64];
+	int n = epoll_wait(s->epfd, ev, 64, timeout);
+	if (n < 0 && errno != EINTR) {
+		rs_fatal("could not wait for descriptors:");
+	}
+	for (int i = 0; i < n; i++) {
+		struct rs_task *t = ev[i].data.ptr;
+		epoll_ctl(s->epfd, EPOLL_CTL_DEL, t->fd, NULL);
+		t->fd = -1;
+		s->nwaiting--;
+		rs_task_enqueue(s, t);
+	}
+#else
+	struct pollfd *fds = NULL;
+	if (s->nwaiting > 0) {
+		fds = malloc(s->nwaiting * sizeof(struct pollfd));
+		if (fds == NULL) {
+			rs_fatal("could not wait for descriptors:");
+		}
+	}
+	size_t i = 0;
+	for (struct rs_task *t = s->waiting; t != NULL; t = t->next, i++) {
+		fds[i].fd = t->fd;
+		fds[i].events = t->events;
+		fds[i].revents = 0;
+	}
+	int n = poll(fds, s->nwaiting, timeout);
+	if (n < 0 && errno != EINTR) {
+		rs_fatal("could not wait for descriptors:");
+	}
+	struct rs_task **link = &s->waiting;
+	for (i = 0; n > 0 && *link != NULL; i++) {
+		struct rs_task *t = *link;
+		if (fds[i].revents != 0) {
+			*link = t->next;
+			t->fd = -1;
+			s->nwaiting--;
+			n--;
+			rs_task_enqueue(s, t);
+		} else {
+			link = &t->next;
+		}
+	}
+	free(fds);
+#endif
+}
+
+
+static void rs_task_sleepers_push(struct rs_sched *s, struct rs_task *t)
+{
+	if (s->nsleepers == s->capsleepers) {
+		s->capsleepers = s->capsleepers == 0 ? 16 : s->capsleepers * 2;
+		struct rs_task **h = realloc(s->sleepers,
+		                             s->capsleepers * sizeof(struct rs_task *));
+		if (h == NULL) {
+			rs_fatal("could not grow sleeping tasks:");
+		}
+		s->sleepers = h;
+	}
+	size_t i = s->nsleepers++;
+	while (i > 0 && s->sleepers[(i - 1) / 2]->wake > t->wake) {
+		s->sleepers[i] = s->sleepers[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	s->sleepers[i] = t;
+}
+
+
+static struct rs_task *rs_task_sleepers_pop(struct rs_sched *s)
+{
+	assert(s->nsleepers > 0);
+	struct rs_task *first = s->sleepers[0];
+	struct rs_task *last = s->sleepers[--s->nsleepers];
+	size_t i = 0;
+	for (;;) {
+		size_t c = 2 * i + 1;
+		if (c >= s->nsleepers) {
+			break;
+		}
+		if (c + 1 < s->nsleepers &&
+		    s->sleepers[c + 1]->wake < s->sleepers[c]->wake) {
+			c++;
+		}
+		if (s->sleepers[c]->wake >= last->wake) {
+			break;
+		}
+		s->sleepers[i] = s->sleepers[c];
+		i = c;
+	}
+	s->sleepers[i] = last;
+	return first;
+}
+
+
+/* Seconds since some fixed time. */
+static double rs_task_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+/**** Testing. ****/
+
+void rs_task_test(void)
+{
+	/* Each task notes what it does, so the log shows the order they ran in.
+	   The root task runs first, and tasks run in the order they were spawned,
+	   or woken, until they suspend.
+	*/
+	rs_eval_expect("(let ((log '()) (c (make-channel)))"
+	               "  (define (note x) (set! log (cons x log)))"
+	               "  (spawn (lambda ()"
+	               "    (note 'a1) (yield) (note 'a2)"
+	               "    (channel-put! c 'from-a) (note 'a3)))"
+	               "  (spawn (lambda ()"
+	               "    (note 'b1) (note (channel-get c)) (note 'b2)))"
+	               "  (spawn (lambda ()"
+	               "    (sleep 0.02) (note 's) (channel-put! c 'from-s)))"
+	               "  (note 'root1)"
+	               "  (yield)"
+	               "  (note 'root2)"
+	               "  (note (channel-get c))"
+	               "  (reverse log))",
+	               "(root1 a1 b1 root2 a2 a3 from-a b2 s from-s)");
+
+	/* Sleepers wake in the order they're due, not the order they slept. */
+	rs_eval_expect("(let ((log '()) (done (make-channel)))"
+	               "  (for-each"
+	               "   (lambda (secs)"
+	               "     (spawn (lambda ()"
+	               "       (sleep secs)"
+	               "       (set! log (cons secs log))"
+	               "       (channel-put! done #t))))"
+	               "   '(0.06 0.02 0 0.04))"
+	               "  (let loop ((n 4))"
+	               "    (when (> n 0) (channel-get done) (loop (- n 1))))"
+	               "  (reverse log))",
+	               "(0 0.02 0.04 0.06)");
+
+	/* Values come out of a channel in the order they were put in, and
+	   waiting tasks get them in the order they started waiting.
+	*/
+	rs_eval_expect("(let ((c (make-channel)) (out (make-channel)))"
+	               "  (channel-put! c 1) (channel-put! c 2) (channel-put! c 3)"
+	               "  (let* ((x (channel-get c)) (y (channel-get c)))"
+	               "    (for-each"
+	               "     (lambda (name)"
+	               "       (spawn (lambda ()"
+	               "         (channel-put! out (list name (channel-get c))))))"
+	               "     '(p q r))"
+	               "    (yield)"
+	               "    (channel-put! c 4) (channel-put! c 5)"
+	               "    (list x y (channel-get out) (channel-get out)"
+	               "          (channel-get out))))",
+	               "(1 2 (p 3) (q 4) (r 5))");
+
+	rs_eval_expect_error("(spawn car)");
+	rs_eval_expect_error("(channel-get 'c)");
+	rs_eval_expect_error("(channel-put! (list 1) 2)");
+	rs_eval_expect_error("(sleep 'a)");
+
+	TRACE("passed");
+}
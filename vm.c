@@ -0,0 +1,1190 @@
+#include "rescheme.h"
+
+#include <assert.h>
+#include <string.h>
+
+/* The VM is a stack machine. Compiled code (see compile.c) pushes values onto
+   a value stack, and each call gets a frame on it:
+
+       ... | procedure | arg 0 ... arg n-1 | locals ... | temporaries ...
+                         ^ fp                                          ^ sp
+
+   so that arguments and let-bound variables are addressed by their index from
+   fp, and the procedure being run is always at fp[-1]. Return addresses and
+   saved frame pointers go on a separate control stack, which keeps the value
+   stack made up of nothing but objects, so the GC can just mark all of it.
+
+   Neither stack is the C stack, and both grow until memory runs out. The value
+   stack is a chain of segments which never move, since fp and sp point into
+   them: a frame that doesn't fit in the current segment starts a new one, and
+   takes its procedure and arguments along with it, and when that frame
+   returns the segment is dropped. The control stack just gets reallocated.
+
+   Dispatch is direct-threaded when the compiler supports computed goto: when a
+   code object is finished, each opcode in it is replaced by the address of its
+   handler, so dispatching an instruction is a single indirect jump. Otherwise
+   (or if RS_VM_NO_THREADING is defined), the loop falls back to a switch.
+
+   Calls in tail position reuse the caller's frame, so tail calls run in
+   constant space. That includes calls made through apply, whose arguments
+   the VM spreads out on the stack itself rather than calling the primitive.
+
+   A thread can run many tasks (see task.c), each with its own value and
+   control stacks, which start small. The running task's stacks are its
+   mutator's, and the VM switches tasks by saving sp, fp and pc in the running
+   task, and loading the next one's. A primitive that suspends its task
+   either finishes its call first, so that the task carries on after it with
+   whatever value it's woken up with, or leaves the call on the stack to be
+   made again. Either way, nothing of the task's is left on the C stack, which
+   is why only code run by the outermost rs_vm_run() can suspend.
+
+   Each code object counts its calls, and once it has been called often enough,
+   it's compiled to native code (see jit.c). From then on, calls and returns
+   into it run the native code, which hands control back to the interpreter
+   whenever it comes to something it doesn't do itself. Frames on the control
+   stack that return into native code have its address, as well as the pc.
+*/
+
+#if defined(__GNUC__) && !defined(RS_VM_NO_THREADING)
+#define _VM_THREADED 1
+#endif
+
+#define _VM_SEGMENT_SIZE (64 * 1024)
+#define _VM_FRAMES_SIZE 4096
+
+/* Tasks' stacks start out small, and each segment they add is twice the size
+   of the last, up to _VM_SEGMENT_SIZE.
+*/
+#define _VM_TASK_SEGMENT_SIZE 256
+#define _VM_TASK_FRAMES_SIZE 32
+
+/* Debug builds compile nearly everything, so that the native code gets
+   exercised.
+*/
+#ifdef DEBUG
+#define _VM_JIT_THRESHOLD 2
+#else
+#define _VM_JIT_THRESHOLD 1000
+#endif
+
+/* A segment of the value stack. saved_sp is where the previous segment's
+   values ended when this one was started.
+*/
+struct rs_vm_segment {
+	struct rs_vm_segment *prev;
+	rs_object *saved_sp;
+	rs_object *end;
+	rs_object base[];
+};
+
+/* The calling thread's mutator in its current interpreter. */
+_VM_THREAD_LOCAL struct rs_mutator *rs_mutator_self = NULL;
+
+static const int operand_count[] = {
+#define _RS_OPCODE_OPERANDS(op, n) n,
+	RS_OPCODES(_RS_OPCODE_OPERANDS)
+#undef _RS_OPCODE_OPERANDS
+};
+
+
+static struct rs_mutator *rs_vm_mutator_create(struct rs_vm *vm);
+static void rs_vm_mutator_free(struct rs_mutator *m);
+static rs_object rs_vm_run(long nargs);
+static rs_object *rs_vm_stack_shrink(rs_object *sp);
+static void rs_vm_frames_grow(void);
+static rs_object *rs_vm_spread(rs_object *sp, long *nargs);
+static void rs_vm_mark(void);
+static void rs_vm_mark_stack(rs_object *top, struct rs_vm_segment *seg);
+static void rs_vm_compile(rs_object code);
+
+
+struct rs_vm *rs_vm_create(void)
+{
+	struct rs_vm *vm = calloc(1, sizeof(struct rs_vm));
+	if (vm == NULL) {
+		rs_fatal("could not allocate interpreter:");
+	}
+#ifdef _JIT_SUPPORTED
+	vm->jit_on = 1;
+#endif
+	if (pthread_mutex_init(&vm->lock, NULL) != 0 ||
+	    pthread_cond_init(&vm->stopped, NULL) != 0) {
+		rs_fatal("could not create interpreter lock");
+	}
+
+	struct rs_vm *prev = rs_vm_enter(vm);
+	rs_gc_init();
+	rs_eval_init();
+	rs_vm_enter(prev);
+	return vm;
+}
+
+
+void rs_vm_destroy(struct rs_vm *vm)
+{
+	assert(vm != NULL);
+
+	struct rs_vm *prev = rs_vm_enter(vm);
+	rs_future_shutdown();
+	assert(vm->nrunning == 1);
+	rs_eval_shutdown();
+	rs_gc_shutdown();
+	rs_symtab_shutdown();
+	while (vm->mutators != NULL) {
+		struct rs_mutator *m = vm->mutators;
+		vm->mutators = m->next;
+		rs_vm_mutator_free(m);
+	}
+	rs_mutator_self = NULL;
+	pthread_cond_destroy(&vm->stopped);
+	pthread_mutex_destroy(&vm->lock);
+	free(vm->keywords);
+	free(vm);
+	rs_vm_enter(prev == vm ? NULL : prev);
+}
+
+
+struct rs_vm *rs_vm_enter(struct rs_vm *vm)
+{
+	struct rs_vm *prev = rs_vm_current();
+	if (vm == prev) {
+		return prev;
+	}
+	if (prev != NULL) {
+		rs_gc_block();
+		rs_mutator_self = NULL;
+	}
+	if (vm == NULL) {
+		return prev;
+	}
+
+	/* Only this thread adds or removes its own mutator, so it's still there
+	   after the lock is dropped. */
+	struct rs_mutator *m;
+	pthread_mutex_lock(&vm->lock);
+	for (m = vm->mutators; m != NULL; m = m->next) {
+		if (pthread_equal(m->owner, pthread_self())) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&vm->lock);
+
+	if (m != NULL) {
+		rs_mutator_self = m;
+		rs_gc_unblock();
+	} else {
+		rs_mutator_self = rs_vm_mutator_create(vm);
+		rs_gc_attach(rs_mutator_self);
+	}
+	return prev;
+}
+
+
+void rs_vm_leave(void)
+{
+	struct rs_mutator *self = rs_mutator_current();
+	if (self == NULL) {
+		return;
+	}
+	rs_gc_detach();
+	rs_vm_mutator_free(self);
+	rs_mutator_self = NULL;
+}
+
+
+/* Make a mutator for the calling thread, with empty stacks, and make it
+   current so that they can be set up.
+*/
+static struct rs_mutator *rs_vm_mutator_create(struct rs_vm *vm)
+{
+	struct rs_mutator *m = calloc(1, sizeof(struct rs_mutator));
+	if (m == NULL) {
+		rs_fatal("could not allocate thread state:");
+	}
+	m->vm = vm;
+	m->owner = pthread_self();
+	m->frames = malloc(_VM_FRAMES_SIZE * sizeof(struct rs_vm_frame));
+	if (m->frames == NULL) {
+		rs_fatal("could not allocate VM stacks:");
+	}
+	m->stacks.frames_end = m->frames + _VM_FRAMES_SIZE;
+	m->stacks.frame = m->frames;
+	rs_mutator_self = m;
+	m->sp = m->fp = rs_vm_stack_grow(NULL, 0, 0);
+	return m;
+}
+
+
+static void rs_vm_mutator_free(struct rs_mutator *m)
+{
+	rs_task_shutdown(m);
+	while (m->segment != NULL) {
+		struct rs_vm_segment *prev = m->segment->prev;
+		free(m->segment);
+		m->segment = prev;
+	}
+	free(m->spare);
+	free(m->frames);
+	free(m->roots);
+	free(m);
+}
+
+
+void rs_vm_init(void)
+{
+	rs_gc_add_root_hook(rs_vm_mark);
+
+#ifdef _VM_THREADED
+	(void) rs_vm_run(-1);
+#endif
+}
+
+
+void rs_vm_shutdown(void)
+{
+	struct rs_vm *vm = rs_vm_current();
+	free(vm->globals);
+	vm->globals = NULL;
+	vm->nglobals = vm->capglobals = 0;
+}
+
+
+/* Global variables live in the value cells of shared symbols, which compiled
+   code refers to directly. The hash-consing table doesn't keep symbols alive,
+   so every symbol with a value is kept in the interpreter's globals array,
+   both for its value's sake and so that its name's shared symbol never
+   changes.
+*/
+void rs_global_define(rs_object sym, rs_object val)
+{
+	rs_symbol *s = rs_obj_to_symbol(sym);
+	assert(rs_hobject_shared_p(s));
+	assert(val != rs_undefined);
+
+	if (s->val.sym.value == rs_undefined) {
+		struct rs_vm *vm = rs_vm_current();
+		pthread_mutex_lock(&vm->lock);
+		if (vm->nglobals == vm->capglobals) {
+			vm->capglobals = vm->capglobals == 0 ? 256 : vm->capglobals * 2;
+			rs_object *g = realloc(vm->globals,
+			                       vm->capglobals * sizeof(rs_object));
+			if (g == NULL) {
+				rs_fatal("could not grow global table:");
+			}
+			vm->globals = g;
+		}
+		vm->globals[vm->nglobals++] = sym;
+		pthread_mutex_unlock(&vm->lock);
+	}
+	s->val.sym.value = val;
+}
+
+
+rs_object rs_global_ref(rs_object sym)
+{
+	assert(rs_hobject_shared_p(rs_obj_to_symbol(sym)));
+	return rs_symbol_value(rs_obj_to_symbol(sym));
+}
+
+
+void rs_global_set(rs_object sym, rs_object val)
+{
+	rs_symbol *s = rs_obj_to_symbol(sym);
+	assert(rs_hobject_shared_p(s));
+	if (s->val.sym.value == rs_undefined) {
+		rs_fatal("unbound variable: %s", rs_symbol_cstr(s));
+	}
+	s->val.sym.value = val;
+}
+
+
+void rs_vm_set_jit(int on)
+{
+#ifdef _JIT_SUPPORTED
+	rs_vm_current()->jit_on = on;
+#else
+	(void) on;
+#endif
+}
+
+
+rs_object rs_vm_execute(rs_object code)
+{
+	assert(rs_code_p(code));
+	assert(rs_obj_to_code(code)->val.code->nargs == 0);
+
+	rs_object proc = rs_closure_create(code, 0);
+	return rs_vm_apply(proc, NULL, 0);
+}
+
+
+rs_object rs_vm_apply(rs_object proc, rs_object *args, int nargs)
+{
+	struct rs_mutator *self = rs_mutator_current();
+	assert(args != NULL || nargs == 0);
+
+	if (self->sp + nargs + 1 > self->stacks.stack_end) {
+		self->sp = rs_vm_stack_grow(self->sp, 0, nargs + 1);
+	}
+	rs_object *base = self->sp;
+	*self->sp++ = proc;
+	for (int i = 0; i < nargs; i++) {
+		*self->sp++ = args[i];
+	}
+
+	if (rs_primitive_p(proc)) {
+		const struct rs_primitive_def *def = rs_obj_to_primitive(proc)->val.prim;
+		if (nargs < def->min_args ||
+		    (def->max_args >= 0 && nargs > def->max_args)) {
+			rs_fatal("wrong number of arguments to %s", def->name);
+		}
+		rs_object result = def->fn(base + 1, nargs);
+		if (self->suspend != RS_RESUME_NONE) {
+			rs_fatal("%s: can't suspend a task in a call from C", def->name);
+		}
+		self->sp = base == self->stacks.stack_base ? rs_vm_stack_shrink(base)
+		                                           : base;
+		return result;
+	} else if (!rs_closure_p(proc)) {
+		rs_fatal("attempt to call a non-procedure");
+	}
+
+	if (self->stacks.frame == self->stacks.frames_end) {
+		rs_vm_frames_grow();
+	}
+	self->stacks.frame->pc = NULL;
+	self->stacks.frame->fp = self->fp;
+	self->stacks.frame->native = NULL;
+	self->stacks.frame++;
+	return rs_vm_run(nargs);
+}
+
+
+void rs_code_release(struct rs_code *code)
+{
+	assert(code != NULL);
+
+	if (code->jit != NULL) {
+		rs_jit_release(code->jit);
+	}
+	free(code->insns);
+	free(code->consts);
+	free(code->name);
+	free(code);
+}
+
+
+void rs_vm_thread(struct rs_code *code)
+{
+	assert(code != NULL);
+
+#ifdef _VM_THREADED
+	const void *const *handlers = rs_vm_current()->handlers;
+	for (size_t i = 0; i < code->ninsns; ) {
+		long op = code->insns[i].n;
+		assert(op >= 0 && op < OP_COUNT);
+		code->insns[i].addr = handlers[op];
+		i += 1 + operand_count[op];
+	}
+#else
+	(void) code;
+	(void) operand_count;
+#endif
+}
+
+
+long rs_vm_opcode(union rs_insn insn)
+{
+#ifdef _VM_THREADED
+	const void *const *handlers = rs_vm_current()->handlers;
+	for (long op = 0; op < OP_COUNT; op++) {
+		if (handlers[op] == insn.addr) {
+			return op;
+		}
+	}
+	rs_fatal("bad opcode");
+#else
+	return insn.n;
+#endif
+}
+
+
+rs_object *rs_vm_stack_grow(rs_object *sp, long carry, long need)
+{
+	struct rs_mutator *self = rs_mutator_current();
+	size_t size = _VM_SEGMENT_SIZE;
+	if (self->segment != NULL &&
+	    (size_t)(self->segment->end - self->segment->base) < size / 2) {
+		size = 2 * (self->segment->end - self->segment->base);
+	}
+	if ((size_t)(carry + need) > size) {
+		size = carry + need;
+	}
+	struct rs_vm_segment *seg = self->spare;
+	self->spare = NULL;
+	if (seg == NULL || (size_t)(seg->end - seg->base) < size) {
+		free(seg);
+		seg = malloc(sizeof(struct rs_vm_segment) + size * sizeof(rs_object));
+		if (seg == NULL) {
+			rs_fatal("stack overflow:");
+		}
+		seg->end = seg->base + size;
+	}
+	TRACE("new stack segment of %zu words", (size_t)(seg->end - seg->base));
+
+	seg->prev = self->segment;
+	seg->saved_sp = sp;
+	if (carry > 0) {
+		seg->saved_sp = sp - carry;
+		memcpy(seg->base, sp - carry, carry * sizeof(rs_object));
+	}
+	/* If that empties the current segment, as when a tail call from the frame
+	   at its base doesn't fit, the new one takes its place. */
+	if (self->segment != NULL && self->segment->prev != NULL &&
+	    seg->saved_sp == self->segment->base) {
+		seg->prev = self->segment->prev;
+		seg->saved_sp = self->segment->saved_sp;
+		free(self->segment);
+	}
+	self->segment = seg;
+	self->stacks.stack_base = seg->base;
+	self->stacks.stack_end = seg->end;
+	return seg->base + carry;
+}
+
+
+/* Once the value stack has come back down to sp, the base of its segment, drop
+   the segment, unless it's the first, and return the top of the one before.
+*/
+static rs_object *rs_vm_stack_shrink(rs_object *sp)
+{
+	struct rs_mutator *self = rs_mutator_current();
+	assert(sp == self->segment->base);
+	if (self->segment->prev == NULL) {
+		return sp;
+	}
+	struct rs_vm_segment *seg = self->segment;
+	self->segment = seg->prev;
+	self->stacks.stack_base = self->segment->base;
+	self->stacks.stack_end = self->segment->end;
+	free(self->spare);
+	self->spare = seg;
+	return seg->saved_sp;
+}
+
+
+static void rs_vm_frames_grow(void)
+{
+	struct rs_mutator *self = rs_mutator_current();
+	size_t n = self->stacks.frames_end - self->frames;
+	size_t used = self->stacks.frame - self->frames;
+	struct rs_vm_frame *f = realloc(self->frames,
+	                                2 * n * sizeof(struct rs_vm_frame));
+	if (f == NULL) {
+		rs_fatal("stack overflow:");
+	}
+	self->frames = f;
+	self->stacks.frame = f + used;
+	self->stacks.frames_end = f + 2 * n;
+}
+
+
+struct rs_task *rs_vm_task_create(rs_object thunk)
+{
+	assert(rs_closure_p(thunk));
+
+	struct rs_task *t = calloc(1, sizeof(struct rs_task));
+	struct rs_vm_segment *seg = malloc(sizeof(struct rs_vm_segment) +
+	                                   _VM_TASK_SEGMENT_SIZE * sizeof(rs_object));
+	struct rs_vm_frame *frames = malloc(_VM_TASK_FRAMES_SIZE *
+	                                    sizeof(struct rs_vm_frame));
+	if (t == NULL || seg == NULL || frames == NULL) {
+		rs_fatal("could not allocate task:");
+	}
+	seg->prev = NULL;
+	seg->saved_sp = NULL;
+	seg->end = seg->base + _VM_TASK_SEGMENT_SIZE;
+	t->segment = seg;
+	t->stacks.stack_base = seg->base;
+	t->stacks.stack_end = seg->end;
+	t->frames = frames;
+	t->stacks.frame = frames;
+	t->stacks.frames_end = frames + _VM_TASK_FRAMES_SIZE;
+
+	/* It starts out as if it had suspended just as it was about to call
+	   thunk from C, so the call pushes a frame that returns nowhere, and when
+	   thunk returns to it, the task is finished. */
+	seg->base[0] = thunk;
+	t->sp = t->fp = seg->base + 1;
+	t->pc = NULL;
+	t->nargs = 0;
+	t->resume = RS_RESUME_RETRY;
+	t->value = rs_unspecified;
+	return t;
+}
+
+
+void rs_vm_task_free(struct rs_task *t)
+{
+	while (t->segment != NULL) {
+		struct rs_vm_segment *prev = t->segment->prev;
+		free(t->segment);
+		t->segment = prev;
+	}
+	free(t->frames);
+	free(t);
+}
+
+
+void rs_vm_task_load(struct rs_task *t)
+{
+	struct rs_mutator *self = rs_mutator_current();
+	struct rs_task *cur = self->task;
+	assert(t != cur);
+
+	cur->sp = self->sp;
+	cur->fp = self->fp;
+	cur->stacks = self->stacks;
+	cur->segment = self->segment;
+	cur->frames = self->frames;
+	self->sp = t->sp;
+	self->fp = t->fp;
+	self->stacks = t->stacks;
+	self->segment = t->segment;
+	self->frames = t->frames;
+	self->task = t;
+}
+
+
+/* The top *nargs values of the stack, which ends at sp, are the arguments to
+   apply, which is under them. Replace them all with the procedure and its
+   spread-out arguments, set *nargs to their number, and return the new top.
+*/
+static rs_object *rs_vm_spread(rs_object *sp, long *nargs)
+{
+	struct rs_mutator *self = rs_mutator_current();
+	long n = *nargs;
+	rs_object list = sp[-1];
+	if (!rs_procedure_p(sp[-n])) {
+		rs_fatal("apply: not a procedure");
+	}
+	long len = 0;
+	rs_object l;
+	for (l = list; rs_pair_p(l); l = rs_pair_cdr(rs_obj_to_pair(l))) {
+		len++;
+	}
+	if (!rs_null_p(l)) {
+		rs_fatal("apply: not a proper list");
+	}
+	if (sp + len > self->stacks.stack_end) {
+		sp = rs_vm_stack_grow(sp, n + 1, len);
+	}
+
+	/* Nothing here allocates, so the list doesn't need to stay on the
+	   stack. */
+	memmove(sp - n - 1, sp - n, (n - 1) * sizeof(rs_object));
+	sp -= 2;
+	for (l = list; rs_pair_p(l); l = rs_pair_cdr(rs_obj_to_pair(l))) {
+		*sp++ = rs_pair_car(rs_obj_to_pair(l));
+	}
+	*nargs = n - 2 + len;
+	return sp;
+}
+
+
+/* Mark every thread's value stack, those of its suspended tasks, and the
+   globals.
+*/
+static void rs_vm_mark(void)
+{
+	struct rs_vm *vm = rs_vm_current();
+	for (struct rs_mutator *m = vm->mutators; m != NULL; m = m->next) {
+		rs_vm_mark_stack(m->sp, m->segment);
+		for (struct rs_task *t = m->tasks; t != NULL; t = t->next_all) {
+			if (t != m->task) {
+				rs_vm_mark_stack(t->sp, t->segment);
+			}
+			rs_gc_mark_range(&t->value, 1);
+		}
+	}
+	rs_gc_mark_range(vm->globals, vm->nglobals);
+}
+
+
+/* Mark a value stack whose top is at top, in its current segment, seg. */
+static void rs_vm_mark_stack(rs_object *top, struct rs_vm_segment *seg)
+{
+	for (; seg != NULL; seg = seg->prev) {
+		assert(top >= seg->base && top <= seg->end);
+		rs_gc_mark_range(seg->base, top - seg->base);
+		top = seg->saved_sp;
+	}
+}
+
+
+/* Compile a code object to native code, unless another thread just has. The
+   lock keeps two threads from compiling the same code at once.
+*/
+static void rs_vm_compile(rs_object code)
+{
+	struct rs_vm *vm = rs_vm_current();
+	pthread_mutex_lock(&vm->lock);
+	if (rs_obj_to_code(code)->val.code->jit == NULL) {
+		rs_jit_compile(code);
+	}
+	pthread_mutex_unlock(&vm->lock);
+}
+
+
+#define CODE_OF(proc) \
+	(rs_obj_to_code(rs_obj_to_closure(proc)->val.closure.code)->val.code)
+
+/* Computed goto is an extension, and -pedantic needs to be told so. */
+#ifdef _VM_THREADED
+#define DISPATCH() __extension__ ({ goto *(pc++)->addr; })
+#define CASE(op) L_##op:
+#else
+#define DISPATCH() goto dispatch
+#define CASE(op) case OP_##op:
+#endif
+
+/* Keep the GC's idea of the top of the stack up to date, before doing
+   anything that can allocate.
+*/
+#define SYNC() (self->sp = sp)
+
+/* Check that the global in a primitive instruction's first operand still holds
+   the primitive in its second. If not, go make an ordinary call instead.
+*/
+#define PRIM_GUARD(nargs, len) do { \
+		g = rs_obj_to_symbol(pc[0].obj); \
+		f = rs_symbol_value(g); \
+		if (f != pc[1].obj) { \
+			n = (nargs); \
+			pc += (len); \
+			goto prim_changed; \
+		} \
+	} while (0)
+
+/* Call the primitive in an open-coded instruction's operand on the top nargs
+   values of the stack, leaving its value in result.
+*/
+#define PRIM_SLOW(nargs) do { \
+		SYNC(); \
+		result = rs_obj_to_primitive(pc[1].obj)->val.prim->fn(sp - (nargs), \
+		                                                     (nargs)); \
+	} while (0)
+
+/* Replace the two arguments of an arithmetic instruction with its result. */
+#define ARITH_DONE() do { \
+		sp--; \
+		sp[-1] = result; \
+		pc += 2; \
+		DISPATCH(); \
+	} while (0)
+
+/* Do an arithmetic instruction, with fixnum_op for fixnums, and op for
+   flonums.
+*/
+#define ARITH(fixnum_op, op) do { \
+		PRIM_GUARD(2, 2); \
+		if (!fixnum_op(sp[-2], sp[-1], &result)) { \
+			if (rs_flonum_p(sp[-2]) && rs_flonum_p(sp[-1])) { \
+				SYNC(); \
+				result = rs_flonum_create(rs_flonum_value(sp[-2]) op \
+				                          rs_flonum_value(sp[-1])); \
+			} else { \
+				PRIM_SLOW(2); \
+			} \
+		} \
+		ARITH_DONE(); \
+	} while (0)
+
+/* Two fixnums compare the same way as their objects. */
+#define COMPARE(op) do { \
+		PRIM_GUARD(2, 2); \
+		if (rs_fixnums_p(sp[-2], sp[-1])) { \
+			result = sp[-2] op sp[-1] ? rs_true : rs_false; \
+		} else if (rs_flonum_p(sp[-2]) && rs_flonum_p(sp[-1])) { \
+			result = rs_flonum_value(sp[-2]) op rs_flonum_value(sp[-1]) \
+			         ? rs_true : rs_false; \
+		} else { \
+			PRIM_SLOW(2); \
+		} \
+		ARITH_DONE(); \
+	} while (0)
+
+
+/* Call the closure on the top of the stack, under its nargs arguments, and
+   run until it returns to C. If nargs is negative, just set up the table of
+   handler addresses.
+*/
+static rs_object rs_vm_run(long nargs)
+{
+#ifdef _VM_THREADED
+#define _RS_OPCODE_LABEL(op, n) __extension__ &&L_##op,
+	static const void *const labels[] = { RS_OPCODES(_RS_OPCODE_LABEL) };
+#undef _RS_OPCODE_LABEL
+	if (nargs < 0) {
+		rs_vm_current()->handlers = labels;
+		return rs_unspecified;
+	}
+#endif
+
+	struct rs_mutator *self = rs_mutator_current();
+	struct rs_vm *vm = self->vm;
+	rs_object *sp = self->sp;
+	rs_object *fp = self->fp;
+	rs_object *free_vals = NULL;
+	union rs_insn *pc = NULL;
+	rs_object f, result;
+	struct rs_code *code;
+	struct rs_task *task;
+	long n = nargs;
+	int tail;
+	rs_symbol *g;
+
+	self->depth++;
+	f = sp[-n - 1];
+	goto enter;
+
+#ifndef _VM_THREADED
+dispatch:
+	switch ((pc++)->n) {
+#endif
+
+	CASE(CONST)
+		*sp++ = (pc++)->obj;
+		DISPATCH();
+
+	CASE(LOCAL)
+		*sp++ = fp[(pc++)->n];
+		DISPATCH();
+
+	CASE(LOCAL_BOXED)
+		*sp++ = rs_box_ref(fp[(pc++)->n]);
+		DISPATCH();
+
+	CASE(SET_LOCAL)
+		fp[(pc++)->n] = *--sp;
+		DISPATCH();
+
+	CASE(SET_LOCAL_BOXED)
+		rs_box_set(fp[(pc++)->n], *--sp);
+		DISPATCH();
+
+	CASE(BOX_LOCAL)
+		SYNC();
+		n = (pc++)->n;
+		fp[n] = rs_box_create(fp[n]);
+		DISPATCH();
+
+	CASE(FREE)
+		*sp++ = free_vals[(pc++)->n];
+		DISPATCH();
+
+	CASE(FREE_BOXED)
+		*sp++ = rs_box_ref(free_vals[(pc++)->n]);
+		DISPATCH();
+
+	CASE(SET_FREE_BOXED)
+		rs_box_set(free_vals[(pc++)->n], *--sp);
+		DISPATCH();
+
+	CASE(GLOBAL)
+		g = rs_obj_to_symbol((pc++)->obj);
+		if (rs_symbol_value(g) == rs_undefined) {
+			rs_fatal("unbound variable: %s", rs_symbol_cstr(g));
+		}
+		*sp++ = rs_symbol_value(g);
+		DISPATCH();
+
+	CASE(SET_GLOBAL)
+		rs_global_set((pc++)->obj, sp[-1]);
+		sp--;
+		DISPATCH();
+
+	CASE(DEFINE_GLOBAL)
+		rs_global_define((pc++)->obj, sp[-1]);
+		sp--;
+		DISPATCH();
+
+	CASE(POP)
+		sp--;
+		DISPATCH();
+
+	CASE(DUP)
+		sp[0] = sp[-1];
+		sp++;
+		DISPATCH();
+
+	CASE(JUMP)
+		pc += pc->n;
+		DISPATCH();
+
+	CASE(JUMP_FALSE)
+		if (*--sp == rs_false) {
+			pc += pc->n;
+		} else {
+			pc++;
+		}
+		DISPATCH();
+
+	CASE(CLOSURE) {
+		rs_object c = pc[0].obj;
+		n = pc[1].n;
+		pc += 2;
+		SYNC();
+		f = rs_closure_create(c, n);
+		sp -= n;
+		if (n > 0) {
+			memcpy(rs_obj_to_closure(f)->val.closure.free, sp,
+			       n * sizeof(rs_object));
+		}
+		*sp++ = f;
+		DISPATCH();
+	}
+
+	CASE(FIX)
+		rs_obj_to_closure(fp[pc[0].n])->val.closure.free[pc[1].n] =
+			fp[pc[2].n];
+		pc += 3;
+		DISPATCH();
+
+	CASE(CALL)
+		n = (pc++)->n;
+		f = sp[-n - 1];
+	call:
+		if (rs_closure_p(f)) {
+			if (self->stacks.frame == self->stacks.frames_end) {
+				rs_vm_frames_grow();
+			}
+			self->stacks.frame->pc = pc;
+			self->stacks.frame->fp = fp;
+			self->stacks.frame->native = NULL;
+			self->stacks.frame++;
+			goto enter;
+		}
+		if (!rs_primitive_p(f)) {
+			rs_fatal("attempt to call a non-procedure");
+		}
+		goto primitive;
+
+	CASE(TAIL_CALL)
+		n = (pc++)->n;
+		f = sp[-n - 1];
+	tail_call:
+		if (rs_closure_p(f)) {
+			/* Slide the procedure and arguments down over the current
+			   frame. */
+			memmove(fp - 1, sp - n - 1, (n + 1) * sizeof(rs_object));
+			sp = fp + n;
+			goto enter;
+		}
+		if (!rs_primitive_p(f)) {
+			rs_fatal("attempt to call a non-procedure");
+		}
+		/* A primitive in tail position just returns its result. */
+		{
+			const struct rs_primitive_def *def =
+				rs_obj_to_primitive(f)->val.prim;
+			if (n < def->min_args ||
+			    (def->max_args >= 0 && n > def->max_args)) {
+				rs_fatal("wrong number of arguments to %s", def->name);
+			}
+			if (def->fn == rs_primitive_apply) {
+				/* Replace the current frame with apply's, and then with
+				   the call it makes, which may have had to move to a new
+				   stack segment. */
+				memmove(fp - 1, sp - n - 1, (n + 1) * sizeof(rs_object));
+				sp = rs_vm_spread(fp + n, &n);
+				fp = sp - n;
+				f = fp[-1];
+				goto tail_call;
+			}
+			SYNC();
+			result = def->fn(sp - n, n);
+			if (self->suspend != RS_RESUME_NONE) {
+				tail = 1;
+				goto suspend;
+			}
+			sp -= n + 1;
+			*sp++ = result;
+		}
+		goto do_return;
+
+	/* Calls to globals that held a primitive when the call was compiled, with
+	   the right number of arguments. As long as the global still holds it,
+	   the primitive is called directly, or its work is done right here. */
+	CASE(PRIM_CALL)
+		PRIM_GUARD(pc[2].n, 3);
+		f = pc[1].obj;
+		n = pc[2].n;
+		pc += 3;
+		SYNC();
+		result = rs_obj_to_primitive(f)->val.prim->fn(sp - n, n);
+		sp -= n;
+		*sp++ = result;
+		DISPATCH();
+
+	CASE(CAR)
+		PRIM_GUARD(1, 2);
+		if (!rs_pair_p(sp[-1])) {
+			rs_fatal("car: not a pair");
+		}
+		sp[-1] = rs_pair_car(rs_obj_to_pair(sp[-1]));
+		pc += 2;
+		DISPATCH();
+
+	CASE(CDR)
+		PRIM_GUARD(1, 2);
+		if (!rs_pair_p(sp[-1])) {
+			rs_fatal("cdr: not a pair");
+		}
+		sp[-1] = rs_pair_cdr(rs_obj_to_pair(sp[-1]));
+		pc += 2;
+		DISPATCH();
+
+	CASE(CONS)
+		PRIM_GUARD(2, 2);
+		SYNC();
+		f = rs_pair_create(sp[-2], sp[-1]);
+		sp--;
+		sp[-1] = f;
+		pc += 2;
+		DISPATCH();
+
+	CASE(NULL_P)
+		PRIM_GUARD(1, 2);
+		sp[-1] = rs_null_p(sp[-1]) ? rs_true : rs_false;
+		pc += 2;
+		DISPATCH();
+
+	CASE(PAIR_P)
+		PRIM_GUARD(1, 2);
+		sp[-1] = rs_pair_p(sp[-1]) ? rs_true : rs_false;
+		pc += 2;
+		DISPATCH();
+
+	CASE(NOT)
+		PRIM_GUARD(1, 2);
+		sp[-1] = sp[-1] == rs_false ? rs_true : rs_false;
+		pc += 2;
+		DISPATCH();
+
+	CASE(EQ_P)
+		PRIM_GUARD(2, 2);
+		sp--;
+		sp[-1] = rs_primitive_eq(sp[-1], sp[0]) ? rs_true : rs_false;
+		pc += 2;
+		DISPATCH();
+
+	/* Arithmetic on two fixnums or two flonums is done here. Anything else,
+	   including overflow, is left to the primitive. */
+	CASE(ADD)
+		ARITH(rs_fixnum_add, +);
+
+	CASE(SUB)
+		ARITH(rs_fixnum_sub, -);
+
+	CASE(MUL)
+		ARITH(rs_fixnum_mul, *);
+
+	CASE(NUM_EQ)
+		COMPARE(==);
+
+	CASE(LT)
+		COMPARE(<);
+
+	CASE(GT)
+		COMPARE(>);
+
+	CASE(LE)
+		COMPARE(<=);
+
+	CASE(GE)
+		COMPARE(>=);
+
+	CASE(RETURN)
+	do_return:
+		result = sp[-1];
+		sp = fp - 1;
+		if (sp == self->stacks.stack_base) {
+			sp = rs_vm_stack_shrink(sp);
+		}
+		self->stacks.frame--;
+		pc = self->stacks.frame->pc;
+		fp = self->stacks.frame->fp;
+		if (pc == NULL) {
+			self->sp = sp;
+			self->fp = fp;
+			if (self->stacks.frame == self->frames && self->task != NULL &&
+			    self->task->spawned) {
+				/* A task's procedure has returned, so it's finished. */
+				task = rs_task_finish();
+				goto resume;
+			}
+			self->depth--;
+			return result;
+		}
+		*sp++ = result;
+		free_vals = rs_obj_to_closure(fp[-1])->val.closure.free;
+		if (vm->jit_on) {
+			code = CODE_OF(fp[-1]);
+			if (_VM_LOAD(&code->jit) != NULL) {
+				goto native;
+			}
+		}
+		DISPATCH();
+
+#ifndef _VM_THREADED
+	default:
+		rs_fatal("bad opcode");
+	}
+#endif
+
+prim_changed:
+	/* The global a PRIM_CALL or open-coded primitive expected has changed, so
+	   put its new value under the arguments (the compiler leaves room for it),
+	   and make an ordinary call. */
+	if (f == rs_undefined) {
+		rs_fatal("unbound variable: %s", rs_symbol_cstr(g));
+	}
+	memmove(sp - n + 1, sp - n, n * sizeof(rs_object));
+	sp[-n] = f;
+	sp++;
+	goto call;
+
+primitive: {
+	const struct rs_primitive_def *def = rs_obj_to_primitive(f)->val.prim;
+	if (n < def->min_args || (def->max_args >= 0 && n > def->max_args)) {
+		rs_fatal("wrong number of arguments to %s", def->name);
+	}
+	if (def->fn == rs_primitive_apply) {
+		sp = rs_vm_spread(sp, &n);
+		f = sp[-n - 1];
+		goto call;
+	}
+	SYNC();
+	result = def->fn(sp - n, n);
+	if (self->suspend != RS_RESUME_NONE) {
+		tail = 0;
+		goto suspend;
+	}
+	sp -= n + 1;
+	if (sp == self->stacks.stack_base) {
+		sp = rs_vm_stack_shrink(sp);
+	}
+	*sp++ = result;
+	DISPATCH();
+}
+
+suspend:
+	/* The primitive f, called with n arguments, has suspended the running
+	   task. If the call is finished, it's popped, and when the task is woken
+	   up, it's given the value it was woken up with. Otherwise, it's made
+	   again. */
+	if (self->depth > 1) {
+		rs_fatal("%s: can't suspend a task in a call from C",
+		         rs_obj_to_primitive(f)->val.prim->name);
+	}
+	task = self->task;
+	task->resume = self->suspend;
+	self->suspend = RS_RESUME_NONE;
+	if (task->resume == RS_RESUME_RETURN) {
+		sp -= n + 1;
+		if (sp == self->stacks.stack_base) {
+			sp = rs_vm_stack_shrink(sp);
+		}
+	}
+	task->pc = pc;
+	task->nargs = n;
+	task->tail = tail;
+	self->sp = sp;
+	self->fp = fp;
+	task = rs_task_switch();
+
+resume:
+	/* task is now the running one. */
+	sp = self->sp;
+	fp = self->fp;
+	pc = task->pc;
+	n = task->nargs;
+	if (task->resume == RS_RESUME_RETRY) {
+		f = sp[-n - 1];
+		if (task->tail) {
+			goto tail_call;
+		}
+		goto call;
+	}
+	*sp++ = task->value;
+	task->value = rs_unspecified;
+	free_vals = rs_obj_to_closure(fp[-1])->val.closure.free;
+	if (task->tail) {
+		goto do_return;
+	}
+	DISPATCH();
+
+enter:
+	/* f is a closure, and it and its n arguments are on top of the stack. */
+	code = CODE_OF(f);
+	if (!code->rest) {
+		if (n != code->nargs) {
+			rs_fatal("wrong number of arguments to %s",
+			         code->name != NULL ? code->name : "#<procedure>");
+		}
+	} else {
+		if (n < code->nargs) {
+			rs_fatal("wrong number of arguments to %s",
+			         code->name != NULL ? code->name : "#<procedure>");
+		}
+		/* Gather the extra arguments into a list, keeping the partial list
+		   on the stack so that it stays alive. */
+		rs_object *args = sp - n;
+		rs_object rest = rs_null;
+		SYNC();
+		for (long i = n - 1; i >= code->nargs; i--) {
+			rest = rs_pair_create(args[i], rest);
+			args[i] = rest;
+		}
+		args[code->nargs] = rest;
+		sp = args + code->nargs + 1;
+		n = code->nargs + 1;
+	}
+	if (sp + (code->nlocals - n) + code->maxdepth > self->stacks.stack_end) {
+		sp = rs_vm_stack_grow(sp, n + 1, code->nlocals - n + code->maxdepth);
+	}
+	fp = sp - n;
+	for (long i = n; i < code->nlocals; i++) {
+		*sp++ = rs_unspecified;
+	}
+	free_vals = rs_obj_to_closure(f)->val.closure.free;
+	pc = code->insns;
+	if (_VM_LOAD(&self->stop)) {
+		/* Another thread is waiting to collect, and everything this one
+		   holds is on the stack. */
+		SYNC();
+		rs_gc_safepoint();
+	}
+	if (vm->jit_on) {
+		if (_VM_LOAD(&code->jit) == NULL &&
+		    _VM_ADD(&code->calls, 1) == _VM_JIT_THRESHOLD) {
+			rs_vm_compile(rs_obj_to_closure(f)->val.closure.code);
+		}
+		if (_VM_LOAD(&code->jit) != NULL) {
+			goto native;
+		}
+	}
+	DISPATCH();
+
+native:
+	/* Run the native code of the procedure in the current frame from pc, and
+	   carry on from wherever it stops, which may be in another frame. */
+	self->sp = sp;
+	self->fp = fp;
+	pc = rs_jit_run(code, pc, &self->sp, &self->fp);
+	sp = self->sp;
+	fp = self->fp;
+	free_vals = rs_obj_to_closure(fp[-1])->val.closure.free;
+	DISPATCH();
+}
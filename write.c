@@ -1,112 +1,732 @@
 #include "rescheme.h"
 
 #include <assert.h>
-#include <ctype.h>
+#include <math.h>
+#include <string.h>
 
 
-static int rs_write_string(FILE *out, rs_string *str);
-static int rs_write_pair(FILE *out, rs_pair *pair);
+/* The writer keeps its own stack of the lists it's in the middle of, so that
+   neither long nor deeply nested lists use up the C stack. Each frame is a
+   pair whose car has been written; what comes next is its cdr. Vectors get
+   frames too, which just count off their elements.
 
+   In shared mode, a first pass finds every pair or vector that can be reached
+   more than once (including through a cycle), and the writer gives each one a
+   datum label (#n=) the first time it's written, and refers back to it (#n#)
+   after that. The label table maps an object to -1 while it still needs a
+   label, and to its label plus 1 once it has one.
 
-int rs_write(FILE *out, rs_object obj)
+   write and display only label what they have to, to finish: the pairs and
+   vectors that cycles lead back to. Looking for those needs a table of every
+   object, though, so first there's a quick check, which walks the structure
+   the way the writer would, but stops if the lists get nested too deeply.
+   Any cycle through the cars or vector elements makes the nesting go on
+   forever, and one through the cdrs alone is caught as the lists are walked,
+   with a second pointer going half as fast. Most data passes the check,
+   which takes no more time than writing it, and is written without a table.
+*/
+
+#define _WRITE_CHECK_DEPTH 10000
+
+struct rs_write_frame {
+	rs_pair *pair;     // or NULL, in a vector's frame
+	int dotted;        // the cdr was written after a " . "
+	rs_vector *vec;
+	size_t next;       // the index of the vector's next element
+};
+
+struct rs_write_state {
+	struct rs_outport *out;
+	struct rs_objtab *labels;
+	int display;
+	long next_label;
+	struct rs_write_frame *frames;
+	size_t depth;
+	size_t cap;
+	struct rs_write_frame small[32];
+};
+
+
+static int rs_write_with(struct rs_outport *out, rs_object obj, int display);
+static void rs_write_obj(struct rs_write_state *st, rs_object obj);
+static int rs_write_label(struct rs_write_state *st, rs_object obj);
+static void rs_write_push(struct rs_write_state *st, rs_pair *pair,
+                          rs_vector *vec);
+static void rs_write_find_shared(rs_object obj, struct rs_objtab *labels);
+static int rs_write_acyclic_p(rs_object obj);
+static int rs_write_find_cycles(rs_object obj, struct rs_objtab *labels);
+static void rs_write_atom(struct rs_outport *out, rs_object obj, int display);
+static void rs_write_string(struct rs_outport *out, rs_string *str);
+static void rs_write_flonum(struct rs_outport *out, double val);
+
+
+int rs_write(struct rs_outport *out, rs_object obj)
+{
+	assert(out != NULL);
+	return rs_write_with(out, obj, 0);
+}
+
+
+int rs_display(struct rs_outport *out, rs_object obj)
 {
 	assert(out != NULL);
+	return rs_write_with(out, obj, 1);
+}
+
+
+int rs_write_shared(struct rs_outport *out, rs_object obj)
+{
+	assert(out != NULL);
+
+	struct rs_objtab labels;
+	rs_objtab_init(&labels);
+	rs_write_find_shared(obj, &labels);
+
+	struct rs_write_state st;
+	st.out = out;
+	st.labels = &labels;
+	st.display = 0;
+	st.next_label = 0;
+
+	long start = rs_outport_offset(out);
+	rs_write_obj(&st, obj);
+	rs_objtab_reset(&labels);
+	return (int)(rs_outport_offset(out) - start);
+}
+
+
+/* Write obj, labelling just the objects that cycles go through, if there
+   are any.
+*/
+static int rs_write_with(struct rs_outport *out, rs_object obj, int display)
+{
+	struct rs_objtab labels;
+	struct rs_write_state st;
+	st.out = out;
+	st.labels = NULL;
+	st.display = display;
+	st.next_label = 0;
+	if (!rs_write_acyclic_p(obj)) {
+		rs_objtab_init(&labels);
+		if (rs_write_find_cycles(obj, &labels)) {
+			st.labels = &labels;
+		} else {
+			rs_objtab_reset(&labels);
+		}
+	}
+
+	long start = rs_outport_offset(out);
+	rs_write_obj(&st, obj);
+	if (st.labels != NULL) {
+		rs_objtab_reset(&labels);
+	}
+	return (int)(rs_outport_offset(out) - start);
+}
+
+
+static void rs_write_obj(struct rs_write_state *st, rs_object obj)
+{
+	struct rs_outport *out = st->out;
+	st->frames = st->small;
+	st->depth = 0;
+	st->cap = sizeof(st->small) / sizeof(st->small[0]);
+
+	for (;;) {
+		/* Write obj, or start writing it if it's a list. */
+		if (!rs_write_label(st, obj)) {
+			if (rs_pair_p(obj)) {
+				rs_pair *pair = rs_obj_to_pair(obj);
+				rs_outport_putc(out, '(');
+				rs_write_push(st, pair, NULL);
+				obj = rs_pair_car(pair);
+				continue;
+			}
+			if (rs_vector_p(obj)) {
+				rs_outport_puts(out, "#(");
+				rs_write_push(st, NULL, rs_obj_to_vector(obj));
+			} else {
+				rs_write_atom(out, obj, st->display);
+			}
+		}
+
+		/* Then carry on with the innermost unfinished list. */
+		for (;;) {
+			if (st->depth == 0) {
+				goto done;
+			}
+			struct rs_write_frame *top = &st->frames[st->depth - 1];
+			if (top->pair == NULL) {
+				if (top->next == rs_vector_length(top->vec)) {
+					rs_outport_putc(out, ')');
+					st->depth--;
+					continue;
+				}
+				if (top->next > 0) {
+					rs_outport_putc(out, ' ');
+				}
+				obj = rs_vector_ref(top->vec, top->next++);
+				break;
+			}
+			rs_object cdr = rs_pair_cdr(top->pair);
+			if (top->dotted || rs_null_p(cdr)) {
+				rs_outport_putc(out, ')');
+				st->depth--;
+				continue;
+			}
+			/* A labelled pair in the cdr can't be spliced into the list. */
+			if (rs_pair_p(cdr) && (st->labels == NULL ||
+			    !rs_objtab_get(st->labels, cdr, NULL))) {
+				rs_outport_putc(out, ' ');
+				top->pair = rs_obj_to_pair(cdr);
+				obj = rs_pair_car(top->pair);
+			} else {
+				rs_outport_puts(out, " . ");
+				top->dotted = 1;
+				obj = cdr;
+			}
+			break;
+		}
+	}
+
+done:
+	if (st->frames != st->small) {
+		free(st->frames);
+	}
+}
+
+
+/* In shared mode, write obj's label if it has one. Returns true if obj has
+   already been written, and there's nothing else to do.
+*/
+static int rs_write_label(struct rs_write_state *st, rs_object obj)
+{
+	long label;
+	if (st->labels == NULL || !rs_heap_p(obj) ||
+	    !rs_objtab_get(st->labels, obj, &label)) {
+		return 0;
+	}
+
+	if (label < 0) {
+		label = st->next_label++;
+		rs_objtab_put(st->labels, obj, label + 1);
+		rs_outport_putc(st->out, '#');
+		rs_outport_long(st->out, label);
+		rs_outport_putc(st->out, '=');
+		return 0;
+	}
+	rs_outport_putc(st->out, '#');
+	rs_outport_long(st->out, label - 1);
+	rs_outport_putc(st->out, '#');
+	return 1;
+}
+
+
+static void rs_write_push(struct rs_write_state *st, rs_pair *pair,
+                          rs_vector *vec)
+{
+	if (st->depth == st->cap) {
+		size_t cap = st->cap * 2;
+		struct rs_write_frame *f;
+		if (st->frames == st->small) {
+			f = malloc(cap * sizeof(struct rs_write_frame));
+			if (f != NULL) {
+				memcpy(f, st->small, sizeof(st->small));
+			}
+		} else {
+			f = realloc(st->frames, cap * sizeof(struct rs_write_frame));
+		}
+		if (f == NULL) {
+			rs_fatal("could not grow writer stack:");
+		}
+		st->frames = f;
+		st->cap = cap;
+	}
+	st->frames[st->depth].pair = pair;
+	st->frames[st->depth].dotted = 0;
+	st->frames[st->depth].vec = vec;
+	st->frames[st->depth].next = 0;
+	st->depth++;
+}
+
+
+/* Put every pair or vector that can be reached from obj more than once into
+   labels, with a value of -1.
+*/
+static void rs_write_find_shared(rs_object obj, struct rs_objtab *labels)
+{
+	struct rs_objtab seen;
+	rs_objtab_init(&seen);
+
+	size_t n = 0, cap = 64;
+	rs_object *todo = malloc(cap * sizeof(rs_object));
+	if (todo == NULL) {
+		rs_fatal("could not allocate writer stack:");
+	}
+	todo[n++] = obj;
+	while (n > 0) {
+		obj = todo[--n];
+		/* Walk down the cdrs here, and leave the cars and vector elements
+		   for later. */
+		while (rs_pair_p(obj) || rs_vector_p(obj)) {
+			if (rs_objtab_get(&seen, obj, NULL)) {
+				rs_objtab_put(labels, obj, -1);
+				break;
+			}
+			rs_objtab_put(&seen, obj, 0);
+
+			rs_object car, *elts = &car;
+			size_t nelts = 1;
+			if (rs_pair_p(obj)) {
+				car = rs_pair_car(rs_obj_to_pair(obj));
+			} else {
+				elts = rs_vector_data(rs_obj_to_vector(obj));
+				nelts = rs_vector_length(rs_obj_to_vector(obj));
+			}
+			for (size_t i = 0; i < nelts; i++) {
+				if (!rs_pair_p(elts[i]) && !rs_vector_p(elts[i])) {
+					continue;
+				}
+				if (n == cap) {
+					cap *= 2;
+					rs_object *t = realloc(todo, cap * sizeof(rs_object));
+					if (t == NULL) {
+						rs_fatal("could not grow writer stack:");
+					}
+					todo = t;
+				}
+				todo[n++] = elts[i];
+			}
+			if (!rs_pair_p(obj)) {
+				break;
+			}
+			obj = rs_pair_cdr(rs_obj_to_pair(obj));
+		}
+	}
+
+	free(todo);
+	rs_objtab_reset(&seen);
+}
+
+
+/* Return true if obj certainly has no cycles. A false result only means
+   that it might (see above).
+*/
+static int rs_write_acyclic_p(rs_object obj)
+{
+	/* Each frame is a list or vector being walked. */
+	struct check_frame {
+		rs_vector *vec;      // or NULL, in a list's frame
+		size_t next;         // the vector's next index, or the list's length
+		rs_object cur;       // the list's next pair
+		rs_object slow;      // a pair that follows cur at half the speed
+	} small[32], *frames = small;
+	size_t depth = 0, cap = sizeof(small) / sizeof(small[0]);
+	int acyclic = 1;
+
+	for (;;) {
+		if (rs_pair_p(obj) || rs_vector_p(obj)) {
+			if (depth == _WRITE_CHECK_DEPTH) {
+				acyclic = 0;
+				break;
+			}
+			if (depth == cap) {
+				cap *= 2;
+				struct check_frame *f = frames == small ? NULL : frames;
+				f = realloc(f, cap * sizeof(struct check_frame));
+				if (f == NULL) {
+					rs_fatal("could not grow writer stack:");
+				}
+				if (frames == small) {
+					memcpy(f, small, sizeof(small));
+				}
+				frames = f;
+			}
+			struct check_frame *f = &frames[depth++];
+			f->vec = rs_vector_p(obj) ? rs_obj_to_vector(obj) : NULL;
+			f->next = 0;
+			f->cur = f->slow = obj;
+		}
+
+		/* Find the next car or element to look at. */
+		int more = 0;
+		while (depth > 0 && !more) {
+			struct check_frame *top = &frames[depth - 1];
+			if (top->vec != NULL) {
+				if (top->next < rs_vector_length(top->vec)) {
+					obj = rs_vector_ref(top->vec, top->next++);
+					more = 1;
+					continue;
+				}
+			} else if (rs_pair_p(top->cur)) {
+				rs_pair *pair = rs_obj_to_pair(top->cur);
+				obj = rs_pair_car(pair);
+				top->cur = rs_pair_cdr(pair);
+				if (++top->next % 2 == 0) {
+					top->slow = rs_pair_cdr(rs_obj_to_pair(top->slow));
+				}
+				if (top->cur == top->slow) {
+					acyclic = 0;
+					break;
+				}
+				more = 1;
+				continue;
+			} else if (rs_vector_p(top->cur)) {
+				/* A dotted list can end in a vector. */
+				obj = top->cur;
+				more = 1;
+			}
+			depth--;
+		}
+		if (!more || !acyclic) {
+			break;
+		}
+	}
+
+	if (frames != small) {
+		free(frames);
+	}
+	return acyclic;
+}
+
+
+/* Put every pair or vector that a cycle leads back to from obj into labels,
+   with a value of -1, and return true if there were any. A depth-first
+   search, in the order the writer goes in, finds them as the objects it
+   meets while they're still on its stack.
+*/
+static int rs_write_find_cycles(rs_object obj, struct rs_objtab *labels)
+{
+	enum { OPEN = 1, CLOSED = 2 };
+	struct rs_objtab state;
+	rs_objtab_init(&state);
+
+	struct cycle_frame {
+		rs_object obj;
+		size_t next;         // the next edge: car and cdr, or elements
+	} *stack;
+	size_t n = 0, cap = 64;
+	int found = 0;
+	stack = malloc(cap * sizeof(struct cycle_frame));
+	if (stack == NULL) {
+		rs_fatal("could not allocate writer stack:");
+	}
+
+	for (;;) {
+		long s;
+		if (rs_pair_p(obj) || rs_vector_p(obj)) {
+			if (!rs_objtab_get(&state, obj, &s)) {
+				rs_objtab_put(&state, obj, OPEN);
+				if (n == cap) {
+					cap *= 2;
+					struct cycle_frame *t = realloc(stack,
+						cap * sizeof(struct cycle_frame));
+					if (t == NULL) {
+						rs_fatal("could not grow writer stack:");
+					}
+					stack = t;
+				}
+				stack[n].obj = obj;
+				stack[n].next = 0;
+				n++;
+			} else if (s == OPEN) {
+				rs_objtab_put(labels, obj, -1);
+				found = 1;
+			}
+		}
+
+		/* Follow the next edge of the innermost object that has one. */
+		while (n > 0) {
+			struct cycle_frame *top = &stack[n - 1];
+			if (rs_pair_p(top->obj) && top->next < 2) {
+				rs_pair *pair = rs_obj_to_pair(top->obj);
+				obj = top->next++ == 0 ? rs_pair_car(pair)
+				                       : rs_pair_cdr(pair);
+				break;
+			}
+			if (rs_vector_p(top->obj) &&
+			    top->next < rs_vector_length(rs_obj_to_vector(top->obj))) {
+				obj = rs_vector_ref(rs_obj_to_vector(top->obj), top->next++);
+				break;
+			}
+			rs_objtab_put(&state, top->obj, CLOSED);
+			n--;
+		}
+		if (n == 0) {
+			break;
+		}
+	}
+
+	free(stack);
+	rs_objtab_reset(&state);
+	return found;
+}
 
-	int result;
+
+static void rs_write_atom(struct rs_outport *out, rs_object obj, int display)
+{
 	if (rs_fixnum_p(obj)) {
-		result = fprintf(out, "%ld", (long)rs_obj_to_fixnum(obj));
+		rs_outport_long(out, (long)rs_obj_to_fixnum(obj));
+	} else if (rs_bignum_p(obj)) {
+		char *digits = rs_bignum_to_cstr(obj, 10);
+		rs_outport_puts(out, digits);
+		free(digits);
+	} else if (rs_flonum_p(obj)) {
+		rs_write_flonum(out, rs_flonum_value(obj));
 	} else if (rs_character_p(obj)) {
 		rs_character c = rs_obj_to_character(obj);
-		if ((char)c == '\n') {
-			result = fprintf(out, "#\\newline");
+		if (display) {
+			rs_outport_putc(out, (char)c);
+		} else if ((char)c == '\n') {
+			rs_outport_puts(out, "#\\newline");
 		} else if ((char)c == '\t') {
-			result = fprintf(out, "#\\tab");
+			rs_outport_puts(out, "#\\tab");
 		} else if ((char)c == ' ') {
-			result = fprintf(out, "#\\space");
+			rs_outport_puts(out, "#\\space");
 		} else {
-			result = fprintf(out, "#\\%c", (char)c);
+			rs_outport_putc(out, '#');
+			rs_outport_putc(out, '\\');
+			rs_outport_putc(out, (char)c);
 		}
 	} else if (rs_boolean_p(obj)) {
-		result = fprintf(out, "#%c", obj == rs_true ? 't' : 'f');
+		rs_outport_puts(out, obj == rs_true ? "#t" : "#f");
 	} else if (rs_null_p(obj)) {
-		result = fprintf(out, "()");
+		rs_outport_puts(out, "()");
 	} else if (rs_symbol_p(obj)) {
-		result = fprintf(out, "%s", rs_symbol_cstr(rs_obj_to_symbol(obj)));
+		rs_outport_puts(out, rs_symbol_cstr(rs_obj_to_symbol(obj)));
 	} else if (rs_string_p(obj)) {
-		result = rs_write_string(out, rs_obj_to_string(obj));
-	} else if (rs_pair_p(obj)) {
-		result = fprintf(out, "(");
-		result += rs_write_pair(out, rs_obj_to_pair(obj));
-		result += fprintf(out, ")");
+		rs_string *str = rs_obj_to_string(obj);
+		if (display) {
+			rs_outport_write(out, rs_string_data(str), rs_string_length(str));
+		} else {
+			rs_write_string(out, str);
+		}
+	} else if (rs_procedure_p(obj)) {
+		const char *name = rs_procedure_name(obj);
+		rs_outport_puts(out, rs_primitive_p(obj) ? "#<primitive" :
+		                "#<procedure");
+		if (name != NULL) {
+			rs_outport_putc(out, ' ');
+			rs_outport_puts(out, name);
+		}
+		rs_outport_putc(out, '>');
+	} else if (rs_bytevector_p(obj)) {
+		rs_bytevector *bv = rs_obj_to_bytevector(obj);
+		rs_outport_puts(out, "#u8(");
+		for (size_t i = 0; i < rs_bytevector_length(bv); i++) {
+			if (i > 0) {
+				rs_outport_putc(out, ' ');
+			}
+			rs_outport_long(out, rs_bytevector_data(bv)[i]);
+		}
+		rs_outport_putc(out, ')');
+	} else if (rs_hashtable_p(obj)) {
+		rs_outport_puts(out, "#<hash-table>");
+	} else if (rs_channel_p(obj)) {
+		rs_outport_puts(out, "#<channel>");
+	} else if (rs_future_p(obj)) {
+		rs_outport_puts(out, "#<future>");
+	} else if (obj == rs_unspecified) {
+		rs_outport_puts(out, "#<unspecified>");
+	} else if (rs_eof_p(obj)) {
+		rs_outport_puts(out, "#<eof>");
 	} else {
 		rs_fatal("illegal object type");
 	}
-	return result;
 }
 
 
-static int rs_write_pair(FILE *out, rs_pair *pair)
+/* Flonums are written with as few digits as will read back as the same number,
+   and always with a decimal point or an exponent, so that they read back as
+   flonums at all.
+*/
+static void rs_write_flonum(struct rs_outport *out, double val)
 {
-	int result = rs_write(out, rs_pair_car(pair));
+	if (isnan(val)) {
+		rs_outport_puts(out, "+nan.0");
+		return;
+	} else if (isinf(val)) {
+		rs_outport_puts(out, val > 0 ? "+inf.0" : "-inf.0");
+		return;
+	}
 
-	rs_object cdr = rs_pair_cdr(pair);
-	if (rs_pair_p(cdr)) {
-		result += fprintf(out, " ");
-		result += rs_write_pair(out, rs_obj_to_pair(cdr));
-	} else if (rs_null_p(cdr)) {
-		return result;
-	} else {
-		result += fprintf(out, " . ");
-		result += rs_write(out, cdr);
+	/* Find the fewest significant digits that are enough, and then write
+	   numbers below 10^15 without an exponent, as %g would with more. */
+	char text[32];
+	int prec;
+	for (prec = 1; prec < 17; prec++) {
+		snprintf(text, sizeof(text), "%.*e", prec - 1, val);
+		if (strtod(text, NULL) == val) {
+			break;
+		}
+	}
+	snprintf(text, sizeof(text), "%.*e", prec - 1, val);
+	int exp = atoi(strchr(text, 'e') + 1);
+	if (exp >= -4 && exp < 15 && prec < exp + 1) {
+		prec = exp + 1;
+	}
+	snprintf(text, sizeof(text), "%.*g", prec, val);
+	rs_outport_puts(out, text);
+	if (strpbrk(text, ".e") == NULL) {
+		rs_outport_puts(out, ".0");
 	}
-	return result;
 }
 
 
-static int rs_write_string(FILE *out, rs_string *str)
+/* How each byte is written inside a string: 0 means as itself, 'x' means as a
+   hex escape, and anything else is the letter of a backslash escape.
+*/
+#define X 'x'
+#define X16 X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X
+static const char escapes[256] = {
+	X, X, X, X, X, X, X, 'a', 'b', 't', 'n', X, X, 'r', X, X,   // 0x00
+	X16,                                                        // 0x10
+	0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,           // 0x20
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,             // 0x30
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,             // 0x40
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,          // 0x50
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,             // 0x60
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, X,             // 0x70
+	X16, X16, X16, X16, X16, X16, X16, X16                      // 0x80-0xff
+};
+#undef X16
+#undef X
+
+
+static void rs_write_string(struct rs_outport *out, rs_string *str)
 {
-	assert(rs_string_cstr(str) != NULL);
+	static const char hex[] = "0123456789abcdef";
 
-	const char *cstr = rs_string_cstr(str);
-	int count = 0;
-	fputc('"', out);
-	while (*cstr != '\0') {
-		switch (*cstr) {
-		case '\n':
-			count += fprintf(out, "\\n");
-			break;
-		case '\t':
-			count += fprintf(out, "\\t");
-			break;
-		case '\"':
-			count += fprintf(out, "\\\"");
-			break;
-		case '\\':
-			count += fprintf(out, "\\\\");
-			break;
-		case '\r':
-			count += fprintf(out, "\\r");
-			break;
-		case '\b':
-			count += fprintf(out, "\\b");
-			break;
-		case '\a':
-			count += fprintf(out, "\\a");
-			break;
-		case ' ':
-			fputc(' ', out);
-			count++;
+	const unsigned char *p = (const unsigned char *)rs_string_data(str);
+	const unsigned char *end = p + rs_string_length(str);
+
+	rs_outport_putc(out, '"');
+	while (p < end) {
+		/* Copy runs of characters that don't need escaping all at once. */
+		const unsigned char *run = p;
+		while (p < end && escapes[*p] == 0) {
+			p++;
+		}
+		rs_outport_write(out, (const char *)run, p - run);
+		if (p == end) {
 			break;
-		default:
-			if (isgraph(*cstr)) {
-				fputc(*cstr, out);
-				count++;
-			} else {
-				count += fprintf(out, "\\x%02x", *cstr);
-			}
 		}
-		cstr++;
+
+		rs_outport_putc(out, '\\');
+		rs_outport_putc(out, escapes[*p]);
+		if (escapes[*p] == 'x') {
+			rs_outport_putc(out, hex[*p >> 4]);
+			rs_outport_putc(out, hex[*p & 0xf]);
+		}
+		p++;
+	}
+	rs_outport_putc(out, '"');
+}
+
+
+
+/**** Testing. ****/
+
+/* Read src, change it with fix, if it isn't NULL, and check that it's written
+   as expected.
+*/
+static void rs_write_test_one(const char *src, void (*fix)(rs_object),
+                              const char *expected)
+{
+	struct rs_port *in = rs_port_open_mem(src, strlen(src));
+	rs_object obj = rs_read(in);
+	rs_port_close(in);
+	if (fix != NULL) {
+		fix(obj);
 	}
-	fputc('"', out);
-	return 2 + count;
+
+	struct rs_outport *out = rs_outport_open_string();
+	rs_write(out, obj);
+	size_t len;
+	const char *data = rs_outport_data(out, &len);
+	if (len != strlen(expected) || memcmp(data, expected, len) != 0) {
+		rs_fatal("wrote %.*s instead of %s", (int)len, data, expected);
+	}
+	rs_outport_close(out);
+}
+
+
+static rs_pair *rs_write_test_pair(rs_object obj)
+{
+	assert(rs_pair_p(obj));
+	return rs_obj_to_pair(obj);
+}
+
+static void rs_write_test_cdr_cycle(rs_object x)
+{
+	rs_pair_set_cdr(rs_write_test_pair(rs_pair_cdr(rs_write_test_pair(x))),
+	                x);
+}
+
+static void rs_write_test_car_cycle(rs_object x)
+{
+	rs_pair_set_car(rs_write_test_pair(x), x);
+}
+
+static void rs_write_test_vector_cycle(rs_object v)
+{
+	rs_vector_set(rs_obj_to_vector(v), 1, v);
+}
+
+static void rs_write_test_inner_cycle(rs_object x)
+{
+	rs_object inner = rs_pair_car(rs_write_test_pair(
+		rs_pair_cdr(rs_write_test_pair(x))));
+	rs_pair_set_cdr(rs_write_test_pair(inner), x);
+}
+
+static void rs_write_test_share(rs_object x)
+{
+	rs_pair_set_car(rs_write_test_pair(rs_pair_cdr(rs_write_test_pair(x))),
+	                rs_pair_car(rs_write_test_pair(x)));
+}
+
+
+/* Check that a list n long, or nested n deep, is written in full, without
+   labels.
+*/
+static void rs_write_test_big(long n, int nested)
+{
+	rs_object obj = rs_null;
+	rs_gc_push(obj);
+	for (long i = 0; i < n; i++) {
+		obj = nested ? rs_pair_create(obj, rs_null)
+		             : rs_pair_create(rs_fixnum_to_obj(i % 10), obj);
+		rs_gc_pop();
+		rs_gc_push(obj);
+	}
+
+	struct rs_outport *out = rs_outport_open_string();
+	rs_write(out, obj);
+	size_t len;
+	const char *data = rs_outport_data(out, &len);
+	if (len != (size_t)(2 * n + (nested ? 2 : 1)) ||
+	    memchr(data, '#', len) != NULL) {
+		rs_fatal("wrong output for a %s of %ld", nested ? "nesting" : "list",
+		         n);
+	}
+	rs_outport_close(out);
+	rs_gc_pop();
+}
+
+
+void rs_write_test(void)
+{
+	rs_write_test_one("(1 2)", rs_write_test_cdr_cycle, "#0=(1 2 . #0#)");
+	rs_write_test_one("(1)", rs_write_test_car_cycle, "#0=(#0#)");
+	rs_write_test_one("#(1 2)", rs_write_test_vector_cycle, "#0=#(1 #0#)");
+	rs_write_test_one("(a (b))", rs_write_test_inner_cycle,
+	                  "#0=(a (b . #0#))");
+	rs_write_test_one("((1) 2)", rs_write_test_share, "((1) (1))");
+	rs_write_test_one("(1 . #(2 (3)))", NULL, "(1 . #(2 (3)))");
+	rs_write_test_one("(+inf.0 -inf.0 +nan.0 -nan.0 1e400 +INF.0)", NULL,
+	                  "(+inf.0 -inf.0 +nan.0 +nan.0 +inf.0 +inf.0)");
+
+	rs_write_test_big(1000000, 0);
+	rs_write_test_big(100000, 1);
+	TRACE("passed");
 }